@@ -0,0 +1,657 @@
+#include "rpc.h"
+#include "rpc_ext.h"
+#include "rpc_array.h"
+#include "rpc_coro.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <glob.h>
+#include <pthread.h>
+#include <sys/wait.h>
+
+#define PORT 'p'
+#define CALLS 'n'
+#define NUM_ARGS 1
+
+#define DEFAULT_CALLS 2000
+#define REPS 20              // new clients timed for their first call
+#define SERVER_START_US 200000
+
+// small calls: data1 below this, and no data2
+#define SMALL_DATA1 128
+
+// pinning: clients calling at once, each on a connection of its own
+#define PIN_CLIENTS 4
+#define NUMASTAT "/sys/devices/system/node/node*/numastat"
+
+// sessions: clients making small calls, while another one makes calls
+// with a large payload (one of which may hold theirs up)
+#define SESSION_CLIENTS 8
+#define LARGE_BYTES (8 << 20)
+
+// coroutines: clients calling at once from a single thread
+#define CORO_CLIENTS 64
+
+// typed arrays: bytes of elements, and times each one is converted
+#define ARRAY_BYTES (4 << 20)
+#define ARRAY_REPS 50
+
+typedef struct {
+    char *name;
+    int nodelay;             // both sides
+    int eager;               // rpc_connect before the first request
+    int version;             // of the protocol (client)
+} config;
+
+// a client of run_sessions, in a thread of its own
+typedef struct {
+    int port;
+    rpc_mux *mux;            // shared connection (NULL for its own)
+    int n_calls;             // small calls, or 0 for large ones...
+    volatile int *done;      // ... until this is set
+    uint64_t *rtt;           // of each small call
+    int large_calls;
+} session;
+
+// a client of run_coroutines, in a coroutine of its own
+typedef struct {
+    int port;
+    int n_calls;
+} coro_client;
+
+rpc_data *echo(rpc_data *);
+pid_t start_server(int port, rpc_sock_opts *opts, int pin_policy);
+void run_config(config *cfg, int port, int n_calls);
+void run_small(config *cfg, int port, int n_calls);
+void run_casts(config *cfg, int port, int n_calls);
+void run_pinning(char *name, int pin_policy, int port, int n_calls);
+void call_echo(int port, int n_calls);
+void run_sessions(char *name, int shared, int port, int n_calls);
+void *run_session(void *arg);
+rpc_client *session_client(session *s);
+void run_coroutines(char *name, int n_coros, int port, int n_calls);
+void coro_echo(void *arg);
+void read_numastat(uint64_t *local, uint64_t *other);
+void run_swap(char *name, size_t size, void (*swap)(void *, size_t, size_t));
+void run_get(char *name, int other);
+void print_speed(char *name, uint64_t elapsed);
+double first_call_us(config *cfg, int port, rpc_sock_opts *opts);
+int cmp_u64(const void *a, const void *b);
+uint64_t now_us(void);
+void read_args(int argc, char *argv[], int *port, int *n_calls);
+
+/* Measures the latency of the first call of a client, and the round-trip
+   time of calls once connected, with and without TCP_NODELAY, with lazy
+   and eager (rpc_connect) connection set-up, and in both versions of the
+   protocol. Then the throughput and bytes on the wire of small calls, in
+   each encoding (and as casts), the throughput of concurrent clients and the pages
+   allocated across NUMA nodes with each pinning of the server's children,
+   small calls of many clients sharing a connection or not (with large ones
+   going on alongside), the throughput of clients in coroutines of a
+   single thread, and the speed of the byte order conversion of
+   arrays.
+ * Each configuration gets its own server, forked here, on port p, p+1...
+ */
+int main(int argc, char *argv[]) {
+    int port, n_calls;
+    read_args(argc, argv, &port, &n_calls);
+    signal(SIGPIPE, SIG_IGN);
+
+    config configs[] = {
+        {"nagle, lazy, v1", 0, 0, RPC_PROTO_V1},
+        {"nagle, lazy, v2", 0, 0, RPC_PROTO_V2},
+        {"nodelay, lazy, v1", 1, 0, RPC_PROTO_V1},
+        {"nodelay, eager, v1", 1, 1, RPC_PROTO_V1},
+        {"nodelay, lazy, v2", 1, 0, RPC_PROTO_V2},
+        {"nodelay, eager, v2", 1, 1, RPC_PROTO_V2},
+    };
+    int n_configs = sizeof(configs) / sizeof(configs[0]);
+
+    printf("%-20s %12s %10s %10s %10s\n",
+           "config", "first call", "rtt avg", "rtt p50", "rtt p99");
+    for (int i = 0; i < n_configs; i++) {
+        run_config(&configs[i], port + i, n_calls);
+    }
+
+    config small[] = {
+        {"v1", 1, 1, RPC_PROTO_V1},
+        {"v2", 1, 1, RPC_PROTO_V2},
+        {"v2, compact", 1, 1, RPC_PROTO_V2_COMPACT},
+    };
+    int n_small = sizeof(small) / sizeof(small[0]);
+
+    printf("\n%-20s %12s %12s\n", "small calls", "calls/s", "bytes/call");
+    for (int i = 0; i < n_small; i++) {
+        run_small(&small[i], port + n_configs + i, n_calls);
+    }
+    config casts = {"v2, compact, casts", 1, 1, RPC_PROTO_V2_COMPACT};
+    run_casts(&casts, port + n_configs + n_small, n_calls);
+
+    printf("\n%-20s %12s %12s %12s\n",
+           "pinning", "calls/s", "local pages", "remote pages");
+    int port_pin = port + n_configs + n_small + 1;
+    run_pinning("none", RPC_PIN_NONE, port_pin, n_calls);
+    run_pinning("round robin", RPC_PIN_ROUND_ROBIN, port_pin + 1, n_calls);
+    run_pinning("incoming cpu", RPC_PIN_INCOMING, port_pin + 2, n_calls);
+
+    printf("\n%-20s %12s %12s %12s\n",
+           "sessions", "calls/s", "p99 small", "large calls");
+    run_sessions("own connections", 0, port_pin + 3, n_calls);
+    run_sessions("one connection", 1, port_pin + 4, n_calls);
+
+    printf("\n%-20s %12s\n", "coroutines", "calls/s");
+    run_coroutines("1 coroutine", 1, port_pin + 5, n_calls);
+    run_coroutines("64 coroutines", CORO_CLIENTS, port_pin + 6, n_calls);
+
+    printf("\n%-20s %12s\n", "arrays", "GB/s");
+    run_swap("i32, scalar", sizeof(int32_t), swap_elems_scalar);
+    run_swap("i32, vector", sizeof(int32_t), swap_elems);
+    run_swap("i64, scalar", sizeof(int64_t), swap_elems_scalar);
+    run_swap("i64, vector", sizeof(int64_t), swap_elems);
+    run_get("get, other order", 1);
+    run_get("get, same order", 0);
+    return 0;
+}
+
+/* Returns its input */
+rpc_data *echo(rpc_data *in) {
+    rpc_data *out = malloc(sizeof(rpc_data));
+    assert(out != NULL);
+    out->data1 = in->data1;
+    out->data2_len = in->data2_len;
+    out->data2 = NULL;
+    if (in->data2_len > 0) {
+        out->data2 = malloc(in->data2_len);
+        assert(out->data2 != NULL);
+        memcpy(out->data2, in->data2, in->data2_len);
+    }
+    return out;
+}
+
+/* Forks a server on the port, using the socket options, its children
+   pinned to its CPUs with the policy (enum RPC_PIN_POLICY).
+ * Returns the server's pid.
+ */
+pid_t start_server(int port, rpc_sock_opts *opts, int pin_policy) {
+    fflush(stdout); // or the server's processes print it again on exit
+    pid_t pid = fork();
+    if (pid != 0)
+        return pid;
+
+    rpc_server *srv = rpc_init_server(port);
+    if (srv == NULL) {
+        fprintf(stderr, "Failed to init server on port %d\n", port);
+        exit(EXIT_FAILURE);
+    }
+    rpc_set_server_sock_opts(srv, opts);
+    rpc_set_cpu_pinning(srv, pin_policy, NULL, 0);
+    rpc_register(srv, "echo", echo);
+    rpc_serve_all(srv);
+    exit(EXIT_SUCCESS);
+}
+
+/* Runs one configuration against a server of its own, and prints a row.
+ */
+void run_config(config *cfg, int port, int n_calls) {
+    rpc_sock_opts opts = RPC_SOCK_OPTS_DEFAULT;
+    opts.nodelay = cfg->nodelay;
+    pid_t server = start_server(port, &opts, RPC_PIN_NONE);
+    usleep(SERVER_START_US);
+
+    double first_us = first_call_us(cfg, port, &opts);
+
+    // steady state: one connection, many calls
+    uint64_t *rtt = malloc(n_calls * sizeof(*rtt));
+    assert(rtt != NULL);
+    rpc_client *cl = rpc_init_client("::1", port);
+    assert(cl != NULL);
+    rpc_set_client_sock_opts(cl, &opts);
+    rpc_set_protocol(cl, cfg->version);
+    rpc_handle *h = rpc_find(cl, "echo");
+    assert(h != NULL);
+
+    char buf[64] = {0};
+    rpc_data req = {.data1 = 0, .data2_len = sizeof(buf), .data2 = buf};
+    double total = 0;
+    for (int i = 0; i < n_calls; i++) {
+        req.data1 = i;
+        uint64_t start = now_us();
+        rpc_data *res = rpc_call(cl, h, &req);
+        rtt[i] = now_us() - start;
+        total += rtt[i];
+        assert(res != NULL && res->data1 == i);
+        rpc_data_free(res);
+    }
+    qsort(rtt, n_calls, sizeof(*rtt), cmp_u64);
+    printf("%-20s %10.0fus %8.0fus %8luus %8luus\n", cfg->name, first_us,
+           total / n_calls, rtt[n_calls / 2], rtt[n_calls * 99 / 100]);
+
+    free(h);
+    free(rtt);
+    rpc_close_client(cl);
+    kill(server, SIGTERM);
+    waitpid(server, NULL, 0);
+}
+
+/* Makes calls with a data1 below SMALL_DATA1 and no data2 on one
+   connection, and prints a row with their rate and the bytes sent and
+   received per call (request and response, headers included).
+ */
+void run_small(config *cfg, int port, int n_calls) {
+    rpc_sock_opts opts = RPC_SOCK_OPTS_DEFAULT;
+    pid_t server = start_server(port, &opts, RPC_PIN_NONE);
+    usleep(SERVER_START_US);
+
+    rpc_client *cl = rpc_init_client("::1", port);
+    assert(cl != NULL);
+    rpc_set_protocol(cl, cfg->version);
+    rpc_handle *h = rpc_find(cl, "echo");
+    assert(h != NULL);
+
+    rpc_client_stats before, after;
+    rpc_get_client_stats(cl, &before);
+    rpc_data req = {.data1 = 0, .data2_len = 0, .data2 = NULL};
+    uint64_t start = now_us();
+    for (int i = 0; i < n_calls; i++) {
+        req.data1 = i % SMALL_DATA1;
+        rpc_data *res = rpc_call(cl, h, &req);
+        assert(res != NULL && res->data1 == req.data1);
+        rpc_data_free(res);
+    }
+    uint64_t elapsed = now_us() - start;
+    rpc_get_client_stats(cl, &after);
+
+    uint64_t bytes = after.bytes_sent + after.bytes_received
+                     - before.bytes_sent - before.bytes_received;
+    printf("%-20s %12.0f %12.1f\n", cfg->name,
+           n_calls * 1e6 / elapsed, (double)bytes / n_calls);
+
+    free(h);
+    rpc_close_client(cl);
+    kill(server, SIGTERM);
+    waitpid(server, NULL, 0);
+}
+
+/* Makes the small calls of run_small as casts, then waits for the server to
+   have made all of them (rpc_cast_failures), and prints a row as
+   run_small does.
+ */
+void run_casts(config *cfg, int port, int n_calls) {
+    rpc_sock_opts opts = RPC_SOCK_OPTS_DEFAULT;
+    pid_t server = start_server(port, &opts, RPC_PIN_NONE);
+    usleep(SERVER_START_US);
+
+    rpc_client *cl = rpc_init_client("::1", port);
+    assert(cl != NULL);
+    rpc_set_protocol(cl, cfg->version);
+    rpc_handle *h = rpc_find(cl, "echo");
+    assert(h != NULL);
+
+    rpc_client_stats before, after;
+    rpc_get_client_stats(cl, &before);
+    rpc_data req = {.data1 = 0, .data2_len = 0, .data2 = NULL};
+    uint64_t start = now_us();
+    for (int i = 0; i < n_calls; i++) {
+        req.data1 = i % SMALL_DATA1;
+        int res = rpc_cast(cl, h, &req);
+        assert(res != -1);
+    }
+    int failures = rpc_cast_failures(cl);
+    assert(failures == 0);
+    uint64_t elapsed = now_us() - start;
+    rpc_get_client_stats(cl, &after);
+
+    uint64_t bytes = after.bytes_sent + after.bytes_received
+                     - before.bytes_sent - before.bytes_received;
+    printf("%-20s %12.0f %12.1f\n", cfg->name,
+           n_calls * 1e6 / elapsed, (double)bytes / n_calls);
+
+    free(h);
+    rpc_close_client(cl);
+    kill(server, SIGTERM);
+    waitpid(server, NULL, 0);
+}
+
+/* Makes small calls from PIN_CLIENTS clients at once (processes of their
+   own) to a server pinning its children with the policy, and prints a row
+   with their total rate and the pages allocated on the node of the CPU
+   allocating them (local) or on another one (remote) meanwhile. The pages
+   are counted on the whole system (there being no count per process), so
+   this is best run on an otherwise idle machine; with a single node, none
+   is ever remote.
+ */
+void run_pinning(char *name, int pin_policy, int port, int n_calls) {
+    rpc_sock_opts opts = RPC_SOCK_OPTS_DEFAULT;
+    pid_t server = start_server(port, &opts, pin_policy);
+    usleep(SERVER_START_US);
+
+    uint64_t local_before, other_before, local_after, other_after;
+    read_numastat(&local_before, &other_before);
+    uint64_t start = now_us();
+    pid_t clients[PIN_CLIENTS];
+    for (int i = 0; i < PIN_CLIENTS; i++) {
+        clients[i] = fork();
+        if (clients[i] == 0) {
+            call_echo(port, n_calls);
+            exit(EXIT_SUCCESS);
+        }
+    }
+    for (int i = 0; i < PIN_CLIENTS; i++) {
+        waitpid(clients[i], NULL, 0);
+    }
+    uint64_t elapsed = now_us() - start;
+    read_numastat(&local_after, &other_after);
+
+    printf("%-20s %12.0f %12llu %12llu\n", name,
+           (double)PIN_CLIENTS * n_calls * 1e6 / elapsed,
+           (unsigned long long)(local_after - local_before),
+           (unsigned long long)(other_after - other_before));
+
+    kill(server, SIGTERM);
+    waitpid(server, NULL, 0);
+}
+
+/* Makes `n_calls` small calls to the server on the port, on a connection
+   of its own.
+ */
+void call_echo(int port, int n_calls) {
+    rpc_client *cl = rpc_init_client("::1", port);
+    assert(cl != NULL);
+    rpc_handle *h = rpc_find(cl, "echo");
+    assert(h != NULL);
+    rpc_data req = {.data1 = 0, .data2_len = 0, .data2 = NULL};
+    for (int i = 0; i < n_calls; i++) {
+        req.data1 = i % SMALL_DATA1;
+        rpc_data *res = rpc_call(cl, h, &req);
+        assert(res != NULL && res->data1 == req.data1);
+        rpc_data_free(res);
+    }
+    free(h);
+    rpc_close_client(cl);
+}
+
+/* Makes small calls from SESSION_CLIENTS clients at once (threads), on
+   connections of their own or sharing one (`shared`), while another client
+   echoes LARGE_BYTES of payload over and over. Prints a row with the rate
+   of the small calls, their p99, and how many large calls were made
+   meanwhile.
+ */
+void run_sessions(char *name, int shared, int port, int n_calls) {
+    rpc_sock_opts opts = RPC_SOCK_OPTS_DEFAULT;
+    pid_t server = start_server(port, &opts, RPC_PIN_NONE);
+    usleep(SERVER_START_US);
+
+    rpc_mux *mux = NULL;
+    if (shared) {
+        mux = rpc_init_mux("::1", port);
+        assert(mux != NULL);
+    }
+    volatile int done = 0;
+    uint64_t *rtt = malloc((size_t)SESSION_CLIENTS * n_calls * sizeof(*rtt));
+    assert(rtt != NULL);
+    session sessions[SESSION_CLIENTS + 1];
+    pthread_t threads[SESSION_CLIENTS + 1];
+    for (int i = 0; i <= SESSION_CLIENTS; i++) { // the last one is large
+        sessions[i] = (session){.port = port, .mux = mux, .done = &done,
+                                .n_calls = i < SESSION_CLIENTS ? n_calls : 0,
+                                .rtt = rtt + (size_t)i * n_calls};
+    }
+    pthread_create(&threads[SESSION_CLIENTS], NULL, run_session,
+                   &sessions[SESSION_CLIENTS]);
+    uint64_t start = now_us();
+    for (int i = 0; i < SESSION_CLIENTS; i++) {
+        pthread_create(&threads[i], NULL, run_session, &sessions[i]);
+    }
+    for (int i = 0; i < SESSION_CLIENTS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    uint64_t elapsed = now_us() - start;
+    done = 1;
+    pthread_join(threads[SESSION_CLIENTS], NULL);
+
+    int n = SESSION_CLIENTS * n_calls;
+    qsort(rtt, n, sizeof(*rtt), cmp_u64);
+    printf("%-20s %12.0f %10luus %12d\n", name, n * 1e6 / elapsed,
+           rtt[n * 99 / 100], sessions[SESSION_CLIENTS].large_calls);
+
+    free(rtt);
+    rpc_close_mux(mux);
+    kill(server, SIGTERM);
+    waitpid(server, NULL, 0);
+}
+
+/* Makes the calls of a client of run_sessions.
+ */
+void *run_session(void *arg) {
+    session *s = arg;
+    rpc_client *cl = session_client(s);
+    rpc_handle *h = rpc_find(cl, "echo");
+    assert(h != NULL);
+
+    if (s->n_calls == 0) {
+        char *large = calloc(LARGE_BYTES, 1);
+        assert(large != NULL);
+        rpc_data req = {.data1 = 0, .data2_len = LARGE_BYTES, .data2 = large};
+        while (!*s->done) {
+            rpc_data *res = rpc_call(cl, h, &req);
+            assert(res != NULL && res->data2_len == LARGE_BYTES);
+            rpc_data_free(res);
+            s->large_calls++;
+        }
+        free(large);
+    }
+
+    rpc_data req = {.data1 = 0, .data2_len = 0, .data2 = NULL};
+    for (int i = 0; i < s->n_calls; i++) {
+        req.data1 = i % SMALL_DATA1;
+        uint64_t start = now_us();
+        rpc_data *res = rpc_call(cl, h, &req);
+        s->rtt[i] = now_us() - start;
+        assert(res != NULL && res->data1 == req.data1);
+        rpc_data_free(res);
+    }
+    free(h);
+    rpc_close_client(cl);
+    return NULL;
+}
+
+/* Returns a new client of the session: of its shared connection, or with
+   one of its own.
+ */
+rpc_client *session_client(session *s) {
+    rpc_client *cl = s->mux != NULL ? rpc_mux_client(s->mux)
+                                    : rpc_init_client("::1", s->port);
+    assert(cl != NULL);
+    return cl;
+}
+
+/* Makes small calls from `n_coros` clients (on connections of their own),
+   each in a coroutine of the same thread, and prints a row with their total
+   rate.
+ */
+void run_coroutines(char *name, int n_coros, int port, int n_calls) {
+    rpc_sock_opts opts = RPC_SOCK_OPTS_DEFAULT;
+    pid_t server = start_server(port, &opts, RPC_PIN_NONE);
+    usleep(SERVER_START_US);
+
+    rpc_coro_sched *sched = rpc_coro_create_sched(0);
+    assert(sched != NULL);
+    coro_client cl = {.port = port, .n_calls = n_calls};
+    for (int i = 0; i < n_coros; i++) {
+        assert(rpc_coro_spawn(sched, coro_echo, &cl) != -1);
+    }
+    uint64_t start = now_us();
+    assert(rpc_coro_run(sched) != -1);
+    uint64_t elapsed = now_us() - start;
+    rpc_coro_free_sched(sched);
+
+    printf("%-20s %12.0f\n", name, (double)n_coros * n_calls * 1e6 / elapsed);
+
+    kill(server, SIGTERM);
+    waitpid(server, NULL, 0);
+}
+
+/* Body of a coroutine of run_coroutines: its client's calls (each wait
+   for the server hands the thread over to another coroutine).
+ */
+void coro_echo(void *arg) {
+    coro_client *cl = arg;
+    call_echo(cl->port, cl->n_calls);
+}
+
+/* Reads the pages allocated so far on the node of the CPU allocating them
+   (`*local`) and on other nodes (`*other`), over all nodes. Both are 0 if
+   the kernel doesn't count them.
+ */
+void read_numastat(uint64_t *local, uint64_t *other) {
+    *local = *other = 0;
+    glob_t nodes;
+    if (glob(NUMASTAT, 0, NULL, &nodes) != 0)
+        return;
+    for (size_t i = 0; i < nodes.gl_pathc; i++) {
+        FILE *f = fopen(nodes.gl_pathv[i], "r");
+        if (f == NULL)
+            continue;
+        char key[32];
+        unsigned long long value;
+        while (fscanf(f, "%31s %llu", key, &value) == 2) {
+            if (strcmp(key, "local_node") == 0)
+                *local += value;
+            else if (strcmp(key, "other_node") == 0)
+                *other += value;
+        }
+        fclose(f);
+    }
+    globfree(&nodes);
+}
+
+/* Converts ARRAY_BYTES bytes of elements of `size` bytes with `swap`, and
+   prints a row with the speed of it.
+ */
+void run_swap(char *name, size_t size,
+              void (*swap)(void *, size_t, size_t)) {
+    char *elems = calloc(ARRAY_BYTES, 1);
+    assert(elems != NULL);
+    uint64_t start = now_us();
+    for (int i = 0; i < ARRAY_REPS; i++) {
+        swap(elems, ARRAY_BYTES / size, size);
+    }
+    print_speed(name, now_us() - start);
+    free(elems);
+}
+
+/* Gets an array of ARRAY_BYTES bytes of int64_t with rpc_data_get_array,
+   as received from a peer of the other byte order (`other`) or of the same
+   one, and prints a row with the speed of it.
+ */
+void run_get(char *name, int other) {
+    size_t n = ARRAY_BYTES / sizeof(int64_t);
+    int64_t *elems = calloc(n, sizeof(int64_t));
+    assert(elems != NULL);
+    rpc_data data = {.data1 = 0, .data2_len = 0, .data2 = NULL};
+    assert(rpc_data_set_array(&data, RPC_I64, elems, n) != -1);
+    array_header *hdr = data.data2;
+
+    uint64_t elapsed = 0;
+    for (int i = 0; i < ARRAY_REPS; i++) {
+        // as if it had just come in
+        if (other)
+            hdr->order = ARRAY_NATIVE == ARRAY_BIG ? ARRAY_LITTLE : ARRAY_BIG;
+        size_t got;
+        uint64_t start = now_us();
+        assert(rpc_data_get_array(&data, RPC_I64, &got) != NULL && got == n);
+        elapsed += now_us() - start;
+    }
+    print_speed(name, elapsed);
+    free(data.data2);
+    free(elems);
+}
+
+/* Prints a row with the speed of ARRAY_REPS conversions of ARRAY_BYTES
+   bytes taking `elapsed` microseconds.
+ */
+void print_speed(char *name, uint64_t elapsed) {
+    if (elapsed == 0)
+        printf("%-20s %12s\n", name, "-");
+    else
+        printf("%-20s %12.2f\n", name,
+               (double)ARRAY_BYTES * ARRAY_REPS / (elapsed * 1e3));
+}
+
+/* Returns the average time from a new client being ready to use to its
+   first result (rpc_find and rpc_call), over REPS clients. An eager client
+   connects (and is timed as ready) after rpc_connect.
+ */
+double first_call_us(config *cfg, int port, rpc_sock_opts *opts) {
+    double total = 0;
+    for (int i = 0; i < REPS; i++) {
+        rpc_client *cl = rpc_init_client("::1", port);
+        assert(cl != NULL);
+        rpc_set_client_sock_opts(cl, opts);
+        rpc_set_protocol(cl, cfg->version);
+        if (cfg->eager && rpc_connect(cl) == -1) {
+            fprintf(stderr, "Failed to connect\n");
+            exit(EXIT_FAILURE);
+        }
+
+        uint64_t start = now_us();
+        rpc_handle *h = rpc_find(cl, "echo");
+        assert(h != NULL);
+        rpc_data req = {.data1 = i, .data2_len = 0, .data2 = NULL};
+        rpc_data *res = rpc_call(cl, h, &req);
+        total += now_us() - start;
+        assert(res != NULL && res->data1 == i);
+
+        rpc_data_free(res);
+        free(h);
+        rpc_close_client(cl);
+    }
+    return total / REPS;
+}
+
+/* Compares two uint64_t (for qsort).
+ */
+int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/* Returns the time of the monotonic clock, in microseconds.
+ */
+uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/* Extracts the command line arguments.
+ */
+void read_args(int argc, char *argv[], int *port, int *n_calls) {
+    int c;
+    int values_read = 0;
+    *n_calls = DEFAULT_CALLS;
+
+    while ((c = getopt(argc, argv, "p:n:")) != -1) {
+        switch (c) {
+            case PORT:
+                *port = atoi(optarg);
+                values_read++;
+                break;
+            case CALLS:
+                *n_calls = atoi(optarg);
+                break;
+            default:
+                exit(0);
+        }
+    }
+
+    if (values_read != NUM_ARGS || *n_calls <= 0) {
+        fprintf(stderr, "Usage: %s -p port [-n calls]\n", argv[0]);
+        exit(0);
+    }
+}
@@ -0,0 +1,203 @@
+/* Generated by rpc-idlgen from the interface calc. Do not edit. */
+
+#include "calc_rpc.h"
+#include "rpc.h"
+#include <stdlib.h>
+#include <string.h>
+
+static inline uint8_t *put_u8(uint8_t *p, uint8_t v) {
+    *p = v;
+    return p + 1;
+}
+
+static inline uint8_t *put_u16(uint8_t *p, uint16_t v) {
+    p[0] = v >> 8;
+    p[1] = v;
+    return p + 2;
+}
+
+static inline uint8_t *put_u32(uint8_t *p, uint32_t v) {
+    p = put_u16(p, v >> 16);
+    return put_u16(p, v);
+}
+
+static inline uint8_t *put_u64(uint8_t *p, uint64_t v) {
+    p = put_u32(p, v >> 32);
+    return put_u32(p, v);
+}
+
+static inline uint8_t *put_f32(uint8_t *p, float v) {
+    uint32_t u;
+    memcpy(&u, &v, sizeof(u));
+    return put_u32(p, u);
+}
+
+static inline uint8_t *put_f64(uint8_t *p, double v) {
+    uint64_t u;
+    memcpy(&u, &v, sizeof(u));
+    return put_u64(p, u);
+}
+
+static inline uint8_t get_u8(const uint8_t **p) {
+    return *(*p)++;
+}
+
+static inline uint16_t get_u16(const uint8_t **p) {
+    uint16_t v = get_u8(p) << 8;
+    return v | get_u8(p);
+}
+
+static inline uint32_t get_u32(const uint8_t **p) {
+    uint32_t v = (uint32_t)get_u16(p) << 16;
+    return v | get_u16(p);
+}
+
+static inline uint64_t get_u64(const uint8_t **p) {
+    uint64_t v = (uint64_t)get_u32(p) << 32;
+    return v | get_u32(p);
+}
+
+static inline float get_f32(const uint8_t **p) {
+    uint32_t u = get_u32(p);
+    float v;
+    memcpy(&v, &u, sizeof(v));
+    return v;
+}
+
+static inline double get_f64(const uint8_t **p) {
+    uint64_t u = get_u64(p);
+    double v;
+    memcpy(&v, &u, sizeof(v));
+    return v;
+}
+
+#define CALC_OPERANDS_SIZE 1
+
+static uint8_t *calc_operands_put(uint8_t *p, const calc_operands *v) {
+    p = put_u8(p, (uint8_t)v->right);
+    return p;
+}
+
+static void calc_operands_get(const uint8_t **p, calc_operands *v) {
+    v->right = (int8_t)get_u8(p);
+}
+
+enum {
+    FUNC_0, // add2
+    FUNC_1, // subtract2
+    NUM_FUNCS
+};
+
+static char *NAMES[NUM_FUNCS] = {
+    "add2",
+    "subtract2",
+};
+
+struct calc_client {
+    rpc_client *cl;
+    rpc_handle *h[NUM_FUNCS];
+};
+
+calc_client *calc_bind(rpc_client *cl) {
+    calc_client *c = calloc(1, sizeof(*c));
+    if (c == NULL)
+        return NULL;
+    c->cl = cl;
+    for (int i = 0; i < NUM_FUNCS; i++) {
+        c->h[i] = rpc_find(cl, NAMES[i]);
+        if (c->h[i] == NULL) {
+            calc_unbind(c);
+            return NULL;
+        }
+    }
+    return c;
+}
+
+void calc_unbind(calc_client *c) {
+    if (c == NULL)
+        return;
+    for (int i = 0; i < NUM_FUNCS; i++)
+        free(c->h[i]);
+    free(c);
+}
+
+int calc_add2(calc_client *c, const calc_operands *in, int32_t *out) {
+    rpc_data req = {.data1 = 0, .data2_len = 0, .data2 = NULL};
+    req.data1 = (int)in->left;
+    uint8_t buf[1];
+    uint8_t *p = buf;
+    p = calc_operands_put(p, in);
+    req.data2_len = sizeof(buf);
+    req.data2 = buf;
+    rpc_data *res = rpc_call(c->cl, c->h[FUNC_0], &req);
+    if (res == NULL)
+        return -1;
+    *out = (int32_t)res->data1;
+    rpc_data_free(res);
+    return 0;
+}
+
+int calc_subtract2(calc_client *c, const calc_operands *in, int32_t *out) {
+    rpc_data req = {.data1 = 0, .data2_len = 0, .data2 = NULL};
+    req.data1 = (int)in->left;
+    uint8_t buf[1];
+    uint8_t *p = buf;
+    p = calc_operands_put(p, in);
+    req.data2_len = sizeof(buf);
+    req.data2 = buf;
+    rpc_data *res = rpc_call(c->cl, c->h[FUNC_1], &req);
+    if (res == NULL)
+        return -1;
+    *out = (int32_t)res->data1;
+    rpc_data_free(res);
+    return 0;
+}
+
+/* A result with a data2 of `len` bytes (none if 0) */
+static rpc_data *new_result(int data1, size_t len) {
+    rpc_data *out = malloc(sizeof(*out));
+    if (out == NULL)
+        return NULL;
+    out->data1 = data1;
+    out->data2_len = len;
+    out->data2 = NULL;
+    if (len > 0 && (out->data2 = malloc(len)) == NULL) {
+        free(out);
+        return NULL;
+    }
+    return out;
+}
+
+static rpc_data *calc_add2_handler(rpc_data *in) {
+    calc_operands arg;
+    int32_t ret;
+    if (in->data2 == NULL || in->data2_len != 1)
+        return NULL;
+    const uint8_t *q = in->data2;
+    calc_operands_get(&q, &arg);
+    arg.left = (int8_t)in->data1;
+    if (calc_add2_impl(&arg, &ret) == -1)
+        return NULL;
+    return new_result((int)ret, 0);
+}
+
+static rpc_data *calc_subtract2_handler(rpc_data *in) {
+    calc_operands arg;
+    int32_t ret;
+    if (in->data2 == NULL || in->data2_len != 1)
+        return NULL;
+    const uint8_t *q = in->data2;
+    calc_operands_get(&q, &arg);
+    arg.left = (int8_t)in->data1;
+    if (calc_subtract2_impl(&arg, &ret) == -1)
+        return NULL;
+    return new_result((int)ret, 0);
+}
+
+int calc_register(rpc_server *srv) {
+    if (rpc_register(srv, "add2", calc_add2_handler) == -1)
+        return -1;
+    if (rpc_register(srv, "subtract2", calc_subtract2_handler) == -1)
+        return -1;
+    return 0;
+}
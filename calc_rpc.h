@@ -0,0 +1,52 @@
+/* Generated by rpc-idlgen from the interface calc. Do not edit. */
+
+#ifndef CALC_RPC_H
+#define CALC_RPC_H
+
+#include <stdint.h>
+#include "rpc.h"
+
+typedef struct {
+    int8_t left;
+    int8_t right;
+} calc_operands;
+
+/* ------ */
+/* Client */
+/* ------ */
+
+/* The functions of the interface, found on a server */
+typedef struct calc_client calc_client;
+
+/* Finds every function of the interface on the server of the client */
+/* RETURNS: calc_client* on success, NULL on error */
+calc_client *calc_bind(rpc_client *cl);
+
+/* Frees the handles (the client itself stays open) */
+void calc_unbind(calc_client *c);
+
+/* Calls add2 on the server */
+/* RETURNS: -1 on failure */
+int calc_add2(calc_client *c, const calc_operands *in, int32_t *out);
+
+/* Calls subtract2 on the server */
+/* RETURNS: -1 on failure */
+int calc_subtract2(calc_client *c, const calc_operands *in, int32_t *out);
+
+/* ------ */
+/* Server */
+/* ------ */
+
+/* add2, to be defined by the server */
+/* RETURNS: -1 on failure */
+int calc_add2_impl(const calc_operands *in, int32_t *out);
+
+/* subtract2, to be defined by the server */
+/* RETURNS: -1 on failure */
+int calc_subtract2_impl(const calc_operands *in, int32_t *out);
+
+/* Registers every function of the interface, as "calc.<function>" (unless named otherwise) */
+/* RETURNS: -1 on failure */
+int calc_register(rpc_server *srv);
+
+#endif
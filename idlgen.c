@@ -0,0 +1,872 @@
+/*-----------------------------------------------------------------------------
+ * Project 2
+ * idlgen.c :
+              = rpc-idlgen, the stub generator of the RPC system
+              = reads an interface description (.idl) and writes the C
+                client stubs and server skeletons of its functions
+                (<name>_rpc.h and <name>_rpc.c, next to it)
+ *
+ * An interface description looks like:
+ *
+ *   interface calc;               // prefix of every generated name
+ *
+ *   struct operands {             // fixed size: scalars, structs declared
+ *       i8 left;                  // above, and arrays of them
+ *       i8 right;
+ *       i32 weights[4];
+ *   };
+ *
+ *   func add2(operands) returns i32;
+ *   func reset();                 // the argument and result are optional
+ *   func sub(operands) as sub2;   // registered as sub2, not calc.sub
+ *
+ * Scalars are i8, i16, i32, i64, u8, u16, u32, u64, f32 and f64.
+ * A value of an integer type of up to 32 bits goes in data1; any other one
+   is encoded in data2, field by field in network byte order.
+ * One field of a struct (an integer of up to 32 bits) may be sent in data1
+   instead, with the others in data2: `i8 left in data1;`. Such a struct
+   is only an argument or a result, not a field.
+ ----------------------------------------------------------------------------*/
+
+#include <ctype.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "rpc_safety.h"
+
+#define MAX_IDENT 64
+#define MAX_STRUCTS 64
+#define MAX_FIELDS 64
+#define MAX_FUNCS 128
+#define MAX_PATH 4096
+
+// Kinds of types
+enum KIND {
+    K_I8, K_I16, K_I32, K_I64, K_U8, K_U16, K_U32, K_U64, K_F32, K_F64,
+    K_STRUCT, K_VOID
+};
+
+// The scalars, indexed by enum KIND
+typedef struct {
+    char *name;             // in the IDL
+    char *c_type;
+    int size;               // in bytes, on the wire
+    char *wire;             // suffix of its put_ / get_ helpers
+} scalar;
+
+static const scalar SCALARS[] = {
+    {"i8", "int8_t", 1, "u8"},     {"i16", "int16_t", 2, "u16"},
+    {"i32", "int32_t", 4, "u32"},  {"i64", "int64_t", 8, "u64"},
+    {"u8", "uint8_t", 1, "u8"},    {"u16", "uint16_t", 2, "u16"},
+    {"u32", "uint32_t", 4, "u32"}, {"u64", "uint64_t", 8, "u64"},
+    {"f32", "float", 4, "f32"},    {"f64", "double", 8, "f64"},
+};
+#define NUM_SCALARS (int)(sizeof(SCALARS) / sizeof(SCALARS[0]))
+
+typedef struct {
+    int kind;               // enum KIND
+    int strct;              // index of the struct, for K_STRUCT
+} type_t;
+
+typedef struct {
+    char name[MAX_IDENT];
+    type_t type;
+    int count;              // number of elements of an array, 0 if not one
+    int in_data1;           // TRUE if sent in data1, not encoded in data2
+} field_t;
+
+typedef struct {
+    char name[MAX_IDENT];
+    field_t fields[MAX_FIELDS];
+    int n_fields;
+    int data1_field;        // index of the field sent in data1, -1 if none
+    long size;              // encoded in data2, in bytes
+} struct_t;
+
+typedef struct {
+    char name[MAX_IDENT];
+    type_t arg;             // K_VOID if none
+    type_t ret;             // K_VOID if none
+    char as[MAX_IDENT];     // name registered, "" for <interface>.<name>
+} func_t;
+
+typedef struct {
+    char name[MAX_IDENT];   // of the interface
+    struct_t structs[MAX_STRUCTS];
+    int n_structs;
+    func_t funcs[MAX_FUNCS];
+    int n_funcs;
+} interface_t;
+
+// State of the parser
+typedef struct {
+    char *path;
+    char *src;
+    char *pos;
+    int line;
+    char tok[MAX_IDENT];    // current token (an identifier, number or symbol)
+} parser;
+
+void fail(parser *ps, char *fmt, ...);
+void next_token(parser *ps);
+int accept(parser *ps, char *tok);
+void expect(parser *ps, char *tok);
+void expect_ident(parser *ps, char *ident);
+void parse_interface(parser *ps, interface_t *itf);
+void parse_struct(parser *ps, interface_t *itf);
+void parse_func(parser *ps, interface_t *itf);
+type_t parse_type(parser *ps, interface_t *itf);
+int is_unique(interface_t *itf, char *name);
+int in_data1(type_t type);
+int data1_field(interface_t *itf, type_t type);
+long type_size(interface_t *itf, type_t type);
+void c_type(interface_t *itf, type_t type, char *buf);
+void reg_name(interface_t *itf, func_t *fn, char *buf);
+char *read_file(char *path);
+void write_header(FILE *f, interface_t *itf, char *guard);
+void write_source(FILE *f, interface_t *itf, char *header);
+void write_prototypes(FILE *f, interface_t *itf, func_t *fn, int impl);
+void write_params(FILE *f, interface_t *itf, func_t *fn);
+void write_put(FILE *f, interface_t *itf, type_t type, char *expr,
+               int indent);
+void write_get(FILE *f, interface_t *itf, type_t type, char *expr,
+               char *src, int indent);
+void write_client(FILE *f, interface_t *itf, func_t *fn, int idx);
+void write_handler(FILE *f, interface_t *itf, func_t *fn);
+
+/* Generates the stubs of the interface described in the file given.
+ */
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s file.idl\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    char *path = argv[1];
+    size_t len = strlen(path);
+    if (len < 4 || strcmp(path + len - 4, ".idl") != 0 || len > MAX_PATH) {
+        fprintf(stderr, "%s: not a .idl file\n", path);
+        exit(EXIT_FAILURE);
+    }
+
+    static interface_t itf;
+    parser ps = {.path = path, .src = read_file(path), .line = 1};
+    ps.pos = ps.src;
+    parse_interface(&ps, &itf);
+    free(ps.src);
+
+    // <base>_rpc.h and <base>_rpc.c, next to <base>.idl
+    char h_path[MAX_PATH + 8], c_path[MAX_PATH + 8];
+    snprintf(h_path, sizeof(h_path), "%.*s_rpc.h", (int)len - 4, path);
+    snprintf(c_path, sizeof(c_path), "%.*s_rpc.c", (int)len - 4, path);
+    char *header = strrchr(h_path, '/') ? strrchr(h_path, '/') + 1 : h_path;
+    char guard[MAX_PATH + 8];
+    int i = 0;
+    for (; header[i] != '\0'; i++) {
+        guard[i] = isalnum((unsigned char)header[i])
+                   ? toupper((unsigned char)header[i]) : '_';
+    }
+    guard[i] = '\0';
+
+    FILE *f = fopen(h_path, "w");
+    if (f == NULL) {
+        perror(h_path);
+        exit(EXIT_FAILURE);
+    }
+    write_header(f, &itf, guard);
+    fclose(f);
+
+    f = fopen(c_path, "w");
+    if (f == NULL) {
+        perror(c_path);
+        exit(EXIT_FAILURE);
+    }
+    write_source(f, &itf, header);
+    fclose(f);
+    return 0;
+}
+
+/******* Parsing *******/
+
+/* Prints an error at the current line of the description, and exits.
+ */
+void fail(parser *ps, char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    fprintf(stderr, "%s:%d: ", ps->path, ps->line);
+    vfprintf(stderr, fmt, args);
+    fprintf(stderr, "\n");
+    va_end(args);
+    exit(EXIT_FAILURE);
+}
+
+/* Moves to the next token (skipping spaces and comments), which is empty at
+   the end of the description.
+ */
+void next_token(parser *ps) {
+    while (1) {
+        if (*ps->pos == '\n')
+            ps->line++;
+        if (isspace((unsigned char)*ps->pos)) {
+            ps->pos++;
+        } else if (*ps->pos == '#'
+                   || (ps->pos[0] == '/' && ps->pos[1] == '/')) {
+            while (*ps->pos != '\0' && *ps->pos != '\n')
+                ps->pos++;
+        } else {
+            break;
+        }
+    }
+
+    int len = 0;
+    if (isalnum((unsigned char)*ps->pos) || *ps->pos == '_') {
+        while (isalnum((unsigned char)ps->pos[len]) || ps->pos[len] == '_')
+            len++;
+        if (len >= MAX_IDENT)
+            fail(ps, "name too long");
+    } else if (*ps->pos != '\0') {
+        len = 1; // a symbol
+    }
+    memcpy(ps->tok, ps->pos, len);
+    ps->tok[len] = '\0';
+    ps->pos += len;
+}
+
+/* Returns TRUE (and moves past it) if the current token is `tok`,
+   FALSE otherwise.
+ */
+int accept(parser *ps, char *tok) {
+    if (strcmp(ps->tok, tok) != 0)
+        return FALSE;
+    next_token(ps);
+    return TRUE;
+}
+
+/* Moves past the current token, which must be `tok`.
+ */
+void expect(parser *ps, char *tok) {
+    if (!accept(ps, tok))
+        fail(ps, "expected '%s', got '%s'", tok, ps->tok);
+}
+
+/* Copies the current token, which must be an identifier, to `ident`, and
+   moves past it.
+ */
+void expect_ident(parser *ps, char *ident) {
+    if (!isalpha((unsigned char)ps->tok[0]) && ps->tok[0] != '_')
+        fail(ps, "expected a name, got '%s'", ps->tok);
+    strcpy(ident, ps->tok);
+    next_token(ps);
+}
+
+/* Parses the whole description to `itf`.
+ */
+void parse_interface(parser *ps, interface_t *itf) {
+    next_token(ps);
+    expect(ps, "interface");
+    expect_ident(ps, itf->name);
+    expect(ps, ";");
+
+    while (ps->tok[0] != '\0') {
+        if (accept(ps, "struct"))
+            parse_struct(ps, itf);
+        else if (accept(ps, "func"))
+            parse_func(ps, itf);
+        else
+            fail(ps, "expected 'struct' or 'func', got '%s'", ps->tok);
+    }
+    if (itf->n_funcs == 0)
+        fail(ps, "no functions in interface %s", itf->name);
+}
+
+/* Parses a struct (after `struct`): its name, then its fields.
+ */
+void parse_struct(parser *ps, interface_t *itf) {
+    if (itf->n_structs == MAX_STRUCTS)
+        fail(ps, "too many structs");
+    struct_t *st = &itf->structs[itf->n_structs];
+    expect_ident(ps, st->name);
+    if (!is_unique(itf, st->name))
+        fail(ps, "%s is declared twice", st->name);
+    expect(ps, "{");
+    st->data1_field = -1;
+
+    while (!accept(ps, "}")) {
+        if (st->n_fields == MAX_FIELDS)
+            fail(ps, "too many fields in %s", st->name);
+        field_t *fd = &st->fields[st->n_fields];
+        fd->type = parse_type(ps, itf);
+        if (data1_field(itf, fd->type) != -1)
+            fail(ps, "%s has a field in data1, so can't be a field",
+                 itf->structs[fd->type.strct].name);
+        expect_ident(ps, fd->name);
+        for (int i = 0; i < st->n_fields; i++) {
+            if (strcmp(st->fields[i].name, fd->name) == 0)
+                fail(ps, "%s.%s is declared twice", st->name, fd->name);
+        }
+        if (accept(ps, "[")) {
+            fd->count = atoi(ps->tok);
+            if (fd->count <= 0 || fd->count > UINT16_MAX)
+                fail(ps, "invalid array length '%s'", ps->tok);
+            next_token(ps);
+            expect(ps, "]");
+        }
+        if (accept(ps, "in")) {
+            expect(ps, "data1");
+            if (!in_data1(fd->type) || fd->count > 0)
+                fail(ps, "only an integer of up to 32 bits goes in data1");
+            if (st->data1_field != -1)
+                fail(ps, "%s has two fields in data1", st->name);
+            fd->in_data1 = TRUE;
+            st->data1_field = st->n_fields;
+        }
+        expect(ps, ";");
+        if (!fd->in_data1)
+            st->size += type_size(itf, fd->type)
+                        * (fd->count > 0 ? fd->count : 1);
+        st->n_fields++;
+    }
+    expect(ps, ";");
+    if (st->n_fields == 0)
+        fail(ps, "struct %s has no fields", st->name);
+    if (st->size > UINT32_MAX)
+        fail(ps, "struct %s is too large", st->name);
+    itf->n_structs++;
+}
+
+/* Parses a function (after `func`): its name, argument and result.
+ */
+void parse_func(parser *ps, interface_t *itf) {
+    if (itf->n_funcs == MAX_FUNCS)
+        fail(ps, "too many functions");
+    func_t *fn = &itf->funcs[itf->n_funcs];
+    expect_ident(ps, fn->name);
+    if (!is_unique(itf, fn->name))
+        fail(ps, "%s is declared twice", fn->name);
+
+    expect(ps, "(");
+    fn->arg.kind = K_VOID;
+    if (!accept(ps, ")")) {
+        fn->arg = parse_type(ps, itf);
+        expect(ps, ")");
+    }
+    fn->ret.kind = K_VOID;
+    if (accept(ps, "returns"))
+        fn->ret = parse_type(ps, itf);
+    if (accept(ps, "as")) {
+        expect_ident(ps, fn->as);
+        for (int i = 0; i < itf->n_funcs; i++) {
+            if (strcmp(itf->funcs[i].as, fn->as) == 0)
+                fail(ps, "%s is registered twice", fn->as);
+        }
+    }
+    expect(ps, ";");
+    itf->n_funcs++;
+}
+
+/* Parses the name of a type: a scalar, or a struct declared before.
+ * Returns the type.
+ */
+type_t parse_type(parser *ps, interface_t *itf) {
+    type_t type = {.kind = K_VOID, .strct = -1};
+    for (int i = 0; i < NUM_SCALARS; i++) {
+        if (strcmp(ps->tok, SCALARS[i].name) == 0)
+            type.kind = i;
+    }
+    for (int i = 0; i < itf->n_structs; i++) {
+        if (strcmp(ps->tok, itf->structs[i].name) == 0) {
+            type.kind = K_STRUCT;
+            type.strct = i;
+        }
+    }
+    if (type.kind == K_VOID)
+        fail(ps, "unknown type '%s'", ps->tok);
+    next_token(ps);
+    return type;
+}
+
+/* Returns TRUE if no struct or function of the interface has the name,
+   FALSE otherwise.
+ */
+int is_unique(interface_t *itf, char *name) {
+    for (int i = 0; i < itf->n_structs; i++) {
+        if (strcmp(itf->structs[i].name, name) == 0)
+            return FALSE;
+    }
+    for (int i = 0; i < itf->n_funcs; i++) {
+        if (strcmp(itf->funcs[i].name, name) == 0)
+            return FALSE;
+    }
+    return TRUE;
+}
+
+/* Returns TRUE if values of the type go in data1 (integers of up to 32
+   bits), FALSE if they go in data2.
+ */
+int in_data1(type_t type) {
+    return type.kind == K_I8 || type.kind == K_I16 || type.kind == K_I32
+        || type.kind == K_U8 || type.kind == K_U16 || type.kind == K_U32;
+}
+
+/* Returns the index of the field of the type sent in data1, or -1 if it
+   is not a struct with one.
+ */
+int data1_field(interface_t *itf, type_t type) {
+    if (type.kind != K_STRUCT)
+        return -1;
+    return itf->structs[type.strct].data1_field;
+}
+
+/* Returns the size of a value of the type (not void) in data2.
+ */
+long type_size(interface_t *itf, type_t type) {
+    if (type.kind == K_STRUCT)
+        return itf->structs[type.strct].size;
+    return SCALARS[type.kind].size;
+}
+
+/* Writes the C name of the type (not void) to `buf`.
+ */
+void c_type(interface_t *itf, type_t type, char *buf) {
+    if (type.kind == K_STRUCT)
+        sprintf(buf, "%s_%s", itf->name, itf->structs[type.strct].name);
+    else
+        strcpy(buf, SCALARS[type.kind].c_type);
+}
+
+/* Writes the name the function is registered (and found) as to `buf`.
+ */
+void reg_name(interface_t *itf, func_t *fn, char *buf) {
+    if (fn->as[0] != '\0')
+        strcpy(buf, fn->as);
+    else
+        sprintf(buf, "%s.%s", itf->name, fn->name);
+}
+
+/* Returns the contents of the file (NUL-terminated), or exits on failure.
+ */
+char *read_file(char *path) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    size_t cap = 4096, len = 0;
+    char *src = malloc(cap);
+    while (src != NULL) {
+        len += fread(src + len, 1, cap - len - 1, f);
+        if (len < cap - 1)
+            break;
+        cap *= 2;
+        char *bigger = realloc(src, cap);
+        if (bigger == NULL)
+            free(src);
+        src = bigger;
+    }
+    if (src == NULL || ferror(f)) {
+        fprintf(stderr, "%s: could not be read\n", path);
+        exit(EXIT_FAILURE);
+    }
+    fclose(f);
+    src[len] = '\0';
+    return src;
+}
+
+/******* Generation *******/
+
+/* Writes the generated header: the types, the client stubs, the functions
+   the server implements, and how to register them.
+ */
+void write_header(FILE *f, interface_t *itf, char *guard) {
+    char *name = itf->name;
+    fprintf(f, "/* Generated by rpc-idlgen from the interface %s. "
+               "Do not edit. */\n\n", name);
+    fprintf(f, "#ifndef %s\n#define %s\n\n", guard, guard);
+    fprintf(f, "#include <stdint.h>\n#include \"rpc.h\"\n\n");
+
+    for (int i = 0; i < itf->n_structs; i++) {
+        struct_t *st = &itf->structs[i];
+        fprintf(f, "typedef struct {\n");
+        for (int j = 0; j < st->n_fields; j++) {
+            char type[2 * MAX_IDENT];
+            c_type(itf, st->fields[j].type, type);
+            fprintf(f, "    %s %s", type, st->fields[j].name);
+            if (st->fields[j].count > 0)
+                fprintf(f, "[%d]", st->fields[j].count);
+            fprintf(f, ";\n");
+        }
+        fprintf(f, "} %s_%s;\n\n", name, st->name);
+    }
+
+    fprintf(f, "/* ------ */\n/* Client */\n/* ------ */\n\n");
+    fprintf(f, "/* The functions of the interface, found on a server */\n");
+    fprintf(f, "typedef struct %s_client %s_client;\n\n", name, name);
+    fprintf(f, "/* Finds every function of the interface on the server of "
+               "the client */\n");
+    fprintf(f, "/* RETURNS: %s_client* on success, NULL on error */\n", name);
+    fprintf(f, "%s_client *%s_bind(rpc_client *cl);\n\n", name, name);
+    fprintf(f, "/* Frees the handles (the client itself stays open) */\n");
+    fprintf(f, "void %s_unbind(%s_client *c);\n\n", name, name);
+    for (int i = 0; i < itf->n_funcs; i++) {
+        fprintf(f, "/* Calls %s on the server */\n", itf->funcs[i].name);
+        write_prototypes(f, itf, &itf->funcs[i], 0);
+    }
+
+    fprintf(f, "/* ------ */\n/* Server */\n/* ------ */\n\n");
+    for (int i = 0; i < itf->n_funcs; i++) {
+        fprintf(f, "/* %s, to be defined by the server */\n",
+                itf->funcs[i].name);
+        write_prototypes(f, itf, &itf->funcs[i], 1);
+    }
+    fprintf(f, "/* Registers every function of the interface, as "
+               "\"%s.<function>\" (unless named otherwise) */\n", name);
+    fprintf(f, "/* RETURNS: -1 on failure */\n");
+    fprintf(f, "int %s_register(rpc_server *srv);\n\n", name);
+    fprintf(f, "#endif\n");
+}
+
+/* Writes the declaration of the client stub (or the function the server
+   implements) of the function.
+ */
+void write_prototypes(FILE *f, interface_t *itf, func_t *fn, int impl) {
+    fprintf(f, "/* RETURNS: -1 on failure */\n");
+    if (impl) {
+        fprintf(f, "int %s_%s_impl(", itf->name, fn->name);
+    } else {
+        fprintf(f, "int %s_%s(%s_client *c", itf->name, fn->name, itf->name);
+        if (fn->arg.kind != K_VOID || fn->ret.kind != K_VOID)
+            fprintf(f, ", ");
+    }
+    write_params(f, itf, fn);
+    if (impl && fn->arg.kind == K_VOID && fn->ret.kind == K_VOID)
+        fprintf(f, "void");
+    fprintf(f, ");\n\n");
+}
+
+/* Writes the parameters of a function: its argument (structs by pointer),
+   then where its result goes.
+ */
+void write_params(FILE *f, interface_t *itf, func_t *fn) {
+    char type[2 * MAX_IDENT];
+    if (fn->arg.kind != K_VOID) {
+        c_type(itf, fn->arg, type);
+        if (fn->arg.kind == K_STRUCT)
+            fprintf(f, "const %s *in", type);
+        else
+            fprintf(f, "%s in", type);
+        if (fn->ret.kind != K_VOID)
+            fprintf(f, ", ");
+    }
+    if (fn->ret.kind != K_VOID) {
+        c_type(itf, fn->ret, type);
+        fprintf(f, "%s *out", type);
+    }
+}
+
+/* Writes the generated source: the encoding of the types, the client stubs
+   and the server's handlers.
+ */
+void write_source(FILE *f, interface_t *itf, char *header) {
+    char *name = itf->name;
+    fprintf(f, "/* Generated by rpc-idlgen from the interface %s. "
+               "Do not edit. */\n\n", name);
+    fprintf(f, "#include \"%s\"\n#include \"rpc.h\"\n", header);
+    fprintf(f, "#include <stdlib.h>\n#include <string.h>\n\n");
+
+    // the scalars, big-endian, a byte at a time (no alignment needed)
+    fprintf(f,
+        "static inline uint8_t *put_u8(uint8_t *p, uint8_t v) {\n"
+        "    *p = v;\n    return p + 1;\n}\n\n"
+        "static inline uint8_t *put_u16(uint8_t *p, uint16_t v) {\n"
+        "    p[0] = v >> 8;\n    p[1] = v;\n    return p + 2;\n}\n\n"
+        "static inline uint8_t *put_u32(uint8_t *p, uint32_t v) {\n"
+        "    p = put_u16(p, v >> 16);\n    return put_u16(p, v);\n}\n\n"
+        "static inline uint8_t *put_u64(uint8_t *p, uint64_t v) {\n"
+        "    p = put_u32(p, v >> 32);\n    return put_u32(p, v);\n}\n\n"
+        "static inline uint8_t *put_f32(uint8_t *p, float v) {\n"
+        "    uint32_t u;\n    memcpy(&u, &v, sizeof(u));\n"
+        "    return put_u32(p, u);\n}\n\n"
+        "static inline uint8_t *put_f64(uint8_t *p, double v) {\n"
+        "    uint64_t u;\n    memcpy(&u, &v, sizeof(u));\n"
+        "    return put_u64(p, u);\n}\n\n"
+        "static inline uint8_t get_u8(const uint8_t **p) {\n"
+        "    return *(*p)++;\n}\n\n"
+        "static inline uint16_t get_u16(const uint8_t **p) {\n"
+        "    uint16_t v = get_u8(p) << 8;\n    return v | get_u8(p);\n}\n\n"
+        "static inline uint32_t get_u32(const uint8_t **p) {\n"
+        "    uint32_t v = (uint32_t)get_u16(p) << 16;\n"
+        "    return v | get_u16(p);\n}\n\n"
+        "static inline uint64_t get_u64(const uint8_t **p) {\n"
+        "    uint64_t v = (uint64_t)get_u32(p) << 32;\n"
+        "    return v | get_u32(p);\n}\n\n"
+        "static inline float get_f32(const uint8_t **p) {\n"
+        "    uint32_t u = get_u32(p);\n    float v;\n"
+        "    memcpy(&v, &u, sizeof(v));\n    return v;\n}\n\n"
+        "static inline double get_f64(const uint8_t **p) {\n"
+        "    uint64_t u = get_u64(p);\n    double v;\n"
+        "    memcpy(&v, &u, sizeof(v));\n    return v;\n}\n\n");
+
+    for (int i = 0; i < itf->n_structs; i++) {
+        struct_t *st = &itf->structs[i];
+        if (st->size == 0)
+            continue; // (all in data1)
+        char type[2 * MAX_IDENT], upper[2 * MAX_IDENT];
+        type_t self = {.kind = K_STRUCT, .strct = i};
+        c_type(itf, self, type);
+        int j = 0;
+        for (; type[j] != '\0'; j++)
+            upper[j] = toupper((unsigned char)type[j]);
+        upper[j] = '\0';
+        fprintf(f, "#define %s_SIZE %ld\n\n", upper, st->size);
+
+        fprintf(f, "static uint8_t *%s_put(uint8_t *p, const %s *v) {\n",
+                type, type);
+        for (int j = 0; j < st->n_fields; j++) {
+            field_t *fd = &st->fields[j];
+            char expr[2 * MAX_IDENT + 16];
+            if (fd->in_data1) {
+                continue;
+            } else if (fd->count > 0) {
+                fprintf(f, "    for (int i = 0; i < %d; i++)\n", fd->count);
+                sprintf(expr, "v->%s[i]", fd->name);
+                write_put(f, itf, fd->type, expr, 8);
+            } else {
+                sprintf(expr, "v->%s", fd->name);
+                write_put(f, itf, fd->type, expr, 4);
+            }
+        }
+        fprintf(f, "    return p;\n}\n\n");
+
+        fprintf(f, "static void %s_get(const uint8_t **p, %s *v) {\n",
+                type, type);
+        for (int j = 0; j < st->n_fields; j++) {
+            field_t *fd = &st->fields[j];
+            char expr[2 * MAX_IDENT + 16];
+            if (fd->in_data1) {
+                continue;
+            } else if (fd->count > 0) {
+                fprintf(f, "    for (int i = 0; i < %d; i++)\n", fd->count);
+                sprintf(expr, "v->%s[i]", fd->name);
+                write_get(f, itf, fd->type, expr, "p", 8);
+            } else {
+                sprintf(expr, "v->%s", fd->name);
+                write_get(f, itf, fd->type, expr, "p", 4);
+            }
+        }
+        fprintf(f, "}\n\n");
+    }
+
+    // the client
+    fprintf(f, "enum {\n");
+    for (int i = 0; i < itf->n_funcs; i++)
+        fprintf(f, "    FUNC_%d, // %s\n", i, itf->funcs[i].name);
+    fprintf(f, "    NUM_FUNCS\n};\n\n");
+    fprintf(f, "static char *NAMES[NUM_FUNCS] = {\n");
+    for (int i = 0; i < itf->n_funcs; i++) {
+        char reg[2 * MAX_IDENT];
+        reg_name(itf, &itf->funcs[i], reg);
+        fprintf(f, "    \"%s\",\n", reg);
+    }
+    fprintf(f, "};\n\n");
+    fprintf(f, "struct %s_client {\n    rpc_client *cl;\n"
+               "    rpc_handle *h[NUM_FUNCS];\n};\n\n", name);
+
+    fprintf(f,
+        "%s_client *%s_bind(rpc_client *cl) {\n"
+        "    %s_client *c = calloc(1, sizeof(*c));\n"
+        "    if (c == NULL)\n        return NULL;\n"
+        "    c->cl = cl;\n"
+        "    for (int i = 0; i < NUM_FUNCS; i++) {\n"
+        "        c->h[i] = rpc_find(cl, NAMES[i]);\n"
+        "        if (c->h[i] == NULL) {\n"
+        "            %s_unbind(c);\n            return NULL;\n        }\n"
+        "    }\n    return c;\n}\n\n", name, name, name, name);
+    fprintf(f,
+        "void %s_unbind(%s_client *c) {\n"
+        "    if (c == NULL)\n        return;\n"
+        "    for (int i = 0; i < NUM_FUNCS; i++)\n        free(c->h[i]);\n"
+        "    free(c);\n}\n\n", name, name);
+    for (int i = 0; i < itf->n_funcs; i++)
+        write_client(f, itf, &itf->funcs[i], i);
+
+    // the server
+    fprintf(f,
+        "/* A result with a data2 of `len` bytes (none if 0) */\n"
+        "static rpc_data *new_result(int data1, size_t len) {\n"
+        "    rpc_data *out = malloc(sizeof(*out));\n"
+        "    if (out == NULL)\n        return NULL;\n"
+        "    out->data1 = data1;\n    out->data2_len = len;\n"
+        "    out->data2 = NULL;\n"
+        "    if (len > 0 && (out->data2 = malloc(len)) == NULL) {\n"
+        "        free(out);\n        return NULL;\n    }\n"
+        "    return out;\n}\n\n");
+    for (int i = 0; i < itf->n_funcs; i++)
+        write_handler(f, itf, &itf->funcs[i]);
+
+    fprintf(f, "int %s_register(rpc_server *srv) {\n", name);
+    for (int i = 0; i < itf->n_funcs; i++) {
+        char reg[2 * MAX_IDENT];
+        reg_name(itf, &itf->funcs[i], reg);
+        fprintf(f, "    if (rpc_register(srv, \"%s\", %s_%s_handler) "
+                   "== -1)\n        return -1;\n",
+                reg, name, itf->funcs[i].name);
+    }
+    fprintf(f, "    return 0;\n}\n");
+}
+
+/* Writes the statement encoding `expr` (of the type) at `p`.
+ */
+void write_put(FILE *f, interface_t *itf, type_t type, char *expr,
+               int indent) {
+    char c[2 * MAX_IDENT];
+    c_type(itf, type, c);
+    if (type.kind == K_STRUCT && expr[0] == '*') // already a pointer
+        fprintf(f, "%*sp = %s_put(p, %s);\n", indent, "", c, expr + 1);
+    else if (type.kind == K_STRUCT)
+        fprintf(f, "%*sp = %s_put(p, &%s);\n", indent, "", c, expr);
+    else if (type.kind == K_F32 || type.kind == K_F64)
+        fprintf(f, "%*sp = put_%s(p, %s);\n", indent, "",
+                SCALARS[type.kind].wire, expr);
+    else
+        fprintf(f, "%*sp = put_%s(p, (uint%d_t)%s);\n", indent, "",
+                SCALARS[type.kind].wire, SCALARS[type.kind].size * 8, expr);
+}
+
+/* Writes the statement decoding `expr` (of the type) from `src` (a
+   `const uint8_t **`).
+ */
+void write_get(FILE *f, interface_t *itf, type_t type, char *expr,
+               char *src, int indent) {
+    char c[2 * MAX_IDENT];
+    c_type(itf, type, c);
+    if (type.kind == K_STRUCT && expr[0] == '*') // already a pointer
+        fprintf(f, "%*s%s_get(%s, %s);\n", indent, "", c, src, expr + 1);
+    else if (type.kind == K_STRUCT)
+        fprintf(f, "%*s%s_get(%s, &%s);\n", indent, "", c, src, expr);
+    else
+        fprintf(f, "%*s%s = (%s)get_%s(%s);\n", indent, "", expr, c,
+                SCALARS[type.kind].wire, src);
+}
+
+/* Writes the client stub of the function (the `idx`th): the argument is
+   encoded on the stack (but for its field in data1, if any), then sent
+   as is.
+ */
+void write_client(FILE *f, interface_t *itf, func_t *fn, int idx) {
+    fprintf(f, "int %s_%s(%s_client *c", itf->name, fn->name, itf->name);
+    if (fn->arg.kind != K_VOID || fn->ret.kind != K_VOID)
+        fprintf(f, ", ");
+    write_params(f, itf, fn);
+    fprintf(f, ") {\n");
+
+    fprintf(f, "    rpc_data req = {.data1 = 0, .data2_len = 0, "
+               ".data2 = NULL};\n");
+    int d1 = data1_field(itf, fn->arg);
+    if (in_data1(fn->arg)) {
+        fprintf(f, "    req.data1 = (int)in;\n");
+    } else if (d1 != -1) {
+        fprintf(f, "    req.data1 = (int)in->%s;\n",
+                itf->structs[fn->arg.strct].fields[d1].name);
+    }
+    if (!in_data1(fn->arg) && fn->arg.kind != K_VOID
+            && type_size(itf, fn->arg) > 0) {
+        fprintf(f, "    uint8_t buf[%ld];\n", type_size(itf, fn->arg));
+        fprintf(f, "    uint8_t *p = buf;\n");
+        write_put(f, itf, fn->arg, fn->arg.kind == K_STRUCT ? "*in" : "in",
+                  4);
+        fprintf(f, "    req.data2_len = sizeof(buf);\n");
+        fprintf(f, "    req.data2 = buf;\n");
+    }
+
+    fprintf(f, "    rpc_data *res = rpc_call(c->cl, c->h[FUNC_%d], &req);\n",
+            idx);
+    fprintf(f, "    if (res == NULL)\n        return -1;\n");
+    char type[2 * MAX_IDENT];
+    d1 = data1_field(itf, fn->ret);
+    if (in_data1(fn->ret)) {
+        c_type(itf, fn->ret, type);
+        fprintf(f, "    *out = (%s)res->data1;\n", type);
+    } else if (d1 != -1) {
+        field_t *fd = &itf->structs[fn->ret.strct].fields[d1];
+        c_type(itf, fd->type, type);
+        fprintf(f, "    out->%s = (%s)res->data1;\n", fd->name, type);
+    }
+    if (!in_data1(fn->ret) && fn->ret.kind != K_VOID
+            && type_size(itf, fn->ret) > 0) {
+        fprintf(f, "    if (res->data2_len != %ld) {\n"
+                   "        rpc_data_free(res);\n        return -1;\n"
+                   "    }\n", type_size(itf, fn->ret));
+        fprintf(f, "    const uint8_t *q = res->data2;\n");
+        write_get(f, itf, fn->ret, "*out", "&q", 4);
+    }
+    fprintf(f, "    rpc_data_free(res);\n    return 0;\n}\n\n");
+}
+
+/* Writes the handler of the function, which decodes its argument, calls
+   the server's implementation and encodes the result (each with its field
+   in data1, if any).
+ */
+void write_handler(FILE *f, interface_t *itf, func_t *fn) {
+    char type[2 * MAX_IDENT];
+    fprintf(f, "static rpc_data *%s_%s_handler(rpc_data *in) {\n",
+            itf->name, fn->name);
+    if (fn->arg.kind != K_VOID) {
+        c_type(itf, fn->arg, type);
+        fprintf(f, "    %s arg;\n", type);
+    }
+    if (fn->ret.kind != K_VOID) {
+        c_type(itf, fn->ret, type);
+        fprintf(f, "    %s ret;\n", type);
+    }
+
+    int d1 = data1_field(itf, fn->arg);
+    if (fn->arg.kind == K_VOID) {
+        fprintf(f, "    (void)in;\n");
+    } else if (in_data1(fn->arg)) {
+        c_type(itf, fn->arg, type);
+        fprintf(f, "    arg = (%s)in->data1;\n", type);
+    } else {
+        if (type_size(itf, fn->arg) > 0) {
+            fprintf(f, "    if (in->data2 == NULL || in->data2_len != %ld)\n"
+                       "        return NULL;\n", type_size(itf, fn->arg));
+            fprintf(f, "    const uint8_t *q = in->data2;\n");
+            write_get(f, itf, fn->arg, "arg", "&q", 4);
+        }
+        if (d1 != -1) {
+            field_t *fd = &itf->structs[fn->arg.strct].fields[d1];
+            c_type(itf, fd->type, type);
+            fprintf(f, "    arg.%s = (%s)in->data1;\n", fd->name, type);
+        }
+    }
+
+    fprintf(f, "    if (%s_%s_impl(", itf->name, fn->name);
+    if (fn->arg.kind == K_STRUCT)
+        fprintf(f, "&arg");
+    else if (fn->arg.kind != K_VOID)
+        fprintf(f, "arg");
+    if (fn->arg.kind != K_VOID && fn->ret.kind != K_VOID)
+        fprintf(f, ", ");
+    if (fn->ret.kind != K_VOID)
+        fprintf(f, "&ret");
+    fprintf(f, ") == -1)\n        return NULL;\n");
+
+    d1 = data1_field(itf, fn->ret);
+    char data1[2 * MAX_IDENT + 16] = "0";
+    if (d1 != -1)
+        sprintf(data1, "(int)ret.%s",
+                itf->structs[fn->ret.strct].fields[d1].name);
+    if (in_data1(fn->ret)) {
+        fprintf(f, "    return new_result((int)ret, 0);\n");
+    } else if (fn->ret.kind == K_VOID || type_size(itf, fn->ret) == 0) {
+        fprintf(f, "    return new_result(%s, 0);\n", data1);
+    } else {
+        fprintf(f, "    rpc_data *out = new_result(%s, %ld);\n", data1,
+                type_size(itf, fn->ret));
+        fprintf(f, "    if (out == NULL)\n        return NULL;\n");
+        fprintf(f, "    uint8_t *p = out->data2;\n");
+        write_put(f, itf, fn->ret, "ret", 4);
+        fprintf(f, "    return out;\n");
+    }
+    fprintf(f, "}\n\n");
+}
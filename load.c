@@ -0,0 +1,437 @@
+#include "rpc.h"
+#include "rpc_ext.h"
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/prctl.h>
+
+#define IP_ADDR 'i'
+#define PORT 'p'
+#define FUNC 'f'
+#define RATE 'r'
+#define DURATION 'd'
+#define CONNS 'c'
+#define ARRIVALS 'a'
+#define SIZE 's'
+#define NUM_ARGS 2
+
+#define DEFAULT_FUNC "add2"  // of rpc-server
+#define DEFAULT_RATE 1000    // calls/s, over all connections
+#define DEFAULT_DURATION 10  // seconds
+#define DEFAULT_CONNS 10
+#define DEFAULT_SIZE 1       // bytes of data2
+#define DATA1_MOD 100        // data1 of the calls: 0 to 99, in turn
+#define START_DELAY_NS 100000000ULL // for every connection to be ready
+#define NS_PER_S 1000000000ULL
+
+// Histograms: values (ns) are kept with 2 significant decimal digits, i.e.
+// below 2^SUB_BITS exactly, and above with the top SUB_BITS bits only
+#define SUB_BITS 8
+#define SUB_COUNT (1 << SUB_BITS)
+#define HALF_COUNT (SUB_COUNT / 2)
+#define MAX_SHIFT (64 - SUB_BITS)
+#define N_BUCKETS (SUB_COUNT + MAX_SHIFT * HALF_COUNT)
+#define TICKS_PER_HALF 5     // rows of the distribution per halving of the
+                             // calls above (as HdrHistogram prints it)
+
+// Summary rows
+static const double SUMMARY_PCT[] = {50, 90, 99, 99.9, 99.99, 100};
+
+enum ARRIVAL {
+    CONSTANT = 'c',          // evenly spaced
+    POISSON = 'p'            // exponentially distributed gaps
+};
+
+typedef struct {
+    uint64_t counts[N_BUCKETS];
+    uint64_t total;
+    uint64_t max;
+    double sum, sum_sq;      // (for the mean and standard deviation)
+} histogram;
+
+// What every connection is given, and what it measures
+typedef struct {
+    int id;                  // of n_conns
+    int n_conns;
+    char *addr;
+    int port;
+    char *func;
+    int arrivals;            // enum ARRIVAL
+    double gap_ns;           // mean time between its calls
+    size_t size;
+    uint64_t start_ns, end_ns;
+    histogram corrected;     // from the time each call was meant to be sent
+    histogram uncorrected;   // from the time it was sent
+    uint64_t calls, errors;
+    uint64_t behind;         // calls meant to be sent before the end, and
+                             // not sent by then
+    int failed;              // could not connect
+} conn_load;
+
+void *run_conn(void *arg);
+double next_gap_ns(conn_load *load, unsigned short seed[3]);
+void record(histogram *hist, uint64_t value);
+int bucket_of(uint64_t value);
+uint64_t highest_in(int bucket);
+uint64_t value_at(histogram *hist, double pct);
+void merge(histogram *into, histogram *from);
+void print_summary(histogram *corrected, histogram *uncorrected);
+void print_distribution(histogram *hist);
+void sleep_until(uint64_t ns);
+uint64_t clock_ns(void);
+void read_args(int argc, char *argv[], conn_load *load, double *rate,
+               int *duration, int *n_conns);
+
+/* Calls a function of a server at a fixed rate (open loop), whether or not
+   earlier calls got a response, over several connections, and prints the
+   distribution of the latency of the calls. The latency is counted from
+   the time each call was meant to be sent: a server that falls behind
+   delays every call queued behind it, which a client waiting for each
+   response before sending the next (like rpc-bench) never sees.
+ * Each connection is a thread with its own schedule: evenly spaced calls,
+   or a Poisson process (the connections together then are one, at the
+   full rate). A call late for its time is sent as soon as the connection
+   is free, and counted from its time anyway.
+ */
+int main(int argc, char *argv[]) {
+    conn_load base;
+    double rate;
+    int duration, n_conns;
+    read_args(argc, argv, &base, &rate, &duration, &n_conns);
+    signal(SIGPIPE, SIG_IGN);
+
+    conn_load *loads = malloc(n_conns * sizeof(*loads));
+    pthread_t *threads = malloc(n_conns * sizeof(*threads));
+    assert(loads != NULL && threads != NULL);
+    base.n_conns = n_conns;
+    base.gap_ns = n_conns * NS_PER_S / rate;
+    base.start_ns = clock_ns() + START_DELAY_NS;
+    base.end_ns = base.start_ns + duration * NS_PER_S;
+    for (int i = 0; i < n_conns; i++) {
+        loads[i] = base;
+        loads[i].id = i;
+        assert(pthread_create(&threads[i], NULL, run_conn, &loads[i]) == 0);
+    }
+
+    histogram *corrected = calloc(1, sizeof(histogram));
+    histogram *uncorrected = calloc(1, sizeof(histogram));
+    assert(corrected != NULL && uncorrected != NULL);
+    uint64_t calls = 0, errors = 0, behind = 0;
+    int failed = 0;
+    for (int i = 0; i < n_conns; i++) {
+        pthread_join(threads[i], NULL);
+        merge(corrected, &loads[i].corrected);
+        merge(uncorrected, &loads[i].uncorrected);
+        calls += loads[i].calls;
+        errors += loads[i].errors;
+        behind += loads[i].behind;
+        failed += loads[i].failed;
+    }
+    if (failed == n_conns) {
+        fprintf(stderr, "Failed to call %s on %s, port %d\n", base.func,
+                base.addr, base.port);
+        exit(EXIT_FAILURE);
+    }
+
+    printf("%s on %s, port %d: %d connections, %s arrivals\n", base.func,
+           base.addr, base.port, n_conns - failed,
+           base.arrivals == POISSON ? "poisson" : "constant");
+    printf("%-20s %12.1f calls/s\n", "requested", rate);
+    printf("%-20s %12.1f calls/s\n", "achieved",
+           (double)calls / duration);
+    printf("%-20s %12llu\n", "calls", (unsigned long long)calls);
+    printf("%-20s %12llu\n", "errors", (unsigned long long)errors);
+    printf("%-20s %12llu\n", "not sent in time", (unsigned long long)behind);
+    if (behind > 0)
+        printf("(calls were still queued at the end: the server may not keep "
+               "up with this rate)\n(they count as waiting until the end: "
+               "the intended latencies are lower bounds)\n");
+    printf("\n");
+    print_summary(corrected, uncorrected);
+    printf("\nLatency from the intended send time (ms):\n\n");
+    print_distribution(corrected);
+
+    free(corrected);
+    free(uncorrected);
+    free(threads);
+    free(loads);
+    return 0;
+}
+
+/* Makes the calls of one connection (a conn_load) on its schedule, from
+   its start to its end.
+ */
+void *run_conn(void *arg) {
+    conn_load *load = arg;
+    unsigned short seed[3] = {(unsigned short)load->id,
+                              (unsigned short)getpid(), 0x330e};
+    // woken up on time (not up to 50us late), or that is counted too
+    prctl(PR_SET_TIMERSLACK, 1UL, 0, 0, 0);
+
+    // connected (and the function found) before the start
+    rpc_client *cl = rpc_init_client(load->addr, load->port);
+    rpc_handle *h = NULL;
+    if (cl == NULL || rpc_connect(cl) == -1
+            || (h = rpc_find(cl, load->func)) == NULL) {
+        load->failed = 1;
+        if (cl != NULL)
+            rpc_close_client(cl);
+        return NULL;
+    }
+    char *data2 = load->size > 0 ? calloc(load->size, 1) : NULL;
+    if (load->size > 0) {
+        assert(data2 != NULL);
+        data2[0] = 1;
+    }
+    rpc_data req = {.data1 = 0, .data2_len = load->size, .data2 = data2};
+
+    // (the connections' first calls are spread over a gap, not at once)
+    double intended = load->start_ns
+                      + (load->arrivals == POISSON ? next_gap_ns(load, seed)
+                         : load->gap_ns * load->id / load->n_conns);
+    while (intended < load->end_ns) {
+        uint64_t due = (uint64_t)intended;
+        sleep_until(due);
+        uint64_t sent = clock_ns();
+        if (sent >= load->end_ns) {
+            // (and every call after it, up to the end): it has waited that
+            // long at least, and its wait is the tail we want to measure
+            load->behind++;
+            record(&load->corrected, sent - due);
+            intended += next_gap_ns(load, seed);
+            continue;
+        }
+
+        req.data1 = load->calls % DATA1_MOD;
+        rpc_data *res = rpc_call(cl, h, &req);
+        uint64_t done = clock_ns();
+        load->calls++;
+        if (res == NULL) {
+            load->errors++;
+        } else {
+            record(&load->corrected, done - due);
+            record(&load->uncorrected, done - sent);
+            rpc_data_free(res);
+        }
+        intended += next_gap_ns(load, seed);
+    }
+
+    free(data2);
+    free(h);
+    rpc_close_client(cl);
+    return NULL;
+}
+
+/* Returns the time until the next call of the connection (ns).
+ */
+double next_gap_ns(conn_load *load, unsigned short seed[3]) {
+    if (load->arrivals == CONSTANT)
+        return load->gap_ns;
+    // (1 - u: never log(0))
+    return -load->gap_ns * log(1 - erand48(seed));
+}
+
+/* Records a value (ns) in the histogram.
+ */
+void record(histogram *hist, uint64_t value) {
+    hist->counts[bucket_of(value)]++;
+    hist->total++;
+    if (value > hist->max)
+        hist->max = value;
+    hist->sum += value;
+    hist->sum_sq += (double)value * value;
+}
+
+/* Returns the bucket of the histograms that counts the value: the value
+   itself below SUB_COUNT, and above, HALF_COUNT buckets for each power of
+   2, each as wide as 1 / HALF_COUNT of it.
+ */
+int bucket_of(uint64_t value) {
+    if (value < SUB_COUNT)
+        return value;
+    // shifted right until its top bit is bit SUB_BITS - 1
+    int shift = 64 - __builtin_clzll(value) - SUB_BITS;
+    return SUB_COUNT + (shift - 1) * HALF_COUNT
+           + (int)(value >> shift) - HALF_COUNT;
+}
+
+/* Returns the highest value counted by the bucket.
+ */
+uint64_t highest_in(int bucket) {
+    if (bucket < SUB_COUNT)
+        return bucket;
+    int shift = (bucket - SUB_COUNT) / HALF_COUNT + 1;
+    uint64_t top = (bucket - SUB_COUNT) % HALF_COUNT + HALF_COUNT;
+    return ((top + 1) << shift) - 1;
+}
+
+/* Returns the value (the highest of its bucket) that `pct` percent of the
+   values of the histogram are at most.
+ */
+uint64_t value_at(histogram *hist, double pct) {
+    if (hist->total == 0)
+        return 0;
+    if (pct >= 100)
+        return hist->max;
+    uint64_t wanted = (uint64_t)ceil(pct / 100 * hist->total);
+    if (wanted == 0)
+        wanted = 1;
+    uint64_t seen = 0;
+    for (int b = 0; b < N_BUCKETS; b++) {
+        seen += hist->counts[b];
+        if (seen >= wanted)
+            return highest_in(b) < hist->max ? highest_in(b) : hist->max;
+    }
+    return hist->max;
+}
+
+/* Adds the values of `from` to `into`.
+ */
+void merge(histogram *into, histogram *from) {
+    for (int b = 0; b < N_BUCKETS; b++) {
+        into->counts[b] += from->counts[b];
+    }
+    into->total += from->total;
+    if (from->max > into->max)
+        into->max = from->max;
+    into->sum += from->sum;
+    into->sum_sq += from->sum_sq;
+}
+
+/* Prints the latency at a few percentiles, counted from the time the calls
+   were meant to be sent and from the time they were sent (in ms).
+ */
+void print_summary(histogram *corrected, histogram *uncorrected) {
+    printf("%-20s %12s %12s\n", "latency (ms)", "intended", "sent");
+    int n = sizeof(SUMMARY_PCT) / sizeof(SUMMARY_PCT[0]);
+    for (int i = 0; i < n; i++) {
+        char name[16];
+        if (SUMMARY_PCT[i] >= 100)
+            snprintf(name, sizeof(name), "max");
+        else
+            snprintf(name, sizeof(name), "p%g", SUMMARY_PCT[i]);
+        printf("%-20s %12.3f %12.3f\n", name,
+               value_at(corrected, SUMMARY_PCT[i]) / 1e6,
+               value_at(uncorrected, SUMMARY_PCT[i]) / 1e6);
+    }
+}
+
+/* Prints the distribution of the values of the histogram (in ms) as
+   HdrHistogram does: a row at every TICKS_PER_HALF-th of the way to the
+   next halving of the values above, then the mean, deviation and maximum.
+ */
+void print_distribution(histogram *hist) {
+    printf("%12s %14s %10s %14s\n\n", "Value", "Percentile", "TotalCount",
+           "1/(1-Percentile)");
+    double pct = 0;
+    uint64_t seen = 0;
+    for (int b = 0; b < N_BUCKETS && hist->total > 0; b++) {
+        if (hist->counts[b] == 0)
+            continue;
+        seen += hist->counts[b];
+        uint64_t value = highest_in(b) < hist->max ? highest_in(b)
+                                                    : hist->max;
+        while (seen * 100.0 >= pct * hist->total && seen < hist->total) {
+            printf("%12.3f %14.12f %10llu %14.2f\n", value / 1e6, pct / 100,
+                   (unsigned long long)seen, 1 / (1 - pct / 100));
+            // (ticks twice as close each time the calls above halve)
+            double ticks = TICKS_PER_HALF
+                           * pow(2, floor(log2(100 / (100 - pct))) + 1);
+            pct += 100 / ticks;
+        }
+    }
+    printf("%12.3f %14.12f %10llu %14s\n", hist->max / 1e6, 1.0,
+           (unsigned long long)hist->total, "inf");
+
+    double mean = hist->total > 0 ? hist->sum / hist->total : 0;
+    double var = hist->total > 0 ? hist->sum_sq / hist->total - mean * mean
+                                 : 0;
+    printf("#[Mean    = %12.3f, StdDeviation   = %12.3f]\n", mean / 1e6,
+           sqrt(var > 0 ? var : 0) / 1e6);
+    printf("#[Max     = %12.3f, Total count    = %12llu]\n",
+           hist->max / 1e6, (unsigned long long)hist->total);
+    printf("#[Buckets = %12d, SubBuckets     = %12d]\n",
+           N_BUCKETS / HALF_COUNT - 1, SUB_COUNT);
+}
+
+/* Sleeps until the time (ns) of the monotonic clock, if it is to come.
+ */
+void sleep_until(uint64_t ns) {
+    struct timespec ts = {.tv_sec = ns / NS_PER_S, .tv_nsec = ns % NS_PER_S};
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL)
+           == EINTR);
+}
+
+/* Returns the time of the monotonic clock, in nanoseconds.
+ */
+uint64_t clock_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * NS_PER_S + ts.tv_nsec;
+}
+
+/* Extracts the command line arguments.
+ */
+void read_args(int argc, char *argv[], conn_load *load, double *rate,
+               int *duration, int *n_conns) {
+    int c;
+    int values_read = 0;
+    memset(load, 0, sizeof(*load));
+    load->func = DEFAULT_FUNC;
+    load->arrivals = CONSTANT;
+    load->size = DEFAULT_SIZE;
+    *rate = DEFAULT_RATE;
+    *duration = DEFAULT_DURATION;
+    *n_conns = DEFAULT_CONNS;
+
+    while ((c = getopt(argc, argv, "i:p:f:r:d:c:a:s:")) != -1) {
+        switch (c) {
+            case IP_ADDR:
+                load->addr = optarg;
+                values_read++;
+                break;
+            case PORT:
+                load->port = atoi(optarg);
+                values_read++;
+                break;
+            case FUNC:
+                load->func = optarg;
+                break;
+            case RATE:
+                *rate = atof(optarg);
+                break;
+            case DURATION:
+                *duration = atoi(optarg);
+                break;
+            case CONNS:
+                *n_conns = atoi(optarg);
+                break;
+            case ARRIVALS:
+                load->arrivals = optarg[0];
+                break;
+            case SIZE:
+                load->size = atoi(optarg);
+                break;
+            default:
+                exit(0);
+        }
+    }
+
+    if (values_read != NUM_ARGS || *rate <= 0 || *duration <= 0
+            || *n_conns <= 0
+            || (load->arrivals != CONSTANT && load->arrivals != POISSON)) {
+        fprintf(stderr, "Usage: %s -i ip-address -p port [-f function] "
+                        "[-r calls/s] [-d seconds] [-c connections] "
+                        "[-a c(onstant)|p(oisson)] [-s data2 bytes]\n",
+                argv[0]);
+        exit(0);
+    }
+}
@@ -0,0 +1,609 @@
+#include "rpc.h"
+#include "rpc_ext.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+
+#define INSTANCES 'n'
+#define REPS 'm'
+#define PORT 'p'
+#define EXPECTED 'o'
+
+#define MAX_LINE 1024
+#define MAX_WORDS 3          // of a command, its name included
+#define MAX_HANDLES 64       // found in one run
+#define NO_PORT -1
+
+// Commands of the scripts
+enum OP {
+    OP_INIT_SERVER,          // init <port>
+    OP_INIT_CLIENT,          // init <addr> <port>
+    OP_REGISTER,             // register <name> <handler>
+    OP_SERVE,                // serve
+    OP_FIND,                 // find <name>
+    OP_CALL,                 // call <handle> <name>, then a line of
+                             // arguments: <data1> [<data2 byte>...]
+    OP_CLOSE                 // close
+};
+
+typedef struct {
+    int op;                  // enum OP
+    int line;                // in the script
+    char *arg1, *arg2;
+    int port;
+    rpc_data payload;        // (calls)
+} command;
+
+typedef struct {
+    command *cmds;
+    int n_cmds;
+    int n_calls;
+    int serves;              // TRUE if it serves (never ends)
+} script;
+
+// A handle found by a run, by the name it was found with
+typedef struct {
+    char *name;
+    rpc_handle *h;
+} named_handle;
+
+// The state of one run of a script
+typedef struct {
+    FILE *out;
+    int port;                // overriding the script's (or NO_PORT)
+    int n_instances;         // made so far
+    rpc_server *srv;         // the current instance, either one
+    rpc_client *cl;
+    named_handle handles[MAX_HANDLES];
+    int n_handles;
+} run_state;
+
+// What every instance of the scaled mode is given, and what it measures
+typedef struct {
+    script *s;
+    int port;
+    int reps;
+    char *expected;          // output of every run, or NULL
+    uint64_t *run_us;        // time of each of its runs
+    int failed;
+} instance_load;
+
+// The handlers a script may register, by name
+typedef struct {
+    char *name;
+    rpc_handler handler;
+} handler_entry;
+
+rpc_data *add2_i8(rpc_data *);
+rpc_data *subtract_i8(rpc_data *);
+
+static handler_entry HANDLERS[] = {
+    {"add2", add2_i8},
+    {"subtract2", subtract_i8},
+};
+
+script *read_script(char *path);
+int parse_command(char *line, FILE *f, int *line_no, command *cmd);
+int parse_args(char *line, rpc_data *payload);
+void free_script(script *s);
+int run_script(script *s, FILE *out, int port);
+int run_command(run_state *st, command *cmd);
+rpc_handler handler_named(char *name);
+rpc_handle *handle_named(run_state *st, char *name);
+void end_run(run_state *st);
+int run_once(script *s, int port, char *expected);
+void run_scaled(char *path, script *s, int port, char *expected,
+                int n_instances, int reps);
+void *run_instance(void *arg);
+char *read_file(char *path);
+int cmp_u64(const void *a, const void *b);
+uint64_t now_us(void);
+void read_args(int argc, char *argv[], char **path, int *n_instances,
+               int *reps, int *port, char **expected_path);
+
+/* Replays a script of the test directory (e.g. test/client.in) against the
+   library, printing what it does as the .out files there show it. With -o,
+   the output is also compared to such a file.
+ * With -n and/or -m, it runs the script m times in each of n instances at
+   once (threads, each with its clients of its own), printing nothing but
+   the failed runs (those not printing the expected output, if any) and
+   the time they took, so that a test also serves as a workload. A script
+   serving (a server's) never ends, so only runs once.
+ * -p replaces the port of every init of the script (its transcript still
+   shows the script's, to compare with -o).
+ */
+int main(int argc, char *argv[]) {
+    char *path, *expected_path;
+    int n_instances, reps, port;
+    read_args(argc, argv, &path, &n_instances, &reps, &port, &expected_path);
+    signal(SIGPIPE, SIG_IGN);
+    // (the server's children print too, and must not print its buffer)
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    script *s = read_script(path);
+    if (s == NULL)
+        exit(EXIT_FAILURE);
+    char *expected = NULL;
+    if (expected_path != NULL && (expected = read_file(expected_path))
+                                 == NULL) {
+        fprintf(stderr, "Failed to read %s\n", expected_path);
+        exit(EXIT_FAILURE);
+    }
+
+    int exit_code = EXIT_SUCCESS;
+    if (n_instances == 1 && reps == 1) {
+        if (run_once(s, port, expected) == -1)
+            exit_code = EXIT_FAILURE;
+    } else if (s->serves) {
+        fprintf(stderr, "%s serves, and only runs once\n", path);
+        exit_code = EXIT_FAILURE;
+    } else {
+        // (a script may fail to find a function on purpose, many times)
+        rpc_set_log_level(RPC_LOG_ERROR);
+        run_scaled(path, s, port, expected, n_instances, reps);
+    }
+
+    free(expected);
+    free_script(s);
+    return exit_code;
+}
+
+/* Adds 2 signed 8 bit numbers (as rpc-server does) */
+rpc_data *add2_i8(rpc_data *in) {
+    if (in->data2 == NULL || in->data2_len != 1)
+        return NULL;
+    char n1 = in->data1;
+    char n2 = ((char *)in->data2)[0];
+    printf("handler add2_i8: arguments %d and %d\n", n1, n2);
+
+    rpc_data *out = malloc(sizeof(rpc_data));
+    assert(out != NULL);
+    out->data1 = n1 + n2;
+    out->data2_len = 0;
+    out->data2 = NULL;
+    return out;
+}
+
+/* Subtracts 2 signed 8 bit numbers (as rpc-server does) */
+rpc_data *subtract_i8(rpc_data *in) {
+    if (in->data2 == NULL || in->data2_len != 1)
+        return NULL;
+    char n1 = in->data1;
+    char n2 = ((char *)in->data2)[0];
+    printf("handler subtract_i8: arguments %d and %d\n", n1, n2);
+
+    rpc_data *out = malloc(sizeof(rpc_data));
+    assert(out != NULL);
+    out->data1 = n1 - n2;
+    out->data2_len = 0;
+    out->data2 = NULL;
+    return out;
+}
+
+/* Reads and parses the script at the path, printing its first error.
+ * Returns it on success, NULL otherwise.
+ */
+script *read_script(char *path) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        perror(path);
+        return NULL;
+    }
+    script *s = calloc(1, sizeof(*s));
+    assert(s != NULL);
+
+    char line[MAX_LINE];
+    int line_no = 0, size = 0;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        line_no++;
+        if (strspn(line, " \t\r\n") == strlen(line))
+            continue; // (blank)
+        if (s->n_cmds == size) {
+            size = size == 0 ? 16 : size * 2;
+            s->cmds = realloc(s->cmds, size * sizeof(command));
+            assert(s->cmds != NULL);
+        }
+        command *cmd = &s->cmds[s->n_cmds];
+        if (parse_command(line, f, &line_no, cmd) == -1) {
+            fprintf(stderr, "%s:%d: invalid command\n", path, line_no);
+            fclose(f);
+            free_script(s);
+            return NULL;
+        }
+        s->n_cmds++;
+        s->n_calls += cmd->op == OP_CALL;
+        s->serves |= cmd->op == OP_SERVE;
+    }
+    fclose(f);
+    return s;
+}
+
+/* Parses the command on the line (reading the line of arguments after it
+   from `f`, for a call; `*line_no` is that of the last line read).
+ * Returns 0 on success, -1 if it is not a valid command.
+ */
+int parse_command(char *line, FILE *f, int *line_no, command *cmd) {
+    char *words[MAX_WORDS] = {NULL};
+    int n_words = 0;
+    char *save;
+    for (char *w = strtok_r(line, " \t\r\n", &save); w != NULL;
+         w = strtok_r(NULL, " \t\r\n", &save)) {
+        if (n_words == MAX_WORDS)
+            return -1;
+        words[n_words++] = w;
+    }
+
+    memset(cmd, 0, sizeof(*cmd));
+    cmd->line = *line_no;
+    cmd->port = NO_PORT;
+    char *name = words[0];
+    if (strcmp(name, "init") == 0 && n_words == 2) {
+        cmd->op = OP_INIT_SERVER;
+        cmd->port = atoi(words[1]);
+    } else if (strcmp(name, "init") == 0 && n_words == 3) {
+        cmd->op = OP_INIT_CLIENT;
+        cmd->arg1 = strdup(words[1]);
+        cmd->port = atoi(words[2]);
+    } else if (strcmp(name, "register") == 0 && n_words == 3) {
+        cmd->op = OP_REGISTER;
+        cmd->arg1 = strdup(words[1]);
+        cmd->arg2 = strdup(words[2]);
+    } else if (strcmp(name, "serve") == 0 && n_words == 1) {
+        cmd->op = OP_SERVE;
+    } else if (strcmp(name, "find") == 0 && n_words == 2) {
+        cmd->op = OP_FIND;
+        cmd->arg1 = strdup(words[1]);
+    } else if (strcmp(name, "call") == 0 && n_words == 3) {
+        cmd->op = OP_CALL;
+        cmd->arg1 = strdup(words[1]);
+        cmd->arg2 = strdup(words[2]);
+        char args[MAX_LINE];
+        if (fgets(args, sizeof(args), f) == NULL)
+            return -1;
+        (*line_no)++;
+        return parse_args(args, &cmd->payload);
+    } else if (strcmp(name, "close") == 0 && n_words == 1) {
+        cmd->op = OP_CLOSE;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+/* Parses the arguments of a call: data1, then the bytes of data2 (if
+   any), as numbers.
+ * Returns 0 on success, -1 if there is no data1.
+ */
+int parse_args(char *line, rpc_data *payload) {
+    char *save;
+    char *w = strtok_r(line, " \t\r\n", &save);
+    if (w == NULL)
+        return -1;
+    payload->data1 = atoi(w);
+    payload->data2_len = 0;
+    payload->data2 = NULL;
+    while ((w = strtok_r(NULL, " \t\r\n", &save)) != NULL) {
+        payload->data2 = realloc(payload->data2, payload->data2_len + 1);
+        assert(payload->data2 != NULL);
+        ((char *)payload->data2)[payload->data2_len++] = atoi(w);
+    }
+    return 0;
+}
+
+/* Frees the script.
+ */
+void free_script(script *s) {
+    for (int i = 0; i < s->n_cmds; i++) {
+        free(s->cmds[i].arg1);
+        free(s->cmds[i].arg2);
+        free(s->cmds[i].payload.data2);
+    }
+    free(s->cmds);
+    free(s);
+}
+
+/* Runs the script, printing what it does to `out`, with the port (or
+   NO_PORT for the script's). The transcript shows the script's ports
+   either way, so it compares with the script's expected output.
+ * Returns 0 if every command could be run, -1 otherwise (stopping there).
+ */
+int run_script(script *s, FILE *out, int port) {
+    run_state st = {.out = out, .port = port};
+    int result = 0;
+    for (int i = 0; i < s->n_cmds && result == 0; i++) {
+        result = run_command(&st, &s->cmds[i]);
+        if (result == -1)
+            fprintf(stderr, "Failed to run line %d of the script\n",
+                    s->cmds[i].line);
+    }
+    end_run(&st);
+    return result;
+}
+
+/* Runs a command of a script, printing what it does to the run's output.
+   A function not found, or a call failing, is printed, not an error.
+ * Returns 0 on success, -1 otherwise.
+ */
+int run_command(run_state *st, command *cmd) {
+    int port = st->port != NO_PORT ? st->port : cmd->port;
+    int instance = st->n_instances - 1;
+    rpc_handle *h;
+    rpc_data *res;
+
+    switch (cmd->op) {
+        case OP_INIT_SERVER:
+            instance = st->n_instances++;
+            fprintf(st->out, "rpc_init_server: instance %d, port %d\n",
+                    instance, cmd->port); // (as the script says)
+            st->srv = rpc_init_server(port);
+            return st->srv == NULL ? -1 : 0;
+        case OP_INIT_CLIENT:
+            end_run(st); // (its client so far, if not closed)
+            instance = st->n_instances++;
+            fprintf(st->out, "rpc_init_client: instance %d, addr %s, "
+                             "port %d\n", instance, cmd->arg1, cmd->port);
+            st->cl = rpc_init_client(cmd->arg1, port);
+            return st->cl == NULL ? -1 : 0;
+        case OP_REGISTER:
+            if (st->srv == NULL || handler_named(cmd->arg2) == NULL)
+                return -1;
+            fprintf(st->out, "rpc_register: instance %d, %s (handler) "
+                             "as %s\n", instance, cmd->arg2, cmd->arg1);
+            return rpc_register(st->srv, cmd->arg1,
+                                handler_named(cmd->arg2)) == -1 ? -1 : 0;
+        case OP_SERVE:
+            if (st->srv == NULL)
+                return -1;
+            fprintf(st->out, "rpc_serve_all: instance %d\n", instance);
+            fflush(st->out); // (or its children print it again)
+            rpc_serve_all(st->srv);
+            return 0;
+        case OP_FIND:
+            if (st->cl == NULL || st->n_handles == MAX_HANDLES)
+                return -1;
+            fprintf(st->out, "rpc_find: instance %d, %s\n", instance,
+                    cmd->arg1);
+            h = rpc_find(st->cl, cmd->arg1);
+            if (h == NULL) {
+                fprintf(st->out, "rpc_find: instance %d, wasn't able to "
+                                 "find function %s\n", instance, cmd->arg1);
+                return 0;
+            }
+            st->handles[st->n_handles].name = cmd->arg1;
+            st->handles[st->n_handles++].h = h;
+            fprintf(st->out, "rpc_find: instance %d, returned handle for "
+                             "function %s\n", instance, cmd->arg1);
+            return 0;
+        case OP_CALL:
+            if (st->cl == NULL || (h = handle_named(st, cmd->arg1)) == NULL)
+                return -1;
+            fprintf(st->out, "rpc_call: instance %d, calling %s, with "
+                             "arguments %d", instance, cmd->arg2,
+                    cmd->payload.data1);
+            for (size_t i = 0; i < cmd->payload.data2_len; i++) {
+                fprintf(st->out, " %d", ((char *)cmd->payload.data2)[i]);
+            }
+            fprintf(st->out, "...\n");
+            res = rpc_call(st->cl, h, &cmd->payload);
+            if (res == NULL) {
+                fprintf(st->out, "rpc_call: instance %d, call of %s "
+                                 "failed\n", instance, cmd->arg2);
+                return 0;
+            }
+            fprintf(st->out, "rpc_call: instance %d, call of %s received "
+                             "result %d\n", instance, cmd->arg2, res->data1);
+            rpc_data_free(res);
+            return 0;
+        case OP_CLOSE:
+            if (st->cl == NULL)
+                return -1;
+            fprintf(st->out, "rpc_close_client: instance %d\n", instance);
+            end_run(st);
+            return 0;
+    }
+    return -1;
+}
+
+/* Returns the handler of the name, or NULL if there is none.
+ */
+rpc_handler handler_named(char *name) {
+    int n = sizeof(HANDLERS) / sizeof(HANDLERS[0]);
+    for (int i = 0; i < n; i++) {
+        if (strcmp(HANDLERS[i].name, name) == 0)
+            return HANDLERS[i].handler;
+    }
+    return NULL;
+}
+
+/* Returns the handle the run found with the name, or NULL if none.
+ */
+rpc_handle *handle_named(run_state *st, char *name) {
+    for (int i = st->n_handles - 1; i >= 0; i--) {
+        if (strcmp(st->handles[i].name, name) == 0)
+            return st->handles[i].h;
+    }
+    return NULL;
+}
+
+/* Frees the handles of the run, and closes its client (if any).
+ */
+void end_run(run_state *st) {
+    for (int i = 0; i < st->n_handles; i++) {
+        free(st->handles[i].h);
+    }
+    st->n_handles = 0;
+    if (st->cl != NULL)
+        rpc_close_client(st->cl);
+    st->cl = NULL;
+}
+
+/* Runs the script once, printing what it does to stdout, and compares
+   that to `expected` (if not NULL).
+ * Returns 0 if it ran as expected, -1 otherwise.
+ */
+int run_once(script *s, int port, char *expected) {
+    char *output = NULL;
+    size_t len = 0;
+    FILE *out = expected != NULL ? open_memstream(&output, &len) : stdout;
+    assert(out != NULL);
+    int result = run_script(s, out, port);
+    if (expected != NULL) {
+        fclose(out);
+        fputs(output, stdout);
+        if (strcmp(output, expected) != 0) {
+            fprintf(stderr, "The output is not the one expected\n");
+            result = -1;
+        }
+        free(output);
+    }
+    return result;
+}
+
+/* Runs the script `reps` times in each of `n_instances` instances at once,
+   and prints the failed runs, their rate and how long they took.
+ */
+void run_scaled(char *path, script *s, int port, char *expected,
+                int n_instances, int reps) {
+    instance_load *loads = calloc(n_instances, sizeof(*loads));
+    pthread_t *threads = malloc(n_instances * sizeof(*threads));
+    uint64_t *run_us = malloc((size_t)n_instances * reps * sizeof(*run_us));
+    assert(loads != NULL && threads != NULL && run_us != NULL);
+
+    uint64_t start = now_us();
+    for (int i = 0; i < n_instances; i++) {
+        loads[i] = (instance_load){.s = s, .port = port, .reps = reps,
+                                   .expected = expected,
+                                   .run_us = run_us + (size_t)i * reps};
+        assert(pthread_create(&threads[i], NULL, run_instance, &loads[i])
+               == 0);
+    }
+    int failed = 0;
+    for (int i = 0; i < n_instances; i++) {
+        pthread_join(threads[i], NULL);
+        failed += loads[i].failed;
+    }
+    uint64_t elapsed = now_us() - start;
+
+    size_t n_runs = (size_t)n_instances * reps;
+    qsort(run_us, n_runs, sizeof(*run_us), cmp_u64);
+    printf("%-20s %12s\n", "script", path);
+    printf("%-20s %12d\n", "instances", n_instances);
+    printf("%-20s %12d\n", "repetitions", reps);
+    printf("%-20s %12zu\n", "runs", n_runs);
+    printf("%-20s %12d\n", "failed", failed);
+    printf("%-20s %12.3f s\n", "elapsed", elapsed / 1e6);
+    printf("%-20s %12.1f\n", "runs/s", n_runs * 1e6 / elapsed);
+    printf("%-20s %12.1f\n", "calls/s", n_runs * s->n_calls * 1e6 / elapsed);
+    printf("%-20s %12.3f ms\n", "run p50", run_us[n_runs / 2] / 1e3);
+    printf("%-20s %12.3f ms\n", "run p90", run_us[n_runs * 90 / 100] / 1e3);
+    printf("%-20s %12.3f ms\n", "run p99", run_us[n_runs * 99 / 100] / 1e3);
+    printf("%-20s %12.3f ms\n", "run max", run_us[n_runs - 1] / 1e3);
+
+    free(run_us);
+    free(threads);
+    free(loads);
+}
+
+/* Runs the script the times of one instance (an instance_load), timing
+   each run, and prints those that failed.
+ */
+void *run_instance(void *arg) {
+    instance_load *load = arg;
+    for (int i = 0; i < load->reps; i++) {
+        char *output = NULL;
+        size_t len = 0;
+        FILE *out = open_memstream(&output, &len);
+        assert(out != NULL);
+        uint64_t start = now_us();
+        int result = run_script(load->s, out, load->port);
+        load->run_us[i] = now_us() - start;
+        fclose(out);
+
+        if (result == -1 || (load->expected != NULL
+                             && strcmp(output, load->expected) != 0)) {
+            load->failed++;
+            // (one write: not mixed with the others')
+            fprintf(stderr, "Failed run:\n%s", output);
+        }
+        free(output);
+    }
+    return NULL;
+}
+
+/* Returns the content of the file (to be freed), or NULL if it can't be
+   read.
+ */
+char *read_file(char *path) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+        return NULL;
+    char *content = NULL;
+    size_t len = 0;
+    FILE *out = open_memstream(&content, &len);
+    assert(out != NULL);
+    char buf[MAX_LINE];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+        fwrite(buf, 1, n, out);
+    }
+    fclose(out);
+    fclose(f);
+    return content;
+}
+
+/* Compares two uint64_t (for qsort).
+ */
+int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/* Returns the time of the monotonic clock, in microseconds.
+ */
+uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/* Extracts the command line arguments.
+ */
+void read_args(int argc, char *argv[], char **path, int *n_instances,
+               int *reps, int *port, char **expected_path) {
+    int c;
+    *n_instances = *reps = 1;
+    *port = NO_PORT;
+    *expected_path = NULL;
+
+    while ((c = getopt(argc, argv, "n:m:p:o:")) != -1) {
+        switch (c) {
+            case INSTANCES:
+                *n_instances = atoi(optarg);
+                break;
+            case REPS:
+                *reps = atoi(optarg);
+                break;
+            case PORT:
+                *port = atoi(optarg);
+                break;
+            case EXPECTED:
+                *expected_path = optarg;
+                break;
+            default:
+                exit(0);
+        }
+    }
+
+    if (optind != argc - 1 || *n_instances <= 0 || *reps <= 0) {
+        fprintf(stderr, "Usage: %s [-n instances] [-m repetitions] "
+                        "[-p port] [-o expected.out] script.in\n", argv[0]);
+        exit(0);
+    }
+    *path = argv[optind];
+}
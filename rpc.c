@@ -1,10 +1,21 @@
 #include "rpc.h"
+#include "rpc_ext.h"
 #include "rpc_io_helper.h"
-#include "array.h"
 #include "rpc_safety.h"
 #include "rpc_func_manager.h"
 #include "rpc_server_helper.h"
 #include "rpc_client_helper.h"
+#include "rpc_shared.h"
+#include "rpc_sched.h"
+#include "rpc_cache.h"
+#include "rpc_resp_cache.h"
+#include "rpc_cluster.h"
+#include "rpc_frame.h"
+#include "rpc_plugin.h"
+#include "rpc_handoff.h"
+#include "rpc_affinity.h"
+#include "rpc_timeouts.h"
+#include "rpc_mux.h"
 
 #include <stdlib.h>
 #include <netdb.h>
@@ -12,10 +23,25 @@
 #include <string.h>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <signal.h>
+#include <dirent.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <inttypes.h>
 
 #define NONBLOCKING
-#define MIN_CONCURRENT_CLNTS 10
+#define DEFAULT_BACKLOG SOMAXCONN // (capped by the kernel's somaxconn)
+#define ACCEPT_BATCH 64 // connections accepted per wakeup, at most
+#define NO_LIMIT 0
 #define PORT_LEN 6 // length of a port number = max 5 digits, with a null byte
+#define COMPACT(cl) ((cl)->version == RPC_PROTO_V2_COMPACT)
+#define PLUGIN_SUFFIX ".so"
+#define DRAIN_MS 30000      // default drain timeout
+#define DRAIN_GRACE_MS 1000 // for the calls running when it's up to return
+#define DRAIN_POLL_US 10000
+#define CONN_MUX 0x100 // added to the version of a multiplexed connection
 
 /* Client states */
 enum CLNT_STATE {OPEN = 0, CLOSED = 1};
@@ -27,12 +53,69 @@ enum CLNT_STATE {OPEN = 0, CLOSED = 1};
 
 /* Server side */
 void rpc_close_server(rpc_server *srv);
-int handle_request(rpc_server *srv, int sockfd);
+rpc_server *new_server(int listening_sd);
+void accept_batch(rpc_server *srv);
+void serve_connection(rpc_server *srv, int newsockfd);
+int await_request(rpc_server *srv, int sockfd, frame_reader *reader,
+                  uint64_t *drain_end);
+void drain_server(rpc_server *srv, int handed_off);
+int handle_request(rpc_server *srv, int sockfd, int *version,
+                   frame_reader *reader);
+int handle_prefix(rpc_server *srv, int sockfd, uint32_t prefix);
+int handle_frame(rpc_server *srv, int sockfd, frame_header *req,
+                 char *payload, int *version, mux_conn *mux);
 int handle_find(rpc_server *srv, int sockfd);
-int handle_call(rpc_server *srv, int sockfd);
+int handle_call(rpc_server *srv, int sockfd, uint64_t deadline);
+int frame_find(rpc_server *srv, char *name, frame_header *resp);
+int frame_call(rpc_server *srv, int sockfd, frame_header *req, char *payload,
+               uint64_t deadline, int compact, mux_conn *mux);
+int frame_cast(rpc_server *srv, frame_header *req, char *payload,
+               uint64_t deadline);
+void frame_ping(rpc_server *srv, frame_header *req, frame_header *resp);
+void end_channel(rpc_server *srv, int channel);
+rpc_data *frame_input(frame_header *req, char *payload);
+int send_response(int sockfd, mux_conn *mux, frame_header *resp,
+                  char *payload, int compact);
+void serve_channels(rpc_server *srv, int sockfd, frame_reader *reader,
+                    int version, uint64_t *drain_end);
+int run_call(rpc_server *srv, uint32_t idx, rpc_data *input,
+             uint64_t deadline, rpc_data **result);
+uint64_t enter_inflight(rpc_server *srv);
+void exit_inflight(rpc_server *srv);
+void give_back_inflight(pid_t pid, void *arg);
+void reject_connection(rpc_server *srv, int sockfd);
+int send_result(int sockfd, rpc_data *result);
+void tend_plugins(rpc_server *srv);
+int rescan_plugins(rpc_server *srv);
+void serve_plugin_ops(rpc_server *srv);
+void drop_plugin(rpc_server *srv, int idx);
+int plugin_file(rpc_server *srv, char *name, char *path);
+rpc_data *admin_load_plugin(rpc_data *input);
+rpc_data *admin_unload_plugin(rpc_data *input);
+rpc_data *admin_plugin_op(rpc_data *input, int op);
 
 /* Client side */
 int init_connection(rpc_client *cl);
+int say_hello(rpc_client *cl);
+void close_connection(rpc_client *cl);
+void count_conn_bytes(rpc_client *cl, rpc_client_stats *stats);
+frame_header new_request(rpc_client *cl, int type);
+int send_request(rpc_client *cl, frame_header *req, char *payload);
+int read_status(rpc_client *cl, frame_header *resp, char **payload);
+rpc_handle *do_find(rpc_client *cl, char *name);
+rpc_data *do_call(rpc_client *cl, rpc_handle *h, rpc_data *payload,
+                  uint64_t deadline);
+int send_call_req(rpc_client *cl, rpc_handle *h, rpc_data *payload,
+                  uint64_t deadline);
+frame_header call_request(rpc_client *cl, int type, rpc_handle *h,
+                          rpc_data *payload, uint64_t deadline);
+rpc_data *read_call_resp(rpc_client *cl);
+int send_cast_req(rpc_client *cl, rpc_handle *h, rpc_data *payload,
+                  uint64_t deadline);
+int ask_casts(rpc_client *cl, uint32_t *run, uint32_t *failed);
+void count_failure(rpc_client *cl);
+void abort_request(rpc_client *cl);
+void overloaded(rpc_client *cl);
 
 /* General */
 int write_rpc_data(int sockfd, rpc_data *data);
@@ -45,14 +128,42 @@ rpc_handle *create_rpc_handle(uint32_t idx);
 /*  Server side  */
 /* ------------- */
 
+/* Casts of a channel of a connection since its last PING (kept by the
+   connection's child) */
+typedef struct {
+    uint32_t run;             // calls made
+    uint32_t failed;          // ... of which not returning a result
+} cast_counts;
+
 struct rpc_server {
-    int listening_sd;   // listening socket
-    array_t *functions; // registered functions
+    int listening_sd;         // listening socket
+    func_registry *functions; // registered functions, shared with children
+    rpc_server_stats *stats;  // counters, shared with the children
+    uint32_t *inflight_by_pid;// calls in flight of each child, shared
+    int n_pids;               // ... (indexed by pid, up to pid_max)
+    int backlog;              // of the listening socket
+    int defer_accept_s;       // TCP_DEFER_ACCEPT (0: off)
+    int max_conns;            // connections served at once (or NO_LIMIT)
+    int max_inflight;         // calls handled at once (or NO_LIMIT)
+    call_sched *sched;        // orders calls by priority, over all children
+    result_cache *cache;      // results of cacheable functions (or NULL)
+    rpc_sock_opts sock_opts;  // of the accepted connections
+    cpu_pinning *pinning;     // CPUs of the children (and the server's)
+    conn_timeouts *timeouts;  // of idle or stalled connections (or NULL)
+    plugin_table *plugins;    // loaded plugins, shared with children
+    char *plugin_dir;         // looked at again on SIGHUP (or NULL)
+    int drain_ms;             // how long draining lets requests finish
+    int drain_fds[2];         // pipe closed by the server to drain
+    int handoff_sd;           // for a new server to take over (or -1)
+    char *handoff_path;       // ... where it is
+    int successor;            // connection of the server taking over (or -1)
+    int predecessor;          // of the server taken over from (or -1)
+    cast_counts *casts;       // of each channel of the connection, in its
+                              // child (NULL until it gets a cast)
 };
 
-struct rpc_handle {
-    uint32_t idx; // index of the handler in the server's RPC functions array
-};
+// The server of the admin functions (only one server per process has them)
+static rpc_server *plugin_admin_srv = NULL;
 
 /* Initialises server state */
 /* RETURNS: rpc_server* on success, NULL on error */
@@ -60,52 +171,169 @@ rpc_server *rpc_init_server(int port) {
     if (check_port(port) == FAILED)
         return NULL;
 
+    // Create listening socket
+    char port_str[PORT_LEN];
+    snprintf(port_str, PORT_LEN, "%d", port);
+    int listening_sd = create_listening_socket(port_str);
+    if (listening_sd == FAILED)
+        return NULL;
+
     // Create server
+    rpc_server *srv = new_server(listening_sd);
+    if (srv == NULL)
+        return NULL;
+
+    // Listen on socket - now ready to accept connections
+	if (listen(listening_sd, srv->backlog) < 0) {
+        perror("listen");
+        rpc_close_server(srv);
+		return NULL;
+	}
+
+    return srv;
+}
+
+/* Initialises a server that takes over from the running one whose handoff
+   socket is at `path` (see rpc_set_handoff_path): it gets its listening
+   socket, already accepting, and the running one drains once this one
+   starts serving. */
+/* RETURNS: rpc_server* on success, NULL on error */
+rpc_server *rpc_take_over_server(char *path) {
+    int predecessor;
+    int listening_sd = receive_listener(path, &predecessor);
+    if (listening_sd == FAILED)
+        return NULL;
+
+    rpc_server *srv = new_server(listening_sd);
+    if (srv == NULL) {
+        close(predecessor); // it keeps serving
+        return NULL;
+    }
+    srv->predecessor = predecessor; // told once this one serves
+    return srv;
+}
+
+/* Creates the state of a server with the listening socket (which is
+   closed on failure).
+ * Returns the server on success, NULL otherwise.
+ */
+rpc_server *new_server(int listening_sd) {
     rpc_server *srv = malloc(sizeof(*srv));
     if (!srv) {
         print_err(MALLOC_FAILED);
+        close(listening_sd);
         return NULL;
     }
 
-    // Create listening socket
-    char port_str[PORT_LEN];
-    snprintf(port_str, PORT_LEN, "%d", port);
-    int listening_sd = create_listening_socket(port_str);
-    if (listening_sd == FAILED) {
-        free(srv);
-        srv = NULL;
-        return NULL;
-    }
     srv->listening_sd = listening_sd;
+    srv->backlog = DEFAULT_BACKLOG;
+    srv->defer_accept_s = 0;
+    srv->stats = NULL;
+    srv->inflight_by_pid = NULL;
+    srv->n_pids = read_pid_max();
+    srv->max_conns = NO_LIMIT;
+    srv->max_inflight = NO_LIMIT;
+    srv->sched = NULL;
+    srv->cache = NULL; // only if asked for
+    srv->sock_opts = (rpc_sock_opts)RPC_SOCK_OPTS_DEFAULT;
+    srv->pinning = NULL;
+    srv->timeouts = NULL; // only if asked for
+    srv->plugins = NULL;
+    srv->plugin_dir = NULL; // only if asked for
+    srv->drain_ms = DRAIN_MS;
+    srv->handoff_sd = -1; // only if asked for
+    srv->handoff_path = NULL;
+    srv->successor = -1;
+    srv->predecessor = -1;
+    srv->drain_fds[0] = srv->drain_fds[1] = -1;
+    srv->casts = NULL;
     
-    // Create the array structure to hold our RPC functions
-    srv->functions = create_array(cmp_func_name, free_rpc_func);
+    // The functions live in shared memory: registering one later still
+    // reaches the children serving connections
+    srv->functions = create_registry();
     if (srv->functions == NULL) {
         rpc_close_server(srv); // clean up for previous mallocs
         return NULL;
     }
 
-    // Set up for later - to get rid of zombie processes
-    if (set_up_sigchld_handler() == FAILED) {
+    // Counters are updated by the children serving the connections
+    srv->stats = create_shared(sizeof(*(srv->stats)));
+    if (srv->stats == NULL) {
         rpc_close_server(srv);
         return NULL;
     }
 
-    // Listen on socket - now ready to accept connections
-	if (listen(listening_sd, MIN_CONCURRENT_CLNTS) < 0) {
-        perror("listen");
+    // ... and the calls in flight, of each of them too, so that those of
+    // a child that died are given back as it is reaped
+    srv->inflight_by_pid = create_shared(srv->n_pids * sizeof(uint32_t));
+    if (srv->inflight_by_pid == NULL
+            || add_reap_hook(give_back_inflight, srv) == FAILED) {
         rpc_close_server(srv);
-		return NULL;
-	}
+        return NULL;
+    }
+
+    // So are the queues of calls waiting for their turn
+    srv->sched = create_call_sched(NO_LIMIT);
+    if (srv->sched == NULL) {
+        rpc_close_server(srv);
+        return NULL;
+    }
+
+    // Children are not pinned to CPUs unless asked for
+    srv->pinning = create_pinning();
+    if (srv->pinning == NULL) {
+        rpc_close_server(srv);
+        return NULL;
+    }
+
+    // And the plugins, which the children load when they need them
+    srv->plugins = create_plugin_table();
+    if (srv->plugins == NULL) {
+        rpc_close_server(srv);
+        return NULL;
+    }
+
+    // The children drain once the write end is closed (see await_request)
+    if (pipe(srv->drain_fds) < 0
+            || fcntl(srv->drain_fds[0], F_SETFD, FD_CLOEXEC) < 0
+            || fcntl(srv->drain_fds[1], F_SETFD, FD_CLOEXEC) < 0) {
+        perror("pipe");
+        rpc_close_server(srv);
+        return NULL;
+    }
 
+    // Set up for later - to get rid of zombie processes
+    // (and keep count of the connections still being served)
+    if (set_up_sigchld_handler(&srv->stats->connections) == FAILED) {
+        rpc_close_server(srv);
+        return NULL;
+    }
     return srv;
 }
 
 /* Registers a function (mapping from name to handler) */
 /* RETURNS: FAILED (-1) on failure */
 int rpc_register(rpc_server *srv, char *name, rpc_handler handler) {
+    return rpc_register_prio(srv, name, handler, RPC_PRIO_NORMAL);
+}
+
+/* Registers a function (mapping from name to handler) in the given
+   priority class (enum RPC_PRIORITY). rpc_register uses RPC_PRIO_NORMAL. */
+/* RETURNS: -1 on failure */
+int rpc_register_prio(rpc_server *srv, char *name, rpc_handler handler,
+                      int prio) {
+    return rpc_register_opts(srv, name, handler, prio, 0);
+}
+
+/* Registers a function (mapping from name to handler) in the given
+   priority class, with the given flags (RPC_FUNC_*, or 0). */
+/* RETURNS: -1 on failure */
+int rpc_register_opts(rpc_server *srv, char *name, rpc_handler handler,
+                      int prio, int flags) {
     if (srv == NULL || srv->functions == NULL 
-            || name == NULL || handler == NULL) {
+            || name == NULL || handler == NULL
+            || prio < RPC_PRIO_HIGH || prio > RPC_PRIO_LOW
+            || (flags & ~RPC_FUNC_CACHEABLE) != 0) {
         print_err(INVALID_INPUT);
         return FAILED; 
     }
@@ -114,60 +342,318 @@ int rpc_register(rpc_server *srv, char *name, rpc_handler handler) {
         return FAILED;
     
     // Check if the name is already registered
-    int func_idx = search_array(srv->functions, name);
-    if (func_idx != FAILED) { 
-        // name found -> replace the original function
-        return replace_func(srv->functions, func_idx, handler);
-    } 
-
-    // name not found -> create new function and append
-    rpc_func *func = create_rpc_func(name, handler);
-    if (!func || array_append(srv->functions, func) == FAILED) {
+    int replaced = find_func(srv->functions, name) != FAILED;
+
+    // From a plugin? -> the children load it before calling the handler
+    rpc_func func = {.handler = handler, .prio = prio, .flags = flags};
+    func.plugin = plugin_of(srv->plugins, handler, &func.plugin_gen);
+
+    // name found -> the new version replaces the original one (calls
+    // already running finish on it); not found -> a new function
+    int func_idx = register_func(srv->functions, name, &func);
+    if (func_idx == FAILED) {
         print_err(FUNC_CREATION_FAILED);
         return FAILED;
     }
 
+    // the results of the original one may no longer be right
+    if (replaced)
+        cache_invalidate(srv->cache, func_idx);
     return SUCCESS;
 }
 
 /* Start serving requests */
+/* Returns (after closing the server) once it was asked to stop, by SIGTERM
+   or by a new server taking over, and drained its connections. */
 void rpc_serve_all(rpc_server *srv) {
     if (srv == NULL) {
         print_err(INVALID_INPUT);
         return;
     }
+    // (a server taking over may accept before this one, leaving it nothing)
+    int flags = fcntl(srv->listening_sd, F_GETFL);
+    if (set_up_sigterm_handler() == FAILED || flags < 0
+            || fcntl(srv->listening_sd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        perror("rpc_serve_all");
+        rpc_close_server(srv);
+        return;
+    }
 
-    int newsockfd, res;
-    while (1) {
-        newsockfd = accept_connection(srv->listening_sd);
-        if (newsockfd < 0) { // failed
-            continue;
-        } 
-        // child process to handle that connection
-        pid_t childpid;
-        if ((childpid = fork()) == -1) {
-            perror("fork");
-            continue;
-
-        } else if (childpid == 0) { // child process
-            close(srv->listening_sd); // child doesn't need this
-            
-            do {
-                res = handle_request(srv, newsockfd);
-            } while (res > 0); // no error and connection not closed
+    // Taking over from a running server -> it can stop accepting now
+    if (srv->predecessor != -1) {
+        send_ready(srv->predecessor);
+        srv->predecessor = -1;
+    }
 
-            close(newsockfd);
-            exit(EXIT_SUCCESS);
+    int handed_off = FALSE;
+    struct pollfd fds[3];
+    while (!stop_requested()) {
+        // the listening socket, and the handoff socket and connection, if
+        // any (a negative fd is left out by poll)
+        fds[0] = (struct pollfd){.fd = srv->listening_sd, .events = POLLIN};
+        fds[1] = (struct pollfd){.fd = srv->successor == -1 ? srv->handoff_sd
+                                                            : -1,
+                                 .events = POLLIN};
+        fds[2] = (struct pollfd){.fd = srv->successor, .events = POLLIN};
+        int n = poll(fds, 3, conn_timeout_ms(srv->timeouts));
+        // plugins to (re)load or unload, told by signals that interrupt poll
+        tend_plugins(srv);
+        // and connections idle or stalled for too long
+        expire_connections(srv->timeouts);
+        if (n < 0) {
+            if (errno != EINTR)
+                perror("poll");
+            continue;
+        }
 
-        } else {
-            close(newsockfd); // parent doesn't need this
+        // The new server is serving (or gave up, and this one carries on)
+        if (fds[2].revents != 0) {
+            handed_off = wait_ready(srv->successor);
+            srv->successor = -1;
+            if (handed_off)
+                break;
         }
+        // A new server wants to take over -> it gets the listening socket
+        if (fds[1].revents != 0)
+            srv->successor = send_listener(srv->handoff_sd, srv->listening_sd);
+
+        if (fds[0].revents != 0)
+            accept_batch(srv);
 	}
 
-    // shouldn't reach here
+    drain_server(srv, handed_off);
     rpc_close_server(srv);
 }
 
+/* Accepts the connections waiting on the listening socket, and serves
+   them, up to ACCEPT_BATCH of them (any more are accepted after looking at
+   the other sockets and signals again).
+ */
+void accept_batch(rpc_server *srv) {
+    uint64_t n = 0;
+    int newsockfd;
+    // (one at a time: a child must not get the sockets of the next ones)
+    while (n < ACCEPT_BATCH
+            && (newsockfd = accept_connection(srv->listening_sd,
+                                              &srv->sock_opts)) >= 0) {
+        n++;
+        serve_connection(srv, newsockfd);
+    }
+    if (n == 0)
+        return; // another process got it first, or it was reset
+
+    SHARED_ADD(srv->stats->accepted, n);
+    SHARED_INC(srv->stats->accept_batches);
+    if (n > SHARED_LOAD(srv->stats->accept_batch_max))
+        __atomic_store_n(&srv->stats->accept_batch_max, n, __ATOMIC_RELAXED);
+}
+
+/* Serves the accepted connection in a child process (or turns it away).
+ */
+void serve_connection(rpc_server *srv, int newsockfd) {
+    // Already serving as many as we can -> turn it away, fast
+    if (srv->max_conns != NO_LIMIT 
+            && SHARED_LOAD(srv->stats->connections) >= srv->max_conns) {
+        reject_connection(srv, newsockfd);
+        return;
+    }
+
+    // where it goes (the server keeps track of whose turn it is)
+    int incoming;
+    int cpu = pick_cpu(srv->pinning, newsockfd, &incoming);
+    if (incoming)
+        SHARED_INC(srv->stats->pinned_incoming);
+
+    // child process to handle that connection
+    SHARED_INC(srv->stats->connections); // the child is reaped later
+    pid_t childpid;
+    if ((childpid = fork()) == -1) {
+        perror("fork");
+        SHARED_DEC(srv->stats->connections);
+        close(newsockfd);
+        return;
+
+    } else if (childpid == 0) { // child process
+        // first of all, so that its memory is on the node of its CPU
+        pin_child(srv->pinning, cpu);
+        close(srv->listening_sd); // child doesn't need this
+        close(srv->drain_fds[1]); // nor this: the server closes it to drain
+        if (srv->handoff_sd != -1)
+            close(srv->handoff_sd);
+        if (srv->successor != -1)
+            close(srv->successor);
+        // any child of its own is not a connection of the server
+        signal(SIGCHLD, SIG_DFL);
+        // plugins and stopping are the server's business: a signal sent
+        // to the whole process group (e.g. pkill -HUP) must not cut calls
+        // short, the server reloads, or drains its connections
+        signal(SIGHUP, SIG_IGN);
+        signal(SIGUSR1, SIG_IGN);
+        signal(SIGTERM, SIG_IGN);
+        // what it is doing is watched by the server (if asked for)
+        enter_connection(srv->timeouts);
+        
+        int version = 0; // told by the first request
+        frame_reader reader; // only used by v2
+        init_reader(&reader, newsockfd);
+        uint64_t drain_end = 0; // not draining
+        while (await_request(srv, newsockfd, &reader, &drain_end)
+                && handle_request(srv, newsockfd, &version, &reader) > 0) {
+            // no error and connection not closed
+            if (version & CONN_MUX) { // its requests come on channels now
+                serve_channels(srv, newsockfd, &reader, version & ~CONN_MUX,
+                               &drain_end);
+                break;
+            }
+        }
+
+        leave_connection(srv->timeouts);
+        close(newsockfd);
+        exit(EXIT_SUCCESS);
+
+    } else {
+        close(newsockfd); // parent doesn't need this
+        watch_connection(srv->timeouts, childpid);
+    }
+}
+
+/* Waits for the next request of the connection (in its child), or for the
+   server to drain: from then on, only requests already sent are handled,
+   and only until `*drain_end` (set here, from the server's drain timeout).
+ * Returns TRUE if there is a request to handle, FALSE if the connection
+   should be closed.
+ */
+int await_request(rpc_server *srv, int sockfd, frame_reader *reader,
+                  uint64_t *drain_end) {
+    if (*drain_end == 0) {
+        if (buffered_bytes(reader) > 0)
+            return TRUE; // sent along with the previous one
+
+        struct pollfd fds[2] = {
+            {.fd = sockfd, .events = POLLIN},
+            {.fd = srv->drain_fds[0], .events = POLLIN}
+        };
+        conn_state(srv->timeouts, CONN_IDLE);
+        int n;
+        while ((n = poll(fds, 2, -1)) < 0 && errno == EINTR);
+        conn_state(srv->timeouts, CONN_IO);
+        if (n < 0 || fds[1].revents == 0)
+            return TRUE; // (reading the request tells what's wrong, if any)
+        *drain_end = now_ns() + srv->drain_ms * NS_PER_MS;
+    }
+
+    // Draining -> an idle connection is closed at once
+    if (now_ns() >= *drain_end)
+        return FALSE;
+    return buffered_bytes(reader) > 0 || poll_fd(sockfd, POLLIN, 0) == SUCCESS;
+}
+
+/* Serves the multiplexed connection (in its child), from the request
+   after its HELLO on (with what the reader read ahead of it): requests are
+   handled as they are read in full, whatever their channel, while the
+   frames of the others and of the responses still to send go in and out.
+   When the server drains, it is served until nothing is left in either
+   direction, or `*drain_end`, as await_request does.
+ */
+void serve_channels(rpc_server *srv, int sockfd, frame_reader *reader,
+                    int version, uint64_t *drain_end) {
+    mux_conn *mux = create_mux_conn(sockfd, version == RPC_PROTO_V2_COMPACT);
+    if (mux == NULL)
+        return;
+    mux_feed(mux, reader);
+
+    int closing = FALSE, res = SUCCESS;
+    while (res == SUCCESS) {
+        // every request read in full, each response going out at once (as
+        // much of it as the socket takes) while the next one is handled
+        frame_header req;
+        char *payload;
+        int next = FALSE;
+        while (!closing && (next = mux_next(mux, &req, &payload)) == TRUE) {
+            int n = handle_frame(srv, sockfd, &req, payload, &version, mux);
+            if (n == EMPTY) { // CLOSE request, once the responses are out
+                closing = TRUE;
+            } else if (n == FAILED || mux_write(mux) == FAILED) {
+                res = FAILED;
+                break;
+            }
+        }
+        if (res == FAILED || next == FAILED)
+            break;
+
+        int idle = mux_pending(mux) == 0 && !mux_busy(mux);
+        if (idle && (closing || (*drain_end != 0
+                                 && poll_fd(sockfd, POLLIN, 0) != SUCCESS)))
+            break;
+        if (*drain_end != 0 && now_ns() >= *drain_end)
+            break;
+
+        // no more requests are read while too much is left to send
+        struct pollfd fds[2] = {
+            {.fd = sockfd, .events = 0},
+            {.fd = srv->drain_fds[0], .events = POLLIN}
+        };
+        if (!closing && mux_pending(mux) < MUX_MAX_PENDING)
+            fds[0].events |= POLLIN;
+        if (mux_pending(mux) > 0)
+            fds[0].events |= POLLOUT;
+        int nfds = *drain_end == 0 ? 2 : 1;
+        int timeout_ms = *drain_end == 0 ? -1 : ms_until(*drain_end);
+        conn_state(srv->timeouts, idle ? CONN_IDLE : CONN_IO);
+        int n;
+        while ((n = poll(fds, nfds, timeout_ms)) < 0 && errno == EINTR);
+        conn_state(srv->timeouts, CONN_IO);
+        if (n < 0)
+            break;
+        if (nfds == 2 && fds[1].revents != 0)
+            *drain_end = now_ns() + srv->drain_ms * NS_PER_MS;
+
+        if (fds[0].revents & POLLOUT)
+            res = mux_write(mux);
+        if (res == SUCCESS && (fds[0].revents & ~POLLOUT))
+            res = mux_read(mux);
+    }
+    free_mux_conn(mux);
+}
+
+/* Drains the server: it stops accepting (a server that took over from it
+   accepts alone from now on), then waits for its connections to finish
+   the requests they were sent, and close.
+ */
+void drain_server(rpc_server *srv, int handed_off) {
+    close(srv->listening_sd);
+    srv->listening_sd = -1;
+    if (srv->handoff_sd != -1 && !handed_off)
+        unlink(srv->handoff_path); // (otherwise it is the new server's now)
+
+    // every child sees the pipe close, and stops once it is idle
+    close(srv->drain_fds[1]);
+    srv->drain_fds[1] = -1;
+    uint64_t deadline = now_ns() + (srv->drain_ms + DRAIN_GRACE_MS) * NS_PER_MS;
+    while (SHARED_LOAD(srv->stats->connections) > 0 && now_ns() < deadline) {
+        usleep(DRAIN_POLL_US); // (cut short by SIGCHLD, as children exit)
+    }
+
+    uint64_t left = SHARED_LOAD(srv->stats->connections);
+    if (left > 0) { // they carry on alone
+        static log_site site = LOG_SITE();
+        char text[LOG_TEXT_LEN * 2]; // (truncated by log_text)
+        snprintf(text, sizeof(text), "%" PRIu64 " connections still draining",
+                 left);
+        log_text(&site, RPC_LOG_WARN, text, 0);
+    }
+}
+
+/* Turns away a connection the server has no capacity for: it is answered
+   OVERLOADED_STAT (whatever its first request is) and closed at once.
+ */
+void reject_connection(rpc_server *srv, int sockfd) {
+    print_err(SERVER_OVERLOADED);
+    SHARED_INC(srv->stats->conns_rejected);
+    write_prefix(sockfd, OVERLOADED_STAT);
+    close(sockfd);
+}
+
 /* Handles a FIND request from the socket.
  * Returns SUCCESS (1) on success of responding to the request
    (i.e. regardless of the result of the FIND),
@@ -180,7 +666,7 @@ int handle_find(rpc_server *srv, int sockfd) {
     }
 
     int idx, n = 0;
-    if ((idx = search_array(srv->functions, name)) == FAILED) {
+    if ((idx = find_func(srv->functions, name)) == FAILED) {
         // function not found -> respond with failure status
         print_err(FUNC_NOT_FOUND);
         n = write_prefix(sockfd, FAILURE_STAT);
@@ -204,11 +690,13 @@ int handle_find(rpc_server *srv, int sockfd) {
 }
 
 /* Handles a CALL request from the socket.
+ * The call is not made if `deadline` (unless NO_DEADLINE) has passed by the
+   time it is read.
  * Returns SUCCESS on success of responding to the request
    (i.e. regardless of the result of the CALL),
  * FAILED on error, or 0 if an I/O operation returned 0.
  */
-int handle_call(rpc_server *srv, int sockfd) {
+int handle_call(rpc_server *srv, int sockfd, uint64_t deadline) {
     uint32_t idx;
     int n = read_u32(sockfd, &idx); // read the function index (RPC handle)
     if (n <= 0) 
@@ -216,8 +704,36 @@ int handle_call(rpc_server *srv, int sockfd) {
     // function input (validity already checked -> NULL if invalid)
     rpc_data *input = read_rpc_data(sockfd);
 
-    // get the actual RPC function
-    rpc_func *func = get_elem_at(srv->functions, idx);
+    rpc_data *result = NULL;
+    conn_state(srv->timeouts, CONN_BUSY);
+    int status = run_call(srv, idx, input, deadline, &result);
+    conn_state(srv->timeouts, CONN_IO);
+    if (status == SUCCESS_STAT)
+        return send_result(sockfd, result);
+
+    // call not made, or failed
+    write_prefix(sockfd, status);
+    // routine failure, not a system error
+    return SUCCESS;
+}
+
+/* Makes a call of function `idx` with the input (NULL if it could not be
+   read), unless `deadline` (unless NO_DEADLINE) has passed, the server is
+   too busy, or the result is cached. The input is freed.
+ * Returns the status of the response (enum REQ_STATUS), with the result of
+   a successful call at `result`.
+ */
+int run_call(rpc_server *srv, uint32_t idx, rpc_data *input,
+             uint64_t deadline, rpc_data **result) {
+    SHARED_INC(srv->stats->calls);
+    *result = NULL;
+
+    // get the actual RPC function (its current version, which this call
+    // keeps to the end)
+    rpc_func version;
+    rpc_func *func = &version;
+    if (get_func(srv->functions, idx, func) == FAILED)
+        func = NULL;
     if (input == NULL || func == NULL) {
         if (input == NULL)
             print_err(INVALID_INPUT);
@@ -228,63 +744,233 @@ int handle_call(rpc_server *srv, int sockfd) {
                 input = NULL;
             }
         }
-        // call failed
-        write_prefix(sockfd, FAILURE_STAT);
-        // routine failure, not a system error
-        return SUCCESS;
+        return FAILURE_STAT;
+    }
+
+    // The client has given up already -> don't waste time on it
+    if (deadline != NO_DEADLINE && now_ns() >= deadline) {
+        print_err(DEADLINE_EXCEEDED);
+        SHARED_INC(srv->stats->deadline_shed);
+        rpc_data_free(input);
+        input = NULL;
+        return EXPIRED_STAT;
     }
     
+    // Already worked out before? -> no need to call the handler
+    if (func->flags & RPC_FUNC_CACHEABLE) {
+        *result = cache_lookup(srv->cache, idx, func->version, input);
+        if (*result != NULL) {
+            rpc_data_free(input);
+            input = NULL;
+            return SUCCESS_STAT;
+        }
+    }
+
+    // Too many calls being handled already -> turn this one away
+    uint64_t inflight = enter_inflight(srv);
+    if (srv->max_inflight != NO_LIMIT && inflight > srv->max_inflight) {
+        exit_inflight(srv);
+        print_err(SERVER_OVERLOADED);
+        SHARED_INC(srv->stats->calls_rejected);
+        rpc_data_free(input);
+        input = NULL;
+        return OVERLOADED_STAT;
+    }
+
+    // Wait for our turn (calls of higher classes go first), or until the
+    // call is too late to bother
+    int turn = sched_acquire(srv->sched, func->prio, deadline);
+    if (turn == FAILED) {
+        exit_inflight(srv);
+        rpc_data_free(input);
+        input = NULL;
+        return FAILURE_STAT;
+    }
+
+    // That may have taken a while
+    if (turn == EMPTY || (deadline != NO_DEADLINE && now_ns() >= deadline)) {
+        if (turn == SUCCESS)
+            sched_release(srv->sched);
+        exit_inflight(srv);
+        print_err(DEADLINE_EXCEEDED);
+        SHARED_INC(srv->stats->deadline_shed);
+        rpc_data_free(input);
+        input = NULL;
+        return EXPIRED_STAT;
+    }
+
+    // From a plugin? -> loaded here if not yet, and not unloaded until the
+    // handler returns (unless it is being unloaded already)
+    rpc_handler handler = enter_plugin(srv->plugins, func);
+    if (handler == NULL) {
+        sched_release(srv->sched);
+        exit_inflight(srv);
+        print_err(FUNC_NOT_FOUND);
+        rpc_data_free(input);
+        input = NULL;
+        return FAILURE_STAT;
+    }
+
     // All good now, let's call the actual remote procedure
-    rpc_data *result = (((rpc_handler)(func->handler))(input));
-    if (check_rpc_data(result) == FAILED) { // really shouldn't happen
-        rpc_data_free(result);
-        result = NULL;
-        write_prefix(sockfd, FAILURE_STAT);
-        return SUCCESS;
+    *result = handler(input);
+    exit_plugin(srv->plugins, func->plugin);
+    sched_release(srv->sched);
+    exit_inflight(srv);
+    if (check_rpc_data(*result) == FAILED) { // really shouldn't happen
+        rpc_data_free(input);
+        input = NULL;
+        rpc_data_free(*result);
+        *result = NULL;
+        return FAILURE_STAT;
     }
 
+    // (not if the function was replaced meanwhile; if it is replaced
+    // right after, the entry is of the version it was called as, which a
+    // lookup of the new one doesn't match)
+    if ((func->flags & RPC_FUNC_CACHEABLE)
+            && func_version(srv->functions, idx) == func->version)
+        cache_insert(srv->cache, idx, func->version, input, *result);
+    
+    // No longer needed
+    rpc_data_free(input);
+    input = NULL;
+
+    return SUCCESS_STAT;
+}
+
+/* Counts a call of this child in flight, in its own count and the server's.
+ * Returns the number of calls in flight on the server, this one included.
+ */
+uint64_t enter_inflight(rpc_server *srv) {
+    // (the server's first: a child killed in between leaves it one too
+    // many, never one too few)
+    uint64_t inflight = SHARED_INC(srv->stats->inflight);
+    pid_t pid = getpid();
+    if (pid < srv->n_pids)
+        SHARED_INC(srv->inflight_by_pid[pid]);
+    return inflight;
+}
+
+/* Counts a call of this child in flight as done.
+ */
+void exit_inflight(rpc_server *srv) {
+    pid_t pid = getpid();
+    if (pid < srv->n_pids)
+        SHARED_DEC(srv->inflight_by_pid[pid]);
+    SHARED_DEC(srv->stats->inflight);
+}
+
+/* Gives back the calls in flight of a child reaped by the server (called
+   by the SIGCHLD handler), e.g. one whose handler crashed.
+ */
+void give_back_inflight(pid_t pid, void *arg) {
+    rpc_server *srv = arg;
+    if (pid >= srv->n_pids)
+        return;
+    uint32_t n = __atomic_exchange_n(&srv->inflight_by_pid[pid], 0,
+                                     __ATOMIC_RELAXED);
+    if (n > 0)
+        __atomic_sub_fetch(&srv->stats->inflight, n, __ATOMIC_RELAXED);
+}
+
+/* Sends the (valid) result of a successful call to the socket, and frees it.
+ * Returns SUCCESS on success, FAILED on error, 
+   or 0 if an I/O operation returned 0.
+ */
+int send_result(int sockfd, rpc_data *result) {
     // Tell the client the call succeeded
-    n = write_prefix(sockfd, SUCCESS_STAT);
-    if (n <= 0)
-        return n;
+    int n = write_prefix(sockfd, SUCCESS_STAT);
 
     // "Here's your result"
-    n = write_rpc_data(sockfd, result);
-    if (n <= 0)
-        return n;
+    if (n > 0)
+        n = write_rpc_data(sockfd, result);
     
     // No longer needed
-    rpc_data_free(input);
-    input = NULL;
     rpc_data_free(result);
     result = NULL;
 
-    return SUCCESS;
+    return n <= 0 ? n : SUCCESS;
+}
+
+/* Handles a request from the socket, in either version of the protocol:
+   the version of the connection (0 until known) is set by its first
+   request, from its first bytes. From then on, v2 frames are read through
+   the connection's read-ahead buffer.
+ * Returns SUCCESS on success of responding to the request
+   (i.e. regardless of the result of that request),
+ * FAILED on error, or 0 if an I/O operation returned 0.
+ */
+int handle_request(rpc_server *srv, int sockfd, int *version,
+                   frame_reader *reader) {
+    frame_header req;
+    char *payload;
+    int n;
+    if (*version == RPC_PROTO_V2 || *version == RPC_PROTO_V2_COMPACT) {
+        n = next_frame(reader, *version == RPC_PROTO_V2_COMPACT, &req,
+                       &payload);
+        if (n <= 0)
+            return n;
+        return handle_frame(srv, sockfd, &req, payload, version, NULL);
+    }
+
+    // a v1 prefix or the start of a frame
+    char buf[FRAME_HEADER_SIZE];
+    n = read_all(sockfd, buf, U32_SIZE);
+    if (n <= 0)
+        return check_io_err(n, "handle_request");
+    if (!is_frame(buf)) {
+        *version = RPC_PROTO_V1;
+        uint32_t prefix;
+        memcpy(&prefix, buf, U32_SIZE);
+        return handle_prefix(srv, sockfd, ntohl(prefix));
+    }
+
+    *version = RPC_PROTO_V2;
+    n = read_header(sockfd, buf, U32_SIZE, &req);
+    if (n > 0)
+        n = read_payload(sockfd, req.payload_len, &payload);
+    if (n <= 0)
+        return n;
+    return handle_frame(srv, sockfd, &req, payload, version, NULL);
 }
 
-/* Handles a request from the socket.
+/* Handles a v1 request from the socket, of which the prefix was read.
  * Returns SUCCESS on success of responding to the request
    (i.e. regardless of the result of that request),
  * FAILED on error, or 0 if an I/O operation returned 0.
  */
-int handle_request(rpc_server *srv, int sockfd) {
-    int prefix = read_prefix(sockfd);
+int handle_prefix(rpc_server *srv, int sockfd, uint32_t prefix) {
     if (check_prefix(prefix) == FAILED)
         return FAILED;
+    uint64_t received = now_ns(); // deadlines count from here
+    SHARED_INC(srv->stats->requests);
     
     int req_result = FAILED;
+    uint32_t budget_ms;
     switch (prefix) {
         case FIND_REQ: // rpc_find request
             req_result = handle_find(srv, sockfd);
             break;
         
         case CALL_REQ: // rpc_call request
-            req_result = handle_call(srv, sockfd);
+            req_result = handle_call(srv, sockfd, NO_DEADLINE);
+            break;
+
+        case CALL_DL_REQ: // rpc_call request with a time budget
+            req_result = read_u32(sockfd, &budget_ms);
+            if (req_result <= 0)
+                break;
+            req_result = handle_call(srv, sockfd, 
+                                     received + budget_ms * NS_PER_MS);
             break;
         
         case CLOSE_REQ: // explicit closing request
             req_result = EMPTY; // i.e. no more I/O ops
             break;
+
+        case PING_REQ: // the client checking that we're there
+            req_result = write_prefix(sockfd, SUCCESS_STAT);
+            break;
         
         default:
             print_err(UNKNOWN_REQ);
@@ -292,92 +978,889 @@ int handle_request(rpc_server *srv, int sockfd) {
     return req_result;
 }
 
-/* Cleans up server state and closes server */
-void rpc_close_server(rpc_server *srv) {
-    if (srv == NULL)
-        return;
-    // close listening socket
-    close(srv->listening_sd);
+/* Handles a v2 request (frame) read from the socket, with its payload.
+   The version of the connection becomes RPC_PROTO_V2_COMPACT once a HELLO
+   asks for it, and gets CONN_MUX once a HELLO asks for channels. On a
+   multiplexed connection (`mux` not NULL), the response is queued. A CAST
+   gets none.
+ * Returns SUCCESS on success of responding to the request
+   (i.e. regardless of the result of that request),
+ * FAILED on error, or 0 if an I/O operation returned 0.
+ */
+int handle_frame(rpc_server *srv, int sockfd, frame_header *req,
+                 char *payload, int *version, mux_conn *mux) {
+    uint64_t received = now_ns(); // deadlines count from here
+    int compact = *version == RPC_PROTO_V2_COMPACT;
+    int n;
+    SHARED_INC(srv->stats->requests);
+
+    // the header tells everything, there's nothing else to read
+    frame_header resp = {.type = SUCCESS_STAT, .flags = FRAME_RESPONSE,
+                         .channel = req->channel, .req_id = req->req_id};
+    switch (req->type) {
+        case FIND_REQ: // the name is the payload
+            n = frame_find(srv, payload, &resp);
+            free(payload);
+            if (n == FAILED)
+                return FAILED;
+            break;
 
-    free_array(srv->functions);
-    srv->functions = NULL;
-    free(srv);
-    srv = NULL;
-}
+        case CALL_REQ: // rpc_call request, with a time budget or not
+            if (!(req->flags & FRAME_DEADLINE))
+                return frame_call(srv, sockfd, req, payload, NO_DEADLINE,
+                                  compact, mux);
+            return frame_call(srv, sockfd, req, payload,
+                              received + req->budget_ms * NS_PER_MS, compact,
+                              mux);
+
+        case CAST_REQ: // a call whose result is not wanted
+            if (!(req->flags & FRAME_DEADLINE))
+                return frame_cast(srv, req, payload, NO_DEADLINE);
+            return frame_cast(srv, req, payload,
+                              received + req->budget_ms * NS_PER_MS);
+
+        case CLOSE_REQ: // explicit closing request: of the connection, or
+                        // of the session of a channel (no response)
+            if (mux == NULL || req->channel == 0)
+                return EMPTY;
+            end_channel(srv, req->channel);
+            return SUCCESS;
+
+        case HELLO_REQ: // opening a v2 connection
+            free(payload);
+            if (mux != NULL || !(req->flags & (FRAME_COMPACT | FRAME_MUX)))
+                break;
+            // agreed, from the next frame on
+            resp.flags |= req->flags & (FRAME_COMPACT | FRAME_MUX);
+            n = write_frame(sockfd, &resp, NULL, compact);
+            if (req->flags & FRAME_COMPACT)
+                *version = RPC_PROTO_V2_COMPACT;
+            if (req->flags & FRAME_MUX)
+                *version |= CONN_MUX;
+            return n;
 
+        case PING_REQ:  // the client checking that we're there (and on
+                        // its casts)
+            frame_ping(srv, req, &resp);
+            break;
 
-/* ------------- */
-/*  Client side  */
-/* ------------- */
+        default: // really shouldn't happen, read_header checked it
+            print_err(UNKNOWN_REQ);
+            free(payload);
+            return FAILED;
+    }
+    return send_response(sockfd, mux, &resp, NULL, compact);
+}
 
-struct rpc_client {
-    char addr[INET6_ADDRSTRLEN];  // IP address
-    char port[PORT_LEN];          // port number as a string
-    int sockfd;                   // socket for connection
-    int state;                    // open or closed?
-};
+/* Looks up the function of a v2 FIND request, setting the status and
+   handle of the response.
+ * Returns SUCCESS if the request could be answered, FAILED otherwise.
+ */
+int frame_find(rpc_server *srv, char *name, frame_header *resp) {
+    if (check_name(name) == FAILED) // really shouldn't happen
+        return FAILED;
 
-/* Initialises client state */
-/* RETURNS: rpc_client* on success, NULL on error */
-rpc_client *rpc_init_client(char *addr, int port) {
-    // Check input validity
-    if (!addr || check_ip(addr) == FAILED || check_port(port) == FAILED) {
-        print_err(INVALID_INPUT);
-        return NULL;
-    }
-        
-    // Create client
-    rpc_client *cl = malloc(sizeof(*cl));
-    if (!cl) { // malloc failed
-        print_err(MALLOC_FAILED);
-        return NULL;
+    int idx = find_func(srv->functions, name);
+    if (idx == FAILED) {
+        print_err(FUNC_NOT_FOUND);
+        resp->type = FAILURE_STAT;
+    } else {
+        resp->handle = idx;
     }
+    return SUCCESS;
+}
 
-    strcpy(cl->addr, addr);
-    snprintf(cl->port, PORT_LEN, "%d", port); // store port number as a string
-    cl->state = CLOSED; // no connection yet
+/* Makes the call of a v2 CALL request, whose payload is its data2, and
+   sends the response (with a compact header if `compact` is TRUE, queued
+   if `mux` is not NULL). The call is not made if `deadline` (unless
+   NO_DEADLINE) has passed by then.
+ * Returns SUCCESS on success of responding to the request
+   (i.e. regardless of the result of the CALL),
+ * FAILED on error, or 0 if an I/O operation returned 0.
+ */
+int frame_call(rpc_server *srv, int sockfd, frame_header *req, char *payload,
+               uint64_t deadline, int compact, mux_conn *mux) {
+    rpc_data *input = frame_input(req, payload);
+    rpc_data *result = NULL;
+    frame_header resp = {.flags = FRAME_RESPONSE, .channel = req->channel,
+                         .req_id = req->req_id};
+    conn_state(srv->timeouts, CONN_BUSY);
+    resp.type = run_call(srv, req->handle, input, deadline, &result);
+    conn_state(srv->timeouts, CONN_IO);
+    if (resp.type != SUCCESS_STAT)
+        return send_response(sockfd, mux, &resp, NULL, compact);
 
-    return cl;
+    // "Here's your result"
+    resp.data1 = result->data1;
+    resp.payload_len = result->data2_len;
+    char *data2 = result->data2; // (sent, then freed, by send_response)
+    result->data2 = NULL;
+    rpc_data_free(result);
+    result = NULL;
+    return send_response(sockfd, mux, &resp, data2, compact);
 }
 
-/* Finds a remote function by name */
-/* RETURNS: rpc_handle* on success, NULL on error */
-/* rpc_handle* will be freed with a single call to free(3) */
-rpc_handle *rpc_find(rpc_client *cl, char *name) {
+/* Makes the call of a v2 CAST request, whose payload is its data2, as
+   frame_call does, but sends nothing back: whether it failed is only
+   counted, against the request's channel, and told by the next PING.
+ * Returns SUCCESS (there is no response to fail to send).
+ */
+int frame_cast(rpc_server *srv, frame_header *req, char *payload,
+               uint64_t deadline) {
+    rpc_data *input = frame_input(req, payload);
+    rpc_data *result = NULL;
+    conn_state(srv->timeouts, CONN_BUSY);
+    int status = run_call(srv, req->handle, input, deadline, &result);
+    conn_state(srv->timeouts, CONN_IO);
+    rpc_data_free(result); // not wanted
+    result = NULL;
+
+    // (the child's own: a connection has a single one)
+    if (srv->casts == NULL)
+        srv->casts = calloc(MAX_SESSIONS + 1, sizeof(*(srv->casts)));
+    if (srv->casts == NULL) {
+        print_err(MALLOC_FAILED);
+        return SUCCESS; // nothing to count them in, they show up as lost
+    }
+    if (req->channel > MAX_SESSIONS) // really shouldn't happen
+        return SUCCESS;
+    srv->casts[req->channel].run++;
+    if (status != SUCCESS_STAT)
+        srv->casts[req->channel].failed++;
+    return SUCCESS;
+}
+
+/* Tells in the response to a v2 PING how the casts of the request's
+   channel went since its last PING (all of them were handled before it):
+   how many were made in data1, how many of those failed in the handle.
+   Their counts start again from 0.
+ */
+void frame_ping(rpc_server *srv, frame_header *req, frame_header *resp) {
+    if (srv->casts == NULL || req->channel > MAX_SESSIONS)
+        return; // none
+    resp->data1 = srv->casts[req->channel].run;
+    resp->handle = srv->casts[req->channel].failed;
+    srv->casts[req->channel].run = 0;
+    srv->casts[req->channel].failed = 0;
+}
+
+/* Forgets the casts of the session of the channel, which the client closed
+   (the channel's next session must not be told of them).
+ */
+void end_channel(rpc_server *srv, int channel) {
+    if (srv->casts == NULL || channel > MAX_SESSIONS)
+        return;
+    srv->casts[channel].run = 0;
+    srv->casts[channel].failed = 0;
+}
+
+/* Makes the input of the call of a v2 CALL or CAST request, whose payload
+   is its data2 (freed if the input can't be made).
+ * Returns the input on success, NULL on error.
+ */
+rpc_data *frame_input(frame_header *req, char *payload) {
+    rpc_data *input = create_rpc_data();
+    if (input == NULL) {
+        free(payload);
+        return NULL;
+    }
+    input->data1 = req->data1;
+    input->data2_len = req->payload_len;
+    input->data2 = payload;
+    return input;
+}
+
+/* Sends the v2 response (with a compact header if `compact` is TRUE), or
+   queues it on a multiplexed connection (`mux` not NULL), and frees its
+   payload once sent.
+ * Returns SUCCESS on success, FAILED on failure,
+   or EMPTY if a write() returned 0.
+ */
+int send_response(int sockfd, mux_conn *mux, frame_header *resp,
+                  char *payload, int compact) {
+    if (mux != NULL)
+        return mux_queue(mux, resp, payload, TRUE);
+    int n = write_frame(sockfd, resp, payload, compact);
+    free(payload);
+    return n;
+}
+
+/* Cleans up server state and closes server */
+void rpc_close_server(rpc_server *srv) {
+    if (srv == NULL)
+        return;
+    // close listening socket (unless drained already)
+    if (srv->listening_sd != -1)
+        close(srv->listening_sd);
+    for (int i = 0; i < 2; i++) {
+        if (srv->drain_fds[i] != -1)
+            close(srv->drain_fds[i]);
+    }
+    if (srv->handoff_sd != -1)
+        close(srv->handoff_sd);
+    if (srv->successor != -1)
+        close(srv->successor);
+    if (srv->predecessor != -1)
+        close(srv->predecessor);
+    free(srv->handoff_path);
+    srv->handoff_path = NULL;
+
+    free_registry(srv->functions);
+    srv->functions = NULL;
+    if (srv->inflight_by_pid != NULL) {
+        remove_reap_hook(give_back_inflight, srv);
+        free_shared(srv->inflight_by_pid, srv->n_pids * sizeof(uint32_t));
+        srv->inflight_by_pid = NULL;
+    }
+    free_shared(srv->stats, sizeof(*(srv->stats)));
+    srv->stats = NULL;
+    free_call_sched(srv->sched);
+    srv->sched = NULL;
+    free_result_cache(srv->cache);
+    srv->cache = NULL;
+    free_pinning(srv->pinning);
+    srv->pinning = NULL;
+    free_conn_timeouts(srv->timeouts);
+    srv->timeouts = NULL;
+    if (plugin_admin_srv == srv)
+        plugin_admin_srv = NULL;
+    free_plugin_table(srv->plugins);
+    srv->plugins = NULL;
+    free(srv->plugin_dir);
+    srv->plugin_dir = NULL;
+    free(srv->casts);
+    srv->casts = NULL;
+    free(srv);
+    srv = NULL;
+}
+
+/* Closes a connection once idle (between requests) for `idle_ms`, or
+   stalled for `io_ms` (no byte moving either way) while a request is read
+   or its response written, e.g. a client that sent half a request; 0 for
+   no limit (default). Calls being handled are never cut short. Applies to
+   the connections accepted from now on. */
+/* RETURNS: -1 on failure */
+int rpc_set_conn_timeouts(rpc_server *srv, int idle_ms, int io_ms) {
+    if (srv == NULL || idle_ms < 0 || io_ms < 0) {
+        print_err(INVALID_INPUT);
+        return FAILED;
+    }
+    // (set up the first time: the children watched share it)
+    if (srv->timeouts == NULL) {
+        if (idle_ms == 0 && io_ms == 0)
+            return SUCCESS;
+        srv->timeouts = create_conn_timeouts(srv->stats);
+        if (srv->timeouts == NULL)
+            return FAILED;
+    }
+    set_conn_timeouts(srv->timeouts, idle_ms, io_ms);
+    return SUCCESS;
+}
+
+/* Pins the child serving each connection accepted from now on to one of
+   the `n_cpus` CPUs at `cpus` (NULL for all those the server may run on),
+   picked by the policy (enum RPC_PIN_POLICY). A child is pinned before
+   anything else, so that its buffers are allocated on the NUMA node of its
+   CPU (where the kernel puts memory first touched by it). */
+/* RETURNS: -1 on failure */
+int rpc_set_cpu_pinning(rpc_server *srv, int policy, const int *cpus,
+                        int n_cpus) {
+    if (srv == NULL) {
+        print_err(INVALID_INPUT);
+        return FAILED;
+    }
+    return set_pinning(srv->pinning, policy, cpus, n_cpus);
+}
+
+/* Pins the server itself (accepting connections) to the CPU, e.g. one of
+   the node of the network card. Its children don't stay on it. */
+/* RETURNS: -1 on failure */
+int rpc_pin_server(rpc_server *srv, int cpu) {
+    if (srv == NULL) {
+        print_err(INVALID_INPUT);
+        return FAILED;
+    }
+    return pin_server(srv->pinning, cpu);
+}
+
+/* Sets the options of the sockets of the connections accepted from now on */
+/* RETURNS: -1 on failure */
+int rpc_set_server_sock_opts(rpc_server *srv, const rpc_sock_opts *opts) {
+    if (srv == NULL || opts == NULL) {
+        print_err(INVALID_INPUT);
+        return FAILED;
+    }
+    srv->sock_opts = *opts;
+    return SUCCESS;
+}
+
+/* Copies the server's counters to `stats`.
+ * RETURNS: -1 on failure */
+int rpc_get_server_stats(rpc_server *srv, rpc_server_stats *stats) {
+    if (srv == NULL || stats == NULL) {
+        print_err(INVALID_INPUT);
+        return FAILED;
+    }
+    stats->requests = SHARED_LOAD(srv->stats->requests);
+    stats->calls = SHARED_LOAD(srv->stats->calls);
+    stats->deadline_shed = SHARED_LOAD(srv->stats->deadline_shed);
+    stats->conns_rejected = SHARED_LOAD(srv->stats->conns_rejected);
+    stats->calls_rejected = SHARED_LOAD(srv->stats->calls_rejected);
+    stats->connections = SHARED_LOAD(srv->stats->connections);
+    stats->inflight = SHARED_LOAD(srv->stats->inflight);
+    stats->accepted = SHARED_LOAD(srv->stats->accepted);
+    stats->accept_batches = SHARED_LOAD(srv->stats->accept_batches);
+    stats->accept_batch_max = SHARED_LOAD(srv->stats->accept_batch_max);
+    get_listen_stats(srv->listening_sd, &stats->accept_queue,
+                     &stats->accept_backlog, &stats->listen_drops);
+    stats->pinned_incoming = SHARED_LOAD(srv->stats->pinned_incoming);
+    stats->idle_timeouts = SHARED_LOAD(srv->stats->idle_timeouts);
+    stats->io_timeouts = SHARED_LOAD(srv->stats->io_timeouts);
+    sched_get_stats(srv->sched, stats->classes);
+    memset(&stats->cache_hits, 0, 
+           sizeof(*stats) - offsetof(rpc_server_stats, cache_hits));
+    cache_get_stats(srv->cache, stats);
+    return SUCCESS;
+}
+
+/* Sets up a cache of at most `max_bytes` (0 to turn it off) for the results
+   of the functions registered with RPC_FUNC_CACHEABLE. A call found in it is
+   answered without running the handler. Must be called before serving. */
+/* RETURNS: -1 on failure */
+int rpc_set_cache_size(rpc_server *srv, size_t max_bytes) {
+    if (srv == NULL) {
+        print_err(INVALID_INPUT);
+        return FAILED;
+    }
+
+    free_result_cache(srv->cache);
+    srv->cache = NULL;
+    if (max_bytes == 0)
+        return SUCCESS;
+
+    srv->cache = create_result_cache(max_bytes);
+    return srv->cache == NULL ? FAILED : SUCCESS;
+}
+
+/* Drops every cached result of the function (also done whenever the
+   function is registered again). */
+/* RETURNS: -1 on failure */
+int rpc_cache_invalidate(rpc_server *srv, char *name) {
+    if (srv == NULL || name == NULL) {
+        print_err(INVALID_INPUT);
+        return FAILED;
+    }
+    int idx = find_func(srv->functions, name);
+    if (idx == FAILED) {
+        print_err(FUNC_NOT_FOUND);
+        return FAILED;
+    }
+    cache_invalidate(srv->cache, idx);
+    return SUCCESS;
+}
+
+/* Limits how many handlers run at the same time, over all connections
+   (0 for no limit, the default). Once the limit is reached, calls wait for
+   their turn, higher priority classes first, though a waiting lower class
+   is never skipped more than a few times in a row. */
+/* RETURNS: -1 on failure */
+int rpc_set_max_running(rpc_server *srv, int max_running) {
+    if (srv == NULL) {
+        print_err(INVALID_INPUT);
+        return FAILED;
+    }
+    return sched_set_max_running(srv->sched, max_running);
+}
+
+/* Limits how many connections are served at the same time (0 for no
+   limit). Connections over the limit are answered OVERLOADED and closed. */
+/* RETURNS: -1 on failure */
+int rpc_set_max_connections(rpc_server *srv, int max_conns) {
+    if (srv == NULL || max_conns < 0) {
+        print_err(INVALID_INPUT);
+        return FAILED;
+    }
+    srv->max_conns = max_conns;
+    return SUCCESS;
+}
+
+/* Limits how many calls are handled at the same time, over all connections
+   (0 for no limit). Calls over the limit are answered OVERLOADED at once,
+   rather than waiting for their turn. */
+/* RETURNS: -1 on failure */
+int rpc_set_max_inflight(rpc_server *srv, int max_inflight) {
+    if (srv == NULL || max_inflight < 0) {
+        print_err(INVALID_INPUT);
+        return FAILED;
+    }
+    srv->max_inflight = max_inflight;
+    return SUCCESS;
+}
+
+/* Sets the size of the queue of connections waiting to be accepted
+   (SOMAXCONN by default, the most the system allows). Connections coming
+   while it is full are dropped, and retried by the client a second or more
+   later, so it should absorb a burst of them (e.g. many clients
+   reconnecting at once). */
+/* RETURNS: -1 on failure */
+int rpc_set_backlog(rpc_server *srv, int backlog) {
+    if (srv == NULL || backlog <= 0 || srv->listening_sd == -1) {
+        print_err(INVALID_INPUT);
+        return FAILED;
+    }
+    srv->backlog = backlog;
+    return set_listen_opts(srv->listening_sd, srv->backlog,
+                           srv->defer_accept_s);
+}
+
+/* Has connections accepted only once their first request has arrived, or
+   after `timeout_s` seconds (0 to turn it off, the default), so that the
+   server doesn't fork a child for a connection that sends nothing. */
+/* RETURNS: -1 on failure */
+int rpc_set_defer_accept(rpc_server *srv, int timeout_s) {
+    if (srv == NULL || timeout_s < 0 || srv->listening_sd == -1) {
+        print_err(INVALID_INPUT);
+        return FAILED;
+    }
+    srv->defer_accept_s = timeout_s;
+    return set_listen_opts(srv->listening_sd, srv->backlog,
+                           srv->defer_accept_s);
+}
+
+/* Listens on a Unix socket at `path` for a new server process to take
+   over (see rpc_take_over_server). */
+/* RETURNS: -1 on failure */
+int rpc_set_handoff_path(rpc_server *srv, char *path) {
+    if (srv == NULL || path == NULL || srv->handoff_sd != -1) {
+        print_err(INVALID_INPUT);
+        return FAILED;
+    }
+    int sd = create_handoff_socket(path);
+    if (sd == FAILED)
+        return FAILED;
+    srv->handoff_path = strdup(path);
+    if (srv->handoff_path == NULL) {
+        print_err(MALLOC_FAILED);
+        close(sd);
+        return FAILED;
+    }
+    srv->handoff_sd = sd;
+    return SUCCESS;
+}
+
+/* Sets how long draining lets the connections finish the requests they
+   were sent, in milliseconds (30s by default). */
+/* RETURNS: -1 on failure */
+int rpc_set_drain_timeout(rpc_server *srv, int timeout_ms) {
+    if (srv == NULL || timeout_ms < 0) {
+        print_err(INVALID_INPUT);
+        return FAILED;
+    }
+    srv->drain_ms = timeout_ms;
+    return SUCCESS;
+}
+
+/* Loads the plugin at `path`, while the server is running or not: its
+   functions are found by every connection at once. Loading a plugin again
+   replaces it (its functions it no longer registers are removed). */
+/* RETURNS: -1 on failure */
+int rpc_load_plugin(rpc_server *srv, char *path) {
+    if (srv == NULL || path == NULL) {
+        print_err(INVALID_INPUT);
+        return FAILED;
+    }
+    // (a child ending the last call of a plugin replaced or unloaded while
+    // it ran tells the server with SIGUSR1, which must not kill it)
+    if (set_up_plugin_signals() == FAILED)
+        return FAILED;
+
+    int old = find_plugin(srv->plugins, path);
+    rpc_plugin_init_fn init;
+    int idx = open_plugin(srv->plugins, path, &init);
+    if (idx == FAILED)
+        return FAILED;
+
+    // it registers its functions (replacing those of the old one, if any)
+    if (init(srv) < 0) {
+        // whatever it registered goes with it
+        print_err(PLUGIN_FAILED);
+        drop_plugin(srv, idx);
+        close_retired(srv->plugins, 0);
+        return FAILED;
+    }
+
+    // the functions of the old one that were not registered again
+    if (old != FAILED)
+        drop_plugin(srv, old);
+    close_retired(srv->plugins, 0); // unless calls of it are still running
+    return SUCCESS;
+}
+
+/* Removes the functions of the plugin loaded from `path`, then unloads it
+   once no call of them is in flight (waiting a few seconds at most, after
+   which it is unloaded later). */
+/* RETURNS: -1 on failure */
+int rpc_unload_plugin(rpc_server *srv, char *path) {
+    if (srv == NULL || path == NULL) {
+        print_err(INVALID_INPUT);
+        return FAILED;
+    }
+    int idx = find_plugin(srv->plugins, path);
+    if (idx == FAILED) {
+        print_err(PLUGIN_FAILED);
+        return FAILED;
+    }
+    drop_plugin(srv, idx);
+    close_retired(srv->plugins, PLUGIN_DRAIN_MS);
+    return SUCCESS;
+}
+
+/* Loads every plugin (`*.so`) of the directory. Whenever the server gets
+   SIGHUP, it looks at the directory again: new plugins are loaded, changed
+   ones loaded again, and removed ones unloaded. */
+/* RETURNS: -1 on failure */
+int rpc_set_plugin_dir(rpc_server *srv, char *dir) {
+    if (srv == NULL || dir == NULL || strlen(dir) >= PATH_MAX) {
+        print_err(INVALID_INPUT);
+        return FAILED;
+    }
+    free(srv->plugin_dir);
+    srv->plugin_dir = strdup(dir);
+    if (srv->plugin_dir == NULL) {
+        print_err(MALLOC_FAILED);
+        return FAILED;
+    }
+    if (set_up_plugin_signals() == FAILED)
+        return FAILED;
+    return rescan_plugins(srv);
+}
+
+/* Registers the functions "rpc.load_plugin" and "rpc.unload_plugin", which
+   load or unload the plugin named by their data2 (a file name, with its
+   terminating null byte) in the plugin directory. Anyone who can call the
+   server can then use them, so they are off by default. */
+/* RETURNS: -1 on failure */
+int rpc_enable_plugin_admin(rpc_server *srv) {
+    if (srv == NULL || (plugin_admin_srv != NULL && plugin_admin_srv != srv)) {
+        print_err(INVALID_INPUT);
+        return FAILED;
+    }
+    // (the children hand the requests over to the server, with SIGUSR1)
+    if (set_up_plugin_signals() == FAILED)
+        return FAILED;
+    plugin_admin_srv = srv;
+    if (rpc_register_prio(srv, "rpc.load_plugin", admin_load_plugin,
+                          RPC_PRIO_HIGH) == FAILED
+            || rpc_register_prio(srv, "rpc.unload_plugin", admin_unload_plugin,
+                                 RPC_PRIO_HIGH) == FAILED)
+        return FAILED;
+    return SUCCESS;
+}
+
+/* Does the plugin work asked for (by signals) since the last time, and
+   unloads the plugins whose last calls have returned meanwhile.
+ */
+void tend_plugins(rpc_server *srv) {
+    int todo = take_plugin_signals();
+    if ((todo & PLUGIN_RESCAN) && srv->plugin_dir != NULL)
+        rescan_plugins(srv);
+    if (todo & PLUGIN_ADMIN)
+        serve_plugin_ops(srv);
+    close_retired(srv->plugins, 0);
+}
+
+/* Loads the new and changed plugins of the plugin directory, and unloads
+   those removed from it.
+ * Returns SUCCESS on success, FAILED if the directory couldn't be read.
+ */
+int rescan_plugins(rpc_server *srv) {
+    DIR *dir = opendir(srv->plugin_dir);
+    if (dir == NULL) {
+        perror(srv->plugin_dir);
+        return FAILED;
+    }
+
+    char path[PATH_MAX];
+    struct dirent *entry;
+    size_t suffix_len = strlen(PLUGIN_SUFFIX);
+    while ((entry = readdir(dir)) != NULL) {
+        size_t len = strlen(entry->d_name);
+        if (len <= suffix_len || strcmp(entry->d_name + len - suffix_len,
+                                        PLUGIN_SUFFIX) != 0)
+            continue; // not a plugin
+        if (plugin_file(srv, entry->d_name, path) == FAILED)
+            continue;
+        int idx = find_plugin(srv->plugins, path);
+        if (idx == FAILED || plugin_changed(srv->plugins, idx))
+            rpc_load_plugin(srv, path); // (a broken one is just reported)
+    }
+    closedir(dir);
+
+    // the plugins of the directory no longer there
+    size_t dir_len = strlen(srv->plugin_dir);
+    for (int i = 0; i < MAX_PLUGINS; i++) {
+        char *loaded = plugin_path(srv->plugins, i);
+        if (loaded != NULL && strncmp(loaded, srv->plugin_dir, dir_len) == 0
+                && loaded[dir_len] == '/' && access(loaded, F_OK) == -1)
+            drop_plugin(srv, i);
+    }
+    close_retired(srv->plugins, 0);
+    return SUCCESS;
+}
+
+/* Carries out the admin requests of the children waiting for the server.
+ */
+void serve_plugin_ops(rpc_server *srv) {
+    int op;
+    uint64_t seq;
+    char name[NAME_MAX + 1], path[PATH_MAX];
+    while ((seq = next_plugin_op(srv->plugins, &op, name)) != 0) {
+        int res = FAILED;
+        if (plugin_file(srv, name, path) == FAILED) {
+            print_err(INVALID_INPUT);
+        } else if (op == PLUGIN_LOAD) {
+            res = rpc_load_plugin(srv, path);
+        } else if ((res = find_plugin(srv->plugins, path)) != FAILED) {
+            // not waiting for its calls: they finish in the background
+            drop_plugin(srv, res);
+            res = SUCCESS;
+        }
+        finish_plugin_op(srv->plugins, seq, res);
+    }
+}
+
+/* Removes the functions of the plugin at index `idx` that are still its
+   own (not registered again since), and starts unloading it.
+ */
+void drop_plugin(rpc_server *srv, int idx) {
+    uint32_t gen = plugin_gen(srv->plugins, idx);
+    uint32_t n = count_funcs(srv->functions);
+    rpc_func func;
+    for (uint32_t i = 0; i < n; i++) {
+        if (get_func(srv->functions, i, &func) == SUCCESS
+                && func.plugin == idx && func.plugin_gen == gen
+                && unregister_func(srv->functions, i, func.version) == SUCCESS)
+            cache_invalidate(srv->cache, i);
+    }
+    retire_plugin(srv->plugins, idx);
+}
+
+/* Writes the path of the file named `name` in the plugin directory to
+   `path` (of PATH_MAX bytes). The name can't lead out of the directory.
+ * Returns SUCCESS on success, FAILED otherwise.
+ */
+int plugin_file(rpc_server *srv, char *name, char *path) {
+    if (srv->plugin_dir == NULL || *name == '\0' || strchr(name, '/') != NULL
+            || strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+        return FAILED;
+    int n = snprintf(path, PATH_MAX, "%s/%s", srv->plugin_dir, name);
+    return n > 0 && n < PATH_MAX ? SUCCESS : FAILED;
+}
+
+/* Handler of "rpc.load_plugin" (see rpc_enable_plugin_admin).
+ */
+rpc_data *admin_load_plugin(rpc_data *input) {
+    return admin_plugin_op(input, PLUGIN_LOAD);
+}
+
+/* Handler of "rpc.unload_plugin" (see rpc_enable_plugin_admin).
+ */
+rpc_data *admin_unload_plugin(rpc_data *input) {
+    return admin_plugin_op(input, PLUGIN_UNLOAD);
+}
+
+/* Has the server carry out the admin request (enum PLUGIN_OP) on the
+   plugin file named by the input's data2 (run by a child).
+ * Returns an empty result on success, NULL otherwise.
+ */
+rpc_data *admin_plugin_op(rpc_data *input, int op) {
+    char *name = input->data2;
+    if (plugin_admin_srv == NULL || name == NULL || input->data2_len == 0
+            || input->data2_len > NAME_MAX + 1
+            || name[input->data2_len - 1] != '\0') {
+        print_err(INVALID_INPUT);
+        return NULL;
+    }
+    if (request_plugin_op(plugin_admin_srv->plugins, op, name) == FAILED)
+        return NULL;
+
+    rpc_data *result = create_rpc_data();
+    if (result == NULL)
+        return NULL;
+    result->data1 = 0;
+    result->data2_len = 0;
+    result->data2 = NULL;
+    return result;
+}
+
+
+/* ------------- */
+/*  Client side  */
+/* ------------- */
+
+struct rpc_client {
+    char addr[INET6_ADDRSTRLEN];  // IP address
+    char port[PORT_LEN];          // port number as a string
+    int sockfd;                   // socket for connection
+    int state;                    // open or closed?
+    int timeout_ms;               // for each call, 0 if none
+    int status;                   // enum RPC_STATUS of the last request
+    int fresh;                    // no response on this connection yet?
+    rpc_client_stats stats;       // counters
+    resp_cache *responses;        // cached responses (NULL until opted in)
+    rpc_sock_opts sock_opts;      // of its connections
+    int version;                  // enum RPC_PROTOCOL of its connections
+    uint32_t req_id;              // of its last v2 request
+    frame_reader reader;          // of its v2 connection
+    rpc_mux *mux;                 // connection shared with other clients
+                                  // (NULL if it has its own)
+    int channel;                  // ... and its session's
+    uint32_t casts;               // sent since rpc_cast_failures last asked
+    uint32_t casts_failed;        // ... known to have failed already (v1)
+};
+
+/* Initialises client state */
+/* RETURNS: rpc_client* on success, NULL on error */
+rpc_client *rpc_init_client(char *addr, int port) {
+    // Check input validity
+    if (!addr || check_ip(addr) == FAILED || check_port(port) == FAILED) {
+        print_err(INVALID_INPUT);
+        return NULL;
+    }
+        
+    // Create client
+    rpc_client *cl = malloc(sizeof(*cl));
+    if (!cl) { // malloc failed
+        print_err(MALLOC_FAILED);
+        return NULL;
+    }
+
+    strcpy(cl->addr, addr);
+    snprintf(cl->port, PORT_LEN, "%d", port); // store port number as a string
+    cl->state = CLOSED; // no connection yet
+    cl->timeout_ms = 0;
+    cl->status = RPC_OK;
+    memset(&cl->stats, 0, sizeof(cl->stats));
+    cl->responses = NULL;
+    cl->sock_opts = (rpc_sock_opts)RPC_SOCK_OPTS_DEFAULT;
+    cl->version = RPC_PROTO_V2;
+    cl->req_id = 0;
+    cl->mux = NULL;
+    cl->channel = 0;
+    cl->casts = 0;
+    cl->casts_failed = 0;
+
+    return cl;
+}
+
+/* Initialises a client whose requests go over the connection. It is used
+   as any other (and closed with rpc_close_client), but by one thread at a
+   time, and has no socket options nor version of the protocol of its own
+   (the connection speaks v2, compact if the server agrees). */
+/* RETURNS: rpc_client* on success, NULL on error */
+rpc_client *rpc_mux_client(rpc_mux *mux) {
+    if (mux == NULL) {
+        print_err(INVALID_INPUT);
+        return NULL;
+    }
+    int channel = mux_open_session(mux);
+    if (channel == FAILED)
+        return NULL;
+    rpc_client *cl = calloc(1, sizeof(*cl));
+    if (!cl) { // malloc failed
+        print_err(MALLOC_FAILED);
+        mux_close_session(mux, channel);
+        return NULL;
+    }
+
+    // (its state stays CLOSED: the connection is the mux's)
+    cl->state = CLOSED;
+    cl->status = RPC_OK;
+    cl->sock_opts = (rpc_sock_opts)RPC_SOCK_OPTS_DEFAULT;
+    cl->version = RPC_PROTO_V2;
+    cl->mux = mux;
+    cl->channel = channel;
+    return cl;
+}
+
+/* Finds a remote function by name */
+/* RETURNS: rpc_handle* on success, NULL on error */
+/* rpc_handle* will be freed with a single call to free(3) */
+rpc_handle *rpc_find(rpc_client *cl, char *name) {
     if (cl == NULL || name == NULL || check_name(name) == FAILED) {
         print_err(INVALID_INPUT);
+        if (cl != NULL)
+            cl->status = RPC_ERROR;
         return NULL;
     }
 
+    // the call timeout also bounds how long we wait for the server here
+    if (cl->timeout_ms > 0)
+        set_io_deadline(now_ns() + cl->timeout_ms * NS_PER_MS);
+    rpc_handle *handle = do_find(cl, name);
+    set_io_deadline(NO_DEADLINE);
+
+    return handle;
+}
+
+/* Sends a FIND request for the name and reads the server's response,
+   setting the client's status accordingly.
+ * Returns the handle on success, NULL on error.
+ */
+rpc_handle *do_find(rpc_client *cl, char *name) {
+    cl->status = RPC_ERROR;
+
     // initiate a connection request
-    init_connection(cl);
+    if (init_connection(cl) == FAILED)
+        return NULL;
 
     // send FIND request
-    int n = write_prefix(cl->sockfd, FIND_REQ);
-    if (n <= 0)
-        return NULL;
-    
-    // send name
-    n = write_name(cl->sockfd, name);
-    if (n <= 0)
+    int n;
+    if (cl->version != RPC_PROTO_V1) { // the name is the payload
+        frame_header req = new_request(cl, FIND_REQ);
+        req.payload_len = strlen(name);
+        n = send_request(cl, &req, name);
+    } else {
+        n = write_prefix(cl->sockfd, FIND_REQ);
+        if (n > 0) // send name
+            n = write_name(cl->sockfd, name);
+    }
+    if (n <= 0) {
+        abort_request(cl);
         return NULL;
+    }
     
     // read the server's response
-    int prefix = read_prefix(cl->sockfd);
+    frame_header resp;
+    char *payload;
+    int prefix = read_status(cl, &resp, &payload);
+    free(payload); // none expected
     if (prefix == FAILURE_STAT) { // find failed
         print_err(FUNC_NOT_FOUND);
+        cl->status = RPC_FAILED;
+        cl->fresh = FALSE;
+        return NULL;
+    } else if (prefix == OVERLOADED_STAT) { // server too busy
+        overloaded(cl);
         return NULL;
     } else if (check_prefix(prefix) == FAILED) {  // other errors
+        abort_request(cl);
         return NULL;
     }
     
     // FIND successful -> continue reading for the handle
-    uint32_t func_idx;
-    n = read_u32(cl->sockfd, &func_idx);
-    if (n <= 0)
+    uint32_t func_idx = resp.handle;
+    if (cl->version == RPC_PROTO_V1)
+        n = read_u32(cl->sockfd, &func_idx);
+    if (n <= 0) {
+        abort_request(cl);
         return NULL;
+    }
     // Create the handle based on the target function's index
     rpc_handle *handle = create_rpc_handle(func_idx);
+    cl->fresh = FALSE;
+    if (handle != NULL)
+        cl->status = RPC_OK;
 
     return handle; // either a valid handle or NULL
 }
@@ -386,49 +1869,624 @@ rpc_handle *rpc_find(rpc_client *cl, char *name) {
  * Returns FAILED on error, SUCCESS otherwise.
  */
 int init_connection(rpc_client *cl) {
+    if (cl->mux != NULL) // (shared, see rpc_mux.h)
+        return mux_connect(cl->mux);
     if (cl->state == OPEN) // we can keep using the current socket
         return SUCCESS;
     
-    int sockfd = connect_to_server(cl->addr, cl->port);
+    int sockfd = connect_to_server(cl->addr, cl->port, &cl->sock_opts);
     if (sockfd == FAILED)
         return FAILED;
     
     cl->sockfd = sockfd;
     cl->state = OPEN;
+    cl->fresh = TRUE;
+    init_reader(&cl->reader, sockfd);
+    if (cl->version != RPC_PROTO_V1)
+        return say_hello(cl);
     return SUCCESS;
 }
 
+/* Opens a v2 connection with a HELLO round trip, which also asks for
+   compact headers if the client wants them. A server that only speaks v1
+   drops the connection on it, in which case the client goes back to v1
+   (for good) on a new connection.
+ * Returns FAILED on error, SUCCESS otherwise.
+ */
+int say_hello(rpc_client *cl) {
+    frame_header req = new_request(cl, HELLO_REQ), resp;
+    char buf[FRAME_HEADER_SIZE];
+    if (COMPACT(cl))
+        req.flags |= FRAME_COMPACT;
+    int n = write_frame(cl->sockfd, &req, NULL, FALSE);
+    rearm_quickack(cl->sockfd, &cl->sock_opts);
+    if (n > 0) // a v1 prefix, or the start of a frame
+        n = read_all(cl->sockfd, buf, U32_SIZE);
+
+    if (n > 0 && !is_frame(buf)) {
+        uint32_t prefix;
+        memcpy(&prefix, buf, U32_SIZE);
+        if (ntohl(prefix) == OVERLOADED_STAT) { // whole connection turned away
+            overloaded(cl);
+            return FAILED;
+        }
+        n = FAILED;
+    } else if (n > 0) {
+        n = read_header(cl->sockfd, buf, U32_SIZE, &resp);
+    }
+
+    if (n > 0 && (resp.type != SUCCESS_STAT || resp.req_id != req.req_id)) {
+        print_err(INVALID_FRAME);
+        n = FAILED;
+    }
+    if (n > 0) {
+        if (!(resp.flags & FRAME_COMPACT)) // not agreed to
+            cl->version = RPC_PROTO_V2;
+        cl->fresh = FALSE;
+        return SUCCESS;
+    }
+    if (io_deadline_passed()) {
+        abort_request(cl);
+        return FAILED;
+    }
+
+    // not understood -> v1 it is
+    close_connection(cl);
+    cl->version = RPC_PROTO_V1;
+    return init_connection(cl);
+}
+
+/* Closes the client's connection without telling the server, e.g. because
+   it is in the middle of a request that can't be completed.
+ * The next request opens a new connection.
+ */
+void close_connection(rpc_client *cl) {
+    if (cl->mux != NULL) { // only the request is given up on
+        mux_cancel(cl->mux, cl->channel);
+        return;
+    }
+    if (cl->state == CLOSED)
+        return;
+    count_conn_bytes(cl, &cl->stats);
+    close(cl->sockfd);
+    cl->state = CLOSED;
+}
+
+/* Adds the bytes sent and received over the client's connection to the
+   counters.
+ */
+void count_conn_bytes(rpc_client *cl, rpc_client_stats *stats) {
+    uint64_t sent, received;
+    if (conn_bytes(cl->sockfd, &sent, &received) == SUCCESS) {
+        stats->bytes_sent += sent;
+        stats->bytes_received += received;
+    }
+}
+
+/* Returns the header of a new v2 request of the client, of the given type
+   (enum PREFIX).
+ */
+frame_header new_request(rpc_client *cl, int type) {
+    frame_header req = {.type = type, .req_id = ++cl->req_id};
+    return req;
+}
+
+/* Sends the v2 request of the client, on its session if its connection is
+   shared (the payload is then kept until the response is read).
+ * Returns SUCCESS on success, FAILED on failure,
+   or EMPTY if a write() returned 0.
+ */
+int send_request(rpc_client *cl, frame_header *req, char *payload) {
+    if (cl->mux != NULL)
+        return mux_send(cl->mux, cl->channel, req, payload, FALSE);
+    return write_frame(cl->sockfd, req, payload, COMPACT(cl));
+}
+
+/* Reads the status of the server's response to the request in progress.
+ * With v2, the whole response is read, into `resp` and `payload` (NULL if
+   there is none); with v1, what follows the status is left to the caller.
+ * Returns the status (enum REQ_STATUS) on success;
+ * Returns FAILED on failure, or EMPTY if a read() read nothing.
+ */
+int read_status(rpc_client *cl, frame_header *resp, char **payload) {
+    *payload = NULL;
+    int n;
+    if (cl->mux != NULL) { // read by the connection's thread
+        n = mux_wait(cl->mux, cl->channel, resp, payload);
+    } else {
+        rearm_quickack(cl->sockfd, &cl->sock_opts);
+        if (cl->version == RPC_PROTO_V1)
+            return read_prefix(cl->sockfd);
+        n = next_frame(&cl->reader, COMPACT(cl), resp, payload);
+    }
+    if (n <= 0)
+        return n;
+    if (!(resp->flags & FRAME_RESPONSE) || resp->req_id != cl->req_id) {
+        print_err(INVALID_FRAME);
+        free(*payload);
+        *payload = NULL;
+        return FAILED;
+    }
+    return resp->type;
+}
+
+/* Gives up on the request in progress after an I/O error, or because its
+   deadline has passed. The server's response could no longer be told apart
+   from the next one, so the connection is dropped.
+ */
+void abort_request(rpc_client *cl) {
+    if (io_deadline_passed()) {
+        print_err(DEADLINE_EXCEEDED);
+        cl->status = RPC_DEADLINE_EXCEEDED;
+    } else {
+        cl->status = RPC_ERROR;
+    }
+    close_connection(cl);
+}
+
+/* Handles an OVERLOADED_STAT response to the request in progress.
+ * If it is the first response on the connection, the server turned the
+   whole connection away and has closed it, so it is dropped here too.
+ */
+void overloaded(rpc_client *cl) {
+    print_err(SERVER_OVERLOADED);
+    cl->status = RPC_OVERLOADED;
+    if (cl->fresh)
+        close_connection(cl);
+}
+
 /* Calls remote function using handle */
 /* RETURNS: rpc_data* on success, NULL on error */
 rpc_data *rpc_call(rpc_client *cl, rpc_handle *h, rpc_data *payload) {
-    if (cl == NULL || h == NULL || check_rpc_data(payload) == FAILED) {
+    if (cl == NULL) {
         print_err(INVALID_INPUT);
         return NULL;
     }
+    return rpc_call_timeout(cl, h, payload, cl->timeout_ms);
+}
 
-    // send request
-    int n = write_prefix(cl->sockfd, CALL_REQ);
-    if (n <= 0) 
+/* Calls remote function using handle, giving up after `timeout_ms`
+   milliseconds (0 for no timeout). The deadline is also sent to the server,
+   which skips the call if it only gets to it once the deadline has passed. */
+/* RETURNS: rpc_data* on success, NULL on error */
+rpc_data *rpc_call_timeout(rpc_client *cl, rpc_handle *h, rpc_data *payload,
+                           int timeout_ms) {
+    if (cl == NULL || h == NULL || timeout_ms < 0
+            || check_rpc_data(payload) == FAILED) {
+        print_err(INVALID_INPUT);
+        if (cl != NULL)
+            cl->status = RPC_ERROR;
         return NULL;
-    // send handle
-    n = write_u32(cl->sockfd, h->idx);
-    if (n <= 0)
+    }
+    cl->stats.calls++;
+
+    // a fresh enough response needs no round trip
+    rpc_data *cached = resp_cache_lookup(cl->responses, h->idx, payload);
+    if (cached != NULL) {
+        cl->status = RPC_OK;
+        return cached;
+    }
+
+    // every read/write of this call gives up at the deadline
+    uint64_t deadline = NO_DEADLINE;
+    if (timeout_ms > 0)
+        deadline = now_ns() + timeout_ms * NS_PER_MS;
+    set_io_deadline(deadline);
+    rpc_data *result = do_call(cl, h, payload, deadline);
+    set_io_deadline(NO_DEADLINE);
+
+    if (result == NULL)
+        count_failure(cl);
+    else
+        resp_cache_insert(cl->responses, h->idx, payload, result);
+    return result;
+}
+
+/* Sends a CALL request (with the deadline, unless NO_DEADLINE) and reads
+   the server's response, setting the client's status accordingly.
+ * Returns the result on success, NULL on error.
+ */
+rpc_data *do_call(rpc_client *cl, rpc_handle *h, rpc_data *payload,
+                  uint64_t deadline) {
+    if (send_call_req(cl, h, payload, deadline) == FAILED)
         return NULL;
+    return read_call_resp(cl);
+}
+
+/* Sends a CALL request, without waiting for the response (hedging sends
+   the same call on two connections, then reads whichever answers first).
+ * Returns the socket the response will arrive on, FAILED on error.
+ */
+int start_call(rpc_client *cl, rpc_handle *h, rpc_data *payload) {
+    if (cl == NULL || h == NULL || check_rpc_data(payload) == FAILED) {
+        print_err(INVALID_INPUT);
+        if (cl != NULL)
+            cl->status = RPC_ERROR;
+        return FAILED;
+    }
+    cl->stats.calls++;
+    if (send_call_req(cl, h, payload, NO_DEADLINE) == FAILED) {
+        count_failure(cl);
+        return FAILED;
+    }
+    return cl->sockfd;
+}
+
+/* Reads the response to the call sent by start_call.
+ * Returns the result on success, NULL on error.
+ */
+rpc_data *finish_call(rpc_client *cl) {
+    rpc_data *result = read_call_resp(cl);
+    if (result == NULL)
+        count_failure(cl);
+    return result;
+}
+
+/* Gives up on the call sent by start_call: its response is not wanted, and
+   could not be told apart from the next one, so the connection is dropped
+   (the next request opens a new one).
+ */
+void drop_call(rpc_client *cl) {
+    close_connection(cl);
+}
+
+/* Sends a CALL request (with the deadline, unless NO_DEADLINE), setting
+   the client's status to RPC_ERROR until its response is read.
+ * Returns SUCCESS on success, FAILED otherwise.
+ */
+int send_call_req(rpc_client *cl, rpc_handle *h, rpc_data *payload,
+                  uint64_t deadline) {
+    cl->status = RPC_ERROR;
+    if (init_connection(cl) == FAILED) // e.g. dropped after a timeout
+        return FAILED;
+
+    // send request
+    int n;
+    if (cl->version != RPC_PROTO_V1) { // data2 is the payload
+        frame_header req = call_request(cl, CALL_REQ, h, payload, deadline);
+        n = send_request(cl, &req, payload->data2);
+        if (n <= 0) {
+            abort_request(cl);
+            return FAILED;
+        }
+        return SUCCESS;
+    }
+
+    if (deadline == NO_DEADLINE) {
+        n = write_prefix(cl->sockfd, CALL_REQ);
+    } else { // along with what's left of the time budget
+        n = write_prefix(cl->sockfd, CALL_DL_REQ);
+        if (n > 0)
+            n = write_u32(cl->sockfd, ms_until(deadline));
+    }
+    // send handle
+    if (n > 0)
+        n = write_u32(cl->sockfd, h->idx);
     // send the data
-    n = write_rpc_data(cl->sockfd, payload);
-    if (n <= 0)
-        return NULL;
+    if (n > 0)
+        n = write_rpc_data(cl->sockfd, payload);
+    if (n <= 0) {
+        abort_request(cl);
+        return FAILED;
+    }
+    return SUCCESS;
+}
 
-    // read response
-    int prefix = read_prefix(cl->sockfd);
+/* Makes the v2 CALL or CAST request (`type`) of the call, with the deadline
+   (unless NO_DEADLINE); data2 is its payload.
+ * Returns the header of the request.
+ */
+frame_header call_request(rpc_client *cl, int type, rpc_handle *h,
+                          rpc_data *payload, uint64_t deadline) {
+    frame_header req = new_request(cl, type);
+    req.handle = h->idx;
+    req.data1 = payload->data1;
+    req.payload_len = payload->data2_len;
+    if (deadline != NO_DEADLINE) {
+        req.flags |= FRAME_DEADLINE;
+        req.budget_ms = ms_until(deadline);
+    }
+    return req;
+}
+
+/* Reads the server's response to a CALL request, setting the client's
+   status accordingly.
+ * Returns the result on success, NULL on error.
+ */
+rpc_data *read_call_resp(rpc_client *cl) {
+    frame_header resp;
+    char *payload;
+    int prefix = read_status(cl, &resp, &payload);
+    if (prefix != SUCCESS_STAT) // none expected
+        free(payload);
     if (prefix == FAILURE_STAT) { // call failed
         print_err(CALL_FAILED);
+        cl->status = RPC_FAILED;
+        cl->fresh = FALSE;
+        return NULL;
+    } else if (prefix == EXPIRED_STAT) { // server got it too late
+        print_err(DEADLINE_EXCEEDED);
+        cl->status = RPC_DEADLINE_EXCEEDED;
+        cl->fresh = FALSE;
+        return NULL;
+    } else if (prefix == OVERLOADED_STAT) { // server too busy
+        overloaded(cl);
         return NULL;
     } else if (check_prefix(prefix) == FAILED) { // other errors
+        abort_request(cl);
         return NULL;
     }
     
-    return read_rpc_data(cl->sockfd); // either a valid (rpc_data *) or NULL
+    rpc_data *result;
+    if (cl->version == RPC_PROTO_V1) {
+        result = read_rpc_data(cl->sockfd);
+    } else if ((result = create_rpc_data()) != NULL) {
+        result->data1 = resp.data1;
+        result->data2_len = resp.payload_len;
+        result->data2 = payload;
+        payload = NULL;
+    }
+    free(payload); // if it could not be kept
+    if (result == NULL) {
+        abort_request(cl);
+        return NULL;
+    }
+    cl->fresh = FALSE;
+    cl->status = RPC_OK;
+    return result;
+}
+
+/* Calls remote function using handle, without waiting for its result: the
+   server sends none back, so this returns once the request is written (or
+   queued, on a multiplexed connection). Whether the call failed is only
+   told by rpc_cast_failures. The deadline of rpc_call applies to the
+   write, and is sent along as with rpc_call. A v1 server knows no casts:
+   the call is then made as with rpc_call, its result dropped. */
+/* RETURNS: -1 on failure */
+int rpc_cast(rpc_client *cl, rpc_handle *h, rpc_data *payload) {
+    if (cl == NULL || h == NULL || check_rpc_data(payload) == FAILED) {
+        print_err(INVALID_INPUT);
+        if (cl != NULL)
+            cl->status = RPC_ERROR;
+        return FAILED;
+    }
+    cl->stats.casts++;
+
+    uint64_t deadline = NO_DEADLINE;
+    if (cl->timeout_ms > 0)
+        deadline = now_ns() + cl->timeout_ms * NS_PER_MS;
+    set_io_deadline(deadline);
+    int res = send_cast_req(cl, h, payload, deadline);
+    set_io_deadline(NO_DEADLINE);
+    return res;
+}
+
+/* Sends a CAST request (with the deadline, unless NO_DEADLINE), or makes
+   the call on a v1 connection, setting the client's status.
+ * Returns SUCCESS on success, FAILED if the request could not be sent.
+ */
+int send_cast_req(rpc_client *cl, rpc_handle *h, rpc_data *payload,
+                  uint64_t deadline) {
+    cl->status = RPC_ERROR;
+    if (init_connection(cl) == FAILED)
+        return FAILED;
+
+    if (cl->version == RPC_PROTO_V1) { // (its failure is known right away)
+        rpc_data *result = do_call(cl, h, payload, deadline);
+        if (result == NULL && cl->status != RPC_FAILED
+                && cl->status != RPC_DEADLINE_EXCEEDED)
+            return FAILED; // not made at all
+        if (result == NULL)
+            cl->casts_failed++;
+        rpc_data_free(result);
+        cl->status = RPC_OK;
+        return SUCCESS;
+    }
+
+    frame_header req = call_request(cl, CAST_REQ, h, payload, deadline);
+    int n = send_request(cl, &req, payload->data2);
+    if (n <= 0) {
+        abort_request(cl);
+        return FAILED;
+    }
+    // no response to wait for: what is left to send of the payload is
+    // copied, the caller may free it
+    if (cl->mux != NULL)
+        mux_cancel(cl->mux, cl->channel);
+    cl->casts++;
+    cl->status = RPC_OK;
+    return SUCCESS;
+}
+
+/* Tells how many of the client's casts since the last time it asked (or
+   since it was made) failed: made a round trip after them, the server
+   having handled all of them by then. A cast lost with its connection (or
+   turned away, like a call) counts as failed. Asking every so often
+   (e.g. every N casts) is an acknowledgement of all of them. */
+/* RETURNS: the number of failed casts, -1 on failure */
+int rpc_cast_failures(rpc_client *cl) {
+    if (cl == NULL) {
+        print_err(INVALID_INPUT);
+        return FAILED;
+    }
+    uint32_t run = 0, failed = 0;
+    if (cl->casts > 0) {
+        if (cl->timeout_ms > 0)
+            set_io_deadline(now_ns() + cl->timeout_ms * NS_PER_MS);
+        int res = ask_casts(cl, &run, &failed);
+        set_io_deadline(NO_DEADLINE);
+        if (res == FAILED) // (they count as lost if it's gone)
+            return FAILED;
+    }
+
+    uint32_t lost = run < cl->casts ? cl->casts - run : 0;
+    uint32_t failures = cl->casts_failed + failed + lost;
+    cl->casts = 0;
+    cl->casts_failed = 0;
+    cl->stats.cast_failures += failures;
+    return failures;
+}
+
+/* Asks the server how the client's casts went, with a PING: how many of
+   them it made since the last PING (`run`), and how many of those failed
+   (`failed`). Those of a connection no longer open are lost: none were
+   made on the new one.
+ * Returns SUCCESS on success, FAILED on failure.
+ */
+int ask_casts(rpc_client *cl, uint32_t *run, uint32_t *failed) {
+    cl->status = RPC_ERROR;
+    if (init_connection(cl) == FAILED)
+        return FAILED;
+    if (cl->version == RPC_PROTO_V1) { // (no casts were made on it)
+        cl->status = RPC_OK;
+        return SUCCESS;
+    }
+
+    frame_header req = new_request(cl, PING_REQ), resp;
+    char *payload = NULL;
+    int prefix = send_request(cl, &req, NULL);
+    if (prefix > 0)
+        prefix = read_status(cl, &resp, &payload);
+    free(payload); // none expected
+    if (prefix == OVERLOADED_STAT) { // connection turned away
+        overloaded(cl);
+        return FAILED;
+    } else if (prefix != SUCCESS_STAT) {
+        abort_request(cl);
+        return FAILED;
+    }
+    *run = resp.data1;
+    *failed = resp.handle;
+    cl->fresh = FALSE;
+    cl->status = RPC_OK;
+    return SUCCESS;
+}
+
+/* Counts a call that did not return a result, by the client's status.
+ */
+void count_failure(rpc_client *cl) {
+    cl->stats.failures++;
+    if (cl->status == RPC_DEADLINE_EXCEEDED)
+        cl->stats.deadline_misses++;
+    else if (cl->status == RPC_OVERLOADED)
+        cl->stats.overloaded++;
+}
+
+/* Connects to the server now (rather than on the first request) and makes
+   a round trip, so that the first rpc_find / rpc_call doesn't pay for the
+   TCP handshake nor for the server setting up the connection. */
+/* RETURNS: -1 on failure */
+int rpc_connect(rpc_client *cl) {
+    if (cl == NULL) {
+        print_err(INVALID_INPUT);
+        return FAILED;
+    }
+    if (cl->timeout_ms > 0)
+        set_io_deadline(now_ns() + cl->timeout_ms * NS_PER_MS);
+
+    // the server only answers once it has forked the connection's process
+    // (with v2, opening the connection takes a round trip already)
+    int res = FAILED;
+    if (init_connection(cl) == SUCCESS && cl->version != RPC_PROTO_V1) {
+        res = SUCCESS;
+    } else if (cl->state == OPEN && write_prefix(cl->sockfd, PING_REQ) > 0) {
+        int prefix = read_prefix(cl->sockfd);
+        if (prefix == SUCCESS_STAT) {
+            cl->fresh = FALSE;
+            res = SUCCESS;
+        } else if (prefix == OVERLOADED_STAT) {
+            overloaded(cl);
+        } else {
+            abort_request(cl);
+        }
+    } else if (cl->state == OPEN) {
+        abort_request(cl);
+    }
+    set_io_deadline(NO_DEADLINE);
+    return res;
+}
+
+/* Sets the options of the client's sockets, applied to its connection
+   right away if it has one */
+/* RETURNS: -1 on failure */
+int rpc_set_client_sock_opts(rpc_client *cl, const rpc_sock_opts *opts) {
+    if (cl == NULL || opts == NULL || cl->mux != NULL) {
+        print_err(INVALID_INPUT);
+        return FAILED;
+    }
+    cl->sock_opts = *opts;
+    if (cl->state == OPEN)
+        return apply_sock_opts(cl->sockfd, opts);
+    return SUCCESS;
+}
+
+/* Sets the version of the protocol (enum RPC_PROTOCOL) spoken by the
+   client from its next connection on. It is RPC_PROTO_V2 by default, and
+   goes back to RPC_PROTO_V1 by itself if the server doesn't speak v2;
+   servers speak both. RPC_PROTO_V2_COMPACT asks each server for varint
+   headers (most small calls then take under 10 bytes of header instead of
+   32), going back to RPC_PROTO_V2 if it doesn't agree. */
+/* RETURNS: -1 on failure */
+int rpc_set_protocol(rpc_client *cl, int version) {
+    if (cl == NULL || cl->mux != NULL
+            || version < RPC_PROTO_V1 || version > RPC_PROTO_V2_COMPACT) {
+        print_err(INVALID_INPUT);
+        return FAILED;
+    }
+    cl->version = version;
+    return SUCCESS;
+}
+
+/* Sets the timeout used by rpc_call, in milliseconds (0 for none) */
+/* RETURNS: -1 on failure */
+int rpc_set_call_timeout(rpc_client *cl, int timeout_ms) {
+    if (cl == NULL || timeout_ms < 0) {
+        print_err(INVALID_INPUT);
+        return FAILED;
+    }
+    cl->timeout_ms = timeout_ms;
+    return SUCCESS;
+}
+
+/* RETURNS: the enum RPC_STATUS of the client's last rpc_find / rpc_call */
+int rpc_last_status(rpc_client *cl) {
+    if (cl == NULL)
+        return RPC_ERROR;
+    return cl->status;
+}
+
+/* Copies the client's counters to `stats`.
+ * RETURNS: -1 on failure */
+int rpc_get_client_stats(rpc_client *cl, rpc_client_stats *stats) {
+    if (cl == NULL || stats == NULL) {
+        print_err(INVALID_INPUT);
+        return FAILED;
+    }
+    *stats = cl->stats;
+    if (cl->state == OPEN) // not counted until it's closed
+        count_conn_bytes(cl, stats);
+    resp_cache_get_stats(cl->responses, &stats->cache_hits,
+                         &stats->cache_misses);
+    return SUCCESS;
+}
+
+/* Caches the responses of the function for `ttl_ms` milliseconds (0 to
+   stop caching them), in at most `max_bytes`. */
+/* RETURNS: -1 on failure */
+int rpc_cache_responses(rpc_client *cl, rpc_handle *h, int ttl_ms,
+                        size_t max_bytes) {
+    if (cl == NULL || h == NULL || ttl_ms < 0) {
+        print_err(INVALID_INPUT);
+        return FAILED;
+    }
+    if (cl->responses == NULL) {
+        if (ttl_ms == 0) // nothing cached anyway
+            return SUCCESS;
+        cl->responses = create_resp_cache();
+        if (cl->responses == NULL)
+            return FAILED;
+    }
+    return resp_cache_configure(cl->responses, h->idx, ttl_ms, max_bytes);
 }
 
 /* Cleans up client state and closes client */
@@ -437,13 +2495,21 @@ void rpc_close_client(rpc_client *cl) {
         return;
     if (cl->state == OPEN) {
         // Tell the server: "I'm closing"
-        write_prefix(cl->sockfd, CLOSE_REQ);
+        if (cl->version != RPC_PROTO_V1) {
+            frame_header req = new_request(cl, CLOSE_REQ);
+            write_frame(cl->sockfd, &req, NULL, COMPACT(cl));
+        } else {
+            write_prefix(cl->sockfd, CLOSE_REQ);
+        }
         // We can close without checking the write here
         // Server closes the connection anyway if it finds nothing to read
         close(cl->sockfd);
         cl->state = CLOSED;
     }
+    if (cl->mux != NULL) // (the connection stays, for the others)
+        mux_close_session(cl->mux, cl->channel);
 
+    free_resp_cache(cl->responses);
     free(cl);
     cl = NULL;
 }
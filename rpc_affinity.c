@@ -0,0 +1,160 @@
+#define _GNU_SOURCE // cpu_set_t, sched_setaffinity
+#include "rpc_affinity.h"
+#include "rpc_ext.h"
+#include "rpc_safety.h"
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+
+struct cpu_pinning {
+    int policy;             // enum RPC_PIN_POLICY
+    cpu_set_t cpus;         // those the children are pinned to
+    int next;               // the next one in turn (round robin)
+    cpu_set_t unpinned;     // the server's own, before pin_server
+    int server_pinned;      // TRUE once the server was pinned
+};
+
+/******* Private functions *******/
+int next_cpu(cpu_pinning *p);
+
+
+/* Creates the pinning of nothing (the server's CPUs being those it may run
+   on now).
+ * Returns it on success, NULL otherwise.
+ */
+cpu_pinning *create_pinning(void) {
+    cpu_pinning *p = malloc(sizeof(*p));
+    if (p == NULL) {
+        print_err(MALLOC_FAILED);
+        return NULL;
+    }
+    p->policy = RPC_PIN_NONE;
+    p->next = 0;
+    p->server_pinned = FALSE;
+    if (sched_getaffinity(0, sizeof(cpu_set_t), &p->unpinned) < 0) {
+        perror("sched_getaffinity");
+        free(p);
+        return NULL;
+    }
+    p->cpus = p->unpinned;
+    return p;
+}
+
+/* Sets the policy (enum RPC_PIN_POLICY) and the CPUs of the children (the
+   `n` ones at `cpus`, or those the server may run on if NULL).
+ * Returns SUCCESS on success, FAILED if any of them is invalid.
+ */
+int set_pinning(cpu_pinning *p, int policy, const int *cpus, int n) {
+    if (policy < RPC_PIN_NONE || policy > RPC_PIN_INCOMING
+            || (cpus != NULL && n <= 0)) {
+        print_err(INVALID_INPUT);
+        return FAILED;
+    }
+
+    cpu_set_t set;
+    if (cpus == NULL) {
+        set = p->unpinned;
+    } else {
+        CPU_ZERO(&set);
+        for (int i = 0; i < n; i++) {
+            // (only those the server may run on: the kernel won't allow
+            // any other)
+            if (cpus[i] < 0 || cpus[i] >= CPU_SETSIZE
+                    || !CPU_ISSET(cpus[i], &p->unpinned)) {
+                print_err(INVALID_INPUT);
+                return FAILED;
+            }
+            CPU_SET(cpus[i], &set);
+        }
+    }
+    p->policy = policy;
+    p->cpus = set;
+    p->next = 0;
+    return SUCCESS;
+}
+
+/* Pins the calling process (the server) to the CPU. Its children are
+   pinned by pick_cpu / pin_child, or go back to its former CPUs.
+ * Returns SUCCESS on success, FAILED otherwise.
+ */
+int pin_server(cpu_pinning *p, int cpu) {
+    if (cpu < 0 || cpu >= CPU_SETSIZE || !CPU_ISSET(cpu, &p->unpinned)) {
+        print_err(INVALID_INPUT);
+        return FAILED;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+        perror("sched_setaffinity");
+        return FAILED;
+    }
+    p->server_pinned = TRUE;
+    return SUCCESS;
+}
+
+/* Picks the CPU of the child serving the connection (called by the server,
+   before forking it): the CPU receiving its packets with RPC_PIN_INCOMING,
+   if one of the children's, or else the next one in turn. `*incoming` is
+   set to TRUE if it is the CPU receiving its packets.
+ * Returns the CPU, or NO_CPU if children are not pinned.
+ */
+int pick_cpu(cpu_pinning *p, int sockfd, int *incoming) {
+    *incoming = FALSE;
+    if (p->policy == RPC_PIN_NONE)
+        return NO_CPU;
+
+    if (p->policy == RPC_PIN_INCOMING) {
+        // where the kernel processed its last packet (its first request,
+        // or the handshake): the softirq of the queue of its flow
+        int cpu = NO_CPU;
+        socklen_t len = sizeof(cpu);
+        if (getsockopt(sockfd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) == 0
+                && cpu >= 0 && cpu < CPU_SETSIZE && CPU_ISSET(cpu, &p->cpus)) {
+            *incoming = TRUE;
+            return cpu;
+        }
+    }
+    return next_cpu(p);
+}
+
+/* Pins the calling process (a child, just forked) to the CPU picked for
+   it, or, with NO_CPU, unpins it from the server's CPU (if pinned).
+ * Returns SUCCESS on success, FAILED otherwise.
+ */
+int pin_child(cpu_pinning *p, int cpu) {
+    cpu_set_t set;
+    if (cpu == NO_CPU) {
+        if (!p->server_pinned)
+            return SUCCESS; // runs anywhere the server may, already
+        set = p->unpinned;
+    } else {
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+    }
+    if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+        perror("sched_setaffinity");
+        return FAILED;
+    }
+    return SUCCESS;
+}
+
+/* Frees the pinning.
+ */
+void free_pinning(cpu_pinning *p) {
+    free(p);
+}
+
+/* Returns the next CPU of the children in turn.
+ */
+int next_cpu(cpu_pinning *p) {
+    for (int i = 0; i < CPU_SETSIZE; i++) {
+        int cpu = (p->next + i) % CPU_SETSIZE;
+        if (CPU_ISSET(cpu, &p->cpus)) {
+            p->next = cpu + 1;
+            return cpu;
+        }
+    }
+    return NO_CPU; // (never empty)
+}
@@ -0,0 +1,57 @@
+/*-----------------------------------------------------------------------------
+ * Project 2
+ * rpc_affinity.h :
+              = the interface of the module `rpc_affinity` of the project
+              = placing the server and the children serving its
+                connections on CPUs (and so, on NUMA nodes)
+ ----------------------------------------------------------------------------*/
+
+#ifndef RPC_AFFINITY_H
+#define RPC_AFFINITY_H
+
+#define NO_CPU -1
+
+/* Where the children serving connections go (see rpc_set_cpu_pinning).
+ * Memory is placed by the kernel on the NUMA node of the CPU that first
+   touches it, so a child pinned before it allocates (or writes to) its
+   buffers has them on its own node.
+ */
+typedef struct cpu_pinning cpu_pinning;
+
+/* Creates the pinning of nothing (the server's CPUs being those it may run
+   on now).
+ * Returns it on success, NULL otherwise.
+ */
+cpu_pinning *create_pinning(void);
+
+/* Sets the policy (enum RPC_PIN_POLICY) and the CPUs of the children (the
+   `n` ones at `cpus`, or those the server may run on if NULL).
+ * Returns SUCCESS on success, FAILED if any of them is invalid.
+ */
+int set_pinning(cpu_pinning *p, int policy, const int *cpus, int n);
+
+/* Pins the calling process (the server) to the CPU. Its children are
+   pinned by pick_cpu / pin_child, or go back to its former CPUs.
+ * Returns SUCCESS on success, FAILED otherwise.
+ */
+int pin_server(cpu_pinning *p, int cpu);
+
+/* Picks the CPU of the child serving the connection (called by the server,
+   before forking it): the CPU receiving its packets with RPC_PIN_INCOMING,
+   if one of the children's, or else the next one in turn. `*incoming` is
+   set to TRUE if it is the CPU receiving its packets.
+ * Returns the CPU, or NO_CPU if children are not pinned.
+ */
+int pick_cpu(cpu_pinning *p, int sockfd, int *incoming);
+
+/* Pins the calling process (a child, just forked) to the CPU picked for
+   it, or, with NO_CPU, unpins it from the server's CPU (if pinned).
+ * Returns SUCCESS on success, FAILED otherwise.
+ */
+int pin_child(cpu_pinning *p, int cpu);
+
+/* Frees the pinning.
+ */
+void free_pinning(cpu_pinning *p);
+
+#endif
@@ -0,0 +1,207 @@
+/*-----------------------------------------------------------------------------
+ * Project 2
+ * rpc_array.c :
+              = the implementation of the module `rpc_array` of the project
+ ----------------------------------------------------------------------------*/
+
+#include "rpc_array.h"
+#include "rpc_ext.h"
+#include "rpc_safety.h"
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD
+#endif
+
+_Static_assert(sizeof(array_header) == ARRAY_HEADER_SIZE,
+               "array_header must have no padding");
+
+/******* Private functions *******/
+int read_array_header(rpc_data *data, array_header *hdr);
+#ifdef HAVE_X86_SIMD
+size_t swap_avx2(void *elems, size_t n, size_t size);
+size_t swap_ssse3(void *elems, size_t n, size_t size);
+#endif
+
+
+/* Copies the `n` elements of the type at `elems` to a new data2 of `data`,
+   after a header tagging them (see rpc_array.h). data2 is not freed first.
+ * Returns SUCCESS on success, FAILED on failure.
+ */
+int rpc_data_set_array(rpc_data *data, int type, const void *elems,
+                       size_t n) {
+    size_t size = elem_size(type);
+    if (data == NULL || size == 0 || (n > 0 && elems == NULL)
+        || n > (MAX_DATA2_LEN - ARRAY_HEADER_SIZE) / size) {
+        print_err(INVALID_INPUT);
+        return FAILED;
+    }
+
+    char *buf = malloc(ARRAY_HEADER_SIZE + n * size);
+    if (buf == NULL) {
+        print_err(MALLOC_FAILED);
+        return FAILED;
+    }
+    // the elements go as they are: only a peer of the other order swaps
+    array_header hdr = {.magic = htons(ARRAY_MAGIC), .type = type,
+                        .order = ARRAY_NATIVE, .count = htonl(n)};
+    memcpy(buf, &hdr, ARRAY_HEADER_SIZE);
+    if (n > 0)
+        memcpy(buf + ARRAY_HEADER_SIZE, elems, n * size);
+
+    data->data2 = buf;
+    data->data2_len = ARRAY_HEADER_SIZE + n * size;
+    return SUCCESS;
+}
+
+/* Gets the elements of the array in data2 of `data`, converting them to the
+   host's byte order in place (once) if they are not in it yet.
+ * Returns a pointer to the elements (inside data2), and their number at
+   `n`, on success; NULL if data2 is not an array of the type.
+ */
+void *rpc_data_get_array(rpc_data *data, int type, size_t *n) {
+    array_header hdr;
+    if (n == NULL || read_array_header(data, &hdr) == FAILED
+        || hdr.type != type) {
+        print_err(INVALID_DATA);
+        return NULL;
+    }
+
+    char *elems = (char *)data->data2 + ARRAY_HEADER_SIZE;
+    if (hdr.order != ARRAY_NATIVE) {
+        swap_elems(elems, hdr.count, elem_size(type));
+        // so that getting it again does not swap it back
+        ((array_header *)data->data2)->order = ARRAY_NATIVE;
+    }
+    *n = hdr.count;
+    return elems;
+}
+
+/* Returns the type of the array in data2 of `data` (enum RPC_ELEM_TYPE),
+   or FAILED if data2 is not an array.
+ */
+int rpc_data_array_type(rpc_data *data) {
+    array_header hdr;
+    if (read_array_header(data, &hdr) == FAILED)
+        return FAILED;
+    return hdr.type;
+}
+
+/* Returns the size in bytes of an element of the type (enum RPC_ELEM_TYPE),
+   or 0 if there is no such type.
+ */
+size_t elem_size(int type) {
+    switch (type) {
+        case RPC_I32:
+        case RPC_F32:
+            return 4;
+        case RPC_I64:
+        case RPC_F64:
+            return 8;
+        default:
+            return 0;
+    }
+}
+
+/* Reverses the bytes of each of the `n` elements (of `size` 4 or 8 bytes)
+   at `elems`, in place, with the widest vector instructions the CPU has.
+ */
+void swap_elems(void *elems, size_t n, size_t size) {
+    size_t done = 0;
+#ifdef HAVE_X86_SIMD
+    // vectors for the bulk, the scalar loop for what is left
+    if (__builtin_cpu_supports("avx2"))
+        done = swap_avx2(elems, n, size);
+    else if (__builtin_cpu_supports("ssse3"))
+        done = swap_ssse3(elems, n, size);
+#endif
+    swap_elems_scalar((char *)elems + done * size, n - done, size);
+}
+
+/* Same as swap_elems(), one element at a time.
+ */
+void swap_elems_scalar(void *elems, size_t n, size_t size) {
+    char *p = elems;
+    if (size == 4) {
+        for (size_t i = 0; i < n; i++, p += 4) {
+            uint32_t u;
+            memcpy(&u, p, 4);
+            u = __builtin_bswap32(u);
+            memcpy(p, &u, 4);
+        }
+    } else {
+        for (size_t i = 0; i < n; i++, p += 8) {
+            uint64_t u;
+            memcpy(&u, p, 8);
+            u = __builtin_bswap64(u);
+            memcpy(p, &u, 8);
+        }
+    }
+}
+
+#ifdef HAVE_X86_SIMD
+/* Swaps the elements 32 bytes at a time, while there are 32 bytes left.
+ * Returns the number of elements swapped.
+ */
+__attribute__((target("avx2")))
+size_t swap_avx2(void *elems, size_t n, size_t size) {
+    // the shuffle works within each 16-byte lane, so the mask is repeated
+    __m256i mask = size == 4
+        ? _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8,
+                           15, 14, 13, 12, 3, 2, 1, 0, 7, 6, 5, 4,
+                           11, 10, 9, 8, 15, 14, 13, 12)
+        : _mm256_setr_epi8(7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12,
+                           11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0,
+                           15, 14, 13, 12, 11, 10, 9, 8);
+    char *p = elems;
+    size_t len = n * size, i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((__m256i *)(p + i));
+        _mm256_storeu_si256((__m256i *)(p + i), _mm256_shuffle_epi8(v, mask));
+    }
+    return i / size;
+}
+
+/* Swaps the elements 16 bytes at a time, while there are 16 bytes left.
+ * Returns the number of elements swapped.
+ */
+__attribute__((target("ssse3")))
+size_t swap_ssse3(void *elems, size_t n, size_t size) {
+    __m128i mask = size == 4
+        ? _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8,
+                        15, 14, 13, 12)
+        : _mm_setr_epi8(7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12,
+                        11, 10, 9, 8);
+    char *p = elems;
+    size_t len = n * size, i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((__m128i *)(p + i));
+        _mm_storeu_si128((__m128i *)(p + i), _mm_shuffle_epi8(v, mask));
+    }
+    return i / size;
+}
+#endif
+
+/* Reads (and checks) the header of the array in data2 of `data` to `hdr`,
+   with its fields in host byte order.
+ * Returns SUCCESS on success, FAILED if data2 is not an array.
+ */
+int read_array_header(rpc_data *data, array_header *hdr) {
+    if (data == NULL || data->data2 == NULL
+        || data->data2_len < ARRAY_HEADER_SIZE)
+        return FAILED;
+    memcpy(hdr, data->data2, ARRAY_HEADER_SIZE);
+    hdr->magic = ntohs(hdr->magic);
+    hdr->count = ntohl(hdr->count);
+
+    size_t size = elem_size(hdr->type);
+    if (hdr->magic != ARRAY_MAGIC || size == 0
+        || (hdr->order != ARRAY_LITTLE && hdr->order != ARRAY_BIG)
+        || (data->data2_len - ARRAY_HEADER_SIZE) / size != hdr->count
+        || (data->data2_len - ARRAY_HEADER_SIZE) % size != 0)
+        return FAILED;
+    return SUCCESS;
+}
@@ -0,0 +1,54 @@
+/*-----------------------------------------------------------------------------
+ * Project 2
+ * rpc_array.h :
+              = the interface of the module `rpc_array` of the project
+              = typed arrays carried in data2: a small header tagging the
+                type of the elements and their byte order, and the bulk
+                byte swaps for when the peers' orders differ
+ ----------------------------------------------------------------------------*/
+
+#ifndef RPC_ARRAY_H
+#define RPC_ARRAY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// first bytes of an array's header ("RA")
+#define ARRAY_MAGIC 0x5241
+#define ARRAY_HEADER_SIZE 8
+
+// Byte order of the elements of an array
+enum ARRAY_ORDER {ARRAY_LITTLE = 1, ARRAY_BIG = 2};
+
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define ARRAY_NATIVE ARRAY_BIG
+#else
+#define ARRAY_NATIVE ARRAY_LITTLE
+#endif
+
+/* Header of an array, at the start of data2 (magic and count in network
+   byte order), followed by the elements in the byte order of `order`.
+ * Its size keeps the elements 8-byte aligned in a malloc'd data2.
+ */
+typedef struct {
+    uint16_t magic;         // ARRAY_MAGIC
+    uint8_t type;           // enum RPC_ELEM_TYPE
+    uint8_t order;          // enum ARRAY_ORDER
+    uint32_t count;         // number of elements
+} array_header;
+
+/* Returns the size in bytes of an element of the type (enum RPC_ELEM_TYPE),
+   or 0 if there is no such type.
+ */
+size_t elem_size(int type);
+
+/* Reverses the bytes of each of the `n` elements (of `size` 4 or 8 bytes)
+   at `elems`, in place, with the widest vector instructions the CPU has.
+ */
+void swap_elems(void *elems, size_t n, size_t size);
+
+/* Same as swap_elems(), one element at a time.
+ */
+void swap_elems_scalar(void *elems, size_t n, size_t size);
+
+#endif
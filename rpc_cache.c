@@ -0,0 +1,335 @@
+#include "rpc_cache.h"
+#include "rpc_shared.h"
+#include "rpc_safety.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#define HASH_MUL 0x9E3779B97F4A7C15ULL // 2^64 / golden ratio
+
+typedef struct {
+    uint8_t used;           // holds a result?
+    uint8_t ref;            // CLOCK reference bit
+    uint32_t func;          // index of the function
+    uint64_t version;       // of the function (see func_version)
+    uint64_t hash;          // of the function and input
+    int64_t in_data1;
+    uint32_t in_len;        // input's data2 is at bytes[0]
+    int64_t out_data1;
+    uint32_t out_len;       // result's data2 is at bytes[in_len]
+    char bytes[CACHE_ENTRY_BYTES];
+} cache_entry;
+
+typedef struct {
+    pthread_mutex_t lock;   // process-shared, robust
+    uint8_t hand;           // CLOCK hand
+    cache_entry ways[CACHE_WAYS];
+} cache_set;
+
+struct result_cache {
+    size_t size;            // bytes of the whole mapping
+    size_t n_sets;          // a power of two
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t entries;       // entries in use
+    uint64_t bytes;         // bytes of data2 held by the entries in use
+    cache_set sets[];
+};
+
+/******* Private functions *******/
+uint64_t hash_call(uint32_t func, rpc_data *input);
+cache_set *set_of(result_cache *cache, uint64_t hash);
+int lock_set(result_cache *cache, cache_set *set);
+void unlock_set(cache_set *set);
+int entry_matches(cache_entry *e, uint32_t func, uint64_t version,
+                  uint64_t hash, rpc_data *input);
+cache_entry *victim(cache_set *set);
+void drop_entry(result_cache *cache, cache_entry *e);
+uint64_t mix64(uint64_t x);
+
+
+/* Creates a cache taking at most `max_bytes` of (shared) memory.
+ * Returns the cache on success, NULL otherwise.
+ */
+result_cache *create_result_cache(size_t max_bytes) {
+    if (max_bytes < sizeof(result_cache) + sizeof(cache_set)) {
+        print_err(INVALID_INPUT);
+        return NULL;
+    }
+
+    // largest power of two number of sets that fits
+    size_t n_sets = 1;
+    while (sizeof(result_cache) + 2 * n_sets * sizeof(cache_set)
+            <= max_bytes) {
+        n_sets *= 2;
+    }
+
+    size_t size = sizeof(result_cache) + n_sets * sizeof(cache_set);
+    result_cache *cache = create_shared(size);
+    if (cache == NULL)
+        return NULL;
+    cache->size = size;
+    cache->n_sets = n_sets;
+
+    // a connection dying while holding a set must not block the others
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    for (size_t s = 0; s < n_sets; s++) {
+        pthread_mutex_init(&cache->sets[s].lock, &attr);
+    }
+    pthread_mutexattr_destroy(&attr);
+    return cache;
+}
+
+/* Looks up the result of calling version `version` of function `func`
+   with `input`.
+ * Returns a copy of the result if cached (to free with rpc_data_free),
+   NULL otherwise.
+ */
+rpc_data *cache_lookup(result_cache *cache, uint32_t func, uint64_t version,
+                       rpc_data *input) {
+    if (cache == NULL || input == NULL)
+        return NULL;
+
+    uint64_t hash = hash_call(func, input);
+    cache_set *set = set_of(cache, hash);
+    rpc_data *result = NULL;
+
+    if (lock_set(cache, set) == FAILED) {
+        SHARED_INC(cache->misses);
+        return NULL;
+    }
+    for (int i = 0; i < CACHE_WAYS; i++) {
+        cache_entry *e = &set->ways[i];
+        if (!entry_matches(e, func, version, hash, input))
+            continue;
+
+        // hit -> copy the result out while we hold the set
+        result = malloc(sizeof(*result));
+        void *data2 = e->out_len > 0 ? malloc(e->out_len) : NULL;
+        if (!result || (e->out_len > 0 && !data2)) {
+            print_err(MALLOC_FAILED);
+            free(result);
+            free(data2);
+            result = NULL;
+            break;
+        }
+        result->data1 = e->out_data1;
+        result->data2_len = e->out_len;
+        result->data2 = data2;
+        if (data2 != NULL)
+            memcpy(data2, e->bytes + e->in_len, e->out_len);
+        e->ref = TRUE;
+        break;
+    }
+    unlock_set(set);
+
+    if (result != NULL)
+        SHARED_INC(cache->hits);
+    else
+        SHARED_INC(cache->misses);
+    return result;
+}
+
+/* Stores the result of calling version `version` of function `func` with
+   `input`, evicting an older entry if needed. Results that don't fit in an
+   entry are skipped.
+ */
+void cache_insert(result_cache *cache, uint32_t func, uint64_t version,
+                  rpc_data *input, rpc_data *result) {
+    if (cache == NULL || input == NULL || result == NULL)
+        return;
+    if (input->data2_len + result->data2_len > CACHE_ENTRY_BYTES)
+        return;
+
+    uint64_t hash = hash_call(func, input);
+    cache_set *set = set_of(cache, hash);
+
+    if (lock_set(cache, set) == FAILED)
+        return;
+    // the same call may have been made (and cached) concurrently
+    cache_entry *e = NULL;
+    for (int i = 0; i < CACHE_WAYS && e == NULL; i++) {
+        if (entry_matches(&set->ways[i], func, version, hash, input))
+            e = &set->ways[i];
+    }
+    if (e == NULL)
+        e = victim(set);
+    drop_entry(cache, e);
+
+    e->func = func;
+    e->version = version;
+    e->hash = hash;
+    e->in_data1 = input->data1;
+    e->in_len = input->data2_len;
+    e->out_data1 = result->data1;
+    e->out_len = result->data2_len;
+    if (e->in_len > 0)
+        memcpy(e->bytes, input->data2, e->in_len);
+    if (e->out_len > 0)
+        memcpy(e->bytes + e->in_len, result->data2, e->out_len);
+    e->ref = TRUE;
+    e->used = TRUE;
+    SHARED_INC(cache->entries);
+    SHARED_ADD(cache->bytes, e->in_len + e->out_len);
+    unlock_set(set);
+}
+
+/* Drops every cached result of function `func`.
+ */
+void cache_invalidate(result_cache *cache, uint32_t func) {
+    if (cache == NULL)
+        return;
+    for (size_t s = 0; s < cache->n_sets; s++) {
+        cache_set *set = &cache->sets[s];
+        if (lock_set(cache, set) == FAILED)
+            continue;
+        for (int i = 0; i < CACHE_WAYS; i++) {
+            if (set->ways[i].used && set->ways[i].func == func)
+                drop_entry(cache, &set->ways[i]);
+        }
+        unlock_set(set);
+    }
+}
+
+/* Fills in the cache counters of `stats`.
+ */
+void cache_get_stats(result_cache *cache, rpc_server_stats *stats) {
+    if (cache == NULL || stats == NULL)
+        return;
+    stats->cache_hits = SHARED_LOAD(cache->hits);
+    stats->cache_misses = SHARED_LOAD(cache->misses);
+    stats->cache_entries = SHARED_LOAD(cache->entries);
+    stats->cache_bytes = SHARED_LOAD(cache->bytes);
+    stats->cache_capacity = cache->size;
+}
+
+/* Frees the cache.
+ */
+void free_result_cache(result_cache *cache) {
+    if (cache == NULL)
+        return;
+    for (size_t s = 0; s < cache->n_sets; s++) {
+        pthread_mutex_destroy(&cache->sets[s].lock);
+    }
+    free_shared(cache, cache->size);
+}
+
+/* Returns a 64-bit hash of the `len` bytes at `data`, starting from `seed`.
+ */
+uint64_t hash_bytes(uint64_t seed, const void *data, size_t len) {
+    const unsigned char *p = data;
+    uint64_t h = seed ^ (len * HASH_MUL);
+    uint64_t word;
+
+    // 8 bytes at a time
+    while (len >= sizeof(word)) {
+        memcpy(&word, p, sizeof(word));
+        h = (h ^ word) * HASH_MUL;
+        h ^= h >> 32;
+        p += sizeof(word);
+        len -= sizeof(word);
+    }
+    // and whatever is left
+    word = 0;
+    memcpy(&word, p, len);
+    h = (h ^ word) * HASH_MUL;
+
+    return mix64(h);
+}
+
+
+/* Returns the hash of calling function `func` with `input`.
+ */
+uint64_t hash_call(uint32_t func, rpc_data *input) {
+    // (every bit of data1, whatever its width)
+    uint64_t seed = mix64(func ^ mix64((uint64_t)(int64_t)input->data1));
+    return hash_bytes(seed, input->data2, input->data2_len);
+}
+
+/* Returns the set holding the entries with the given hash.
+ */
+cache_set *set_of(result_cache *cache, uint64_t hash) {
+    return &cache->sets[hash & (cache->n_sets - 1)];
+}
+
+/* Locks the set (held only for a lookup, an insertion or an invalidation).
+   If its holder died, the set is emptied, as its holder may have left an
+   entry half written.
+ * Returns SUCCESS on success, FAILED otherwise.
+ */
+int lock_set(result_cache *cache, cache_set *set) {
+    int err = pthread_mutex_lock(&set->lock);
+    if (err == EOWNERDEAD) {
+        for (int i = 0; i < CACHE_WAYS; i++) {
+            drop_entry(cache, &set->ways[i]);
+        }
+        pthread_mutex_consistent(&set->lock);
+        err = 0;
+    }
+    if (err != 0) {
+        errno = err;
+        print_sys_err("pthread_mutex_lock");
+        return FAILED;
+    }
+    return SUCCESS;
+}
+
+/* Unlocks the set.
+ */
+void unlock_set(cache_set *set) {
+    pthread_mutex_unlock(&set->lock);
+}
+
+/* Returns TRUE if the entry holds the result of calling version `version`
+   of function `func` with `input` (whose hash is `hash`), FALSE otherwise.
+ */
+int entry_matches(cache_entry *e, uint32_t func, uint64_t version,
+                  uint64_t hash, rpc_data *input) {
+    return e->used && e->hash == hash && e->func == func
+        && e->version == version
+        && e->in_data1 == input->data1 && e->in_len == input->data2_len
+        && (e->in_len == 0 || memcmp(e->bytes, input->data2, e->in_len) == 0);
+}
+
+/* Picks the entry of the set to replace: a free one if any, otherwise the
+   first one the CLOCK hand finds not referenced since it last passed.
+ */
+cache_entry *victim(cache_set *set) {
+    for (int i = 0; i < CACHE_WAYS; i++) {
+        if (!set->ways[i].used)
+            return &set->ways[i];
+    }
+    while (TRUE) {
+        cache_entry *e = &set->ways[set->hand];
+        set->hand = (set->hand + 1) % CACHE_WAYS;
+        if (!e->ref)
+            return e;
+        e->ref = FALSE; // second chance
+    }
+}
+
+/* Marks the entry as free (with its set locked).
+ */
+void drop_entry(result_cache *cache, cache_entry *e) {
+    if (!e->used)
+        return;
+    e->used = FALSE;
+    SHARED_DEC(cache->entries);
+    SHARED_ADD(cache->bytes, -(uint64_t)(e->in_len + e->out_len));
+}
+
+/* Scrambles the bits of `x` (the finaliser of MurmurHash3).
+ */
+uint64_t mix64(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
@@ -0,0 +1,68 @@
+/*-----------------------------------------------------------------------------
+ * Project 2
+ * rpc_cache.h :
+              = the interface of the module `rpc_cache` of the project
+              = a bounded cache of the results of cacheable (pure) functions,
+                shared by every connection of the server
+ ----------------------------------------------------------------------------*/
+
+#ifndef RPC_CACHE_H
+#define RPC_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "rpc.h"
+#include "rpc_ext.h"
+
+// bytes of an entry for the input's and result's data2 (bigger: not cached)
+#define CACHE_ENTRY_BYTES 224
+// entries per set; a set is searched (and evicted from) as a whole
+#define CACHE_WAYS 8
+
+/* The cache is split into sets of CACHE_WAYS entries; the hash of a call
+   (function and input) picks its set, and CLOCK evicts within the set.
+ * It lives in shared memory, and each set has its own lock, so the
+   connections only contend when they use the same set. The locks are
+   robust: the set of a connection that died holding it is emptied.
+ * An entry keeps the version of the function it is a result of: once the
+   function is replaced, its older results are never returned.
+ */
+typedef struct result_cache result_cache;
+
+/* Creates a cache taking at most `max_bytes` of (shared) memory.
+ * Returns the cache on success, NULL otherwise.
+ */
+result_cache *create_result_cache(size_t max_bytes);
+
+/* Looks up the result of calling version `version` of function `func`
+   with `input`.
+ * Returns a copy of the result if cached (to free with rpc_data_free),
+   NULL otherwise.
+ */
+rpc_data *cache_lookup(result_cache *cache, uint32_t func, uint64_t version,
+                       rpc_data *input);
+
+/* Stores the result of calling version `version` of function `func` with
+   `input`, evicting an older entry if needed. Results that don't fit in an
+   entry are skipped.
+ */
+void cache_insert(result_cache *cache, uint32_t func, uint64_t version,
+                  rpc_data *input, rpc_data *result);
+
+/* Drops every cached result of function `func`.
+ */
+void cache_invalidate(result_cache *cache, uint32_t func);
+
+/* Fills in the cache counters of `stats`.
+ */
+void cache_get_stats(result_cache *cache, rpc_server_stats *stats);
+
+/* Frees the cache.
+ */
+void free_result_cache(result_cache *cache);
+
+/* Returns a 64-bit hash of the `len` bytes at `data`, starting from `seed`.
+ */
+uint64_t hash_bytes(uint64_t seed, const void *data, size_t len);
+
+#endif
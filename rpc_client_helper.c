@@ -4,12 +4,21 @@
 #include <netdb.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <linux/tcp.h>
+#include "rpc_io_helper.h"
 
-/* Makes a socket connection to the server on the given IP address and port.
+/******* Private functions *******/
+int connect_nonblocking(int sockfd, struct sockaddr *addr, socklen_t len);
+
+/* Makes a socket connection to the server on the given IP address and port,
+   with the given socket options (if not NULL).
  * Returns the file description for the socket on success;
  * Returns FAILURE otherwise.
  */
-int connect_to_server(char *addr, char *port) {
+int connect_to_server(char *addr, char *port, const rpc_sock_opts *opts) {
     int sockfd;
 
     // Create address
@@ -27,11 +36,16 @@ int connect_to_server(char *addr, char *port) {
 
 	// Connect to first valid result
 	for (rp = servinfo; rp != NULL; rp = rp->ai_next) {
-		sockfd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
+		// non-blocking, so that coroutines can wait on it (see rpc_coro)
+		sockfd = socket(rp->ai_family, rp->ai_socktype | SOCK_NONBLOCK,
+		                rp->ai_protocol);
 		if (sockfd == -1)
 			continue;
+		// before connecting, so the buffer sizes apply to the handshake
+		apply_sock_opts(sockfd, opts);
 
-		if (connect(sockfd, rp->ai_addr, rp->ai_addrlen) != -1)
+		if (connect_nonblocking(sockfd, rp->ai_addr, rp->ai_addrlen)
+				== SUCCESS)
 			break; // success
 		
 		close(sockfd);
@@ -44,4 +58,42 @@ int connect_to_server(char *addr, char *port) {
 	}
 
     return sockfd;
-}
\ No newline at end of file
+}
+
+/* Connects the non-blocking socket to the address, waiting with
+   wait_for_fd() until the connection is established.
+ * Returns SUCCESS on success, FAILED otherwise.
+ */
+int connect_nonblocking(int sockfd, struct sockaddr *addr, socklen_t len) {
+	if (connect(sockfd, addr, len) == 0)
+		return SUCCESS;
+	if (errno != EINPROGRESS)
+		return FAILED;
+
+	if (wait_for_fd(sockfd, POLLOUT, -1) != SUCCESS)
+		return FAILED;
+
+	// writable -> the handshake finished, check how it went
+	int err = 0;
+	socklen_t err_len = sizeof(err);
+	if (getsockopt(sockfd, SOL_SOCKET, SO_ERROR, &err, &err_len) < 0
+			|| err != 0)
+		return FAILED;
+	return SUCCESS;
+}
+
+/* Gets the bytes sent (and acknowledged) and received so far over the
+   (TCP) socket, as counted by the kernel.
+ * Returns SUCCESS on success, FAILED otherwise.
+ */
+int conn_bytes(int sockfd, uint64_t *sent, uint64_t *received) {
+	struct tcp_info info;
+	socklen_t len = sizeof(info);
+	if (getsockopt(sockfd, IPPROTO_TCP, TCP_INFO, &info, &len) < 0) {
+		perror("getsockopt");
+		return FAILED;
+	}
+	*sent = info.tcpi_bytes_acked;
+	*received = info.tcpi_bytes_received;
+	return SUCCESS;
+}
@@ -9,12 +9,21 @@
 #ifndef RPC_CLIENT_HELPER_H
 #define RPC_CLIENT_HELPER_H
 
+#include "rpc_ext.h"
+
 /* Yes, short, but extensible. */
 
-/* Makes a socket connection to the server on the given IP address and port.
+/* Makes a socket connection to the server on the given IP address and port,
+   with the given socket options (if not NULL).
  * Returns the file description for the socket on success;
  * Returns FAILURE otherwise.
  */
-int connect_to_server(char *addr, char *port);
+int connect_to_server(char *addr, char *port, const rpc_sock_opts *opts);
+
+/* Gets the bytes sent (and acknowledged) and received so far over the
+   (TCP) socket, as counted by the kernel.
+ * Returns SUCCESS on success, FAILED otherwise.
+ */
+int conn_bytes(int sockfd, uint64_t *sent, uint64_t *received);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,781 @@
+#include "rpc_cluster.h"
+#include "rpc_cache.h"
+#include "rpc_safety.h"
+#include "rpc_io_helper.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <errno.h>
+
+#define NO_BACKEND -1
+#define UNRESOLVED 0 // generation of a handle not resolved on a backend
+#define ID_LEN (INET6_ADDRSTRLEN + 7) // "address:port", with a null byte
+#define NO_HEDGE -1
+#define NO_OUTCOME -1 // of a call dropped before its response
+#define MILLI 1000    // hedge tokens are counted in thousandths
+
+typedef struct {
+    int live;                       // slot in use?
+    uint32_t gen;                   // changes whenever the slot is reused
+    char *addr;
+    int port;
+    rpc_client *idle[MAX_IDLE_CONNS]; // connections not in use
+    int n_idle;
+    int fails;                      // failed calls in a row
+    uint64_t ejected_until;         // out of rotation until then (now_ns)
+    int eject_ms;                   // for how long it is taken out next
+    int probing;                    // a retry after an ejection in progress?
+    rpc_backend_stats stats;
+} backend;
+
+// a point of the ring: keys hashing up to it go to its backend
+typedef struct {
+    uint64_t hash;
+    int backend;
+} ring_point;
+
+struct rpc_cluster {
+    pthread_mutex_t lock;
+    int policy;                     // enum RPC_LB_POLICY
+    backend backends[MAX_BACKENDS];
+    int n_backends;                 // slots used so far
+    uint32_t next_gen;
+    unsigned int seed;              // for RPC_LB_P2C
+    int cursor;                     // where ties start being looked at
+    ring_point ring[MAX_BACKENDS * VNODES]; // sorted by hash
+    int n_points;
+};
+
+struct rpc_cluster_handle {
+    uint32_t idx[MAX_BACKENDS];     // the function's index on each backend
+    uint32_t gen[MAX_BACKENDS];     // ... valid if the backend's generation
+    // hedging (changed with the cluster's lock held)
+    int hedge_delay_ms;             // 0 if off, or RPC_HEDGE_P95
+    int budget_pct;
+    int tokens;                     // hedges that may be sent, in MILLI
+    uint32_t latency_us[LATENCY_SAMPLES]; // of the latest calls
+    int n_samples;                  // calls sampled so far
+    uint32_t p95_us;                // of the samples, updated now and then
+    char name[];
+};
+
+// a call sent to a backend, on a connection taken from its pool
+typedef struct {
+    int backend;
+    uint32_t gen;                   // of the backend when it was picked
+    rpc_client *cl;
+    int sockfd;                     // once sent with start_call
+} attempt;
+
+/******* Private functions *******/
+rpc_data *call_backend(rpc_cluster *cluster, rpc_cluster_handle *h,
+                       rpc_data *payload, const uint64_t *key);
+rpc_data *hedged_call(rpc_cluster *cluster, rpc_cluster_handle *h,
+                      rpc_data *payload, const uint64_t *key, attempt *first,
+                      int delay_ms);
+int begin_attempt(rpc_cluster *cluster, rpc_cluster_handle *h,
+                  const uint64_t *key, int exclude, attempt *a);
+rpc_data *finish_attempt(rpc_cluster *cluster, attempt *a);
+void end_attempt(rpc_cluster *cluster, attempt *a, int status);
+int wait_readable(int sockfd, int timeout_ms);
+attempt *first_answer(attempt *a, attempt *b);
+int hedge_delay(rpc_cluster *cluster, rpc_cluster_handle *h);
+int take_hedge_token(rpc_cluster *cluster, rpc_cluster_handle *h);
+void record_latency(rpc_cluster *cluster, rpc_cluster_handle *h,
+                    uint64_t ns);
+int cmp_u32(const void *a, const void *b);
+int pick_backend(rpc_cluster *cluster, const uint64_t *key, int exclude);
+int is_usable(backend *b, uint64_t now);
+int least_outstanding(rpc_cluster *cluster, int *usable, int n);
+int power_of_two(rpc_cluster *cluster, int *usable, int n);
+int on_ring(rpc_cluster *cluster, uint64_t key, uint64_t now, int exclude);
+void build_ring(rpc_cluster *cluster);
+int cmp_points(const void *a, const void *b);
+void close_idle(backend *b);
+rpc_client *take_conn(rpc_cluster *cluster, int i, uint32_t *gen);
+void put_conn(rpc_cluster *cluster, int i, uint32_t gen, rpc_client *cl);
+int resolve(rpc_cluster_handle *h, int i, uint32_t gen, rpc_client *cl);
+void record_outcome(rpc_cluster *cluster, int i, uint32_t gen, int status);
+
+
+/* Initialises a cluster without backends, picking the backend of each call
+   with the given policy (enum RPC_LB_POLICY) */
+/* RETURNS: rpc_cluster* on success, NULL on error */
+rpc_cluster *rpc_init_cluster(int policy) {
+    if (policy != RPC_LB_LEAST_OUTSTANDING && policy != RPC_LB_P2C
+            && policy != RPC_LB_HASH) {
+        print_err(INVALID_INPUT);
+        return NULL;
+    }
+    rpc_cluster *cluster = calloc(1, sizeof(*cluster));
+    if (cluster == NULL) {
+        print_err(MALLOC_FAILED);
+        return NULL;
+    }
+    pthread_mutex_init(&cluster->lock, NULL);
+    cluster->policy = policy;
+    cluster->next_gen = UNRESOLVED + 1;
+    cluster->seed = (unsigned int)now_ns();
+    return cluster;
+}
+
+/* Adds a backend to the cluster */
+/* RETURNS: the backend's number on success, -1 on error */
+int rpc_cluster_add(rpc_cluster *cluster, char *addr, int port) {
+    if (cluster == NULL || addr == NULL || check_ip(addr) == FAILED
+            || check_port(port) == FAILED) {
+        print_err(INVALID_INPUT);
+        return FAILED;
+    }
+
+    pthread_mutex_lock(&cluster->lock);
+    if (cluster->n_backends == MAX_BACKENDS) {
+        pthread_mutex_unlock(&cluster->lock);
+        print_err(OVERLENGTH);
+        return FAILED;
+    }
+    int i = cluster->n_backends;
+    backend *b = &cluster->backends[i];
+    memset(b, 0, sizeof(*b));
+    b->addr = strdup(addr);
+    if (b->addr == NULL) {
+        pthread_mutex_unlock(&cluster->lock);
+        print_err(MALLOC_FAILED);
+        return FAILED;
+    }
+    b->port = port;
+    b->gen = cluster->next_gen++;
+    b->eject_ms = MIN_EJECT_MS;
+    b->live = TRUE;
+    cluster->n_backends++;
+    build_ring(cluster);
+    pthread_mutex_unlock(&cluster->lock);
+    return i;
+}
+
+/* Removes a backend from the cluster, closing its connections. Calls in
+   progress on it still complete. */
+/* RETURNS: -1 on failure */
+int rpc_cluster_remove(rpc_cluster *cluster, int backend) {
+    if (cluster == NULL || backend < 0) {
+        print_err(INVALID_INPUT);
+        return FAILED;
+    }
+    pthread_mutex_lock(&cluster->lock);
+    if (backend >= cluster->n_backends
+            || !cluster->backends[backend].live) {
+        pthread_mutex_unlock(&cluster->lock);
+        print_err(INVALID_INPUT);
+        return FAILED;
+    }
+    // the slot is not reused, so the backend's numbers stay valid
+    cluster->backends[backend].live = FALSE;
+    close_idle(&cluster->backends[backend]);
+    build_ring(cluster);
+    pthread_mutex_unlock(&cluster->lock);
+    return SUCCESS;
+}
+
+/* Finds a remote function by name, on one of the backends */
+/* RETURNS: rpc_cluster_handle* on success, NULL on error */
+/* rpc_cluster_handle* will be freed with a single call to free(3) */
+rpc_cluster_handle *rpc_cluster_find(rpc_cluster *cluster, char *name) {
+    if (cluster == NULL || name == NULL || check_name(name) == FAILED) {
+        print_err(INVALID_INPUT);
+        return NULL;
+    }
+    rpc_cluster_handle *h = calloc(1, sizeof(*h) + strlen(name) + 1);
+    if (h == NULL) {
+        print_err(MALLOC_FAILED);
+        return NULL;
+    }
+    for (int i = 0; i < MAX_BACKENDS; i++) {
+        h->gen[i] = UNRESOLVED;
+    }
+    strcpy(h->name, name);
+
+    // the name must exist somewhere; the other backends are asked lazily
+    pthread_mutex_lock(&cluster->lock);
+    int i = pick_backend(cluster, NULL, NO_BACKEND);
+    if (i != NO_BACKEND)
+        cluster->backends[i].stats.outstanding++;
+    pthread_mutex_unlock(&cluster->lock);
+    if (i == NO_BACKEND) {
+        print_err(CONNECTION_FAILED);
+        free(h);
+        return NULL;
+    }
+
+    uint32_t gen;
+    rpc_client *cl = take_conn(cluster, i, &gen);
+    int res = resolve(h, i, gen, cl);
+    record_outcome(cluster, i, gen, rpc_last_status(cl));
+    put_conn(cluster, i, gen, cl);
+    if (res == FAILED) {
+        free(h);
+        return NULL;
+    }
+    return h;
+}
+
+/* Calls remote function on the backend picked by the cluster's policy.
+   A backend failing several calls in a row is taken out of rotation, and
+   tried again later with a single call (waiting longer each time). */
+/* RETURNS: rpc_data* on success, NULL on error */
+rpc_data *rpc_cluster_call(rpc_cluster *cluster, rpc_cluster_handle *h,
+                           rpc_data *payload) {
+    if (cluster == NULL || h == NULL || payload == NULL) {
+        print_err(INVALID_INPUT);
+        return NULL;
+    }
+    // with RPC_LB_HASH, the key defaults to data1
+    uint64_t key = (uint64_t)(int64_t)payload->data1;
+    return call_backend(cluster, h, payload, &key);
+}
+
+/* Calls remote function on the backend owning `key` on the ring of a
+   cluster using RPC_LB_HASH (or as rpc_cluster_call, for other policies) */
+/* RETURNS: rpc_data* on success, NULL on error */
+rpc_data *rpc_cluster_call_key(rpc_cluster *cluster, rpc_cluster_handle *h,
+                               rpc_data *payload, uint64_t key) {
+    if (cluster == NULL || h == NULL || payload == NULL) {
+        print_err(INVALID_INPUT);
+        return NULL;
+    }
+    return call_backend(cluster, h, payload, &key);
+}
+
+/* Hedges the calls of the function: a call still unanswered after
+   `delay_ms` milliseconds (or RPC_HEDGE_P95) is sent again, and whichever
+   answers first wins. At most `budget_pct` percent of the calls are
+   hedged. A delay of 0 turns hedging off. */
+/* RETURNS: -1 on failure */
+int rpc_cluster_set_hedging(rpc_cluster *cluster, rpc_cluster_handle *h,
+                            int delay_ms, int budget_pct) {
+    if (cluster == NULL || h == NULL || delay_ms < RPC_HEDGE_P95
+            || budget_pct < 0 || budget_pct > 100) {
+        print_err(INVALID_INPUT);
+        return FAILED;
+    }
+    pthread_mutex_lock(&cluster->lock);
+    h->hedge_delay_ms = delay_ms;
+    h->budget_pct = budget_pct;
+    h->tokens = 0;
+    h->n_samples = 0; // latencies are only sampled for RPC_HEDGE_P95
+    pthread_mutex_unlock(&cluster->lock);
+    return SUCCESS;
+}
+
+/* Copies the counters of the backend to `stats`.
+ * RETURNS: -1 on failure */
+int rpc_get_backend_stats(rpc_cluster *cluster, int backend,
+                          rpc_backend_stats *stats) {
+    if (cluster == NULL || stats == NULL || backend < 0) {
+        print_err(INVALID_INPUT);
+        return FAILED;
+    }
+    pthread_mutex_lock(&cluster->lock);
+    if (backend >= cluster->n_backends
+            || !cluster->backends[backend].live) {
+        pthread_mutex_unlock(&cluster->lock);
+        print_err(INVALID_INPUT);
+        return FAILED;
+    }
+    *stats = cluster->backends[backend].stats;
+    pthread_mutex_unlock(&cluster->lock);
+    return SUCCESS;
+}
+
+/* Closes every connection of the cluster and frees it */
+void rpc_close_cluster(rpc_cluster *cluster) {
+    if (cluster == NULL)
+        return;
+    for (int i = 0; i < cluster->n_backends; i++) {
+        close_idle(&cluster->backends[i]);
+        free(cluster->backends[i].addr);
+    }
+    pthread_mutex_destroy(&cluster->lock);
+    free(cluster);
+}
+
+
+/* Sends the call to the backend picked for it (by `key` if the cluster
+   shards its calls), hedging it if the handle says so.
+ * Returns the result on success, NULL on error.
+ */
+rpc_data *call_backend(rpc_cluster *cluster, rpc_cluster_handle *h,
+                       rpc_data *payload, const uint64_t *key) {
+    attempt a;
+    if (begin_attempt(cluster, h, key, NO_BACKEND, &a) == FAILED)
+        return NULL;
+
+    // the call itself runs without the lock held
+    uint64_t start = now_ns();
+    int delay_ms = hedge_delay(cluster, h);
+    rpc_data *result;
+    if (delay_ms == NO_HEDGE) {
+        struct rpc_handle handle = {.idx = h->idx[a.backend]};
+        result = rpc_call(a.cl, &handle, payload);
+        end_attempt(cluster, &a, rpc_last_status(a.cl));
+    } else {
+        result = hedged_call(cluster, h, payload, key, &a, delay_ms);
+    }
+
+    if (result != NULL)
+        record_latency(cluster, h, now_ns() - start);
+    return result;
+}
+
+/* Sends the call of the attempt `first`, and if it has not been answered
+   after `delay_ms` (and the budget allows it), sends it again to another
+   backend. The first response wins and the other call is dropped.
+ * Returns the result on success, NULL on error.
+ */
+rpc_data *hedged_call(rpc_cluster *cluster, rpc_cluster_handle *h,
+                      rpc_data *payload, const uint64_t *key, attempt *first,
+                      int delay_ms) {
+    struct rpc_handle handle = {.idx = h->idx[first->backend]};
+    first->sockfd = start_call(first->cl, &handle, payload);
+    if (first->sockfd == FAILED) {
+        end_attempt(cluster, first, rpc_last_status(first->cl));
+        return NULL;
+    }
+    if (wait_readable(first->sockfd, delay_ms)
+            || !take_hedge_token(cluster, h))
+        return finish_attempt(cluster, first);
+
+    // too slow -> hedge, on another backend if there is one
+    attempt second;
+    if (begin_attempt(cluster, h, key, first->backend, &second) == FAILED)
+        return finish_attempt(cluster, first);
+    handle.idx = h->idx[second.backend];
+    second.sockfd = start_call(second.cl, &handle, payload);
+    if (second.sockfd == FAILED) {
+        end_attempt(cluster, &second, rpc_last_status(second.cl));
+        return finish_attempt(cluster, first);
+    }
+    pthread_mutex_lock(&cluster->lock);
+    cluster->backends[second.backend].stats.hedges++;
+    pthread_mutex_unlock(&cluster->lock);
+
+    attempt *winner = first_answer(first, &second);
+    attempt *loser = winner == first ? &second : first;
+    rpc_data *result = finish_attempt(cluster, winner);
+    if (result == NULL) { // the other may still answer
+        winner = loser;
+        result = finish_attempt(cluster, winner);
+    } else {
+        // the slow one's response will never be read
+        drop_call(loser->cl);
+        end_attempt(cluster, loser, NO_OUTCOME);
+    }
+
+    if (result != NULL && winner == &second) {
+        pthread_mutex_lock(&cluster->lock);
+        cluster->backends[second.backend].stats.hedge_wins++;
+        pthread_mutex_unlock(&cluster->lock);
+    }
+    return result;
+}
+
+/* Picks a backend for a call (other than `exclude`, if there is another),
+   takes a connection to it, and makes sure the handle is resolved there.
+ * Returns SUCCESS on success, FAILED otherwise (with the attempt ended).
+ */
+int begin_attempt(rpc_cluster *cluster, rpc_cluster_handle *h,
+                  const uint64_t *key, int exclude, attempt *a) {
+    pthread_mutex_lock(&cluster->lock);
+    a->backend = pick_backend(cluster, key, exclude);
+    if (a->backend != NO_BACKEND) {
+        cluster->backends[a->backend].stats.outstanding++;
+        cluster->backends[a->backend].stats.calls++;
+    }
+    pthread_mutex_unlock(&cluster->lock);
+    if (a->backend == NO_BACKEND) {
+        print_err(CONNECTION_FAILED);
+        return FAILED;
+    }
+
+    a->cl = take_conn(cluster, a->backend, &a->gen);
+    if (resolve(h, a->backend, a->gen, a->cl) == FAILED) {
+        end_attempt(cluster, a, rpc_last_status(a->cl));
+        return FAILED;
+    }
+    return SUCCESS;
+}
+
+/* Reads the response to the attempt's call, and ends the attempt.
+ * Returns the result on success, NULL on error.
+ */
+rpc_data *finish_attempt(rpc_cluster *cluster, attempt *a) {
+    rpc_data *result = finish_call(a->cl);
+    end_attempt(cluster, a, rpc_last_status(a->cl));
+    return result;
+}
+
+/* Records the outcome of the attempt's call (enum RPC_STATUS, or
+   NO_OUTCOME) and gives back its connection.
+ */
+void end_attempt(rpc_cluster *cluster, attempt *a, int status) {
+    record_outcome(cluster, a->backend, a->gen, status);
+    put_conn(cluster, a->backend, a->gen, a->cl);
+}
+
+/* Waits up to `timeout_ms` milliseconds (-1 for no limit) for the socket
+   to be readable.
+ * Returns TRUE if it is (or has an error to report), FALSE otherwise.
+ */
+int wait_readable(int sockfd, int timeout_ms) {
+    struct pollfd pfd = {.fd = sockfd, .events = POLLIN};
+    int n;
+    do {
+        n = poll(&pfd, 1, timeout_ms);
+    } while (n < 0 && errno == EINTR);
+    return n != 0;
+}
+
+/* Waits for the first of the two attempts' responses to arrive.
+ * Returns that attempt (`a` if both have).
+ */
+attempt *first_answer(attempt *a, attempt *b) {
+    struct pollfd pfds[2] = {
+        {.fd = a->sockfd, .events = POLLIN},
+        {.fd = b->sockfd, .events = POLLIN}
+    };
+    int n;
+    do {
+        n = poll(pfds, 2, -1);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0 || pfds[0].revents != 0)
+        return a;
+    return b;
+}
+
+/* Adds the handle's share of hedges for one more call to its budget, and
+   finds how long to wait before hedging the call (with a 1 ms minimum).
+ * Returns the delay in milliseconds, NO_HEDGE if the call is not hedged.
+ */
+int hedge_delay(rpc_cluster *cluster, rpc_cluster_handle *h) {
+    int delay_ms = NO_HEDGE;
+    pthread_mutex_lock(&cluster->lock);
+    if (h->hedge_delay_ms != 0) {
+        h->tokens += h->budget_pct * MILLI / 100;
+        if (h->tokens > MAX_HEDGE_TOKENS * MILLI)
+            h->tokens = MAX_HEDGE_TOKENS * MILLI;
+
+        if (h->hedge_delay_ms > 0)
+            delay_ms = h->hedge_delay_ms;
+        else if (h->n_samples >= MIN_LATENCY_SAMPLES) // RPC_HEDGE_P95
+            delay_ms = (h->p95_us + 999) / 1000;
+        if (delay_ms == 0)
+            delay_ms = 1;
+    }
+    pthread_mutex_unlock(&cluster->lock);
+    return delay_ms;
+}
+
+/* Takes a hedge out of the handle's budget.
+ * Returns TRUE if there was one left, FALSE otherwise.
+ */
+int take_hedge_token(rpc_cluster *cluster, rpc_cluster_handle *h) {
+    int ok = FALSE;
+    pthread_mutex_lock(&cluster->lock);
+    if (h->tokens >= MILLI) {
+        h->tokens -= MILLI;
+        ok = TRUE;
+    }
+    pthread_mutex_unlock(&cluster->lock);
+    return ok;
+}
+
+/* Records how long a call of the handle took, updating its p95 every
+   sixteenth call.
+ */
+void record_latency(rpc_cluster *cluster, rpc_cluster_handle *h,
+                    uint64_t ns) {
+    pthread_mutex_lock(&cluster->lock);
+    if (h->hedge_delay_ms == RPC_HEDGE_P95) {
+        uint64_t us = ns / 1000;
+        h->latency_us[h->n_samples % LATENCY_SAMPLES]
+            = us > UINT32_MAX ? UINT32_MAX : us;
+        h->n_samples++;
+        if (h->n_samples == MIN_LATENCY_SAMPLES
+                || (h->n_samples > MIN_LATENCY_SAMPLES
+                    && h->n_samples % 16 == 0)) {
+            int n = h->n_samples < LATENCY_SAMPLES ? h->n_samples
+                                                   : LATENCY_SAMPLES;
+            uint32_t sorted[LATENCY_SAMPLES];
+            memcpy(sorted, h->latency_us, n * sizeof(*sorted));
+            qsort(sorted, n, sizeof(*sorted), cmp_u32);
+            h->p95_us = sorted[n * 95 / 100];
+        }
+    }
+    pthread_mutex_unlock(&cluster->lock);
+}
+
+/* Compares two uint32_t (for qsort).
+ */
+int cmp_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+
+/* Picks the backend of the next call (with the lock held): the one owning
+   `key` on the ring if the cluster shards its calls (and there is a key),
+   otherwise the one picked by the cluster's policy.
+ * Backend `exclude` (or NO_BACKEND) is only picked if no other one can be.
+   Backends out of rotation are only picked once it is time to try them
+   again, or if every backend is out (the one due back first).
+ * Returns the backend's number, NO_BACKEND if the cluster has none.
+ */
+int pick_backend(rpc_cluster *cluster, const uint64_t *key, int exclude) {
+    uint64_t now = now_ns();
+    int usable[MAX_BACKENDS];
+    int n = 0;
+    int due_first = NO_BACKEND;
+
+    for (int i = 0; i < cluster->n_backends; i++) {
+        backend *b = &cluster->backends[i];
+        if (!b->live)
+            continue;
+        if (is_usable(b, now) && i != exclude)
+            usable[n++] = i;
+        if (due_first == NO_BACKEND || b->ejected_until
+                < cluster->backends[due_first].ejected_until)
+            due_first = i;
+    }
+    if (n == 0 && exclude != NO_BACKEND)
+        return exclude; // e.g. a hedge, on another connection
+    if (n == 0) // better to try one than to fail straight away
+        return due_first;
+
+    int i;
+    if (cluster->policy == RPC_LB_HASH && key != NULL)
+        i = on_ring(cluster, *key, now, exclude);
+    else if (cluster->policy == RPC_LB_P2C)
+        i = power_of_two(cluster, usable, n);
+    else
+        i = least_outstanding(cluster, usable, n);
+
+    // a backend back from an ejection gets a single call at first
+    backend *b = &cluster->backends[i];
+    if (b->ejected_until != 0)
+        b->probing = TRUE;
+    return i;
+}
+
+/* Returns TRUE if calls may be sent to the backend, FALSE otherwise.
+ */
+int is_usable(backend *b, uint64_t now) {
+    if (b->ejected_until == 0)
+        return TRUE;
+    return now >= b->ejected_until && !b->probing;
+}
+
+/* Returns the usable backend with the fewest calls in progress, looking at
+   them from a different one each time so ties are spread evenly.
+ */
+int least_outstanding(rpc_cluster *cluster, int *usable, int n) {
+    int start = cluster->cursor++ % n;
+    int best = usable[start];
+    for (int k = 1; k < n; k++) {
+        int i = usable[(start + k) % n];
+        if (cluster->backends[i].stats.outstanding
+                < cluster->backends[best].stats.outstanding)
+            best = i;
+    }
+    return best;
+}
+
+/* Returns the usable backend with the fewer calls in progress out of two
+   picked at random.
+ */
+int power_of_two(rpc_cluster *cluster, int *usable, int n) {
+    int a = usable[rand_r(&cluster->seed) % n];
+    if (n == 1)
+        return a;
+    int b = usable[rand_r(&cluster->seed) % (n - 1)];
+    if (b == a) // pick among the others
+        b = usable[n - 1];
+    return cluster->backends[b].stats.outstanding
+           < cluster->backends[a].stats.outstanding ? b : a;
+}
+
+/* Returns the usable backend owning the key: the one of the first point of
+   the ring at or after the key's hash, skipping the points of backends out
+   of rotation and of `exclude` (their keys go to the next backend, the
+   others stay put).
+ * There must be such a backend.
+ */
+int on_ring(rpc_cluster *cluster, uint64_t key, uint64_t now, int exclude) {
+    uint64_t hash = hash_bytes(0, &key, sizeof(key));
+
+    // first point at or after the hash (wrapping around)
+    int lo = 0, hi = cluster->n_points;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (cluster->ring[mid].hash < hash)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    for (int k = 0; k < cluster->n_points; k++) {
+        int i = cluster->ring[(lo + k) % cluster->n_points].backend;
+        if (i != exclude && is_usable(&cluster->backends[i], now))
+            return i;
+    }
+    return NO_BACKEND; // not reached
+}
+
+/* Places VNODES points of every backend on the ring (with the lock held).
+ * A point's place only depends on its backend's address and port, so a
+   backend added or removed only moves the keys of its own points.
+ */
+void build_ring(rpc_cluster *cluster) {
+    char id[ID_LEN];
+    cluster->n_points = 0;
+    for (int i = 0; i < cluster->n_backends; i++) {
+        backend *b = &cluster->backends[i];
+        b->stats.share_ppm = 0;
+        if (!b->live)
+            continue;
+        int len = snprintf(id, sizeof(id), "%s:%d", b->addr, b->port);
+        for (int v = 0; v < VNODES; v++) {
+            ring_point *p = &cluster->ring[cluster->n_points++];
+            p->hash = hash_bytes(v, id, len);
+            p->backend = i;
+        }
+    }
+    qsort(cluster->ring, cluster->n_points, sizeof(ring_point), cmp_points);
+
+    // the share of the keys of each backend: the arcs ending at its points
+    for (int k = 0; k < cluster->n_points; k++) {
+        uint64_t prev = k > 0 ? cluster->ring[k - 1].hash
+                              : cluster->ring[cluster->n_points - 1].hash;
+        uint64_t arc = cluster->ring[k].hash - prev; // wraps for k = 0
+        cluster->backends[cluster->ring[k].backend].stats.share_ppm
+            += (uint32_t)((arc >> 32) * 1000000 >> 32);
+    }
+}
+
+/* Compares the hashes of two points of the ring (for qsort).
+ */
+int cmp_points(const void *a, const void *b) {
+    uint64_t x = ((const ring_point *)a)->hash;
+    uint64_t y = ((const ring_point *)b)->hash;
+    return (x > y) - (x < y);
+}
+
+/* Closes the idle connections to the backend (with the lock held).
+ */
+void close_idle(backend *b) {
+    for (int j = 0; j < b->n_idle; j++) {
+        rpc_close_client(b->idle[j]);
+    }
+    b->n_idle = 0;
+}
+
+/* Takes an idle connection to the backend, or makes a new one, noting the
+   backend's generation in `gen`.
+ * Returns the connection (NULL if a new one could not be made).
+ */
+rpc_client *take_conn(rpc_cluster *cluster, int i, uint32_t *gen) {
+    backend *b = &cluster->backends[i];
+    pthread_mutex_lock(&cluster->lock);
+    *gen = b->gen;
+    if (b->n_idle > 0) {
+        rpc_client *cl = b->idle[--b->n_idle];
+        pthread_mutex_unlock(&cluster->lock);
+        return cl;
+    }
+    char *addr = strdup(b->addr);
+    int port = b->port;
+    pthread_mutex_unlock(&cluster->lock);
+
+    // connects on its first request
+    rpc_client *cl = addr ? rpc_init_client(addr, port) : NULL;
+    free(addr);
+    return cl;
+}
+
+/* Gives back a connection taken with take_conn, keeping it for later calls
+   unless it failed, there are enough idle ones already, or the backend has
+   changed since.
+ */
+void put_conn(rpc_cluster *cluster, int i, uint32_t gen, rpc_client *cl) {
+    if (cl == NULL)
+        return;
+    backend *b = &cluster->backends[i];
+    pthread_mutex_lock(&cluster->lock);
+    if (b->live && b->gen == gen && b->n_idle < MAX_IDLE_CONNS
+            && rpc_last_status(cl) != RPC_ERROR) {
+        b->idle[b->n_idle++] = cl;
+        cl = NULL;
+    }
+    pthread_mutex_unlock(&cluster->lock);
+    rpc_close_client(cl);
+}
+
+/* Makes sure the handle knows the function's index on backend `i`
+   (of generation `gen`), asking it over the connection if needed.
+ * Returns SUCCESS on success, FAILED otherwise.
+ */
+int resolve(rpc_cluster_handle *h, int i, uint32_t gen, rpc_client *cl) {
+    if (cl == NULL)
+        return FAILED;
+    if (__atomic_load_n(&h->gen[i], __ATOMIC_ACQUIRE) == gen)
+        return SUCCESS;
+
+    rpc_handle *found = rpc_find(cl, h->name);
+    if (found == NULL)
+        return FAILED;
+    // threads resolving it at once all store the same index
+    __atomic_store_n(&h->idx[i], found->idx, __ATOMIC_RELAXED);
+    __atomic_store_n(&h->gen[i], gen, __ATOMIC_RELEASE);
+    free(found);
+    return SUCCESS;
+}
+
+/* Records how a call to backend `i` (of generation `gen`) went, taking the
+   backend out of rotation if it keeps failing.
+ * Only I/O errors and timeouts count: a call the server reported as failed
+   or turned away still shows that the server is up. A call dropped before
+   its response (NO_OUTCOME) tells nothing either way.
+ */
+void record_outcome(rpc_cluster *cluster, int i, uint32_t gen, int status) {
+    backend *b = &cluster->backends[i];
+    pthread_mutex_lock(&cluster->lock);
+    b->stats.outstanding--;
+    if (!b->live || b->gen != gen || status == NO_OUTCOME) {
+        pthread_mutex_unlock(&cluster->lock);
+        return;
+    }
+
+    int failed = status == RPC_ERROR || status == RPC_DEADLINE_EXCEEDED;
+    if (!failed) {
+        b->fails = 0;
+        b->ejected_until = 0;
+        b->probing = FALSE;
+        b->eject_ms = MIN_EJECT_MS;
+        b->stats.ejected = FALSE;
+    } else {
+        b->fails++;
+        b->stats.failures++;
+        int in_rotation = b->ejected_until == 0;
+        if (b->probing || (in_rotation && b->fails >= EJECT_AFTER)) {
+            b->ejected_until = now_ns() + b->eject_ms * NS_PER_MS;
+            b->eject_ms *= 2;
+            if (b->eject_ms > MAX_EJECT_MS)
+                b->eject_ms = MAX_EJECT_MS;
+            b->probing = FALSE;
+            b->fails = 0;
+            b->stats.ejections++;
+            b->stats.ejected = TRUE;
+        }
+    }
+    pthread_mutex_unlock(&cluster->lock);
+}
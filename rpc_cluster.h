@@ -0,0 +1,55 @@
+/*-----------------------------------------------------------------------------
+ * Project 2
+ * rpc_cluster.h :
+              = the interface of the module `rpc_cluster` of the project
+              = a client of several identical servers, spreading its calls
+                over them and taking failing ones out of rotation
+ * Note: The functions of the module are part of the RPC system's interface,
+   so they are declared in rpc_ext.h; this only holds its settings.
+ ----------------------------------------------------------------------------*/
+
+#ifndef RPC_CLUSTER_H
+#define RPC_CLUSTER_H
+
+#include "rpc.h"
+#include "rpc_ext.h"
+
+// most backends a cluster may have
+#define MAX_BACKENDS 64
+// idle connections kept to each backend
+#define MAX_IDLE_CONNS 8
+// failed calls in a row after which a backend is taken out of rotation
+#define EJECT_AFTER 3
+// how long it stays out at first, then after each failed retry (doubling)
+#define MIN_EJECT_MS 100
+#define MAX_EJECT_MS 10000
+// points of each backend on the ring of RPC_LB_HASH (virtual nodes)
+#define VNODES 160
+// latencies of a handle's recent calls kept to estimate its p95
+#define LATENCY_SAMPLES 128
+// ... and how many are needed before hedging on the estimate
+#define MIN_LATENCY_SAMPLES 20
+// hedges a handle may save up while its calls are fast (the budget's burst)
+#define MAX_HEDGE_TOKENS 10
+
+/* The functions below are implemented in rpc.c, as they need the state of
+   the client; they let the cluster wait for two calls at once. */
+
+/* Sends a CALL request, without waiting for the response (hedging sends
+   the same call on two connections, then reads whichever answers first).
+ * Returns the socket the response will arrive on, FAILED on error.
+ */
+int start_call(rpc_client *cl, rpc_handle *h, rpc_data *payload);
+
+/* Reads the response to the call sent by start_call.
+ * Returns the result on success, NULL on error.
+ */
+rpc_data *finish_call(rpc_client *cl);
+
+/* Gives up on the call sent by start_call: its response is not wanted, and
+   could not be told apart from the next one, so the connection is dropped
+   (the next request opens a new one).
+ */
+void drop_call(rpc_client *cl);
+
+#endif
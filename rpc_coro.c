@@ -0,0 +1,515 @@
+#include "rpc_coro.h"
+#include "rpc_io_helper.h"
+#include "rpc_safety.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <ucontext.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+
+#define MAX_EVENTS 256     // events handled per epoll_wait()
+#define INIT_TIMERS 64     // initial capacity of the timer heap
+#define INIT_FDS 64        // initial size of the fd owner table
+#define NOT_IN_HEAP -1
+#define NO_FD -1
+
+typedef struct coro coro_t;
+
+struct coro {
+    ucontext_t ctx;     // saved registers and stack of this coroutine
+    void *stack;        // stack mapping (lowest page is a guard page)
+    size_t map_size;    // size of the stack mapping
+    rpc_coro_fn fn;     // body
+    void *arg;          // argument to the body
+    int wait_fd;        // file descriptor waited on, or NO_FD
+    int wake_result;    // SUCCESS (fd ready / woken) or EMPTY (timed out)
+    uint64_t wake_ns;   // when the timer (if any) expires
+    int heap_idx;       // position in the timer heap, or NOT_IN_HEAP
+    coro_t *next;       // next coroutine in the ready queue
+};
+
+struct rpc_coro_sched {
+    int epfd;                   // one epoll instance for every coroutine
+    size_t stack_size;          // usable stack per coroutine
+    ucontext_t ctx;             // where the scheduler loop is suspended
+    coro_t *ready_head;         // coroutines ready to be resumed (FIFO)
+    coro_t *ready_tail;
+    coro_t **timers;            // min-heap on wake_ns
+    int n_timers;
+    int timers_cap;
+    coro_t **fd_owner;          // coroutine that registered each fd
+    int n_fds;                  // size of fd_owner
+    int live;                   // number of coroutines not yet returned
+    int running;                // is rpc_coro_run() active?
+};
+
+// the scheduler running on this thread, and the coroutine it is running
+static __thread rpc_coro_sched *cur_sched = NULL;
+static __thread coro_t *cur_coro = NULL;
+
+/******* Private functions *******/
+void coro_main(void);
+void resume(rpc_coro_sched *sched, coro_t *c);
+void suspend(void);
+void push_ready(rpc_coro_sched *sched, coro_t *c);
+coro_t *pop_ready(rpc_coro_sched *sched);
+int timer_push(rpc_coro_sched *sched, coro_t *c, uint64_t wake_ns);
+void timer_remove(rpc_coro_sched *sched, coro_t *c);
+void timer_sift_up(rpc_coro_sched *sched, int i);
+void timer_sift_down(rpc_coro_sched *sched, int i);
+void expire_timers(rpc_coro_sched *sched);
+int next_timeout_ms(rpc_coro_sched *sched);
+int claim_fd(rpc_coro_sched *sched, coro_t *c, int fd);
+void drop_fds(rpc_coro_sched *sched, coro_t *c);
+void free_coro(coro_t *c);
+
+
+/* Creates a scheduler whose coroutines each get `stack_size` bytes of stack
+   (CORO_DEFAULT_STACK if 0).
+ * Returns the scheduler on success, NULL on error.
+ */
+rpc_coro_sched *rpc_coro_create_sched(size_t stack_size) {
+    rpc_coro_sched *sched = calloc(1, sizeof(*sched));
+    if (!sched) {
+        print_err(MALLOC_FAILED);
+        return NULL;
+    }
+
+    sched->timers = malloc(sizeof(*(sched->timers)) * INIT_TIMERS);
+    if (!sched->timers) {
+        print_err(MALLOC_FAILED);
+        free(sched);
+        return NULL;
+    }
+    sched->timers_cap = INIT_TIMERS;
+
+    sched->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (sched->epfd < 0) {
+        perror("epoll_create1");
+        free(sched->timers);
+        free(sched);
+        return NULL;
+    }
+
+    sched->stack_size = stack_size > 0 ? stack_size : CORO_DEFAULT_STACK;
+    return sched;
+}
+
+/* Creates a coroutine that will run `fn(arg)` once the scheduler runs.
+ * May also be called from inside a running coroutine.
+ * Returns SUCCESS on success, FAILED otherwise.
+ */
+int rpc_coro_spawn(rpc_coro_sched *sched, rpc_coro_fn fn, void *arg) {
+    if (sched == NULL || fn == NULL) {
+        print_err(INVALID_INPUT);
+        return FAILED;
+    }
+
+    coro_t *c = calloc(1, sizeof(*c));
+    if (!c) {
+        print_err(MALLOC_FAILED);
+        return FAILED;
+    }
+
+    // Stack, with a guard page at the bottom to catch overflows
+    size_t page = sysconf(_SC_PAGESIZE);
+    c->map_size = page + ((sched->stack_size + page - 1) / page) * page;
+    c->stack = mmap(NULL, c->map_size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+    if (c->stack == MAP_FAILED) {
+        perror("mmap");
+        free(c);
+        return FAILED;
+    }
+    mprotect(c->stack, page, PROT_NONE);
+
+    if (getcontext(&c->ctx) < 0) {
+        perror("getcontext");
+        free_coro(c);
+        return FAILED;
+    }
+    c->ctx.uc_stack.ss_sp = (char *)c->stack + page;
+    c->ctx.uc_stack.ss_size = c->map_size - page;
+    c->ctx.uc_link = &sched->ctx; // back to the scheduler when it returns
+    makecontext(&c->ctx, coro_main, 0);
+
+    c->fn = fn;
+    c->arg = arg;
+    c->wait_fd = NO_FD;
+    c->heap_idx = NOT_IN_HEAP;
+
+    push_ready(sched, c);
+    sched->live++;
+    return SUCCESS;
+}
+
+/* Runs the scheduler on the calling thread until every coroutine has
+   returned.
+ * Returns SUCCESS on success, FAILED on error.
+ */
+int rpc_coro_run(rpc_coro_sched *sched) {
+    if (sched == NULL || sched->running) {
+        print_err(INVALID_INPUT);
+        return FAILED;
+    }
+
+    // From now on, I/O waits on this thread go through the scheduler
+    rpc_coro_sched *prev_sched = cur_sched;
+    io_wait_fn prev_hook = get_io_wait_hook();
+    cur_sched = sched;
+    sched->running = TRUE;
+    set_io_wait_hook(rpc_coro_wait_fd);
+
+    struct epoll_event events[MAX_EVENTS];
+    int result = SUCCESS;
+    while (sched->live > 0) {
+        // run everything that can make progress
+        coro_t *c;
+        while ((c = pop_ready(sched)) != NULL) {
+            resume(sched, c);
+        }
+        if (sched->live == 0)
+            break;
+
+        // all remaining coroutines are waiting -> sleep until one is due
+        int n = epoll_wait(sched->epfd, events, MAX_EVENTS,
+                           next_timeout_ms(sched));
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait");
+            result = FAILED;
+            break;
+        }
+
+        for (int i = 0; i < n; i++) {
+            // only wake the coroutine that is waiting on the fd right now
+            int fd = events[i].data.fd;
+            c = fd < sched->n_fds ? sched->fd_owner[fd] : NULL;
+            if (c == NULL || c->wait_fd != fd)
+                continue;
+            if (c->heap_idx != NOT_IN_HEAP)
+                timer_remove(sched, c);
+            c->wake_result = SUCCESS;
+            push_ready(sched, c);
+        }
+        expire_timers(sched);
+    }
+
+    set_io_wait_hook(prev_hook);
+    sched->running = FALSE;
+    cur_sched = prev_sched;
+    return result;
+}
+
+/* Suspends the current coroutine until the file descriptor is ready for
+   `events` (POLLIN / POLLOUT), or `timeout_ms` milliseconds have passed
+   (negative for no timeout).
+ * Outside a coroutine, this simply polls the file descriptor.
+ * Returns SUCCESS if ready, EMPTY on timeout, FAILED on error.
+ */
+int rpc_coro_wait_fd(int fd, short events, int timeout_ms) {
+    coro_t *c = cur_coro;
+    if (c == NULL || timeout_ms == 0)
+        return poll_fd(fd, events, timeout_ms);
+
+    // one-shot: the fd is disarmed again as soon as it fires once
+    struct epoll_event ev;
+    ev.events = EPOLLONESHOT;
+    if (events & POLLIN)
+        ev.events |= EPOLLIN;
+    if (events & POLLOUT)
+        ev.events |= EPOLLOUT;
+    ev.data.fd = fd;
+    if (claim_fd(cur_sched, c, fd) == FAILED)
+        return FAILED;
+
+    // sockets are usually waited on repeatedly, so try re-arming first
+    if (epoll_ctl(cur_sched->epfd, EPOLL_CTL_MOD, fd, &ev) < 0) {
+        if (errno != ENOENT
+                || epoll_ctl(cur_sched->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            perror("epoll_ctl");
+            return FAILED;
+        }
+    }
+
+    c->wait_fd = fd;
+    if (timeout_ms > 0) {
+        uint64_t wake_ns = rpc_coro_now_ns() + timeout_ms * NS_PER_MS;
+        if (timer_push(cur_sched, c, wake_ns) == FAILED) {
+            epoll_ctl(cur_sched->epfd, EPOLL_CTL_DEL, fd, NULL);
+            c->wait_fd = NO_FD;
+            return FAILED;
+        }
+    }
+
+    suspend();
+    c->wait_fd = NO_FD;
+    return c->wake_result;
+}
+
+/* Suspends the current coroutine until the monotonic clock (as returned by
+   rpc_coro_now_ns()) reaches `wake_ns`.
+ */
+void rpc_coro_sleep_until(uint64_t wake_ns) {
+    if (cur_coro == NULL) { // not in a coroutine -> just sleep
+        struct timespec ts;
+        ts.tv_sec = wake_ns / (NS_PER_MS * MS_PER_S);
+        ts.tv_nsec = wake_ns % (NS_PER_MS * MS_PER_S);
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL)
+                == EINTR);
+        return;
+    }
+
+    if (wake_ns <= rpc_coro_now_ns()
+            || timer_push(cur_sched, cur_coro, wake_ns) == FAILED) {
+        rpc_coro_yield();
+        return;
+    }
+    suspend();
+}
+
+/* Lets the other ready coroutines run before continuing.
+ */
+void rpc_coro_yield(void) {
+    if (cur_coro == NULL)
+        return;
+    push_ready(cur_sched, cur_coro);
+    suspend();
+}
+
+/* Returns the current time of the monotonic clock, in nanoseconds.
+ */
+uint64_t rpc_coro_now_ns(void) {
+    return now_ns();
+}
+
+/* Frees the scheduler. Must not be called while it is running.
+ */
+void rpc_coro_free_sched(rpc_coro_sched *sched) {
+    if (sched == NULL || sched->running)
+        return;
+
+    // coroutines that were spawned but never run
+    coro_t *c;
+    while ((c = pop_ready(sched)) != NULL) {
+        free_coro(c);
+    }
+    close(sched->epfd);
+    free(sched->timers);
+    sched->timers = NULL;
+    free(sched->fd_owner);
+    sched->fd_owner = NULL;
+    free(sched);
+    sched = NULL;
+}
+
+
+/* Entry point of every coroutine: runs its body, then falls back to the
+   scheduler through `uc_link`.
+ */
+void coro_main(void) {
+    coro_t *c = cur_coro;
+    c->fn(c->arg);
+    c->fn = NULL; // marks the coroutine as returned
+    cur_sched->live--;
+}
+
+/* Switches from the scheduler to the coroutine until it suspends or returns.
+ */
+void resume(rpc_coro_sched *sched, coro_t *c) {
+    cur_coro = c;
+    swapcontext(&sched->ctx, &c->ctx);
+    cur_coro = NULL;
+
+    if (c->fn == NULL) { // returned -> nobody may refer to it anymore
+        drop_fds(sched, c);
+        free_coro(c);
+    }
+}
+
+/* Switches from the current coroutine back to the scheduler.
+ */
+void suspend(void) {
+    swapcontext(&cur_coro->ctx, &cur_sched->ctx);
+}
+
+/* Appends the coroutine to the ready queue.
+ */
+void push_ready(rpc_coro_sched *sched, coro_t *c) {
+    c->next = NULL;
+    if (sched->ready_tail)
+        sched->ready_tail->next = c;
+    else
+        sched->ready_head = c;
+    sched->ready_tail = c;
+}
+
+/* Removes and returns the first coroutine of the ready queue (NULL if none).
+ */
+coro_t *pop_ready(rpc_coro_sched *sched) {
+    coro_t *c = sched->ready_head;
+    if (c == NULL)
+        return NULL;
+    sched->ready_head = c->next;
+    if (sched->ready_head == NULL)
+        sched->ready_tail = NULL;
+    c->next = NULL;
+    return c;
+}
+
+/* Arms a timer for the coroutine, expiring at `wake_ns`.
+ * Returns SUCCESS on success, FAILED otherwise.
+ */
+int timer_push(rpc_coro_sched *sched, coro_t *c, uint64_t wake_ns) {
+    if (sched->n_timers == sched->timers_cap) {
+        int new_cap = sched->timers_cap * 2;
+        coro_t **new = realloc(sched->timers, sizeof(*new) * new_cap);
+        if (!new) {
+            print_err(MALLOC_FAILED);
+            return FAILED;
+        }
+        sched->timers = new;
+        sched->timers_cap = new_cap;
+    }
+
+    c->wake_ns = wake_ns;
+    c->wake_result = SUCCESS;
+    c->heap_idx = sched->n_timers++;
+    sched->timers[c->heap_idx] = c;
+    timer_sift_up(sched, c->heap_idx);
+    return SUCCESS;
+}
+
+/* Disarms the coroutine's timer.
+ */
+void timer_remove(rpc_coro_sched *sched, coro_t *c) {
+    int i = c->heap_idx;
+    c->heap_idx = NOT_IN_HEAP;
+
+    // move the last timer into the hole, then restore the heap order
+    coro_t *last = sched->timers[--sched->n_timers];
+    if (i == sched->n_timers)
+        return;
+    sched->timers[i] = last;
+    last->heap_idx = i;
+    timer_sift_up(sched, i);
+    timer_sift_down(sched, last->heap_idx);
+}
+
+/* Moves the timer at index `i` up the heap until its parent is not later.
+ */
+void timer_sift_up(rpc_coro_sched *sched, int i) {
+    coro_t **t = sched->timers;
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (t[parent]->wake_ns <= t[i]->wake_ns)
+            break;
+        coro_t *tmp = t[parent];
+        t[parent] = t[i];
+        t[i] = tmp;
+        t[parent]->heap_idx = parent;
+        t[i]->heap_idx = i;
+        i = parent;
+    }
+}
+
+/* Moves the timer at index `i` down the heap until no child is earlier.
+ */
+void timer_sift_down(rpc_coro_sched *sched, int i) {
+    coro_t **t = sched->timers;
+    int n = sched->n_timers;
+    while (TRUE) {
+        int min = i, left = 2 * i + 1, right = 2 * i + 2;
+        if (left < n && t[left]->wake_ns < t[min]->wake_ns)
+            min = left;
+        if (right < n && t[right]->wake_ns < t[min]->wake_ns)
+            min = right;
+        if (min == i)
+            break;
+        coro_t *tmp = t[min];
+        t[min] = t[i];
+        t[i] = tmp;
+        t[min]->heap_idx = min;
+        t[i]->heap_idx = i;
+        i = min;
+    }
+}
+
+/* Wakes up every coroutine whose timer has expired.
+ */
+void expire_timers(rpc_coro_sched *sched) {
+    uint64_t now = rpc_coro_now_ns();
+    while (sched->n_timers > 0 && sched->timers[0]->wake_ns <= now) {
+        coro_t *c = sched->timers[0];
+        timer_remove(sched, c);
+        if (c->wait_fd != NO_FD) {
+            // timed out -> the fd must not fire for this coroutine anymore
+            epoll_ctl(sched->epfd, EPOLL_CTL_DEL, c->wait_fd, NULL);
+            c->wake_result = EMPTY;
+        }
+        push_ready(sched, c);
+    }
+}
+
+/* Returns how long epoll_wait() may block before the next timer is due,
+   in milliseconds (-1 if there is no timer).
+ */
+int next_timeout_ms(rpc_coro_sched *sched) {
+    if (sched->n_timers == 0)
+        return -1;
+    return ms_until(sched->timers[0]->wake_ns);
+}
+
+/* Records the coroutine as the one waiting on the fd, so that its events
+   wake it up.
+ * Returns SUCCESS on success, FAILED otherwise.
+ */
+int claim_fd(rpc_coro_sched *sched, coro_t *c, int fd) {
+    if (fd >= sched->n_fds) {
+        int new_n = sched->n_fds > 0 ? sched->n_fds : INIT_FDS;
+        while (new_n <= fd)
+            new_n *= 2;
+        coro_t **new = realloc(sched->fd_owner, sizeof(*new) * new_n);
+        if (!new) {
+            print_err(MALLOC_FAILED);
+            return FAILED;
+        }
+        for (int i = sched->n_fds; i < new_n; i++) {
+            new[i] = NULL;
+        }
+        sched->fd_owner = new;
+        sched->n_fds = new_n;
+    }
+    sched->fd_owner[fd] = c;
+    return SUCCESS;
+}
+
+/* Removes the fds the (returned) coroutine registered from the epoll
+   instance, so that a late event on one of them can't wake it up once
+   freed.
+ */
+void drop_fds(rpc_coro_sched *sched, coro_t *c) {
+    for (int fd = 0; fd < sched->n_fds; fd++) {
+        if (sched->fd_owner[fd] != c)
+            continue;
+        // closed already -> EBADF, nothing left to remove
+        epoll_ctl(sched->epfd, EPOLL_CTL_DEL, fd, NULL);
+        sched->fd_owner[fd] = NULL;
+    }
+}
+
+/* Frees the coroutine and its stack.
+ */
+void free_coro(coro_t *c) {
+    if (c == NULL)
+        return;
+    munmap(c->stack, c->map_size);
+    c->stack = NULL;
+    free(c);
+    c = NULL;
+}
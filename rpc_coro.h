@@ -0,0 +1,76 @@
+/*-----------------------------------------------------------------------------
+ * Project 2
+ * rpc_coro.h :
+              = the interface of the module `rpc_coro` of the project
+              = provides a coroutine runtime for the client side, so that a
+                single thread can drive many RPC calls at the same time
+ ----------------------------------------------------------------------------*/
+
+#ifndef RPC_CORO_H
+#define RPC_CORO_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CORO_DEFAULT_STACK (128 * 1024) // bytes of stack per coroutine
+
+/* Coroutine scheduler (one per thread) */
+typedef struct rpc_coro_sched rpc_coro_sched;
+
+/* Body of a coroutine */
+typedef void (*rpc_coro_fn)(void *arg);
+
+/* How to use:
+ * - Create a scheduler, spawn one coroutine per logical call sequence,
+   then run the scheduler until all coroutines have returned.
+ * - Each coroutine uses the usual rpc_init_client / rpc_find / rpc_call /
+   rpc_close_client functions (one rpc_client per coroutine).
+ * - Whenever a call has to wait for the server, the coroutine is suspended
+   and the scheduler resumes another one; a single epoll loop wakes it up
+   again once its socket is ready.
+ */
+
+/* Creates a scheduler whose coroutines each get `stack_size` bytes of stack
+   (CORO_DEFAULT_STACK if 0).
+ * Returns the scheduler on success, NULL on error.
+ */
+rpc_coro_sched *rpc_coro_create_sched(size_t stack_size);
+
+/* Creates a coroutine that will run `fn(arg)` once the scheduler runs.
+ * May also be called from inside a running coroutine.
+ * Returns SUCCESS on success, FAILED otherwise.
+ */
+int rpc_coro_spawn(rpc_coro_sched *sched, rpc_coro_fn fn, void *arg);
+
+/* Runs the scheduler on the calling thread until every coroutine has
+   returned.
+ * Returns SUCCESS on success, FAILED on error.
+ */
+int rpc_coro_run(rpc_coro_sched *sched);
+
+/* Suspends the current coroutine until the file descriptor is ready for
+   `events` (POLLIN / POLLOUT), or `timeout_ms` milliseconds have passed
+   (negative for no timeout).
+ * Outside a coroutine, this simply polls the file descriptor.
+ * Returns SUCCESS if ready, EMPTY on timeout, FAILED on error.
+ */
+int rpc_coro_wait_fd(int fd, short events, int timeout_ms);
+
+/* Suspends the current coroutine until the monotonic clock (as returned by
+   rpc_coro_now_ns()) reaches `wake_ns`.
+ */
+void rpc_coro_sleep_until(uint64_t wake_ns);
+
+/* Lets the other ready coroutines run before continuing.
+ */
+void rpc_coro_yield(void);
+
+/* Returns the current time of the monotonic clock, in nanoseconds.
+ */
+uint64_t rpc_coro_now_ns(void);
+
+/* Frees the scheduler. Must not be called while it is running.
+ */
+void rpc_coro_free_sched(rpc_coro_sched *sched);
+
+#endif
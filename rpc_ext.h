@@ -0,0 +1,513 @@
+/*-----------------------------------------------------------------------------
+ * Project 2
+ * rpc_ext.h :
+              = extensions to the interface of the RPC system
+              = rpc.h must stay as it is, so every function added on top of
+                it is declared here
+ ----------------------------------------------------------------------------*/
+
+#ifndef RPC_EXT_H
+#define RPC_EXT_H
+
+#include <stdint.h>
+#include "rpc.h"
+
+/* Outcome of the last rpc_find / rpc_call made by a client */
+enum RPC_STATUS {
+    RPC_OK = 0,                // success
+    RPC_ERROR = 1,             // invalid input, I/O or protocol error
+    RPC_FAILED = 2,            // the server reported a failure
+    RPC_DEADLINE_EXCEEDED = 3, // no result before the call's deadline
+    RPC_OVERLOADED = 4         // the server turned the request away
+};
+
+/* Priority classes of registered functions, highest first */
+enum RPC_PRIORITY {
+    RPC_PRIO_HIGH = 0,         // latency-critical (health checks, lookups)
+    RPC_PRIO_NORMAL = 1,       // default
+    RPC_PRIO_LOW = 2           // bulk / batch work
+};
+#define RPC_NUM_PRIOS 3
+
+/* Flags of registered functions */
+#define RPC_FUNC_CACHEABLE 0x1 // pure: its result only depends on its input
+
+/* Where the child serving each connection runs (see rpc_set_cpu_pinning) */
+enum RPC_PIN_POLICY {
+    RPC_PIN_NONE = 0,         // wherever the scheduler puts it (default)
+    RPC_PIN_ROUND_ROBIN = 1,  // on each of the server's CPUs in turn
+    RPC_PIN_INCOMING = 2      // on the CPU receiving its packets
+                              // (SO_INCOMING_CPU), if one of the server's
+};
+
+/* How a cluster picks the backend of a call */
+enum RPC_LB_POLICY {
+    RPC_LB_LEAST_OUTSTANDING = 0, // the one with the fewest calls in progress
+    RPC_LB_P2C = 1,               // the better of two picked at random
+    RPC_LB_HASH = 2               // the owner of the call's key (sharding)
+};
+
+/* Hedging delay of the p95 of recent calls (see rpc_cluster_set_hedging) */
+#define RPC_HEDGE_P95 -1
+
+/* Options of the sockets of a client or server (see rpc_set_*_sock_opts) */
+typedef struct {
+    int nodelay;               // TCP_NODELAY: send small writes at once
+    int quickack;              // TCP_QUICKACK: don't delay ACKs (client)
+    int keepalive_s;           // idle seconds before keepalive probes (0: off)
+    int sndbuf;                // SO_SNDBUF, in bytes (0: system default)
+    int rcvbuf;                // SO_RCVBUF, in bytes (0: system default)
+} rpc_sock_opts;
+
+/* What clients and servers use unless told otherwise. In v1, a request or
+   response is sent in several small writes, so with Nagle's algorithm on,
+   each would wait for the peer's delayed ACK (~40ms). */
+#define RPC_SOCK_OPTS_DEFAULT {.nodelay = 1}
+
+/* Versions of the protocol (see rpc_set_protocol) */
+enum RPC_PROTOCOL {
+    RPC_PROTO_V1 = 1,          // a prefix, then each field on its own
+    RPC_PROTO_V2 = 2,          // frames: a fixed-size header, then payload
+    RPC_PROTO_V2_COMPACT = 3   // v2, with varint headers if the server agrees
+};
+
+/* Types of the elements of typed arrays (see rpc_data_set_array) */
+enum RPC_ELEM_TYPE {
+    RPC_I32 = 1,               // int32_t
+    RPC_I64 = 2,               // int64_t
+    RPC_F32 = 3,               // float
+    RPC_F64 = 4                // double
+};
+
+/* Levels of what the library logs (see rpc_set_log_level) */
+enum RPC_LOG_LEVEL {
+    RPC_LOG_DEBUG = 0,
+    RPC_LOG_INFO = 1,          // e.g. peers closing, functions not found
+    RPC_LOG_WARN = 2,          // requests turned away, timed out (default)
+    RPC_LOG_ERROR = 3,         // invalid input, failed calls and I/O
+    RPC_LOG_OFF = 4            // nothing
+};
+
+/* Counters kept by a client */
+typedef struct {
+    uint64_t calls;            // calls attempted
+    uint64_t failures;         // calls that did not return a result
+    uint64_t deadline_misses;  // ... of which because of their deadline
+    uint64_t overloaded;       // ... of which turned away by the server
+    uint64_t cache_hits;       // calls answered from the response cache
+    uint64_t cache_misses;     // calls of cached handles not found in it
+    uint64_t bytes_sent;       // over all its connections (TCP payload)
+    uint64_t bytes_received;
+    uint64_t casts;            // casts attempted (see rpc_cast)
+    uint64_t cast_failures;    // ... told failed by rpc_cast_failures
+} rpc_client_stats;
+
+/* Scheduling counters of a priority class (see rpc_set_max_running) */
+typedef struct {
+    uint64_t calls;            // calls scheduled
+    uint64_t queued;           // calls waiting for their turn right now
+    uint64_t waited;           // calls that had to wait for their turn
+    uint64_t wait_ns;          // total time spent waiting, in nanoseconds
+    uint64_t max_wait_ns;      // longest wait, in nanoseconds
+    uint64_t expired;          // calls whose deadline passed while waiting
+} rpc_class_stats;
+
+/* Counters kept by a cluster for each of its backends */
+typedef struct {
+    uint64_t calls;            // calls sent to the backend
+    uint64_t failures;         // ... that failed on an I/O error or timeout
+    uint64_t ejections;        // times it was taken out of rotation
+    uint64_t outstanding;      // calls in progress right now
+    int ejected;               // out of rotation right now?
+    uint32_t share_ppm;        // its share of the keys (RPC_LB_HASH), per
+                               // million; compare with its share of calls
+                               // to spot hot keys
+    uint64_t hedges;           // hedged calls sent to it (also in calls)
+    uint64_t hedge_wins;       // ... that answered before the first call
+} rpc_backend_stats;
+
+/* Counters kept by a server (shared by all its connections) */
+typedef struct {
+    uint64_t requests;         // requests received
+    uint64_t calls;            // CALL requests received
+    uint64_t deadline_shed;    // calls dropped as their deadline had passed
+    uint64_t conns_rejected;   // connections turned away (too many)
+    uint64_t calls_rejected;   // calls turned away (too many in flight)
+    uint64_t connections;      // connections being served right now
+    uint64_t inflight;         // calls being handled right now
+    uint64_t accepted;         // connections accepted
+    uint64_t accept_batches;   // times connections were accepted in a row
+    uint64_t accept_batch_max; // most connections accepted in a row
+    uint64_t accept_queue;     // connections waiting to be accepted right now
+    uint64_t accept_backlog;   // most that can wait (see rpc_set_backlog)
+    uint64_t listen_drops;     // connections dropped as too many were
+                               // waiting (as counted by the kernel, which
+                               // also counts those held back by
+                               // rpc_set_defer_accept)
+    uint64_t pinned_incoming;  // connections served on the CPU receiving
+                               // their packets (RPC_PIN_INCOMING)
+    uint64_t idle_timeouts;    // connections closed as idle for too long
+    uint64_t io_timeouts;      // ... as stalled for too long in the middle
+                               // of a request or response
+    rpc_class_stats classes[RPC_NUM_PRIOS]; // indexed by enum RPC_PRIORITY
+    uint64_t cache_hits;       // calls answered from the result cache
+    uint64_t cache_misses;     // calls of cacheable functions not cached
+    uint64_t cache_entries;    // results cached right now
+    uint64_t cache_bytes;      // bytes of payload held by those results
+    uint64_t cache_capacity;   // bytes of memory taken by the cache
+} rpc_server_stats;
+
+/* ---------------- */
+/* Server functions */
+/* ---------------- */
+
+/* Registers a function (mapping from name to handler) in the given
+   priority class (enum RPC_PRIORITY). rpc_register uses RPC_PRIO_NORMAL. */
+/* RETURNS: -1 on failure */
+int rpc_register_prio(rpc_server *srv, char *name, rpc_handler handler,
+                      int prio);
+
+/* Registers a function (mapping from name to handler) in the given
+   priority class, with the given flags (RPC_FUNC_*, or 0). */
+/* RETURNS: -1 on failure */
+int rpc_register_opts(rpc_server *srv, char *name, rpc_handler handler,
+                      int prio, int flags);
+
+/* Sets up a cache of at most `max_bytes` (0 to turn it off) for the results
+   of the functions registered with RPC_FUNC_CACHEABLE. A call found in it is
+   answered without running the handler. Must be called before serving. */
+/* RETURNS: -1 on failure */
+int rpc_set_cache_size(rpc_server *srv, size_t max_bytes);
+
+/* Drops every cached result of the function (also done whenever the
+   function is registered again). */
+/* RETURNS: -1 on failure */
+int rpc_cache_invalidate(rpc_server *srv, char *name);
+
+/* Limits how many handlers run at the same time, over all connections
+   (0 for no limit, the default). Once the limit is reached, calls wait for
+   their turn, higher priority classes first, though a waiting lower class
+   is never skipped more than a few times in a row. */
+/* RETURNS: -1 on failure */
+int rpc_set_max_running(rpc_server *srv, int max_running);
+
+/* Limits how many connections are served at the same time (0 for no
+   limit). Connections over the limit are answered OVERLOADED and closed. */
+/* RETURNS: -1 on failure */
+int rpc_set_max_connections(rpc_server *srv, int max_conns);
+
+/* Limits how many calls are handled at the same time, over all connections
+   (0 for no limit), whether running or waiting for their turn. Calls over
+   the limit are answered OVERLOADED at once, rather than queued. */
+/* RETURNS: -1 on failure */
+int rpc_set_max_inflight(rpc_server *srv, int max_inflight);
+
+/* Sets the size of the queue of connections waiting to be accepted
+   (SOMAXCONN by default, the most the system allows). Connections coming
+   while it is full are dropped, and retried by the client a second or more
+   later, so it should absorb a burst of them (e.g. many clients
+   reconnecting at once). */
+/* RETURNS: -1 on failure */
+int rpc_set_backlog(rpc_server *srv, int backlog);
+
+/* Has connections accepted only once their first request has arrived, or
+   after `timeout_s` seconds (0 to turn it off, the default), so that the
+   server doesn't fork a child for a connection that sends nothing. */
+/* RETURNS: -1 on failure */
+int rpc_set_defer_accept(rpc_server *srv, int timeout_s);
+
+/* Closes a connection once idle (between requests) for `idle_ms`, or
+   stalled for `io_ms` (no byte moving either way) while a request is read
+   or its response written, e.g. a client that sent half a request; 0 for
+   no limit (default). Calls being handled are never cut short. Applies to
+   the connections accepted from now on. */
+/* RETURNS: -1 on failure */
+int rpc_set_conn_timeouts(rpc_server *srv, int idle_ms, int io_ms);
+
+/* Pins the child serving each connection accepted from now on to one of
+   the `n_cpus` CPUs at `cpus` (NULL for all those the server may run on),
+   picked by the policy (enum RPC_PIN_POLICY). A child is pinned before
+   anything else, so that its buffers are allocated on the NUMA node of its
+   CPU (where the kernel puts memory first touched by it). */
+/* RETURNS: -1 on failure */
+int rpc_set_cpu_pinning(rpc_server *srv, int policy, const int *cpus,
+                        int n_cpus);
+
+/* Pins the server itself (accepting connections) to the CPU, e.g. one of
+   the node of the network card. Its children don't stay on it. */
+/* RETURNS: -1 on failure */
+int rpc_pin_server(rpc_server *srv, int cpu);
+
+/* Sets the options of the sockets of the connections accepted from now on */
+/* RETURNS: -1 on failure */
+int rpc_set_server_sock_opts(rpc_server *srv, const rpc_sock_opts *opts);
+
+/* Copies the server's counters to `stats`.
+ * RETURNS: -1 on failure */
+int rpc_get_server_stats(rpc_server *srv, rpc_server_stats *stats);
+
+/* -------------------- */
+/* Stopping, restarting */
+/* -------------------- */
+
+/* rpc_serve_all returns once the server gets SIGTERM, or a new server has
+   taken over from it. It first drains: it stops accepting, each connection
+   finishes the requests it was sent (closing at once if idle), and the
+   server waits for them to close, then closes itself. The processes
+   serving connections ignore SIGTERM: only the server's own stops them. */
+
+/* Sets how long draining lets the connections finish the requests they
+   were sent, in milliseconds (30s by default). */
+/* RETURNS: -1 on failure */
+int rpc_set_drain_timeout(rpc_server *srv, int timeout_ms);
+
+/* Listens on a Unix socket at `path` for a new server process to take
+   over (see rpc_take_over_server). */
+/* RETURNS: -1 on failure */
+int rpc_set_handoff_path(rpc_server *srv, char *path);
+
+/* Initialises a server that takes over from the running one whose handoff
+   socket is at `path` (see rpc_set_handoff_path): it gets its listening
+   socket, already accepting, and the running one drains once this one
+   starts serving. No connection is refused in between. */
+/* RETURNS: rpc_server* on success, NULL on error */
+rpc_server *rpc_take_over_server(char *path);
+
+/* ------- */
+/* Plugins */
+/* ------- */
+
+/* A plugin is a shared object exporting a function of this name and type,
+   which registers its handlers (with rpc_register and the like) when the
+   plugin is loaded. The server program must be linked with -rdynamic, for
+   plugins to call it. */
+#define RPC_PLUGIN_INIT "rpc_plugin_init"
+typedef int (*rpc_plugin_init_fn)(rpc_server *srv);
+
+/* Loads the plugin at `path`, while the server is running or not: its
+   functions are found by every connection at once. Loading a plugin again
+   replaces it (its functions it no longer registers are removed). */
+/* RETURNS: -1 on failure */
+int rpc_load_plugin(rpc_server *srv, char *path);
+
+/* Removes the functions of the plugin loaded from `path`, then unloads it
+   once no call of them is in flight (waiting a few seconds at most, after
+   which it is unloaded later). */
+/* RETURNS: -1 on failure */
+int rpc_unload_plugin(rpc_server *srv, char *path);
+
+/* Loads every plugin (`*.so`) of the directory. Whenever the server gets
+   SIGHUP, it looks at the directory again: new plugins are loaded, changed
+   ones loaded again, and removed ones unloaded. */
+/* RETURNS: -1 on failure */
+int rpc_set_plugin_dir(rpc_server *srv, char *dir);
+
+/* Registers the functions "rpc.load_plugin" and "rpc.unload_plugin", which
+   load or unload the plugin named by their data2 (a file name, with its
+   terminating null byte) in the plugin directory. Anyone who can call the
+   server can then use them, so they are off by default. */
+/* RETURNS: -1 on failure */
+int rpc_enable_plugin_admin(rpc_server *srv);
+
+/* ---------------- */
+/* Client functions */
+/* ---------------- */
+
+/* Connects to the server now (rather than on the first request) and makes
+   a round trip, so that the first rpc_find / rpc_call doesn't pay for the
+   TCP handshake nor for the server setting up the connection. */
+/* RETURNS: -1 on failure */
+int rpc_connect(rpc_client *cl);
+
+/* Sets the options of the client's sockets, applied to its connection
+   right away if it has one */
+/* RETURNS: -1 on failure */
+int rpc_set_client_sock_opts(rpc_client *cl, const rpc_sock_opts *opts);
+
+/* Sets the version of the protocol (enum RPC_PROTOCOL) spoken by the
+   client from its next connection on. It is RPC_PROTO_V2 by default, and
+   goes back to RPC_PROTO_V1 by itself if the server doesn't speak v2;
+   servers speak both. RPC_PROTO_V2_COMPACT asks each server for varint
+   headers (most small calls then take under 10 bytes of header instead of
+   32), going back to RPC_PROTO_V2 if it doesn't agree. */
+/* RETURNS: -1 on failure */
+int rpc_set_protocol(rpc_client *cl, int version);
+
+/* Sets the timeout used by rpc_call, in milliseconds (0 for none) */
+/* RETURNS: -1 on failure */
+int rpc_set_call_timeout(rpc_client *cl, int timeout_ms);
+
+/* Calls remote function using handle, giving up after `timeout_ms`
+   milliseconds (0 for no timeout). The deadline is also sent to the server,
+   which skips the call if it only gets to it once the deadline has passed. */
+/* RETURNS: rpc_data* on success, NULL on error */
+rpc_data *rpc_call_timeout(rpc_client *cl, rpc_handle *h, rpc_data *payload,
+                           int timeout_ms);
+
+/* Calls remote function using handle, without waiting for its result: the
+   server sends none back, so this returns once the request is written (or
+   queued, on a multiplexed connection). Whether the call failed is only
+   told by rpc_cast_failures. The deadline of rpc_call applies to the
+   write, and is sent along as with rpc_call. A v1 server knows no casts:
+   the call is then made as with rpc_call, its result dropped. */
+/* RETURNS: -1 on failure */
+int rpc_cast(rpc_client *cl, rpc_handle *h, rpc_data *payload);
+
+/* Tells how many of the client's casts since the last time it asked (or
+   since it was made) failed: made a round trip after them, the server
+   having handled all of them by then. A cast lost with its connection (or
+   turned away, like a call) counts as failed. Asking every so often
+   (e.g. every N casts) is an acknowledgement of all of them. */
+/* RETURNS: the number of failed casts, -1 on failure */
+int rpc_cast_failures(rpc_client *cl);
+
+/* Caches the responses of the function for `ttl_ms` milliseconds (0 to
+   stop caching them), in at most `max_bytes`. A call with the same payload
+   is then answered from the cache, without a round trip to the server, so
+   this is only meant for idempotent, read-only functions. */
+/* RETURNS: -1 on failure */
+int rpc_cache_responses(rpc_client *cl, rpc_handle *h, int ttl_ms,
+                        size_t max_bytes);
+
+/* RETURNS: the enum RPC_STATUS of the client's last rpc_find / rpc_call */
+int rpc_last_status(rpc_client *cl);
+
+/* Copies the client's counters to `stats`.
+ * RETURNS: -1 on failure */
+int rpc_get_client_stats(rpc_client *cl, rpc_client_stats *stats);
+
+/* ----------------- */
+/* Cluster functions */
+/* ----------------- */
+
+/* A client of several identical servers (backends), with connections to
+   each, that spreads its calls over them. It may be used by several
+   threads at once. */
+typedef struct rpc_cluster rpc_cluster;
+
+/* A function found through a cluster; it stands for the function's handle
+   on each backend (the backends may have registered it at different
+   indices), each resolved when the function is first called there. */
+typedef struct rpc_cluster_handle rpc_cluster_handle;
+
+/* Initialises a cluster without backends, picking the backend of each call
+   with the given policy (enum RPC_LB_POLICY) */
+/* RETURNS: rpc_cluster* on success, NULL on error */
+rpc_cluster *rpc_init_cluster(int policy);
+
+/* Adds a backend to the cluster */
+/* RETURNS: the backend's number on success, -1 on error */
+int rpc_cluster_add(rpc_cluster *cluster, char *addr, int port);
+
+/* Removes a backend from the cluster, closing its connections. Calls in
+   progress on it still complete. */
+/* RETURNS: -1 on failure */
+int rpc_cluster_remove(rpc_cluster *cluster, int backend);
+
+/* Finds a remote function by name, on one of the backends */
+/* RETURNS: rpc_cluster_handle* on success, NULL on error */
+/* rpc_cluster_handle* will be freed with a single call to free(3) */
+rpc_cluster_handle *rpc_cluster_find(rpc_cluster *cluster, char *name);
+
+/* Calls remote function on the backend picked by the cluster's policy.
+   A backend failing several calls in a row is taken out of rotation, and
+   tried again later with a single call (waiting longer each time). */
+/* RETURNS: rpc_data* on success, NULL on error */
+rpc_data *rpc_cluster_call(rpc_cluster *cluster, rpc_cluster_handle *h,
+                           rpc_data *payload);
+
+/* With RPC_LB_HASH, every call with the same key goes to the same backend:
+   keys are hashed onto a ring on which each backend has many points, and
+   belong to the backend of the next point. Adding or removing one of N
+   backends thus only moves about 1/N of the keys, and the keys of a backend
+   out of rotation go to the next one on the ring until it is back.
+ * rpc_cluster_call uses the payload's data1 as the key; this takes it from
+   the caller (e.g. a hash of data2) instead. */
+/* RETURNS: rpc_data* on success, NULL on error */
+rpc_data *rpc_cluster_call_key(rpc_cluster *cluster, rpc_cluster_handle *h,
+                               rpc_data *payload, uint64_t key);
+
+/* Hedges the calls of the function (meant for idempotent ones): a call
+   still unanswered after `delay_ms` milliseconds is sent again to another
+   backend (or on another connection), and whichever answers first wins,
+   the other being dropped. With a delay of RPC_HEDGE_P95, it is the p95 of
+   the function's recent calls. At most `budget_pct` percent of the calls
+   are hedged. A delay of 0 turns hedging off. */
+/* RETURNS: -1 on failure */
+int rpc_cluster_set_hedging(rpc_cluster *cluster, rpc_cluster_handle *h,
+                            int delay_ms, int budget_pct);
+
+/* Copies the counters of the backend to `stats`.
+ * RETURNS: -1 on failure */
+int rpc_get_backend_stats(rpc_cluster *cluster, int backend,
+                          rpc_backend_stats *stats);
+
+/* Closes every connection of the cluster and frees it */
+void rpc_close_cluster(rpc_cluster *cluster);
+
+/* ----------------------- */
+/* Multiplexed connections */
+/* ----------------------- */
+
+/* A single connection to a server, shared by many clients (sessions) that
+   may be used by different threads at once. Each client's requests go on
+   a channel of its own; long payloads are sent a piece at a time, the
+   other clients' requests and responses going in between, so they don't
+   hold up small calls. The server still makes the calls of a connection
+   one after the other. */
+typedef struct rpc_mux rpc_mux;
+
+/* Initialises a connection to the server for many clients at once (see
+   rpc_mux_client), connected on their first request. A thread of its own
+   reads their responses, and sends what they could not send at once. */
+/* RETURNS: rpc_mux* on success, NULL on error */
+rpc_mux *rpc_init_mux(char *addr, int port);
+
+/* Initialises a client whose requests go over the connection. It is used
+   as any other (and closed with rpc_close_client), but by one thread at a
+   time, and has no socket options nor version of the protocol of its own
+   (the connection speaks v2, compact if the server agrees). */
+/* RETURNS: rpc_client* on success, NULL on error */
+rpc_client *rpc_mux_client(rpc_mux *mux);
+
+/* Closes the connection (after sending what is queued, if the socket takes
+   it at once) and frees it. Its clients must be closed first. */
+void rpc_close_mux(rpc_mux *mux);
+
+/* ------------ */
+/* Typed arrays */
+/* ------------ */
+
+/* Sets data2 to a copy of the `n` elements of the type (enum RPC_ELEM_TYPE)
+   at `elems`, tagged with their type and byte order. The old data2 is not
+   freed; the new one is freed by rpc_data_free. */
+/* RETURNS: -1 on failure */
+int rpc_data_set_array(rpc_data *data, int type, const void *elems,
+                       size_t n);
+
+/* Gets the elements of the array of the type in data2, and their number at
+   `n`. They are converted to the host's byte order in place, only if the
+   sender's was different. */
+/* RETURNS: NULL if data2 is not an array of the type */
+void *rpc_data_get_array(rpc_data *data, int type, size_t *n);
+
+/* RETURNS: the type of the array in data2 (enum RPC_ELEM_TYPE),
+   -1 if data2 is not an array */
+int rpc_data_array_type(rpc_data *data);
+
+/* ------- */
+/* Logging */
+/* ------- */
+
+/* Logs (to stderr) only what is at least of the level (enum
+   RPC_LOG_LEVEL); RPC_LOG_WARN by default. Logging never waits for the
+   write: it is done by a background thread of each process that logs,
+   shortly after (and on exit). Each place that logs does so a limited
+   number of times a second; what it leaves out is counted. */
+/* RETURNS: -1 on failure */
+int rpc_set_log_level(int level);
+
+/* Writes out what this process logged so far */
+void rpc_flush_log(void);
+
+#endif
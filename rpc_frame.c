@@ -0,0 +1,419 @@
+#include "rpc_frame.h"
+#include "rpc_io_helper.h"
+#include "rpc_safety.h"
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+_Static_assert(sizeof(frame_header) == FRAME_HEADER_SIZE,
+               "frame_header must have no padding");
+
+// continuation bits of the 8 bytes of a word
+#define VARINT_MORE 0x8080808080808080ULL
+
+/******* Private functions *******/
+void encode_header(frame_header *hdr, char *buf);
+void decode_header(const char *buf, frame_header *hdr);
+int encode_compact(frame_header *hdr, char *buf);
+int decode_compact(const uint8_t *buf, int len, frame_header *hdr);
+int is_valid_header(frame_header *hdr);
+int fill_reader(frame_reader *r, int want);
+uint8_t *put_varint(uint8_t *p, uint64_t v);
+uint64_t get_varint(const uint8_t **p);
+uint64_t get_long_varint(const uint8_t **p);
+uint64_t load_le64(const uint8_t *p);
+
+
+/* Returns TRUE if the first 4 bytes read from a connection (at `buf`) are
+   those of a frame, FALSE if they are a v1 prefix.
+ */
+int is_frame(const char *buf) {
+    uint16_t magic;
+    memcpy(&magic, buf, sizeof(magic));
+    return ntohs(magic) == FRAME_MAGIC;
+}
+
+/* Writes the frame (the header's magic and version are filled in here),
+   with `hdr->payload_len` bytes of payload.
+ * Returns SUCCESS on success, FAILED on failure,
+   or EMPTY if a write() returned 0.
+ */
+int write_frame(int sockfd, frame_header *hdr, const char *payload,
+                int compact) {
+    char buf[FRAME_HEADER_SIZE + MAX_INLINE_PAYLOAD];
+    int hdr_len = encode_frame_header(hdr, buf, compact);
+
+    // small frame -> a single write
+    uint32_t len = hdr->payload_len;
+    if (len <= MAX_INLINE_PAYLOAD) {
+        if (len > 0)
+            memcpy(buf + hdr_len, payload, len);
+        int n = write_all(sockfd, buf, hdr_len + len);
+        return n <= 0 ? check_io_err(n, "write_frame") : SUCCESS;
+    }
+
+    // large one -> not worth copying
+    int n = write_all(sockfd, buf, hdr_len);
+    if (n > 0)
+        n = write_all(sockfd, (char *)payload, len);
+    return n <= 0 ? check_io_err(n, "write_frame") : SUCCESS;
+}
+
+/* Encodes the header (its magic and version are filled in here) into
+   `buf`, with the compact format if `compact` is TRUE (see next_frame).
+ * Returns the length of the encoded header.
+ */
+int encode_frame_header(frame_header *hdr, char *buf, int compact) {
+    hdr->magic = FRAME_MAGIC;
+    hdr->version = FRAME_VERSION;
+    if (compact)
+        return encode_compact(hdr, buf);
+    encode_header(hdr, buf);
+    return FRAME_HEADER_SIZE;
+}
+
+/* Decodes the header of the frame at `buf`, of which `len` bytes have been
+   read (with room after them, as in a frame_reader), into `hdr`, with the
+   compact format if `compact` is TRUE.
+ * Returns the length of the header if it was all read and is valid, 0 if
+   more of it is needed, or FAILED if it is invalid.
+ */
+int parse_frame_header(const uint8_t *buf, int len, int compact,
+                       frame_header *hdr) {
+    if (len == 0)
+        return 0;
+    int hdr_len = compact ? buf[0] : FRAME_HEADER_SIZE;
+    if (len < hdr_len && hdr_len <= MAX_COMPACT_HEADER)
+        return 0;
+
+    int n = SUCCESS;
+    if (compact)
+        n = decode_compact(buf, hdr_len, hdr);
+    else
+        decode_header((const char *)buf, hdr);
+    if (n == FAILED || is_valid_header(hdr) == FALSE) {
+        print_err(INVALID_FRAME);
+        return FAILED;
+    }
+    return hdr_len;
+}
+
+/* Reads the header of a frame into `buf` (of FRAME_HEADER_SIZE bytes),
+   whose first `have` bytes were read already, and decodes it into `hdr`.
+ * Everything needed to dispatch the frame is checked here: once it is
+   read, only its payload is left to read.
+ * Returns SUCCESS on success, FAILED on failure or an invalid header,
+   or EMPTY if a read() read nothing.
+ */
+int read_header(int sockfd, char *buf, int have, frame_header *hdr) {
+    int n = read_all(sockfd, buf + have, FRAME_HEADER_SIZE - have);
+    if (n <= 0)
+        return check_io_err(n, "read_header");
+
+    decode_header(buf, hdr);
+    if (is_valid_header(hdr) == FALSE) {
+        print_err(INVALID_FRAME);
+        return FAILED;
+    }
+    return SUCCESS;
+}
+
+/* Sets up an empty read-ahead buffer for the socket.
+ */
+void init_reader(frame_reader *r, int sockfd) {
+    r->sockfd = sockfd;
+    r->start = 0;
+    r->end = 0;
+}
+
+/* Returns the number of bytes read ahead, but not used yet.
+ */
+int buffered_bytes(frame_reader *r) {
+    return r->end - r->start;
+}
+
+/* Reads the next frame from the read-ahead buffer of the connection,
+   its header into `hdr` and its payload into `*payload` (as read_payload).
+ * With `compact` (as agreed to in the HELLO of the connection), the header
+   is its length, its type, then the other fields as LEB128 varints (data1
+   zigzag-encoded), budget_ms only with FRAME_DEADLINE. Most take a single
+   byte.
+ * Returns SUCCESS on success, FAILED on failure or an invalid header,
+   or EMPTY if a read() read nothing.
+ */
+int next_frame(frame_reader *r, int compact, frame_header *hdr,
+               char **payload) {
+    *payload = NULL;
+
+    // the header, decoded where it was read
+    int hdr_len = compact ? MIN_COMPACT_HEADER : FRAME_HEADER_SIZE;
+    int n = fill_reader(r, hdr_len);
+    if (n > 0 && compact) {
+        hdr_len = r->buf[r->start];
+        if (hdr_len > MIN_COMPACT_HEADER && hdr_len <= MAX_COMPACT_HEADER)
+            n = fill_reader(r, hdr_len);
+    }
+    if (n <= 0)
+        return n;
+
+    if (compact)
+        n = decode_compact(r->buf + r->start, hdr_len, hdr);
+    else
+        decode_header((char *)r->buf + r->start, hdr);
+    if (n == FAILED || is_valid_header(hdr) == FALSE) {
+        print_err(INVALID_FRAME);
+        return FAILED;
+    }
+    r->start += hdr_len;
+
+    // then the payload: what was read ahead of it, and the rest (if any)
+    uint32_t len = hdr->payload_len;
+    if (len == 0)
+        return SUCCESS;
+    char *buf = malloc((size_t)len + 1);
+    if (buf == NULL) {
+        print_err(MALLOC_FAILED);
+        return FAILED;
+    }
+    uint32_t have = r->end - r->start;
+    if (have > len)
+        have = len;
+    memcpy(buf, r->buf + r->start, have);
+    r->start += have;
+    if (have < len && (n = read_all(r->sockfd, buf + have, len - have)) <= 0) {
+        free(buf);
+        return check_io_err(n, "next_frame");
+    }
+    buf[len] = '\0';
+    *payload = buf;
+    return SUCCESS;
+}
+
+/* Reads the `len` bytes of payload of a frame into `*payload` (malloced,
+   and null-terminated so that a name can be used as it is), or sets it to
+   NULL if `len` is 0.
+ * Returns SUCCESS on success, FAILED on failure,
+   or EMPTY if a read() read nothing.
+ */
+int read_payload(int sockfd, uint32_t len, char **payload) {
+    *payload = NULL;
+    if (len == 0)
+        return SUCCESS;
+
+    char *buf = malloc((size_t)len + 1);
+    if (buf == NULL) {
+        print_err(MALLOC_FAILED);
+        return FAILED;
+    }
+    int n = read_all(sockfd, buf, len);
+    if (n <= 0) {
+        free(buf);
+        return check_io_err(n, "read_payload");
+    }
+    buf[len] = '\0';
+    *payload = buf;
+    return SUCCESS;
+}
+
+/* Reads into the read-ahead buffer until it holds at least `want` bytes
+   (at most READ_AHEAD) not used yet.
+ * Returns SUCCESS on success, FAILED on failure,
+   or EMPTY if a read() read nothing.
+ */
+int fill_reader(frame_reader *r, int want) {
+    if (r->end - r->start >= want)
+        return SUCCESS;
+
+    // not enough room left after them -> move them to the front
+    if (r->start + want > READ_AHEAD) {
+        memmove(r->buf, r->buf + r->start, r->end - r->start);
+        r->end -= r->start;
+        r->start = 0;
+    }
+    while (r->end - r->start < want) {
+        int n = read_some(r->sockfd, (char *)r->buf + r->end,
+                          READ_AHEAD - r->end);
+        if (n <= 0)
+            return n;
+        r->end += n;
+    }
+    return SUCCESS;
+}
+
+/* Encodes the header into `buf`, in network byte order.
+ */
+void encode_header(frame_header *hdr, char *buf) {
+    frame_header net = {
+        .magic = htons(hdr->magic),
+        .version = hdr->version,
+        .type = hdr->type,
+        .flags = htons(hdr->flags),
+        .channel = htons(hdr->channel),
+        .req_id = htonl(hdr->req_id),
+        .handle = htonl(hdr->handle),
+        .data1 = htonll(hdr->data1),
+        .payload_len = htonl(hdr->payload_len),
+        .budget_ms = htonl(hdr->budget_ms)
+    };
+    memcpy(buf, &net, FRAME_HEADER_SIZE);
+}
+
+/* Decodes the header at `buf` (in network byte order) into `hdr`.
+ */
+void decode_header(const char *buf, frame_header *hdr) {
+    memcpy(hdr, buf, FRAME_HEADER_SIZE);
+    hdr->magic = ntohs(hdr->magic);
+    hdr->flags = ntohs(hdr->flags);
+    hdr->channel = ntohs(hdr->channel);
+    hdr->req_id = ntohl(hdr->req_id);
+    hdr->handle = ntohl(hdr->handle);
+    hdr->data1 = ntohll(hdr->data1);
+    hdr->payload_len = ntohl(hdr->payload_len);
+    hdr->budget_ms = ntohl(hdr->budget_ms);
+}
+
+/* Encodes the header into `buf` in the compact format (see
+   next_frame).
+ * Returns the length of the encoded header.
+ */
+int encode_compact(frame_header *hdr, char *buf) {
+    uint8_t *p = (uint8_t *)buf + 2;
+    int64_t data1 = hdr->data1;
+    p = put_varint(p, hdr->flags);
+    p = put_varint(p, hdr->channel);
+    p = put_varint(p, hdr->req_id);
+    p = put_varint(p, hdr->handle);
+    p = put_varint(p, ((uint64_t)data1 << 1) ^ (data1 >> 63)); // zigzag
+    p = put_varint(p, hdr->payload_len);
+    if (hdr->flags & FRAME_DEADLINE)
+        p = put_varint(p, hdr->budget_ms);
+
+    int len = p - (uint8_t *)buf;
+    buf[0] = len;
+    buf[1] = hdr->type;
+    return len;
+}
+
+/* Decodes the compact header of `len` bytes at `buf` (followed by enough
+   readable bytes for the varints of a corrupt header running past its end,
+   see frame_reader) into `hdr`.
+ * Returns SUCCESS on success, FAILED if it is not `len` bytes long.
+ */
+int decode_compact(const uint8_t *buf, int len, frame_header *hdr) {
+    if (len < MIN_COMPACT_HEADER || len > MAX_COMPACT_HEADER)
+        return FAILED;
+
+    const uint8_t *p = buf + 2;
+    hdr->magic = FRAME_MAGIC; // implied by the connection
+    hdr->version = FRAME_VERSION;
+    hdr->type = buf[1];
+    hdr->flags = get_varint(&p);
+    hdr->channel = get_varint(&p);
+    hdr->req_id = get_varint(&p);
+    hdr->handle = get_varint(&p);
+    uint64_t zz = get_varint(&p);
+    hdr->data1 = (zz >> 1) ^ -(zz & 1);
+    hdr->payload_len = get_varint(&p);
+    hdr->budget_ms = 0;
+    if (hdr->flags & FRAME_DEADLINE)
+        hdr->budget_ms = get_varint(&p);
+
+    // a field running past the header (or not filling it) -> corrupt
+    return p == buf + len ? SUCCESS : FAILED;
+}
+
+/* Writes `v` at `p` as a LEB128 varint (7 bits per byte, lowest first, the
+   top bit set on every byte but the last).
+ * Returns the position after it.
+ */
+uint8_t *put_varint(uint8_t *p, uint64_t v) {
+    while (v >= 0x80) {
+        *p++ = v | 0x80;
+        v >>= 7;
+    }
+    *p++ = v;
+    return p;
+}
+
+/* Reads the LEB128 varint at `*p` (with at least 8 readable bytes from
+   there), moving `*p` past it.
+ * Varints of up to 8 bytes (56 bits) are decoded from a single load,
+   without a branch per byte: the first byte with its top bit clear ends
+   it, and the 7-bit groups before are then packed together.
+ * Returns the value read.
+ */
+uint64_t get_varint(const uint8_t **p) {
+    uint64_t w = load_le64(*p);
+    uint64_t ends = ~w & VARINT_MORE;
+    if (ends == 0) // over 8 bytes (only for huge data1)
+        return get_long_varint(p);
+
+    // the bytes up to the first end, and how many
+    w &= ends ^ (ends - 1);
+    *p += (__builtin_ctzll(ends) + 1) / 8;
+
+    return (w & 0x7f)
+        | ((w >> 1) & (0x7fULL << 7))
+        | ((w >> 2) & (0x7fULL << 14))
+        | ((w >> 3) & (0x7fULL << 21))
+        | ((w >> 4) & (0x7fULL << 28))
+        | ((w >> 5) & (0x7fULL << 35))
+        | ((w >> 6) & (0x7fULL << 42))
+        | ((w >> 7) & (0x7fULL << 49));
+}
+
+/* Reads the LEB128 varint at `*p` byte by byte (at most 10 bytes), moving
+   `*p` past it.
+ * Returns the value read.
+ */
+uint64_t get_long_varint(const uint8_t **p) {
+    uint64_t v = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        uint8_t b = *(*p)++;
+        v |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80))
+            break;
+    }
+    return v;
+}
+
+/* Returns the 8 bytes at `p` as a little-endian integer.
+ */
+uint64_t load_le64(const uint8_t *p) {
+    uint64_t w;
+    memcpy(&w, p, sizeof(w));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    w = __builtin_bswap64(w);
+#endif
+    return w;
+}
+
+/* Returns TRUE if the (decoded) header is valid, FALSE otherwise.
+ */
+int is_valid_header(frame_header *hdr) {
+    if (hdr->magic != FRAME_MAGIC || hdr->version != FRAME_VERSION
+            || (hdr->flags & ~FRAME_FLAGS) != 0)
+        return FALSE;
+    // (only data2 is ever split over several frames)
+    if ((hdr->flags & FRAME_MORE) && hdr->type != CALL_REQ
+            && hdr->type != CAST_REQ && hdr->type != SUCCESS_STAT)
+        return FALSE;
+
+    if (hdr->flags & FRAME_RESPONSE)
+        return hdr->type >= FAILURE_STAT && hdr->type <= OVERLOADED_STAT;
+
+    switch (hdr->type) {
+        case FIND_REQ: // the name
+            return hdr->payload_len >= MIN_NAME_LEN
+                && hdr->payload_len <= MAX_NAME_LEN;
+        case CALL_REQ: // data2
+        case CAST_REQ:
+            return TRUE;
+        case CLOSE_REQ:
+        case PING_REQ:
+        case HELLO_REQ:
+            return hdr->payload_len == 0;
+        default: // CALL_DL_REQ is a CALL_REQ with FRAME_DEADLINE in v2
+            return FALSE;
+    }
+}
@@ -0,0 +1,132 @@
+/*-----------------------------------------------------------------------------
+ * Project 2
+ * rpc_frame.h :
+              = the interface of the module `rpc_frame` of the project
+              = framing of the version 2 of the protocol: every request and
+                response is a fixed-size header, followed by its payload
+ ----------------------------------------------------------------------------*/
+
+#ifndef RPC_FRAME_H
+#define RPC_FRAME_H
+
+#include <stdint.h>
+
+// first bytes of a frame ("RP"); a v1 prefix always starts with a 0 byte
+#define FRAME_MAGIC 0x5250
+#define FRAME_VERSION 2
+#define FRAME_HEADER_SIZE 32
+// payloads up to this size go out in the same write as their header
+#define MAX_INLINE_PAYLOAD 4064
+// size of a compact header: its length and type, then 6 or 7 varints
+#define MIN_COMPACT_HEADER 8
+#define MAX_COMPACT_HEADER 38
+// bytes read ahead from a connection
+#define READ_AHEAD 4096
+
+// Flags of a frame
+#define FRAME_DEADLINE 0x1 // request: `budget_ms` is set
+#define FRAME_RESPONSE 0x2 // a response (types overlap with requests')
+#define FRAME_COMPACT 0x4  // HELLO: compact headers asked for / agreed to
+#define FRAME_MUX 0x8      // HELLO: channels asked for / agreed to
+#define FRAME_MORE 0x10    // payload goes on in the channel's next frame
+#define FRAME_FLAGS (FRAME_DEADLINE | FRAME_RESPONSE | FRAME_COMPACT \
+                     | FRAME_MUX | FRAME_MORE)
+
+/* Header of a frame, as sent on the wire (in network byte order).
+ * Every field is at an offset that is a multiple of its size, so it has no
+   padding, and is read with a single read of FRAME_HEADER_SIZE bytes.
+ */
+typedef struct {
+    uint16_t magic;         // FRAME_MAGIC
+    uint8_t version;        // FRAME_VERSION
+    uint8_t type;           // enum PREFIX (request) or REQ_STATUS (response)
+    uint16_t flags;         // FRAME_*
+    uint16_t channel;       // of a multiplexed connection (see rpc_mux.h),
+                            // 0 otherwise
+    uint32_t req_id;        // picked by the client, echoed in the response
+    uint32_t handle;        // the function called / found
+    uint64_t data1;
+    uint32_t payload_len;   // bytes following the header
+    uint32_t budget_ms;     // time left to the request (FRAME_DEADLINE)
+} frame_header;
+
+/* Read-ahead buffer of a v2 connection: each read() takes whatever the
+   socket has (up to READ_AHEAD bytes), so that a small frame, header and
+   payload, usually comes in with a single one.
+ */
+typedef struct {
+    int sockfd;
+    int start;              // first byte not used yet
+    int end;                // end of the bytes read
+    // with room past the end for decoding a (corrupt) compact header in
+    // place: up to 10 bytes per varint, and 8-byte loads
+    uint8_t buf[READ_AHEAD + 2 * MAX_COMPACT_HEADER + 8];
+} frame_reader;
+
+/* Returns TRUE if the first 4 bytes read from a connection (at `buf`) are
+   those of a frame, FALSE if they are a v1 prefix.
+ */
+int is_frame(const char *buf);
+
+/* Writes the frame (the header's magic and version are filled in here),
+   with `hdr->payload_len` bytes of payload, with a compact header if
+   `compact` is TRUE.
+ * Returns SUCCESS on success, FAILED on failure,
+   or EMPTY if a write() returned 0.
+ */
+int write_frame(int sockfd, frame_header *hdr, const char *payload,
+                int compact);
+
+/* Encodes the header (its magic and version are filled in here) into
+   `buf`, with the compact format if `compact` is TRUE (see next_frame).
+ * Returns the length of the encoded header.
+ */
+int encode_frame_header(frame_header *hdr, char *buf, int compact);
+
+/* Decodes the header of the frame at `buf`, of which `len` bytes have been
+   read (with room after them, as in a frame_reader), into `hdr`, with the
+   compact format if `compact` is TRUE.
+ * Returns the length of the header if it was all read and is valid, 0 if
+   more of it is needed, or FAILED if it is invalid.
+ */
+int parse_frame_header(const uint8_t *buf, int len, int compact,
+                       frame_header *hdr);
+
+/* Reads the header of a frame into `buf` (of FRAME_HEADER_SIZE bytes),
+   whose first `have` bytes were read already, and decodes it into `hdr`.
+ * Everything needed to dispatch the frame is checked here: once it is
+   read, only its payload is left to read.
+ * Returns SUCCESS on success, FAILED on failure or an invalid header,
+   or EMPTY if a read() read nothing.
+ */
+int read_header(int sockfd, char *buf, int have, frame_header *hdr);
+
+/* Sets up an empty read-ahead buffer for the socket.
+ */
+void init_reader(frame_reader *r, int sockfd);
+
+/* Returns the number of bytes read ahead, but not used yet.
+ */
+int buffered_bytes(frame_reader *r);
+
+/* Reads the next frame from the read-ahead buffer of the connection,
+   its header into `hdr` and its payload into `*payload` (as read_payload).
+ * With `compact` (as agreed to in the HELLO of the connection), the header
+   is its length, its type, then the other fields as LEB128 varints (data1
+   zigzag-encoded), budget_ms only with FRAME_DEADLINE. Most take a single
+   byte.
+ * Returns SUCCESS on success, FAILED on failure or an invalid header,
+   or EMPTY if a read() read nothing.
+ */
+int next_frame(frame_reader *r, int compact, frame_header *hdr,
+               char **payload);
+
+/* Reads the `len` bytes of payload of a frame into `*payload` (malloced,
+   and null-terminated so that a name can be used as it is), or sets it to
+   NULL if `len` is 0.
+ * Returns SUCCESS on success, FAILED on failure,
+   or EMPTY if a read() read nothing.
+ */
+int read_payload(int sockfd, uint32_t len, char **payload);
+
+#endif
@@ -1,63 +1,251 @@
 #include "rpc_func_manager.h"
 #include "rpc_safety.h"
+#include "rpc_shared.h"
+#include "rpc_cache.h"
 #include <string.h>
 #include <stdlib.h>
+#include <sched.h>
 
-/* Creates a function with the given name and handler.
- * Returns the pointer to the rpc_func on success, NULL otherwise.
+// Where a function is found (a slot is never reused)
+typedef struct {
+    uint64_t hash;         // of its name
+    uint32_t name_off;     // its name, in the registry's names
+    uint32_t name_len;
+    uint32_t current;      // index of its current version
+} func_slot;
+
+struct func_registry {
+    uint32_t n_funcs;      // slots published so far
+    uint8_t lock;          // spinlock of the writers (test-and-set)
+    uint64_t last_version; // only touched by writers, from here on
+    uint32_t n_used;       // versions ever used
+    uint32_t retired_head; // oldest retired version, in `retired`
+    uint32_t n_retired;
+    uint32_t names_used;   // bytes
+    func_slot slots[REGISTRY_FUNCS];
+    rpc_func versions[REGISTRY_VERSIONS];
+    uint32_t retired[REGISTRY_VERSIONS]; // ring of versions no longer current
+    char names[REGISTRY_NAME_BYTES];
+};
+
+/******* Private functions *******/
+int find_slot(func_registry *reg, char *name);
+uint32_t new_version(func_registry *reg);
+void publish_version(rpc_func *dst, rpc_func *src);
+void swap_version(func_registry *reg, uint32_t idx, uint32_t v);
+void lock_registry(func_registry *reg);
+void unlock_registry(func_registry *reg);
+
+
+/* Creates an empty registry.
+ * Returns the registry on success, NULL otherwise.
+ */
+func_registry *create_registry(void) {
+    return create_shared(sizeof(func_registry));
+}
+
+/* Registers a function with the given name and version (its handler,
+   priority class, flags and plugin; its version number is set here), or
+   replaces the function of that name.
+ * Returns the index of the function on success, FAILED otherwise.
  */
-rpc_func *create_rpc_func(char *name, rpc_handler handler) {
-    if (!name || !handler || check_name(name) == FAILED) {
-        return NULL;
+int register_func(func_registry *reg, char *name, rpc_func *func) {
+    if (!reg || !name || !func || !func->handler
+            || check_name(name) == FAILED) {
+        return FAILED;
+    }
+
+    lock_registry(reg);
+    int idx = find_slot(reg, name);
+    size_t len = strlen(name);
+    if (idx == FAILED && (reg->n_funcs == REGISTRY_FUNCS
+                          || len > REGISTRY_NAME_BYTES - reg->names_used)) {
+        // no room for another one
+        unlock_registry(reg);
+        return FAILED;
     }
 
-    rpc_func *f = malloc(sizeof(*f));
-    if (!f) {
-        print_err(MALLOC_FAILED);
-        return NULL;
+    // the new version, written where no one reads it yet
+    func->version = ++reg->last_version;
+    uint32_t v = new_version(reg);
+    publish_version(&reg->versions[v], func);
+
+    if (idx != FAILED) {
+        // swap it in: calls from now on get it, running ones keep the old
+        swap_version(reg, idx, v);
+    } else {
+        // a new slot, counted once it is complete
+        idx = reg->n_funcs;
+        func_slot *slot = &reg->slots[idx];
+        memcpy(reg->names + reg->names_used, name, len);
+        slot->name_off = reg->names_used;
+        slot->name_len = len;
+        slot->hash = hash_bytes(0, name, len);
+        slot->current = v;
+        reg->names_used += len;
+        __atomic_store_n(&reg->n_funcs, idx + 1, __ATOMIC_RELEASE);
     }
-    
-    f->name = strdup(name);
-    f->handler = handler;
-    return f;
+    unlock_registry(reg);
+    return idx;
+}
+
+/* Removes the function at index `idx`, if its current version is still
+   `version` (it may have been registered again since).
+ * Returns SUCCESS if removed, FAILED otherwise.
+ */
+int unregister_func(func_registry *reg, uint32_t idx, uint64_t version) {
+    if (!reg)
+        return FAILED;
+    lock_registry(reg);
+    if (idx >= reg->n_funcs
+            || reg->versions[reg->slots[idx].current].version != version) {
+        unlock_registry(reg);
+        return FAILED;
+    }
+
+    // a version with no handler: calls from now on don't find it
+    rpc_func removed = {.handler = NULL, .plugin = NO_PLUGIN,
+                        .version = ++reg->last_version};
+    uint32_t v = new_version(reg);
+    publish_version(&reg->versions[v], &removed);
+    swap_version(reg, idx, v);
+    unlock_registry(reg);
+    return SUCCESS;
+}
+
+/* Returns the number of functions ever registered (the indices of the
+   functions are below it, removed ones included).
+ */
+uint32_t count_funcs(func_registry *reg) {
+    if (!reg)
+        return 0;
+    return __atomic_load_n(&reg->n_funcs, __ATOMIC_ACQUIRE);
 }
 
-/* Compares the RPC function's name to a string.
- * Returns 0 if they are equal,
- * negative if the function's name compares less than the string, 
- * positive otherwise.
+/* Looks up a function by name.
+ * Returns the index of the function if found, FAILED otherwise.
  */
-int cmp_func_name(void *func, void *s) {
-    return strcmp(((rpc_func *)func)->name, (char *)s);
+int find_func(func_registry *reg, char *name) {
+    rpc_func func;
+    int idx = find_slot(reg, name);
+    if (idx == FAILED || get_func(reg, idx, &func) == FAILED)
+        return FAILED; // not there, or removed
+    return idx;
 }
 
-/* Replaces the handler of the RPC function at index `idx` 
-   in the array `functions`.
- * Returns SUCCESS on success, FAILED otherwise.
+/* Looks up the slot of a function by name (even if removed).
+ * Returns its index if found, FAILED otherwise.
  */
-int replace_func(array_t *functions, int idx, rpc_handler new_handler) {
-	if (!functions || !is_valid_idx(functions, idx) || !new_handler) {
+int find_slot(func_registry *reg, char *name) {
+    if (!reg || !name)
         return FAILED;
+    size_t len = strlen(name);
+    uint64_t hash = hash_bytes(0, name, len);
+    uint32_t n = __atomic_load_n(&reg->n_funcs, __ATOMIC_ACQUIRE);
+    for (uint32_t i = 0; i < n; i++) {
+        func_slot *slot = &reg->slots[i];
+        if (slot->hash == hash && slot->name_len == len
+                && memcmp(reg->names + slot->name_off, name, len) == 0)
+            return i;
     }
-	
-    rpc_func *func = get_elem_at(functions, idx);
-    if (func == NULL) {
+    return FAILED;
+}
+
+/* Copies the current version of the function at index `idx` to `func`.
+ * Returns SUCCESS on success, FAILED if there is no such function (or it
+   was removed).
+ */
+int get_func(func_registry *reg, uint32_t idx, rpc_func *func) {
+    if (!reg || idx >= __atomic_load_n(&reg->n_funcs, __ATOMIC_ACQUIRE))
         return FAILED;
+
+    func_slot *slot = &reg->slots[idx];
+    while (1) {
+        uint32_t v = __atomic_load_n(&slot->current, __ATOMIC_ACQUIRE);
+        rpc_func *src = &reg->versions[v];
+        uint64_t version = __atomic_load_n(&src->version, __ATOMIC_ACQUIRE);
+        func->handler = __atomic_load_n(&src->handler, __ATOMIC_RELAXED);
+        func->prio = __atomic_load_n(&src->prio, __ATOMIC_RELAXED);
+        func->flags = __atomic_load_n(&src->flags, __ATOMIC_RELAXED);
+        func->plugin = __atomic_load_n(&src->plugin, __ATOMIC_RELAXED);
+        func->plugin_gen = __atomic_load_n(&src->plugin_gen,
+                                           __ATOMIC_RELAXED);
+        func->version = version;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+        // still the same version: the copy is whole
+        // (otherwise it was retired long ago and reused meanwhile)
+        if (version != 0
+                && __atomic_load_n(&src->version, __ATOMIC_RELAXED) == version)
+            return func->handler == NULL ? FAILED : SUCCESS;
     }
+}
 
-	func->handler = new_handler;
-    return SUCCESS;
+/* Returns the version number of the current version of the function at
+   index `idx` (0 if there is no such function).
+ */
+uint64_t func_version(func_registry *reg, uint32_t idx) {
+    rpc_func func;
+    if (get_func(reg, idx, &func) == FAILED)
+        return 0;
+    return func.version;
+}
+
+/* Frees the registry.
+ */
+void free_registry(func_registry *reg) {
+    free_shared(reg, sizeof(func_registry));
 }
 
-/* Frees the RPC function.
+/* Picks the place of a new version (with the registry locked): one never
+   used, or else the one retired the longest ago.
+ * Returns its index.
  */
-void free_rpc_func(void *f) {
-    if (f == NULL)
-        return;
+uint32_t new_version(func_registry *reg) {
+    if (reg->n_used < REGISTRY_VERSIONS)
+        return reg->n_used++;
+    // at most REGISTRY_FUNCS versions are current, so plenty are retired
+    uint32_t v = reg->retired[reg->retired_head];
+    reg->retired_head = (reg->retired_head + 1) % REGISTRY_VERSIONS;
+    reg->n_retired--;
+    return v;
+}
 
-    rpc_func *func = f;
-    free(func->name);
-    func->name = NULL;
-    free(func);
-    func = NULL;
+/* Writes the version `src` to `dst`, which readers may still be copying
+   (if it was retired): they see it change, and copy again.
+ */
+void publish_version(rpc_func *dst, rpc_func *src) {
+    __atomic_store_n(&dst->version, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&dst->handler, src->handler, __ATOMIC_RELAXED);
+    __atomic_store_n(&dst->prio, src->prio, __ATOMIC_RELAXED);
+    __atomic_store_n(&dst->flags, src->flags, __ATOMIC_RELAXED);
+    __atomic_store_n(&dst->plugin, src->plugin, __ATOMIC_RELAXED);
+    __atomic_store_n(&dst->plugin_gen, src->plugin_gen, __ATOMIC_RELAXED);
+    __atomic_store_n(&dst->version, src->version, __ATOMIC_RELEASE);
+}
+
+/* Makes version `v` the current one of the function at index `idx` (with
+   the registry locked), retiring the one it replaces.
+ */
+void swap_version(func_registry *reg, uint32_t idx, uint32_t v) {
+    uint32_t old = __atomic_exchange_n(&reg->slots[idx].current, v,
+                                       __ATOMIC_ACQ_REL);
+    reg->retired[(reg->retired_head + reg->n_retired)
+                 % REGISTRY_VERSIONS] = old;
+    reg->n_retired++;
+}
+
+/* Locks the registry (against other writers).
+ */
+void lock_registry(func_registry *reg) {
+    while (__atomic_test_and_set(&reg->lock, __ATOMIC_ACQUIRE)) {
+        sched_yield();
+    }
+}
+
+/* Unlocks the registry.
+ */
+void unlock_registry(func_registry *reg) {
+    __atomic_clear(&reg->lock, __ATOMIC_RELEASE);
 }
@@ -2,42 +2,86 @@
  * Project 2
  * Created by Angel He (angelh1@student.unimelb.edu.au) 09/05/2023
  * rpc_func_manager.h :
-              = the interface of the module `rpc_func_manager` of the project 
+              = the interface of the module `rpc_func_manager` of the project
               = includes the general functions for managing RPC functions
+                (the registry, shared by the server and its children)
  ----------------------------------------------------------------------------*/
 
 #ifndef RPC_FUNC_MANAGER_H
 #define RPC_FUNC_MANAGER_H
 
-#include "array.h"
+#include <stdint.h>
 #include "rpc.h"
 
-// storage structure in server
+// functions registered at most (a handle is an index below this)
+#define REGISTRY_FUNCS 1024
+// versions of functions kept: the current one of each, and retired ones
+#define REGISTRY_VERSIONS (4 * REGISTRY_FUNCS)
+// bytes for the names of all the functions
+#define REGISTRY_NAME_BYTES (256 << 10)
+// plugin of the functions of the program itself
+#define NO_PLUGIN -1
+
+// A version of a function, as registered (never changed once published)
 typedef struct {
-    char *name;
-    rpc_handler handler;
+    rpc_handler handler;   // NULL once the function is removed
+    int prio;              // priority class (enum RPC_PRIORITY)
+    int flags;             // RPC_FUNC_* flags
+    uint64_t version;      // increases every time a function is registered
+    int plugin;            // where the handler is from (or NO_PLUGIN)
+    uint32_t plugin_gen;   // ... which load of that plugin
 } rpc_func;
 
-/* Creates a function with the given name and handler.
- * Returns the pointer to the rpc_func on success, NULL otherwise.
+/* The registered functions, in shared memory: a function registered (or
+   replaced) while the server runs is seen at once by every connection.
+ * Lookups never lock: a function's current version is published with an
+   atomic swap (read-copy-update), and is copied by whoever calls it, so a
+   call already running finishes on the version it started with.
+ * Registering takes a lock, only against other registrations.
+ */
+typedef struct func_registry func_registry;
+
+/* Creates an empty registry.
+ * Returns the registry on success, NULL otherwise.
+ */
+func_registry *create_registry(void);
+
+/* Registers a function with the given name and version (its handler,
+   priority class, flags and plugin; its version number is set here), or
+   replaces the function of that name.
+ * Returns the index of the function on success, FAILED otherwise.
+ */
+int register_func(func_registry *reg, char *name, rpc_func *func);
+
+/* Removes the function at index `idx`, if its current version is still
+   `version` (it may have been registered again since).
+ * Returns SUCCESS if removed, FAILED otherwise.
+ */
+int unregister_func(func_registry *reg, uint32_t idx, uint64_t version);
+
+/* Returns the number of functions ever registered (the indices of the
+   functions are below it, removed ones included).
+ */
+uint32_t count_funcs(func_registry *reg);
+
+/* Looks up a function by name.
+ * Returns the index of the function if found, FAILED otherwise.
  */
-rpc_func *create_rpc_func(char *name, rpc_handler handler);
+int find_func(func_registry *reg, char *name);
 
-/* Compares the RPC function's name to a string.
- * Returns 0 if they are equal,
- * negative if the function's name compares less than the string, 
- * positive otherwise.
+/* Copies the current version of the function at index `idx` to `func`.
+ * Returns SUCCESS on success, FAILED if there is no such function (or it
+   was removed).
  */
-int cmp_func_name(void *func, void *s);
+int get_func(func_registry *reg, uint32_t idx, rpc_func *func);
 
-/* Replaces the handler of the RPC function at index `idx` 
-   in the array `functions`.
- * Returns SUCCESS on success, FAILED otherwise
+/* Returns the version number of the current version of the function at
+   index `idx` (0 if there is no such function).
  */
-int replace_func(array_t *functions, int idx, rpc_handler new_handler);
+uint64_t func_version(func_registry *reg, uint32_t idx);
 
-/* Frees the RPC function.
+/* Frees the registry.
  */
-void free_rpc_func(void *f);
+void free_registry(func_registry *reg);
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,175 @@
+#define _GNU_SOURCE // accept4
+#include "rpc_handoff.h"
+#include "rpc_safety.h"
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+// What is said on a handoff connection (one byte each)
+#define HANDOFF_LISTENER 'L' // old -> new: with the listening socket
+#define HANDOFF_READY 'R'    // new -> old: serving now
+// how long a new server waits for the listening socket
+#define HANDOFF_TIMEOUT_S 5
+
+/******* Private functions *******/
+int handoff_address(char *path, struct sockaddr_un *addr);
+
+
+/* Creates a Unix socket at `path` (replacing any file there), listening
+   for a new server to take over.
+ * Returns its file descriptor on success, FAILED otherwise.
+ */
+int create_handoff_socket(char *path) {
+    struct sockaddr_un addr;
+    if (handoff_address(path, &addr) == FAILED)
+        return FAILED;
+
+    int sd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sd < 0) {
+        perror("socket");
+        return FAILED;
+    }
+    // (the socket of the server this one took over from, most likely)
+    unlink(path);
+    if (bind(sd, (struct sockaddr *)&addr, sizeof(addr)) < 0
+            || listen(sd, 1) < 0) {
+        perror(path);
+        close(sd);
+        return FAILED;
+    }
+    return sd;
+}
+
+/* Accepts the connection of a new server on the handoff socket, and sends
+   it (a copy of) the listening socket.
+ * Returns the file descriptor of the connection on success, FAILED
+   otherwise.
+ */
+int send_listener(int handoff_sd, int listening_sd) {
+    int conn = accept4(handoff_sd, NULL, NULL, SOCK_CLOEXEC);
+    if (conn < 0) {
+        if (errno != EINTR)
+            perror("accept");
+        return FAILED;
+    }
+
+    // one byte of data, carrying the file descriptor
+    char byte = HANDOFF_LISTENER;
+    struct iovec iov = {.iov_base = &byte, .iov_len = 1};
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    memset(&control, 0, sizeof(control));
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1,
+                         .msg_control = control.buf,
+                         .msg_controllen = sizeof(control.buf)};
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &listening_sd, sizeof(int));
+
+    if (sendmsg(conn, &msg, MSG_NOSIGNAL) != 1) {
+        perror("sendmsg");
+        close(conn);
+        return FAILED;
+    }
+    return conn;
+}
+
+/* Connects to the server whose handoff socket is at `path`, and receives
+   its listening socket; the connection is put at `conn`.
+ * Returns the file descriptor of the listening socket on success, FAILED
+   otherwise.
+ */
+int receive_listener(char *path, int *conn) {
+    struct sockaddr_un addr;
+    if (handoff_address(path, &addr) == FAILED)
+        return FAILED;
+
+    int sd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sd < 0) {
+        perror("socket");
+        return FAILED;
+    }
+    struct timeval timeout = {.tv_sec = HANDOFF_TIMEOUT_S};
+    setsockopt(sd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    if (connect(sd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror(path);
+        close(sd);
+        return FAILED;
+    }
+
+    char byte = 0;
+    struct iovec iov = {.iov_base = &byte, .iov_len = 1};
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1,
+                         .msg_control = control.buf,
+                         .msg_controllen = sizeof(control.buf)};
+    ssize_t n;
+    while ((n = recvmsg(sd, &msg, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR);
+    struct cmsghdr *cmsg = n == 1 ? CMSG_FIRSTHDR(&msg) : NULL;
+    if (byte != HANDOFF_LISTENER || cmsg == NULL
+            || cmsg->cmsg_level != SOL_SOCKET
+            || cmsg->cmsg_type != SCM_RIGHTS
+            || cmsg->cmsg_len != CMSG_LEN(sizeof(int))) {
+        if (n < 0)
+            perror("recvmsg");
+        print_err(CONNECTION_FAILED);
+        close(sd);
+        return FAILED;
+    }
+
+    int listening_sd;
+    memcpy(&listening_sd, CMSG_DATA(cmsg), sizeof(int));
+    *conn = sd;
+    return listening_sd;
+}
+
+/* Tells the server taken over from (on the connection) that this one is
+   serving now, and closes the connection.
+ * Returns SUCCESS on success, FAILED otherwise.
+ */
+int send_ready(int conn) {
+    char byte = HANDOFF_READY;
+    int res = send(conn, &byte, 1, MSG_NOSIGNAL) == 1 ? SUCCESS : FAILED;
+    if (res == FAILED)
+        perror("send");
+    close(conn);
+    return res;
+}
+
+/* Reads what the new server says on the connection (once readable), and
+   closes the connection.
+ * Returns TRUE if it is serving now, FALSE if it gave up.
+ */
+int wait_ready(int conn) {
+    char byte = 0;
+    ssize_t n;
+    while ((n = read(conn, &byte, 1)) < 0 && errno == EINTR);
+    close(conn);
+    return n == 1 && byte == HANDOFF_READY ? TRUE : FALSE;
+}
+
+/* Writes the address of the Unix socket at `path` to `addr`.
+ * Returns SUCCESS on success, FAILED if the path is too long.
+ */
+int handoff_address(char *path, struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (path == NULL || *path == '\0'
+            || strlen(path) >= sizeof(addr->sun_path)) {
+        print_err(INVALID_INPUT);
+        return FAILED;
+    }
+    strcpy(addr->sun_path, path);
+    return SUCCESS;
+}
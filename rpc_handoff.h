@@ -0,0 +1,53 @@
+/*-----------------------------------------------------------------------------
+ * Project 2
+ * rpc_handoff.h :
+              = the interface of the module `rpc_handoff` of the project
+              = handing the listening socket of a running server over to
+                a new server process (over a Unix socket, with SCM_RIGHTS)
+ ----------------------------------------------------------------------------*/
+
+#ifndef RPC_HANDOFF_H
+#define RPC_HANDOFF_H
+
+/* How a handoff goes:
+ * 1. The running server listens on a Unix socket (create_handoff_socket).
+ * 2. The new server connects to it, and gets a copy of the listening
+      socket (send_listener / receive_listener). Both now accept from the
+      same queue, so no connection is refused meanwhile.
+ * 3. Once ready to serve, the new server says so (send_ready), and the
+      running server stops accepting and drains (see wait_ready).
+ */
+
+/* Creates a Unix socket at `path` (replacing any file there), listening
+   for a new server to take over.
+ * Returns its file descriptor on success, FAILED otherwise.
+ */
+int create_handoff_socket(char *path);
+
+/* Accepts the connection of a new server on the handoff socket, and sends
+   it (a copy of) the listening socket.
+ * Returns the file descriptor of the connection on success, FAILED
+   otherwise.
+ */
+int send_listener(int handoff_sd, int listening_sd);
+
+/* Connects to the server whose handoff socket is at `path`, and receives
+   its listening socket; the connection is put at `conn`.
+ * Returns the file descriptor of the listening socket on success, FAILED
+   otherwise.
+ */
+int receive_listener(char *path, int *conn);
+
+/* Tells the server taken over from (on the connection) that this one is
+   serving now, and closes the connection.
+ * Returns SUCCESS on success, FAILED otherwise.
+ */
+int send_ready(int conn);
+
+/* Reads what the new server says on the connection (once readable), and
+   closes the connection.
+ * Returns TRUE if it is serving now, FALSE if it gave up.
+ */
+int wait_ready(int conn);
+
+#endif
@@ -3,9 +3,161 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <limits.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
 #include "rpc_io_helper.h"
 #include "rpc_safety.h"
 
+// how this thread waits on non-blocking sockets (NULL -> poll_fd)
+static __thread io_wait_fn io_wait_hook = NULL;
+// when I/O on non-blocking sockets gives up, and whether it did
+static __thread uint64_t io_deadline = NO_DEADLINE;
+static __thread int io_timed_out = FALSE;
+
+/******* Private functions *******/
+int should_wait(int sockfd, int n, short events);
+
+
+/* Sets the function used by this thread to wait on non-blocking sockets
+   (NULL to go back to poll_fd).
+ * This is how the coroutine runtime suspends a call until its data arrives.
+ */
+void set_io_wait_hook(io_wait_fn hook) {
+	io_wait_hook = hook;
+}
+
+/* Returns the function currently used by this thread to wait on sockets
+   (NULL if poll_fd is used).
+ */
+io_wait_fn get_io_wait_hook(void) {
+	return io_wait_hook;
+}
+
+/* Waits with poll(2) until `fd` is ready for `events`, or `timeout_ms`
+   milliseconds have passed (negative for no timeout).
+ * Returns SUCCESS if ready, EMPTY on timeout, FAILED on error.
+ */
+int poll_fd(int fd, short events, int timeout_ms) {
+	struct pollfd pfd = {.fd = fd, .events = events};
+	int n;
+	while ((n = poll(&pfd, 1, timeout_ms)) < 0 && errno == EINTR);
+	if (n < 0) {
+		perror("poll");
+		return FAILED;
+	}
+	return n == 0 ? EMPTY : SUCCESS;
+}
+
+/* Waits until `fd` is ready for `events` using this thread's wait function.
+ * Returns SUCCESS if ready, EMPTY on timeout, FAILED on error.
+ */
+int wait_for_fd(int fd, short events, int timeout_ms) {
+	if (io_wait_hook != NULL)
+		return io_wait_hook(fd, events, timeout_ms);
+	return poll_fd(fd, events, timeout_ms);
+}
+
+/* Applies the options to the (TCP) socket.
+ * Returns SUCCESS on success, FAILED if an option could not be set.
+ */
+int apply_sock_opts(int sockfd, const rpc_sock_opts *opts) {
+	if (opts == NULL)
+		return SUCCESS;
+	int res = SUCCESS;
+	int on = 1;
+	int nodelay = opts->nodelay != 0;      // set either way, so that it can
+	int keepalive = opts->keepalive_s > 0; // be turned off again
+
+	if (setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &nodelay,
+	               sizeof(nodelay)) < 0)
+		res = FAILED;
+	if (opts->quickack && setsockopt(sockfd, IPPROTO_TCP, TCP_QUICKACK,
+	                                 &on, sizeof(on)) < 0)
+		res = FAILED;
+	if (setsockopt(sockfd, SOL_SOCKET, SO_KEEPALIVE, &keepalive,
+	               sizeof(keepalive)) < 0)
+		res = FAILED;
+	if (keepalive && setsockopt(sockfd, IPPROTO_TCP, TCP_KEEPIDLE,
+	                            &opts->keepalive_s, sizeof(int)) < 0)
+		res = FAILED;
+	if (opts->sndbuf > 0 && setsockopt(sockfd, SOL_SOCKET, SO_SNDBUF,
+	                                   &opts->sndbuf, sizeof(int)) < 0)
+		res = FAILED;
+	if (opts->rcvbuf > 0 && setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF,
+	                                   &opts->rcvbuf, sizeof(int)) < 0)
+		res = FAILED;
+
+	if (res == FAILED)
+		perror("setsockopt");
+	return res;
+}
+
+/* Turns TCP_QUICKACK back on for the socket (the kernel turns it off again
+   by itself), if the options ask for it.
+ */
+void rearm_quickack(int sockfd, const rpc_sock_opts *opts) {
+	int on = 1;
+	if (opts != NULL && opts->quickack)
+		setsockopt(sockfd, IPPROTO_TCP, TCP_QUICKACK, &on, sizeof(on));
+}
+
+/* Returns the current time of the monotonic clock, in nanoseconds.
+ */
+uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * NS_PER_MS * MS_PER_S + ts.tv_nsec;
+}
+
+/* Makes every following read/write on a non-blocking socket (from this
+   thread) fail with ETIMEDOUT once the monotonic clock reaches
+   `deadline_ns`, or never for NO_DEADLINE.
+ */
+void set_io_deadline(uint64_t deadline_ns) {
+	io_deadline = deadline_ns;
+	io_timed_out = FALSE;
+}
+
+/* Returns the deadline set with set_io_deadline() (NO_DEADLINE if none).
+ */
+uint64_t get_io_deadline(void) {
+	return io_deadline;
+}
+
+/* Records that an operation of this thread ran out of time without reading
+   or writing (waiting for a response to be read by another thread), as if
+   its own I/O had: see io_deadline_passed().
+ */
+void note_io_timeout(void) {
+	io_timed_out = TRUE;
+	errno = ETIMEDOUT;
+}
+
+/* Returns TRUE if an I/O operation failed because of the deadline set with
+   set_io_deadline(), FALSE otherwise.
+ */
+int io_deadline_passed(void) {
+	return io_timed_out;
+}
+
+/* Returns the number of whole milliseconds left until `deadline_ns`
+   (rounded up; 0 if it has passed), or -1 for NO_DEADLINE.
+ */
+int ms_until(uint64_t deadline_ns) {
+	if (deadline_ns == NO_DEADLINE)
+		return -1;
+	uint64_t now = now_ns();
+	if (deadline_ns <= now)
+		return 0;
+	uint64_t ms = (deadline_ns - now + NS_PER_MS - 1) / NS_PER_MS;
+	return ms > INT_MAX ? INT_MAX : (int)ms;
+}
+
 
 /* Fully writes `len` bytes of data from the buffer to the socket.
  * Returns the actual number of bytes written on success;
@@ -18,6 +170,8 @@ int write_all(int sockfd, char *buf, int len) {
 
     while (total_bytes < len) {
         n = write(sockfd, buf + total_bytes, bytes_left);
+        if (should_wait(sockfd, n, POLLOUT) == TRUE)
+            continue;
         if (n <= 0) 
 			return check_io_err(n, "write");
 		
@@ -46,6 +200,8 @@ int read_all(int sockfd, char *buf, int len) {
 	memset(buf, 0, len);  // clear this memory block
 	while (total_bytes < len) {
 		n = read(sockfd, buf + total_bytes, bytes_left);
+		if (should_wait(sockfd, n, POLLIN) == TRUE)
+			continue;
 		if (n <= 0)
 			return check_io_err(n, "read");
 		
@@ -62,6 +218,21 @@ int read_all(int sockfd, char *buf, int len) {
 	return total_bytes;
 }
 
+/* Reads whatever the socket has (at least 1 byte, at most `len`) to the
+   buffer, waiting for it if there is nothing yet.
+ * Returns the number of bytes read on success;
+ * Returns FAILED on failure, or EMPTY if a read() read nothing.
+ */
+int read_some(int sockfd, char *buf, int len) {
+	int n;
+	do {
+		n = read(sockfd, buf, len);
+	} while (should_wait(sockfd, n, POLLIN) == TRUE);
+	if (n <= 0)
+		return check_io_err(n, "read");
+	return n;
+}
+
 /* Writes a 16-bit unsigned integer to the socket.
  * Returns the number of bytes written on success;
  * Returns FAILED on failure, or EMPTY if a write() returned 0.
@@ -264,3 +435,24 @@ char *read_name(int sockfd) {
 
 	return name;
 }
+
+/* Decides whether a read() or write() that returned `n` should simply be
+   retried, waiting for the socket to become ready for `events` if needed.
+ * Returns TRUE if so, FALSE if `n` is a real result (data, EOF or error).
+ */
+int should_wait(int sockfd, int n, short events) {
+	if (n >= 0)
+		return FALSE;
+	if (errno == EINTR)
+		return TRUE;
+	if (errno != EAGAIN && errno != EWOULDBLOCK)
+		return FALSE;
+
+	int timeout_ms = ms_until(io_deadline);
+	int res = timeout_ms == 0 ? EMPTY : wait_for_fd(sockfd, events, timeout_ms);
+	if (res == EMPTY) { // out of time
+		io_timed_out = TRUE;
+		errno = ETIMEDOUT;
+	}
+	return res == SUCCESS ? TRUE : FALSE;
+}
@@ -11,25 +11,106 @@
 #define RPC_IO_HELPER_H
 
 #include <stdint.h>
+#include "rpc_ext.h"
 
 // size of some fixed width data types, in bytes
 #define U64_SIZE 8
 #define U32_SIZE 4
 #define U16_SIZE 2
 
+#define NO_DEADLINE 0
+#define NS_PER_MS 1000000ULL
+#define MS_PER_S 1000ULL
+
+/* Function that blocks until `fd` is ready for `events` (POLLIN / POLLOUT),
+   or `timeout_ms` milliseconds have passed (negative for no timeout).
+ * Returns SUCCESS if ready, EMPTY on timeout, FAILED on error.
+ */
+typedef int (*io_wait_fn)(int fd, short events, int timeout_ms);
+
+/* Sets the function used by this thread to wait on non-blocking sockets
+   (NULL to go back to poll_fd).
+ * This is how the coroutine runtime suspends a call until its data arrives.
+ */
+void set_io_wait_hook(io_wait_fn hook);
+
+/* Returns the function currently used by this thread to wait on sockets
+   (NULL if poll_fd is used).
+ */
+io_wait_fn get_io_wait_hook(void);
+
+/* Waits with poll(2) until `fd` is ready for `events`, or `timeout_ms`
+   milliseconds have passed (negative for no timeout).
+ * Returns SUCCESS if ready, EMPTY on timeout, FAILED on error.
+ */
+int poll_fd(int fd, short events, int timeout_ms);
+
+/* Waits until `fd` is ready for `events` using this thread's wait function.
+ * Returns SUCCESS if ready, EMPTY on timeout, FAILED on error.
+ */
+int wait_for_fd(int fd, short events, int timeout_ms);
+
+/* Returns the current time of the monotonic clock, in nanoseconds.
+ */
+uint64_t now_ns(void);
+
+/* Makes every following read/write on a non-blocking socket (from this
+   thread) fail with ETIMEDOUT once the monotonic clock reaches
+   `deadline_ns`, or never for NO_DEADLINE.
+ */
+void set_io_deadline(uint64_t deadline_ns);
+
+/* Returns the deadline set with set_io_deadline() (NO_DEADLINE if none).
+ */
+uint64_t get_io_deadline(void);
+
+/* Records that an operation of this thread ran out of time without reading
+   or writing (waiting for a response to be read by another thread), as if
+   its own I/O had: see io_deadline_passed().
+ */
+void note_io_timeout(void);
+
+/* Returns TRUE if an I/O operation failed because of the deadline set with
+   set_io_deadline(), FALSE otherwise.
+ */
+int io_deadline_passed(void);
+
+/* Returns the number of whole milliseconds left until `deadline_ns`
+   (rounded up; 0 if it has passed), or -1 for NO_DEADLINE.
+ */
+int ms_until(uint64_t deadline_ns);
+
+/* Applies the options to the (TCP) socket.
+ * Returns SUCCESS on success, FAILED if an option could not be set.
+ */
+int apply_sock_opts(int sockfd, const rpc_sock_opts *opts);
+
+/* Turns TCP_QUICKACK back on for the socket (the kernel turns it off again
+   by itself), if the options ask for it.
+ */
+void rearm_quickack(int sockfd, const rpc_sock_opts *opts);
 
 /* Fully writes `len` bytes of data from the buffer to the socket.
+ * Non-blocking sockets are waited on with wait_for_fd() when full.
  * Returns the actual number of bytes written on success;
  * Returns FAILED on failure, or EMPTY if a write() returned 0.
  */
 int write_all(int sockfd, char *buf, int len);
 
 /* Fully reads `len` bytes of data to the buffer from the socket.
+ * Non-blocking sockets are waited on with wait_for_fd() when empty.
  * Returns the actual number of bytes written on success;
  * Returns FAILED on failure, or EMPTY if a read() read nothing.
  */
 int read_all(int sockfd, char *buf, int len);
 
+/* Reads whatever the socket has (at least 1 byte, at most `len`) to the
+   buffer, waiting for it if there is nothing yet.
+ * Returns the number of bytes read on success;
+ * Returns FAILED on failure, or EMPTY if a read() read nothing.
+ */
+int read_some(int sockfd, char *buf, int len);
+
 /* Writes a 16-bit unsigned integer to the socket.
  * Returns the number of bytes written on success;
  * Returns FAILED on failure, or EMPTY if a write() returned 0.
@@ -0,0 +1,497 @@
+#define _GNU_SOURCE // syscall, strerror_r
+#include "rpc_log.h"
+#include "rpc_ext.h"
+#include "rpc_safety.h"
+#include "rpc_io_helper.h"
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#define LOG_RING_SIZE 256  // records per thread (a power of 2)
+#define LOG_BURST 20       // records per site in a window, at most
+#define LOG_WINDOW_MS 1000
+#define LOG_LINE_LEN 256   // formatted, at most
+#define LOG_BUF_SIZE 8192  // written at once
+#define NO_CODE -1
+
+// What is logged, as it is logged (formatted only when written)
+typedef struct {
+    uint64_t time_ms;          // (of the real-time clock)
+    const log_site *site;
+    int32_t level;             // enum RPC_LOG_LEVEL
+    int32_t code;              // enum ERROR, or NO_CODE
+    int32_t sys_errno;         // (0 if none)
+    uint32_t suppressed;       // records of the site not made before it
+    char text[LOG_TEXT_LEN];   // (if NO_CODE)
+} log_record;
+
+// The records of a thread: made by it, written by the writer
+typedef struct log_ring {
+    struct log_ring *next;     // (never freed: another thread takes it over)
+    int owned;                 // by a running thread?
+    uint64_t head;             // records made
+    uint64_t tail;             // records written
+    uint64_t dropped;          // records not made as it was full
+    uint64_t dropped_told;     // ... reported so far
+    log_record records[LOG_RING_SIZE];
+} log_ring;
+
+static const char *LEVEL_NAME[] = {"DEBUG", "INFO", "WARN", "ERROR"};
+
+static int log_level = RPC_LOG_WARN;
+static log_ring *rings = NULL;               // of every thread
+static __thread log_ring *own_ring = NULL;
+static pthread_once_t log_once = PTHREAD_ONCE_INIT;
+static pthread_key_t ring_key;               // gives a ring up on thread exit
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t start_lock = PTHREAD_MUTEX_INITIALIZER;
+static int writer_running = FALSE;           // in this process
+static int writer_asleep = FALSE;            // (a futex)
+static log_site *quiet_sites = NULL;         // leaving records out
+
+/******* Private functions *******/
+void make_record(log_site *site, int level, int code, const char *text,
+                 int sys_errno);
+int let_through(log_site *site, uint64_t now, uint32_t *suppressed);
+log_ring *get_ring(void);
+void init_log(void);
+void release_ring(void *ring);
+void start_writer(void);
+void *run_writer(void *arg);
+void wake_writer(void);
+int drain_rings(int all_quiet);
+void report_quiet_sites(char *buf, size_t *len, pid_t pid, int all);
+char *next_line(char *buf, size_t *len);
+int records_left(void);
+int format_record(log_record *rec, pid_t pid, char *line);
+int format_line(char *line, uint64_t time_ms, pid_t pid, int level,
+                const log_site *site);
+void write_out(char *buf, size_t len);
+uint64_t realtime_ms(void);
+void lock_before_fork(void);
+void unlock_after_fork(void);
+void reset_after_fork(void);
+
+
+/* Logs the error (enum ERROR, see rpc_safety.h) at its level, from the
+   site, with `sys_errno` (0 if none).
+ */
+void log_code(log_site *site, int code, int sys_errno) {
+    int level = error_level(code);
+    if (log_enabled(level))
+        make_record(site, level, code, NULL, sys_errno);
+}
+
+/* Logs `text` (truncated to LOG_TEXT_LEN - 1 characters) at the level,
+   from the site, with `sys_errno` (0 if none).
+ */
+void log_text(log_site *site, int level, const char *text, int sys_errno) {
+    if (log_enabled(level))
+        make_record(site, level, NO_CODE, text, sys_errno);
+}
+
+/* Returns TRUE if records of the level are made, FALSE otherwise.
+ */
+int log_enabled(int level) {
+    return level >= __atomic_load_n(&log_level, __ATOMIC_RELAXED);
+}
+
+/* Logs (to stderr) only what is at least of the level (enum
+   RPC_LOG_LEVEL); RPC_LOG_WARN by default. Logging never waits for the
+   write: it is done by a background thread of each process that logs,
+   shortly after (and on exit). Each place that logs does so a limited
+   number of times a second; what it leaves out is counted. */
+/* RETURNS: -1 on failure */
+int rpc_set_log_level(int level) {
+    if (level < RPC_LOG_DEBUG || level > RPC_LOG_OFF) {
+        print_err(INVALID_INPUT);
+        return FAILED;
+    }
+    __atomic_store_n(&log_level, level, __ATOMIC_RELAXED);
+    return SUCCESS;
+}
+
+/* Writes out what this process logged so far */
+void rpc_flush_log(void) {
+    if (__atomic_load_n(&rings, __ATOMIC_ACQUIRE) != NULL)
+        drain_rings(TRUE);
+}
+
+/* Puts a record in the thread's ring (unless its site logged too much
+   lately, or the ring is full), and wakes the writer up.
+ */
+void make_record(log_site *site, int level, int code, const char *text,
+                 int sys_errno) {
+    uint64_t now = realtime_ms();
+    uint32_t suppressed;
+    __atomic_store_n(&site->level, level, __ATOMIC_RELAXED);
+    if (!let_through(site, now, &suppressed))
+        return;
+    log_ring *ring = get_ring();
+    if (ring == NULL)
+        return;
+    start_writer();
+
+    uint64_t head = ring->head; // (only this thread changes it)
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)
+            >= LOG_RING_SIZE) {
+        __atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+        wake_writer();
+        return;
+    }
+    log_record *rec = &ring->records[head & (LOG_RING_SIZE - 1)];
+    rec->time_ms = now;
+    rec->site = site;
+    rec->level = level;
+    rec->code = code;
+    rec->sys_errno = sys_errno;
+    rec->suppressed = suppressed;
+    if (text != NULL) {
+        strncpy(rec->text, text, LOG_TEXT_LEN - 1);
+        rec->text[LOG_TEXT_LEN - 1] = '\0';
+    }
+    // (seen by the writer only once filled in)
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_SEQ_CST);
+    wake_writer();
+}
+
+/* Decides whether the site may make a record now (at `now`, in
+   milliseconds), and if so, puts the number of records it did not make
+   since its last one at `suppressed`. (Threads logging from the same site
+   at once may be a little off: it is only a limit.)
+ * Returns TRUE if it may, FALSE otherwise.
+ */
+int let_through(log_site *site, uint64_t now, uint32_t *suppressed) {
+    if (now - __atomic_load_n(&site->window_ms, __ATOMIC_RELAXED)
+            >= LOG_WINDOW_MS) {
+        __atomic_store_n(&site->window_ms, now, __ATOMIC_RELAXED);
+        __atomic_store_n(&site->in_window, 0, __ATOMIC_RELAXED);
+    }
+    if (__atomic_add_fetch(&site->in_window, 1, __ATOMIC_RELAXED)
+            > LOG_BURST) {
+        __atomic_add_fetch(&site->suppressed, 1, __ATOMIC_RELAXED);
+        // (the writer reports it if nothing else does)
+        if (!__atomic_exchange_n(&site->quiet, TRUE, __ATOMIC_ACQUIRE)) {
+            site->next = __atomic_load_n(&quiet_sites, __ATOMIC_RELAXED);
+            while (!__atomic_compare_exchange_n(&quiet_sites, &site->next,
+                                                site, FALSE, __ATOMIC_RELEASE,
+                                                __ATOMIC_RELAXED));
+            wake_writer();
+        }
+        return FALSE;
+    }
+    *suppressed = __atomic_exchange_n(&site->suppressed, 0, __ATOMIC_RELAXED);
+    return TRUE;
+}
+
+/* Returns the ring of the calling thread: one given up by a thread that
+   exited, or a new one, the first time.
+ * Returns NULL if there is none and it could not be allocated.
+ */
+log_ring *get_ring(void) {
+    if (own_ring != NULL)
+        return own_ring;
+    pthread_once(&log_once, init_log);
+
+    log_ring *ring;
+    for (ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); ring != NULL;
+            ring = ring->next) {
+        int unowned = FALSE;
+        if (__atomic_compare_exchange_n(&ring->owned, &unowned, TRUE, FALSE,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            break;
+    }
+    if (ring == NULL) {
+        ring = calloc(1, sizeof(*ring));
+        if (ring == NULL)
+            return NULL; // (nowhere to log it)
+        ring->owned = TRUE;
+        ring->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&rings, &ring->next, ring, FALSE,
+                                            __ATOMIC_RELEASE,
+                                            __ATOMIC_RELAXED));
+    }
+    pthread_setspecific(ring_key, ring);
+    own_ring = ring;
+    return ring;
+}
+
+/* Sets up logging in this process (and those it forks), once.
+ */
+void init_log(void) {
+    pthread_key_create(&ring_key, release_ring);
+    pthread_atfork(lock_before_fork, unlock_after_fork, reset_after_fork);
+    atexit(rpc_flush_log);
+}
+
+/* Gives up the ring of a thread exiting (its records are still written).
+ */
+void release_ring(void *ring) {
+    __atomic_store_n(&((log_ring *)ring)->owned, FALSE, __ATOMIC_RELEASE);
+}
+
+/* Starts the writer of this process, if not running yet. It gets no
+   signal: they are the business of the threads it logs for.
+ */
+void start_writer(void) {
+    if (__atomic_load_n(&writer_running, __ATOMIC_ACQUIRE))
+        return;
+    pthread_mutex_lock(&start_lock);
+    if (!writer_running) {
+        sigset_t all, old;
+        sigfillset(&all);
+        pthread_sigmask(SIG_SETMASK, &all, &old);
+        pthread_t writer;
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        // (if it cannot start, records are written out on exit)
+        if (pthread_create(&writer, &attr, run_writer, NULL) == 0)
+            __atomic_store_n(&writer_running, TRUE, __ATOMIC_RELEASE);
+        pthread_attr_destroy(&attr);
+        pthread_sigmask(SIG_SETMASK, &old, NULL);
+    }
+    pthread_mutex_unlock(&start_lock);
+}
+
+/* Writes out records as they are made, sleeping while there are none
+   (and waking up once a window is over, if sites left records out).
+ */
+void *run_writer(void *arg) {
+    struct timespec window = {.tv_sec = LOG_WINDOW_MS / MS_PER_S,
+                              .tv_nsec = LOG_WINDOW_MS % MS_PER_S
+                                         * NS_PER_MS};
+    while (TRUE) {
+        if (drain_rings(FALSE) > 0)
+            continue;
+        // (a record made from here on wakes it up)
+        __atomic_store_n(&writer_asleep, TRUE, __ATOMIC_SEQ_CST);
+        if (!records_left())
+            syscall(SYS_futex, &writer_asleep, FUTEX_WAIT_PRIVATE, TRUE,
+                    __atomic_load_n(&quiet_sites, __ATOMIC_RELAXED) != NULL
+                    ? &window : NULL, NULL, 0);
+        __atomic_store_n(&writer_asleep, FALSE, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+/* Wakes the writer up, if asleep (most of the time, it is not: no system
+   call then).
+ */
+void wake_writer(void) {
+    if (__atomic_load_n(&writer_asleep, __ATOMIC_SEQ_CST)
+            && __atomic_exchange_n(&writer_asleep, FALSE, __ATOMIC_SEQ_CST))
+        syscall(SYS_futex, &writer_asleep, FUTEX_WAKE_PRIVATE, 1,
+                NULL, NULL, 0);
+}
+
+/* Formats and writes out the records in every ring, how many were
+   dropped, and how many the sites left out (of those whose window is over,
+   or `all_quiet`).
+ * Returns the number of records written.
+ */
+int drain_rings(int all_quiet) {
+    char buf[LOG_BUF_SIZE];
+    size_t len = 0;
+    int n = 0;
+    pid_t pid = getpid();
+
+    pthread_mutex_lock(&drain_lock);
+    for (log_ring *ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE);
+            ring != NULL; ring = ring->next) {
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        for (uint64_t i = ring->tail; i < head; i++) {
+            char *line = next_line(buf, &len);
+            len += format_record(&ring->records[i & (LOG_RING_SIZE - 1)],
+                                 pid, line);
+            // (free for the thread again)
+            __atomic_store_n(&ring->tail, i + 1, __ATOMIC_RELEASE);
+            n++;
+        }
+
+        uint64_t dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+        if (dropped != ring->dropped_told) {
+            char *line = next_line(buf, &len);
+            int n_line = format_line(line, realtime_ms(), pid, RPC_LOG_WARN,
+                                     NULL);
+            len += n_line + snprintf(line + n_line, LOG_LINE_LEN - n_line,
+                                     "%" PRIu64 " log records dropped "
+                                     "(logging too fast)\n",
+                                     dropped - ring->dropped_told);
+            ring->dropped_told = dropped;
+        }
+    }
+    report_quiet_sites(buf, &len, pid, all_quiet);
+    write_out(buf, len);
+    pthread_mutex_unlock(&drain_lock);
+    return n;
+}
+
+/* Reports how many records the sites that left some out did not make (the
+   sites whose window is over, or `all`), to the buffer. The others stay on
+   the list.
+ */
+void report_quiet_sites(char *buf, size_t *len, pid_t pid, int all) {
+    log_site *site = __atomic_exchange_n(&quiet_sites, NULL, __ATOMIC_ACQUIRE);
+    uint64_t now = realtime_ms();
+    while (site != NULL) {
+        log_site *next = site->next;
+        if (!all && now - __atomic_load_n(&site->window_ms, __ATOMIC_RELAXED)
+                    < LOG_WINDOW_MS) {
+            // (back on the list, for later)
+            site->next = __atomic_load_n(&quiet_sites, __ATOMIC_RELAXED);
+            while (!__atomic_compare_exchange_n(&quiet_sites, &site->next,
+                                                site, FALSE, __ATOMIC_RELEASE,
+                                                __ATOMIC_RELAXED));
+            site = next;
+            continue;
+        }
+
+        // (left out from now on: listed again)
+        __atomic_store_n(&site->quiet, FALSE, __ATOMIC_RELEASE);
+        uint32_t left_out = __atomic_exchange_n(&site->suppressed, 0,
+                                                __ATOMIC_RELAXED);
+        if (left_out > 0) {
+            char *line = next_line(buf, len);
+            int n_line = format_line(line, now, pid,
+                                     __atomic_load_n(&site->level,
+                                                     __ATOMIC_RELAXED),
+                                     site);
+            *len += n_line + snprintf(line + n_line, LOG_LINE_LEN - n_line,
+                                      "(+%u more)\n", left_out);
+        }
+        site = next;
+    }
+}
+
+/* Returns where the next line goes in the buffer (holding `*len` bytes),
+   writing it out first if the line may not fit.
+ */
+char *next_line(char *buf, size_t *len) {
+    if (*len + LOG_LINE_LEN > LOG_BUF_SIZE) {
+        write_out(buf, *len);
+        *len = 0;
+    }
+    return buf + *len;
+}
+
+/* Returns TRUE if there are records (or drops) not written yet, FALSE
+   otherwise.
+ */
+int records_left(void) {
+    for (log_ring *ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE);
+            ring != NULL; ring = ring->next) {
+        if (__atomic_load_n(&ring->head, __ATOMIC_SEQ_CST) != ring->tail
+                || __atomic_load_n(&ring->dropped, __ATOMIC_SEQ_CST)
+                   != ring->dropped_told)
+            return TRUE;
+    }
+    return FALSE;
+}
+
+/* Formats the record (made in process `pid`) as a line, to `line`
+   (LOG_LINE_LEN bytes at most):
+   <time> [<pid>] <level> <file>:<line>: <message>[: <errno>][ (+N more)]
+   N being the number of records its site left out just before.
+ * Returns its length.
+ */
+int format_record(log_record *rec, pid_t pid, char *line) {
+    char errbuf[LOG_TEXT_LEN * 2];
+    const char *msg = rec->code == NO_CODE ? rec->text : error_msg(rec->code);
+    const char *err = rec->sys_errno == 0 ? NULL
+        : strerror_r(rec->sys_errno, errbuf, sizeof(errbuf));
+    int n = format_line(line, rec->time_ms, pid, rec->level, rec->site);
+    n += snprintf(line + n, LOG_LINE_LEN - n, "%s%s%s", msg,
+                  err != NULL ? ": " : "", err != NULL ? err : "");
+    if (rec->suppressed > 0 && n < LOG_LINE_LEN)
+        n += snprintf(line + n, LOG_LINE_LEN - n, " (+%u more)",
+                      rec->suppressed);
+    if (n > LOG_LINE_LEN - 2)
+        n = LOG_LINE_LEN - 2; // (truncated)
+    line[n++] = '\n';
+    line[n] = '\0';
+    return n;
+}
+
+/* Formats the start of a line, to `line`:
+   <time> [<pid>] <level> [<file>:<line>: ]
+ * Returns its length.
+ */
+int format_line(char *line, uint64_t time_ms, pid_t pid, int level,
+                const log_site *site) {
+    int n = snprintf(line, LOG_LINE_LEN, "%" PRIu64 ".%03u [%d] %s ",
+                     (uint64_t)(time_ms / MS_PER_S),
+                     (unsigned)(time_ms % MS_PER_S),
+                     (int)pid, LEVEL_NAME[level]);
+    if (site != NULL)
+        n += snprintf(line + n, LOG_LINE_LEN - n, "%s:%d: ", site->file,
+                      site->line);
+    return n;
+}
+
+/* Writes the buffer to stderr (directly: no lock of stdio is taken).
+ */
+void write_out(char *buf, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = write(STDERR_FILENO, buf + done, len - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return; // (nowhere to log that)
+        done += n;
+    }
+}
+
+/* Returns the current time of the real-time clock, in milliseconds.
+ */
+uint64_t realtime_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * MS_PER_S + ts.tv_nsec / NS_PER_MS;
+}
+
+/* Before forking: no ring is being drained (as the child would find it).
+ */
+void lock_before_fork(void) {
+    pthread_mutex_lock(&start_lock);
+    pthread_mutex_lock(&drain_lock);
+}
+
+/* After forking, in the parent.
+ */
+void unlock_after_fork(void) {
+    pthread_mutex_unlock(&drain_lock);
+    pthread_mutex_unlock(&start_lock);
+}
+
+/* After forking, in the child: the records made so far are the parent's
+   to write, the threads of the other rings are gone, and so is the
+   writer.
+ */
+void reset_after_fork(void) {
+    for (log_ring *ring = rings; ring != NULL; ring = ring->next) {
+        ring->tail = ring->head;
+        ring->dropped_told = ring->dropped;
+        if (ring != own_ring)
+            ring->owned = FALSE;
+    }
+    // (and what the parent's sites left out is the parent's to report)
+    for (log_site *site = quiet_sites; site != NULL; site = site->next) {
+        site->suppressed = 0;
+        site->quiet = FALSE;
+    }
+    quiet_sites = NULL;
+    writer_running = FALSE;
+    writer_asleep = FALSE;
+    pthread_mutex_unlock(&drain_lock);
+    pthread_mutex_unlock(&start_lock);
+}
@@ -0,0 +1,64 @@
+/*-----------------------------------------------------------------------------
+ * Project 2
+ * rpc_log.h :
+              = the interface of the module `rpc_log` of the project
+              = logging without blocking: records are put in a ring of the
+                thread logging them, and written out (to stderr) by a
+                background thread
+ ----------------------------------------------------------------------------*/
+
+#ifndef RPC_LOG_H
+#define RPC_LOG_H
+
+#include <stdint.h>
+
+#define LOG_TEXT_LEN 40    // of a text logged, with its NUL (see log_text)
+
+/* How it goes:
+ * - Every place that logs has a log_site of its own (static, see
+   LOG_SITE), which limits how often it logs: at most LOG_BURST records
+   every LOG_WINDOW_MS, the others being counted (and the count reported
+   by its next record).
+ * - A record is a few binary fields (the site, the error code or a short
+   text, errno), put in the thread's ring without taking any lock (nor
+   making a system call, unless the writer is asleep).
+   It is only formatted by the writer, a thread of each process that logs,
+   woken up when there is something to write. If the ring is full, the
+   record is dropped (and counted).
+ * - Records below the log level (rpc_set_log_level, declared with the rest
+   of the interface in rpc_ext.h) are not even made.
+ * - In a process just forked, the records of its parent are left to the
+   parent, and the writer is started again on its first record. Records
+   left are written out on exit (not when killed).
+ */
+
+// A place that logs, and how often it did lately
+typedef struct log_site {
+    const char *file;
+    int line;
+    int level;                // of its last record
+    uint64_t window_ms;       // when the current window started
+    uint32_t in_window;       // records made in it
+    uint32_t suppressed;      // ... and not made, since the last one
+    int quiet;                // on the writer's list of sites leaving
+    struct log_site *next;    // records out (reported once the window is
+                              // over, if no record of its own does)
+} log_site;
+
+#define LOG_SITE() {__FILE__, __LINE__, 0, 0, 0, 0, 0, NULL}
+
+/* Logs the error (enum ERROR, see rpc_safety.h) at its level, from the
+   site, with `sys_errno` (0 if none).
+ */
+void log_code(log_site *site, int code, int sys_errno);
+
+/* Logs `text` (truncated to LOG_TEXT_LEN - 1 characters) at the level,
+   from the site, with `sys_errno` (0 if none).
+ */
+void log_text(log_site *site, int level, const char *text, int sys_errno);
+
+/* Returns TRUE if records of the level are made, FALSE otherwise.
+ */
+int log_enabled(int level);
+
+#endif
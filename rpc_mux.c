@@ -0,0 +1,931 @@
+#include "rpc_mux.h"
+#include "rpc_io_helper.h"
+#include "rpc_client_helper.h"
+#include "rpc_safety.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+// a frame as sent: its header, then at most MUX_CHUNK bytes of payload
+#define MUX_FRAME_MAX (MAX_COMPACT_HEADER + MUX_CHUNK)
+// bytes read at once (and frames put together for sending)
+#define MUX_BUF_SIZE (2 * MUX_FRAME_MAX)
+// room past the end of what was read, for decoding a (corrupt) compact
+// header in place (see frame_reader)
+#define MUX_SLACK (2 * MAX_COMPACT_HEADER + 8)
+#define PORT_STR_LEN 6 // max 5 digits, with a null byte
+
+// A message queued for sending
+typedef struct mux_msg {
+    frame_header hdr;           // payload_len being all of it
+    char *data;                 // what is left of its payload to send
+    char *own;                  // its payload, if freed once sent
+    uint32_t sent;              // bytes of payload sent so far
+    struct mux_msg *next;       // whose turn is next
+    struct mux_msg *after;      // next message of the same channel
+} mux_msg;
+
+// A message of which some frames were read
+typedef struct mux_part {
+    frame_header hdr;           // of its first frame
+    char *buf;
+    uint32_t len;               // payload read so far
+    uint32_t cap;
+    struct mux_part *next;
+} mux_part;
+
+struct mux_conn {
+    int sockfd;
+    int compact;                // compact headers?
+    uint8_t *in;                // read, MUX_BUF_SIZE (+ MUX_SLACK)
+    int in_start;               // ... and not used yet, up to in_end
+    int in_end;
+    mux_part *parts;            // messages being read, one per channel
+    char *out;                  // frames to send, MUX_BUF_SIZE
+    int out_start;              // ... and not sent yet, up to out_end
+    int out_end;
+    mux_msg *head;              // messages taking turns (the first of each
+    mux_msg *tail;              // channel's, the others after it)
+    size_t queued;              // bytes of payload not in `out` yet
+};
+
+// A client of a multiplexed connection
+typedef struct {
+    int open;                   // in use by a client?
+    uint32_t req_id;            // of the request waiting for its response
+                                // (0 if none)
+    int answered;               // its response is in
+    int failed;                 // ... or never will be
+    frame_header resp;
+    char *payload;
+    pthread_cond_t cond;        // signalled when either happens
+} mux_session;
+
+struct rpc_mux {
+    char addr[INET6_ADDRSTRLEN];
+    char port[PORT_STR_LEN];
+    pthread_mutex_t lock;
+    int sockfd;                 // -1 if not connected
+    mux_conn *conn;
+    int broken;                 // lost, until the I/O thread closes it
+    pthread_cond_t reset;       // signalled once it did
+    int closing;                // the I/O thread should stop
+    int polling_out;            // the I/O thread waits to write
+    int wake[2];                // pipe waking the I/O thread up
+    pthread_t thread;
+    mux_session sessions[MAX_SESSIONS]; // of channels 1 to MAX_SESSIONS
+};
+
+/******* Private functions *******/
+int fill_out(mux_conn *m);
+mux_msg *pop_turn(mux_conn *m);
+void push_turn(mux_conn *m, mux_msg *msg);
+void free_msg(mux_msg *msg);
+mux_part *add_to_part(mux_part *part, frame_header *hdr,
+                      const uint8_t *payload);
+mux_part *take_part(mux_conn *m, int channel);
+void free_part(mux_part *part);
+void set_notsent_lowat(int sockfd);
+int say_mux_hello(int sockfd, int *compact, frame_reader *reader);
+void *run_mux(void *arg);
+void serve_mux(rpc_mux *mux, short revents);
+void deliver(rpc_mux *mux, frame_header *hdr, char *payload);
+void break_mux(rpc_mux *mux);
+void reset_mux(rpc_mux *mux);
+void wake_mux(rpc_mux *mux);
+void deadline_timespec(uint64_t deadline_ns, struct timespec *ts);
+
+
+/* ---------------------- */
+/*  Frames of connections */
+/* ---------------------- */
+
+/* Creates the state of the multiplexed connection on the (non-blocking)
+   socket, whose headers are compact if `compact` is TRUE.
+ * Returns the state on success, NULL on error.
+ */
+mux_conn *create_mux_conn(int sockfd, int compact) {
+    mux_conn *m = calloc(1, sizeof(*m));
+    if (m != NULL) {
+        m->in = malloc(MUX_BUF_SIZE + MUX_SLACK);
+        m->out = malloc(MUX_BUF_SIZE);
+    }
+    if (m == NULL || m->in == NULL || m->out == NULL) {
+        print_err(MALLOC_FAILED);
+        free_mux_conn(m);
+        return NULL;
+    }
+    m->sockfd = sockfd;
+    m->compact = compact;
+    set_notsent_lowat(sockfd);
+    return m;
+}
+
+/* Frees the state of the connection (it does not close the socket), and
+   what is left in it.
+ */
+void free_mux_conn(mux_conn *m) {
+    if (m == NULL)
+        return;
+    mux_msg *msg;
+    while ((msg = pop_turn(m)) != NULL) {
+        while (msg != NULL) {
+            mux_msg *after = msg->after;
+            free_msg(msg);
+            msg = after;
+        }
+    }
+    while (m->parts != NULL) {
+        mux_part *part = m->parts;
+        m->parts = part->next;
+        free_part(part);
+    }
+    free(m->in);
+    free(m->out);
+    free(m);
+}
+
+/* Takes the bytes the reader read ahead, but did not use (sent right after
+   the HELLO), as the first bytes read from the connection.
+ */
+void mux_feed(mux_conn *m, frame_reader *r) {
+    int len = buffered_bytes(r); // (less than READ_AHEAD < MUX_BUF_SIZE)
+    memcpy(m->in + m->in_end, r->buf + r->start, len);
+    m->in_end += len;
+    r->start = r->end;
+}
+
+/* Reads whatever the socket has, without waiting.
+ * Returns SUCCESS on success (even if nothing was read),
+   FAILED on failure, or EMPTY if the connection was closed.
+ */
+int mux_read(mux_conn *m) {
+    // (the messages already read must be taken first, to make room)
+    while (m->in_end < MUX_BUF_SIZE) {
+        ssize_t n = recv(m->sockfd, m->in + m->in_end,
+                         MUX_BUF_SIZE - m->in_end, MSG_DONTWAIT);
+        if (n > 0) {
+            m->in_end += n;
+            continue;
+        }
+        if (n == 0)
+            return check_io_err(0, "mux_read");
+        if (errno == EINTR)
+            continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            break;
+        return check_io_err(FAILED, "mux_read");
+    }
+    return SUCCESS;
+}
+
+/* Takes the next message read in full (its frames put back together), its
+   header into `hdr` (payload_len being all of it) and its payload into
+   `*payload` (as next_frame).
+ * Returns TRUE if there was one, FALSE if not (yet),
+   or FAILED on an invalid frame.
+ */
+int mux_next(mux_conn *m, frame_header *hdr, char **payload) {
+    *payload = NULL;
+    while (TRUE) {
+        int have = m->in_end - m->in_start;
+        uint8_t *frame = m->in + m->in_start;
+        int hdr_len = parse_frame_header(frame, have, m->compact, hdr);
+        if (hdr_len == FAILED)
+            return FAILED;
+        if (hdr_len > 0 && hdr->payload_len > MUX_CHUNK) {
+            print_err(INVALID_FRAME);
+            return FAILED;
+        }
+
+        // not all of it yet -> moved to the front, to be read after it
+        if (hdr_len == 0 || have < hdr_len + (int)hdr->payload_len) {
+            memmove(m->in, frame, have);
+            m->in_start = 0;
+            m->in_end = have;
+            return FALSE;
+        }
+        m->in_start += hdr_len + hdr->payload_len;
+        if (m->in_start == m->in_end)
+            m->in_start = m->in_end = 0;
+
+        // the message being read on its channel, if any (a frame of another
+        // request means it was given up on, by the client)
+        uint8_t *data = frame + hdr_len;
+        mux_part *part = take_part(m, hdr->channel);
+        if (part != NULL && part->hdr.req_id != hdr->req_id) {
+            free_part(part);
+            part = NULL;
+        }
+
+        // a message of a single frame, as it mostly is
+        if (part == NULL && !(hdr->flags & FRAME_MORE)) {
+            if (hdr->payload_len == 0)
+                return TRUE;
+            *payload = malloc(hdr->payload_len + 1);
+            if (*payload == NULL) {
+                print_err(MALLOC_FAILED);
+                return FAILED;
+            }
+            memcpy(*payload, data, hdr->payload_len);
+            (*payload)[hdr->payload_len] = '\0';
+            return TRUE;
+        }
+
+        // or a frame of a longer one
+        part = add_to_part(part, hdr, data);
+        if (part == NULL)
+            return FAILED;
+        if (hdr->flags & FRAME_MORE) {
+            part->next = m->parts;
+            m->parts = part;
+            continue;
+        }
+        *hdr = part->hdr;
+        hdr->flags &= ~FRAME_MORE;
+        hdr->payload_len = part->len;
+        *payload = part->buf;
+        free(part);
+        return TRUE;
+    }
+}
+
+/* Queues a message (the header's payload_len being all of it) behind those
+   of its channel. With `owned`, the payload is freed once sent; otherwise
+   it must be kept as it is until then (see mux_keep_unsent).
+ * Returns SUCCESS on success, FAILED on failure.
+ */
+int mux_queue(mux_conn *m, frame_header *hdr, char *payload, int owned) {
+    mux_msg *msg = calloc(1, sizeof(*msg));
+    if (msg == NULL) {
+        print_err(MALLOC_FAILED);
+        if (owned)
+            free(payload);
+        return FAILED;
+    }
+    msg->hdr = *hdr;
+    msg->data = payload;
+    msg->own = owned ? payload : NULL;
+    m->queued += hdr->payload_len;
+
+    // behind the last one of its channel, if it has any queued
+    for (mux_msg *turn = m->head; turn != NULL; turn = turn->next) {
+        if (turn->hdr.channel == hdr->channel) {
+            while (turn->after != NULL)
+                turn = turn->after;
+            turn->after = msg;
+            return SUCCESS;
+        }
+    }
+    push_turn(m, msg);
+    return SUCCESS;
+}
+
+/* Sends what is queued, a frame of each message in turn, until the socket
+   can take no more.
+ * Returns SUCCESS on success (even if something is left to send),
+   FAILED on failure.
+ */
+int mux_write(mux_conn *m) {
+    while (fill_out(m) > 0) {
+        ssize_t n = send(m->sockfd, m->out + m->out_start,
+                         m->out_end - m->out_start,
+                         MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (n <= 0)
+            return check_io_err(FAILED, "mux_write");
+        m->out_start += n;
+    }
+    return SUCCESS;
+}
+
+/* Copies what is left to send of the messages of the channel whose payload
+   is not their own, so that it may be freed.
+ * Returns SUCCESS on success, FAILED on failure.
+ */
+int mux_keep_unsent(mux_conn *m, int channel) {
+    for (mux_msg *turn = m->head; turn != NULL; turn = turn->next) {
+        if (turn->hdr.channel != channel)
+            continue;
+        for (mux_msg *msg = turn; msg != NULL; msg = msg->after) {
+            uint32_t left = msg->hdr.payload_len - msg->sent;
+            if (msg->own != NULL || left == 0)
+                continue;
+            char *copy = malloc(left);
+            if (copy == NULL) {
+                print_err(MALLOC_FAILED);
+                return FAILED;
+            }
+            memcpy(copy, msg->data, left);
+            msg->data = copy;
+            msg->own = copy;
+        }
+        return SUCCESS;
+    }
+    return SUCCESS;
+}
+
+/* Returns the number of bytes queued, but not sent yet.
+ */
+size_t mux_pending(mux_conn *m) {
+    return m->queued + (m->out_end - m->out_start);
+}
+
+/* Returns TRUE if a message is being read (some of its frames, or of a
+   frame, were), FALSE otherwise.
+ */
+int mux_busy(mux_conn *m) {
+    return m->parts != NULL || m->in_end > m->in_start;
+}
+
+/* Puts the next frames to send in the output buffer (after what is left of
+   the previous ones, moved to its front), while they fit: a frame of each
+   message in turn.
+ * Returns the number of bytes to send.
+ */
+int fill_out(mux_conn *m) {
+    int left = m->out_end - m->out_start;
+    if (m->out_start > 0) {
+        memmove(m->out, m->out + m->out_start, left);
+        m->out_start = 0;
+        m->out_end = left;
+    }
+
+    while (m->head != NULL) {
+        mux_msg *msg = m->head;
+        uint32_t len = msg->hdr.payload_len - msg->sent;
+        if (len > MUX_CHUNK)
+            len = MUX_CHUNK;
+        if (m->out_end + MAX_COMPACT_HEADER + (int)len > MUX_BUF_SIZE)
+            break;
+
+        frame_header hdr = msg->hdr;
+        hdr.payload_len = len;
+        if (msg->sent + len < msg->hdr.payload_len)
+            hdr.flags |= FRAME_MORE;
+        m->out_end += encode_frame_header(&hdr, m->out + m->out_end,
+                                          m->compact);
+        if (len > 0)
+            memcpy(m->out + m->out_end, msg->data, len);
+        m->out_end += len;
+        msg->data += len;
+        msg->sent += len;
+        m->queued -= len;
+
+        // its turn is over: to the back of the line, or it is done (and
+        // the next message of its channel takes its place there)
+        pop_turn(m);
+        if (msg->sent < msg->hdr.payload_len) {
+            push_turn(m, msg);
+        } else {
+            if (msg->after != NULL)
+                push_turn(m, msg->after);
+            free_msg(msg);
+        }
+    }
+    return m->out_end;
+}
+
+/* Takes the message at the front of the line.
+ * Returns it, or NULL if there is none.
+ */
+mux_msg *pop_turn(mux_conn *m) {
+    mux_msg *msg = m->head;
+    if (msg != NULL) {
+        m->head = msg->next;
+        if (m->head == NULL)
+            m->tail = NULL;
+        msg->next = NULL;
+    }
+    return msg;
+}
+
+/* Puts the message at the back of the line.
+ */
+void push_turn(mux_conn *m, mux_msg *msg) {
+    msg->next = NULL;
+    if (m->tail != NULL)
+        m->tail->next = msg;
+    else
+        m->head = msg;
+    m->tail = msg;
+}
+
+/* Frees the message (and its payload, if its own).
+ */
+void free_msg(mux_msg *msg) {
+    free(msg->own);
+    free(msg);
+}
+
+/* Adds the frame's payload to the message (a new one if NULL, of which it
+   is the first frame), null-terminated.
+ * Returns the message on success, NULL on failure (it is freed then).
+ */
+mux_part *add_to_part(mux_part *part, frame_header *hdr,
+                      const uint8_t *payload) {
+    if (part == NULL) {
+        if ((part = calloc(1, sizeof(*part))) == NULL) {
+            print_err(MALLOC_FAILED);
+            return NULL;
+        }
+        part->hdr = *hdr;
+    }
+
+    uint64_t need = (uint64_t)part->len + hdr->payload_len + 1;
+    if (need > UINT32_MAX) {
+        print_err(OVERLENGTH);
+        free_part(part);
+        return NULL;
+    }
+    if (need > part->cap) { // (doubling, so as not to copy it all each time)
+        uint64_t cap = part->cap ? 2 * (uint64_t)part->cap : MUX_CHUNK + 1;
+        if (cap < need)
+            cap = need;
+        if (cap > UINT32_MAX)
+            cap = UINT32_MAX;
+        char *buf = realloc(part->buf, cap);
+        if (buf == NULL) {
+            print_err(MALLOC_FAILED);
+            free_part(part);
+            return NULL;
+        }
+        part->buf = buf;
+        part->cap = cap;
+    }
+    memcpy(part->buf + part->len, payload, hdr->payload_len);
+    part->len += hdr->payload_len;
+    part->buf[part->len] = '\0';
+    return part;
+}
+
+/* Takes the message of the channel being read out of the list.
+ * Returns it, or NULL if there is none.
+ */
+mux_part *take_part(mux_conn *m, int channel) {
+    for (mux_part **p = &m->parts; *p != NULL; p = &(*p)->next) {
+        if ((*p)->hdr.channel == channel) {
+            mux_part *part = *p;
+            *p = part->next;
+            part->next = NULL;
+            return part;
+        }
+    }
+    return NULL;
+}
+
+/* Frees the message being read, and what was read of it.
+ */
+void free_part(mux_part *part) {
+    free(part->buf);
+    free(part);
+}
+
+/* Has the socket take at most MUX_NOTSENT_LOWAT bytes not sent yet: past
+   it, a write() fails with EAGAIN (and poll() waits) as if it were full.
+ */
+void set_notsent_lowat(int sockfd) {
+    int lowat = MUX_NOTSENT_LOWAT;
+    // (only an optimisation, so a failure is of no consequence)
+    setsockopt(sockfd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat,
+               sizeof(lowat));
+}
+
+
+/* ---------------------------------- */
+/*  Multiplexed connection of clients */
+/* ---------------------------------- */
+
+/* Initialises a connection to the server for many clients at once (see
+   rpc_mux_client), connected on their first request. A thread of its own
+   reads their responses, and sends what they could not send at once. */
+/* RETURNS: rpc_mux* on success, NULL on error */
+rpc_mux *rpc_init_mux(char *addr, int port) {
+    if (!addr || check_ip(addr) == FAILED || check_port(port) == FAILED) {
+        print_err(INVALID_INPUT);
+        return NULL;
+    }
+    rpc_mux *mux = calloc(1, sizeof(*mux));
+    if (mux == NULL) {
+        print_err(MALLOC_FAILED);
+        return NULL;
+    }
+    strcpy(mux->addr, addr);
+    snprintf(mux->port, PORT_STR_LEN, "%d", port);
+    mux->sockfd = -1;
+    pthread_mutex_init(&mux->lock, NULL);
+    pthread_cond_init(&mux->reset, NULL);
+
+    // (the I/O thread waits on the socket and on this, at once)
+    if (pipe(mux->wake) < 0
+            || fcntl(mux->wake[0], F_SETFL, O_NONBLOCK) < 0
+            || fcntl(mux->wake[1], F_SETFL, O_NONBLOCK) < 0
+            || fcntl(mux->wake[0], F_SETFD, FD_CLOEXEC) < 0
+            || fcntl(mux->wake[1], F_SETFD, FD_CLOEXEC) < 0) {
+        print_sys_err("pipe");
+        pthread_mutex_destroy(&mux->lock);
+        pthread_cond_destroy(&mux->reset);
+        free(mux);
+        return NULL;
+    }
+
+    // signals are for the application's threads, not this one
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    int err = pthread_create(&mux->thread, NULL, run_mux, mux);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (err != 0) {
+        errno = err;
+        print_sys_err("pthread_create");
+        close(mux->wake[0]);
+        close(mux->wake[1]);
+        pthread_mutex_destroy(&mux->lock);
+        pthread_cond_destroy(&mux->reset);
+        free(mux);
+        return NULL;
+    }
+    return mux;
+}
+
+/* Closes the connection (after sending what is queued, if the socket takes
+   it at once) and frees it. Its clients must be closed first. */
+void rpc_close_mux(rpc_mux *mux) {
+    if (mux == NULL)
+        return;
+    pthread_mutex_lock(&mux->lock);
+    mux->closing = TRUE;
+    wake_mux(mux);
+    pthread_mutex_unlock(&mux->lock);
+    pthread_join(mux->thread, NULL);
+
+    if (mux->sockfd != -1) {
+        // Tell the server: "I'm closing"
+        // (it closes the connection anyway if it finds nothing to read)
+        frame_header req = {.type = CLOSE_REQ}; // of the connection's own
+        if (!mux->broken && mux_queue(mux->conn, &req, NULL, TRUE) == SUCCESS)
+            mux_write(mux->conn);
+        close(mux->sockfd);
+        free_mux_conn(mux->conn);
+    }
+
+    for (int i = 0; i < MAX_SESSIONS; i++) {
+        if (mux->sessions[i].open) { // (not closed as they should be)
+            free(mux->sessions[i].payload);
+            pthread_cond_destroy(&mux->sessions[i].cond);
+        }
+    }
+    close(mux->wake[0]);
+    close(mux->wake[1]);
+    pthread_mutex_destroy(&mux->lock);
+    pthread_cond_destroy(&mux->reset);
+    free(mux);
+}
+
+/* Opens a session of the connection, for a client.
+ * Returns its channel on success, FAILED if there are MAX_SESSIONS already.
+ */
+int mux_open_session(rpc_mux *mux) {
+    pthread_mutex_lock(&mux->lock);
+    int i = 0;
+    while (i < MAX_SESSIONS && mux->sessions[i].open)
+        i++;
+    if (i == MAX_SESSIONS) {
+        pthread_mutex_unlock(&mux->lock);
+        print_err(INVALID_INPUT);
+        return FAILED;
+    }
+
+    mux_session *s = &mux->sessions[i];
+    memset(s, 0, sizeof(*s));
+    s->open = TRUE;
+    // (waits end at deadlines of the monotonic clock, see now_ns)
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&s->cond, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_mutex_unlock(&mux->lock);
+    return i + 1;
+}
+
+/* Closes the session of the channel (its response, if any, is dropped),
+   telling the server with a CLOSE on the channel: the channel's next
+   session starts afresh (e.g. it isn't told of this one's casts).
+ */
+void mux_close_session(rpc_mux *mux, int channel) {
+    mux_cancel(mux, channel);
+    pthread_mutex_lock(&mux->lock);
+    // (behind what is left of its last request, if anything)
+    frame_header req = {.type = CLOSE_REQ, .channel = channel};
+    if (mux->sockfd != -1 && !mux->broken
+            && (mux_queue(mux->conn, &req, NULL, TRUE) == FAILED
+                || mux_write(mux->conn) == FAILED))
+        break_mux(mux);
+    else if (mux->sockfd != -1 && mux_pending(mux->conn) > 0
+             && !mux->polling_out)
+        wake_mux(mux); // to send the rest once it can
+    mux_session *s = &mux->sessions[channel - 1];
+    pthread_cond_destroy(&s->cond);
+    s->open = FALSE;
+    pthread_mutex_unlock(&mux->lock);
+}
+
+/* Connects (again, if the connection was lost), unless connected already.
+ * Returns SUCCESS on success, FAILED on failure.
+ */
+int mux_connect(rpc_mux *mux) {
+    pthread_mutex_lock(&mux->lock);
+    while (mux->broken) // the I/O thread closes it first
+        pthread_cond_wait(&mux->reset, &mux->lock);
+    if (mux->sockfd != -1) {
+        pthread_mutex_unlock(&mux->lock);
+        return SUCCESS;
+    }
+
+    // (the other clients have nothing to do but wait, meanwhile)
+    int compact;
+    frame_reader reader;
+    mux_conn *conn = NULL;
+    int sockfd = connect_to_server(mux->addr, mux->port, NULL);
+    if (sockfd != FAILED) {
+        init_reader(&reader, sockfd);
+        if (say_mux_hello(sockfd, &compact, &reader) == SUCCESS)
+            conn = create_mux_conn(sockfd, compact);
+        if (conn == NULL) {
+            close(sockfd);
+            sockfd = FAILED;
+        }
+    }
+    if (sockfd != FAILED) {
+        mux_feed(conn, &reader);
+        mux->conn = conn;
+        mux->sockfd = sockfd;
+        wake_mux(mux); // to wait on it from now on
+    }
+    pthread_mutex_unlock(&mux->lock);
+    return sockfd == FAILED ? FAILED : SUCCESS;
+}
+
+/* Queues the request of the session, and sends as much of it as the socket
+   takes (the rest goes out in the background). The payload must be kept
+   as it is until its response has been waited for, unless `owned` (then it
+   is freed once sent).
+ * Returns SUCCESS on success, FAILED on failure.
+ */
+int mux_send(rpc_mux *mux, int channel, frame_header *req, char *payload,
+             int owned) {
+    pthread_mutex_lock(&mux->lock);
+    if (mux->sockfd == -1 || mux->broken) { // lost since it was connected
+        pthread_mutex_unlock(&mux->lock);
+        print_err(CONNECTION_CLOSED);
+        if (owned)
+            free(payload);
+        return FAILED;
+    }
+
+    mux_session *s = &mux->sessions[channel - 1];
+    free(s->payload); // (of a response not taken)
+    s->payload = NULL;
+    s->req_id = req->req_id;
+    s->answered = FALSE;
+    s->failed = FALSE;
+
+    req->channel = channel;
+    int res = mux_queue(mux->conn, req, payload, owned);
+    if (res == SUCCESS && mux_write(mux->conn) == FAILED) {
+        break_mux(mux);
+        res = FAILED;
+    } else if (res == SUCCESS && mux_pending(mux->conn) > 0
+               && !mux->polling_out) {
+        wake_mux(mux); // to send the rest once it can
+    }
+    pthread_mutex_unlock(&mux->lock);
+    return res;
+}
+
+/* Waits for the response to the last request of the session, until this
+   thread's I/O deadline (see set_io_deadline), into `resp` and `*payload`
+   (as next_frame).
+ * Returns SUCCESS on success, FAILED if the connection was lost or the
+   deadline passed (io_deadline_passed() then tells it).
+ */
+int mux_wait(rpc_mux *mux, int channel, frame_header *resp, char **payload) {
+    *payload = NULL;
+    uint64_t deadline = get_io_deadline();
+    struct timespec ts;
+    if (deadline != NO_DEADLINE)
+        deadline_timespec(deadline, &ts);
+
+    pthread_mutex_lock(&mux->lock);
+    mux_session *s = &mux->sessions[channel - 1];
+    int timed_out = FALSE;
+    while (!s->answered && !s->failed && !timed_out) {
+        if (deadline == NO_DEADLINE)
+            pthread_cond_wait(&s->cond, &mux->lock);
+        else if (pthread_cond_timedwait(&s->cond, &mux->lock, &ts)
+                 == ETIMEDOUT)
+            timed_out = TRUE;
+    }
+    int res = FAILED;
+    if (s->answered) {
+        *resp = s->resp;
+        *payload = s->payload;
+        s->payload = NULL;
+        res = SUCCESS;
+    }
+    s->req_id = 0; // (a late response is dropped)
+    s->answered = FALSE;
+
+    // what is left of the request can't be sent from the caller's payload
+    if (res == FAILED && !mux->broken && mux->conn != NULL
+            && mux_keep_unsent(mux->conn, channel) == FAILED)
+        break_mux(mux);
+    pthread_mutex_unlock(&mux->lock);
+
+    if (res == FAILED && timed_out)
+        note_io_timeout();
+    return res;
+}
+
+/* Gives up on the response to the last request of the session (a late one
+   is dropped).
+ */
+void mux_cancel(rpc_mux *mux, int channel) {
+    pthread_mutex_lock(&mux->lock);
+    mux_session *s = &mux->sessions[channel - 1];
+    free(s->payload);
+    s->payload = NULL;
+    s->req_id = 0;
+    s->answered = FALSE;
+    if (!mux->broken && mux->conn != NULL
+            && mux_keep_unsent(mux->conn, channel) == FAILED)
+        break_mux(mux);
+    pthread_mutex_unlock(&mux->lock);
+}
+
+/* Opens the v2 connection on the socket with a HELLO round trip, asking
+   for channels (and compact headers). The server must agree to channels.
+ * Sets `*compact` to TRUE if it agreed to compact headers.
+ * Returns SUCCESS on success, FAILED otherwise.
+ */
+int say_mux_hello(int sockfd, int *compact, frame_reader *reader) {
+    frame_header req = {.type = HELLO_REQ, .flags = FRAME_MUX | FRAME_COMPACT,
+                        .req_id = 1};
+    frame_header resp;
+    char *payload = NULL;
+    int n = write_frame(sockfd, &req, NULL, FALSE);
+    // (a server turning it away, or only speaking v1, closes it on us)
+    if (n > 0)
+        n = next_frame(reader, FALSE, &resp, &payload);
+    free(payload); // none expected
+    if (n <= 0)
+        return FAILED;
+    if (resp.type != SUCCESS_STAT || resp.req_id != req.req_id
+            || !(resp.flags & FRAME_MUX)) {
+        print_err(INVALID_FRAME);
+        return FAILED;
+    }
+    *compact = (resp.flags & FRAME_COMPACT) ? TRUE : FALSE;
+    return SUCCESS;
+}
+
+/* Reads the responses of the connection's clients, and sends what they
+   queued, until the connection is closed (rpc_close_mux).
+ * The lock is only left while waiting, so the clients only ever find the
+   connection as it is between two rounds.
+ */
+void *run_mux(void *arg) {
+    rpc_mux *mux = arg;
+    pthread_mutex_lock(&mux->lock);
+    while (!mux->closing) {
+        if (mux->broken)
+            reset_mux(mux);
+
+        // nothing to wait on but the pipe, until a client connects
+        struct pollfd fds[2] = {
+            {.fd = mux->wake[0], .events = POLLIN},
+            {.fd = mux->sockfd, .events = POLLIN}
+        };
+        int nfds = mux->sockfd == -1 ? 1 : 2;
+        mux->polling_out = nfds == 2 && mux_pending(mux->conn) > 0;
+        if (mux->polling_out)
+            fds[1].events |= POLLOUT;
+        pthread_mutex_unlock(&mux->lock);
+
+        // (only this thread closes the socket, so it is the same one after)
+        int n = poll(fds, nfds, -1);
+        char buf[64];
+        while (read(mux->wake[0], buf, sizeof(buf)) > 0)
+            ; // woken up once for all
+
+        pthread_mutex_lock(&mux->lock);
+        if (n > 0 && nfds == 2 && fds[1].revents != 0 && !mux->broken)
+            serve_mux(mux, fds[1].revents);
+    }
+    mux->polling_out = FALSE;
+    pthread_mutex_unlock(&mux->lock);
+    return NULL;
+}
+
+/* Reads what came in (handing each response read in full to its session)
+   and/or sends what is queued, as the socket is ready for (`revents`).
+ */
+void serve_mux(rpc_mux *mux, short revents) {
+    int n = SUCCESS, next = FALSE;
+    if (revents & (POLLIN | POLLERR | POLLHUP)) {
+        n = mux_read(mux->conn);
+        // (even if it was then closed)
+        frame_header hdr;
+        char *payload;
+        while ((next = mux_next(mux->conn, &hdr, &payload)) == TRUE)
+            deliver(mux, &hdr, payload);
+    }
+    if (n == SUCCESS && next != FAILED && (revents & POLLOUT))
+        n = mux_write(mux->conn);
+
+    if (n != SUCCESS || next == FAILED) {
+        break_mux(mux);
+        reset_mux(mux);
+    }
+}
+
+/* Hands the response to the session waiting for it, or drops it if there
+   is none (a response to a request given up on, or of a session closed
+   since).
+ */
+void deliver(rpc_mux *mux, frame_header *hdr, char *payload) {
+    if (hdr->channel == 0 || hdr->channel > MAX_SESSIONS) {
+        free(payload);
+        return;
+    }
+    mux_session *s = &mux->sessions[hdr->channel - 1];
+    if (!s->open || s->req_id == 0 || s->req_id != hdr->req_id
+            || s->answered) {
+        free(payload);
+        return;
+    }
+    s->resp = *hdr;
+    s->payload = payload;
+    s->answered = TRUE;
+    pthread_cond_signal(&s->cond);
+}
+
+/* Fails the requests waiting for a response on the connection, which is
+   lost: the I/O thread closes it (reset_mux), and the next request of a
+   client opens a new one.
+ */
+void break_mux(rpc_mux *mux) {
+    if (mux->broken)
+        return;
+    mux->broken = TRUE;
+    for (int i = 0; i < MAX_SESSIONS; i++) {
+        mux_session *s = &mux->sessions[i];
+        if (s->open && s->req_id != 0 && !s->answered) {
+            s->failed = TRUE;
+            pthread_cond_signal(&s->cond);
+        }
+    }
+    wake_mux(mux);
+}
+
+/* Closes the lost connection (in the I/O thread), dropping what is left in
+   it.
+ */
+void reset_mux(rpc_mux *mux) {
+    close(mux->sockfd);
+    free_mux_conn(mux->conn);
+    mux->sockfd = -1;
+    mux->conn = NULL;
+    mux->broken = FALSE;
+    pthread_cond_broadcast(&mux->reset);
+}
+
+/* Wakes the I/O thread up, to wait on the connection as it is now.
+ */
+void wake_mux(rpc_mux *mux) {
+    // (if the pipe is full, it is awake already)
+    ssize_t n = write(mux->wake[1], "", 1);
+    (void)n;
+}
+
+/* Converts the deadline (of now_ns) to the time of pthread_cond_timedwait.
+ */
+void deadline_timespec(uint64_t deadline_ns, struct timespec *ts) {
+    ts->tv_sec = deadline_ns / (NS_PER_MS * MS_PER_S);
+    ts->tv_nsec = deadline_ns % (NS_PER_MS * MS_PER_S);
+}
@@ -0,0 +1,147 @@
+/*-----------------------------------------------------------------------------
+ * Project 2
+ * rpc_mux.h :
+              = the interface of the module `rpc_mux` of the project
+              = multiplexing of a v2 connection: the requests of many
+                clients (sessions), each on a channel of its own, share a
+                single socket, and their frames are interleaved fairly
+ * Note: The functions of the client's multiplexed connections are part of
+   the RPC system's interface, so they are declared in rpc_ext.h.
+ ----------------------------------------------------------------------------*/
+
+#ifndef RPC_MUX_H
+#define RPC_MUX_H
+
+#include <stddef.h>
+#include "rpc.h"
+#include "rpc_ext.h"
+#include "rpc_frame.h"
+
+// most sessions of a connection (channel 0 is the connection's own)
+#define MAX_SESSIONS 1024
+// most payload sent in a frame: a longer one goes in several, the other
+// channels taking their turn in between
+#define MUX_CHUNK 16384
+// bytes written but not sent yet that the kernel may hold (so that a long
+// payload does not fill its buffer, ahead of what is queued after it)
+#define MUX_NOTSENT_LOWAT (2 * MUX_CHUNK)
+// output queued past which a server reads no more requests, until some of
+// it is sent
+#define MUX_MAX_PENDING (4 << 20)
+
+/* How it goes:
+ * - Both ends ask for FRAME_MUX in the HELLO (the client) and agree to it
+   (the server). From then on, every frame has the channel of its session,
+   and at most MUX_CHUNK bytes of payload: a longer one is split into
+   frames with FRAME_MORE, but the last.
+ * - Messages waiting to be sent take turns, a frame each: a long one only
+   holds up the others for one frame at a time. The messages of a channel
+   are sent in order.
+ * - A request is handled once all of it is read. Its response (and any
+   other) is queued, and sent while the next requests are handled.
+ */
+
+// The frames of a multiplexed connection, in and out
+typedef struct mux_conn mux_conn;
+
+/* Creates the state of the multiplexed connection on the (non-blocking)
+   socket, whose headers are compact if `compact` is TRUE.
+ * Returns the state on success, NULL on error.
+ */
+mux_conn *create_mux_conn(int sockfd, int compact);
+
+/* Frees the state of the connection (it does not close the socket), and
+   what is left in it.
+ */
+void free_mux_conn(mux_conn *m);
+
+/* Takes the bytes the reader read ahead, but did not use (sent right after
+   the HELLO), as the first bytes read from the connection.
+ */
+void mux_feed(mux_conn *m, frame_reader *r);
+
+/* Reads whatever the socket has, without waiting.
+ * Returns SUCCESS on success (even if nothing was read),
+   FAILED on failure, or EMPTY if the connection was closed.
+ */
+int mux_read(mux_conn *m);
+
+/* Takes the next message read in full (its frames put back together), its
+   header into `hdr` (payload_len being all of it) and its payload into
+   `*payload` (as next_frame).
+ * Returns TRUE if there was one, FALSE if not (yet),
+   or FAILED on an invalid frame.
+ */
+int mux_next(mux_conn *m, frame_header *hdr, char **payload);
+
+/* Queues a message (the header's payload_len being all of it) behind those
+   of its channel. With `owned`, the payload is freed once sent; otherwise
+   it must be kept as it is until then (see mux_keep_unsent).
+ * Returns SUCCESS on success, FAILED on failure.
+ */
+int mux_queue(mux_conn *m, frame_header *hdr, char *payload, int owned);
+
+/* Sends what is queued, a frame of each message in turn, until the socket
+   can take no more.
+ * Returns SUCCESS on success (even if something is left to send),
+   FAILED on failure.
+ */
+int mux_write(mux_conn *m);
+
+/* Copies what is left to send of the messages of the channel whose payload
+   is not their own, so that it may be freed.
+ * Returns SUCCESS on success, FAILED on failure.
+ */
+int mux_keep_unsent(mux_conn *m, int channel);
+
+/* Returns the number of bytes queued, but not sent yet.
+ */
+size_t mux_pending(mux_conn *m);
+
+/* Returns TRUE if a message is being read (some of its frames, or of a
+   frame, were), FALSE otherwise.
+ */
+int mux_busy(mux_conn *m);
+
+/* The functions below are implemented in rpc_mux.c, for the clients of a
+   multiplexed connection (rpc_mux_client, in rpc.c). */
+
+/* Opens a session of the connection, for a client.
+ * Returns its channel on success, FAILED if there are MAX_SESSIONS already.
+ */
+int mux_open_session(rpc_mux *mux);
+
+/* Closes the session of the channel (its response, if any, is dropped),
+   telling the server with a CLOSE on the channel: the channel's next
+   session starts afresh (e.g. it isn't told of this one's casts).
+ */
+void mux_close_session(rpc_mux *mux, int channel);
+
+/* Connects (again, if the connection was lost), unless connected already.
+ * Returns SUCCESS on success, FAILED on failure.
+ */
+int mux_connect(rpc_mux *mux);
+
+/* Queues the request of the session, and sends as much of it as the socket
+   takes (the rest goes out in the background). The payload must be kept
+   as it is until its response has been waited for, unless `owned` (then it
+   is freed once sent).
+ * Returns SUCCESS on success, FAILED on failure.
+ */
+int mux_send(rpc_mux *mux, int channel, frame_header *req, char *payload,
+             int owned);
+
+/* Waits for the response to the last request of the session, until this
+   thread's I/O deadline (see set_io_deadline), into `resp` and `*payload`
+   (as next_frame).
+ * Returns SUCCESS on success, FAILED if the connection was lost or the
+   deadline passed (io_deadline_passed() then tells it).
+ */
+int mux_wait(rpc_mux *mux, int channel, frame_header *resp, char **payload);
+
+/* Gives up on the response to the last request of the session (a late one
+   is dropped).
+ */
+void mux_cancel(rpc_mux *mux, int channel);
+
+#endif
@@ -0,0 +1,507 @@
+#define _GNU_SOURCE // dladdr1, dlinfo, memfd_create
+#include "rpc_plugin.h"
+#include "rpc_shared.h"
+#include "rpc_safety.h"
+#include "rpc_io_helper.h"
+#include <dlfcn.h>
+#include <link.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// "/proc/<pid>/fd/<fd>"
+#define IMAGE_LEN 48
+#define COPY_BUF 65536
+// how often a child waiting on an admin request signals the server again
+#define ADMIN_RESIGNAL_MS 100
+
+// States of a plugin slot
+enum PLUGIN_STATE {PLUGIN_FREE = 0, PLUGIN_LOADED = 1, PLUGIN_RETIRED = 2};
+
+// A plugin, as every process sees it
+typedef struct {
+    int state;                // enum PLUGIN_STATE
+    uint32_t gen;             // bumped every time the slot is loaded
+    uint64_t inflight;        // calls of it running, in all processes
+    uintptr_t base;           // where the server loaded it
+    dev_t dev;                // its file, when loaded
+    ino_t ino;
+    struct timespec mtime;
+    off_t size;
+    char path[PATH_MAX];
+    char image[IMAGE_LEN];    // its copy, which children load
+} plugin_slot;
+
+// Admin requests from children, one at a time
+typedef struct {
+    pid_t holder;             // the child making a request (0: none)
+    uint64_t seq;             // of the last request
+    uint64_t done;            // of the last request carried out
+    int op;                   // enum PLUGIN_OP
+    int result;
+    char name[NAME_MAX + 1];
+} plugin_mailbox;
+
+typedef struct {
+    pid_t owner;              // the server process
+    uint32_t epoch;           // bumped whenever a plugin is closed
+    plugin_slot slots[MAX_PLUGINS];
+    plugin_mailbox mailbox;
+} plugin_shared;
+
+// A plugin, as loaded in this process
+typedef struct {
+    uint32_t gen;             // of the slot when loaded here (0: not loaded)
+    void *dl;
+    struct link_map *map;
+    int fd;                   // its copy (server only, -1 otherwise)
+} plugin_local;
+
+struct plugin_table {
+    plugin_shared *shared;
+    uint32_t epoch;           // of the shared one, last time it was checked
+    plugin_local local[MAX_PLUGINS];
+};
+
+// PLUGIN_* asked for by the signals received (see take_plugin_signals)
+static int pending_signals = 0;
+
+/******* Private functions *******/
+int copy_to_memory(char *path, struct stat *st);
+void close_local(plugin_local *l);
+void sync_plugins(plugin_table *pt);
+void plugin_signal_handler(int sig);
+int lock_mailbox(plugin_mailbox *m, int *waited);
+
+
+/* Creates an empty table, for plugins loaded by this process.
+ * Returns the table on success, NULL otherwise.
+ */
+plugin_table *create_plugin_table(void) {
+    plugin_table *pt = malloc(sizeof(*pt));
+    if (pt == NULL) {
+        print_err(MALLOC_FAILED);
+        return NULL;
+    }
+    pt->shared = create_shared(sizeof(plugin_shared));
+    if (pt->shared == NULL) {
+        free(pt);
+        return NULL;
+    }
+    pt->shared->owner = getpid();
+    pt->epoch = 0;
+    for (int i = 0; i < MAX_PLUGINS; i++) {
+        pt->local[i] = (plugin_local){.gen = 0, .dl = NULL, .map = NULL,
+                                      .fd = -1};
+    }
+    return pt;
+}
+
+/* Loads (a copy of) the shared object at `path` as a new plugin, and finds
+   its RPC_PLUGIN_INIT function (not called here) to put at `init`.
+ * Returns the index of the plugin on success, FAILED otherwise.
+ */
+int open_plugin(plugin_table *pt, char *path, rpc_plugin_init_fn *init) {
+    plugin_shared *sh = pt->shared;
+    if (getpid() != sh->owner || strlen(path) >= PATH_MAX) {
+        print_err(INVALID_INPUT);
+        return FAILED;
+    }
+
+    int idx = 0;
+    while (idx < MAX_PLUGINS && sh->slots[idx].state != PLUGIN_FREE)
+        idx++;
+    if (idx == MAX_PLUGINS) {
+        print_err(PLUGIN_FAILED);
+        return FAILED;
+    }
+    plugin_slot *slot = &sh->slots[idx];
+    plugin_local *l = &pt->local[idx];
+
+    // the copy: what's loaded stays the same, whatever happens to the file
+    struct stat st;
+    int fd = copy_to_memory(path, &st);
+    if (fd == FAILED) {
+        print_err(PLUGIN_FAILED);
+        return FAILED;
+    }
+    snprintf(slot->image, IMAGE_LEN, "/proc/%d/fd/%d", (int)sh->owner, fd);
+    void *dl = dlopen(slot->image, RTLD_NOW | RTLD_LOCAL);
+    void *sym = dl ? dlsym(dl, RPC_PLUGIN_INIT) : NULL;
+    struct link_map *map = NULL;
+    if (sym == NULL || dlinfo(dl, RTLD_DI_LINKMAP, &map) != 0) {
+        fprintf(stderr, "%s: %s\n", path, dlerror());
+        print_err(PLUGIN_FAILED);
+        if (dl != NULL)
+            dlclose(dl);
+        close(fd);
+        return FAILED;
+    }
+    *init = (rpc_plugin_init_fn)sym;
+
+    *l = (plugin_local){.dl = dl, .map = map, .fd = fd};
+    strcpy(slot->path, path);
+    slot->base = map->l_addr;
+    slot->dev = st.st_dev;
+    slot->ino = st.st_ino;
+    slot->mtime = st.st_mtim;
+    slot->size = st.st_size;
+    l->gen = __atomic_add_fetch(&slot->gen, 1, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&slot->state, PLUGIN_LOADED, __ATOMIC_SEQ_CST);
+    return idx;
+}
+
+/* Looks up the plugin loaded from `path` (not being unloaded).
+ * Returns its index if found, FAILED otherwise.
+ */
+int find_plugin(plugin_table *pt, char *path) {
+    for (int i = 0; i < MAX_PLUGINS; i++) {
+        if (plugin_path(pt, i) != NULL
+                && strcmp(pt->shared->slots[i].path, path) == 0)
+            return i;
+    }
+    return FAILED;
+}
+
+/* Returns the path of the plugin at index `idx` if it is loaded (not being
+   unloaded), NULL otherwise.
+ */
+char *plugin_path(plugin_table *pt, int idx) {
+    plugin_slot *slot = &pt->shared->slots[idx];
+    if (__atomic_load_n(&slot->state, __ATOMIC_ACQUIRE) != PLUGIN_LOADED)
+        return NULL;
+    return slot->path;
+}
+
+/* Returns the generation of the plugin at index `idx` (which load of it).
+ */
+uint32_t plugin_gen(plugin_table *pt, int idx) {
+    return __atomic_load_n(&pt->shared->slots[idx].gen, __ATOMIC_ACQUIRE);
+}
+
+/* Returns TRUE if the file of the plugin at index `idx` was changed (or
+   removed) since it was loaded, FALSE otherwise.
+ */
+int plugin_changed(plugin_table *pt, int idx) {
+    plugin_slot *slot = &pt->shared->slots[idx];
+    struct stat st;
+    if (stat(slot->path, &st) == -1)
+        return TRUE;
+    return st.st_dev != slot->dev || st.st_ino != slot->ino
+        || st.st_size != slot->size
+        || st.st_mtim.tv_sec != slot->mtime.tv_sec
+        || st.st_mtim.tv_nsec != slot->mtime.tv_nsec;
+}
+
+/* Tells which loaded plugin the handler (an address in this process) is
+   from, and its generation at `gen`.
+ * Returns the index of the plugin, or NO_PLUGIN if it is from the program.
+ */
+int plugin_of(plugin_table *pt, rpc_handler handler, uint32_t *gen) {
+    Dl_info info;
+    struct link_map *map = NULL;
+    if (dladdr1((void *)handler, &info, (void **)&map, RTLD_DL_LINKMAP) == 0
+            || map == NULL)
+        return NO_PLUGIN;
+    for (int i = 0; i < MAX_PLUGINS; i++) {
+        if (pt->local[i].gen != 0 && pt->local[i].map == map) {
+            *gen = pt->local[i].gen;
+            return i;
+        }
+    }
+    return NO_PLUGIN;
+}
+
+/* Starts unloading the plugin at index `idx`: no call of it starts from
+   now on (its functions should have been removed already).
+ */
+void retire_plugin(plugin_table *pt, int idx) {
+    __atomic_store_n(&pt->shared->slots[idx].state, PLUGIN_RETIRED,
+                     __ATOMIC_SEQ_CST);
+}
+
+/* Closes the plugins being unloaded that have no calls in flight, waiting
+   up to `wait_ms` milliseconds for them.
+ * Returns the number of plugins still being unloaded.
+ */
+int close_retired(plugin_table *pt, int wait_ms) {
+    plugin_shared *sh = pt->shared;
+    uint64_t deadline = now_ns() + wait_ms * NS_PER_MS;
+    int left = 0;
+    for (int i = 0; i < MAX_PLUGINS; i++) {
+        plugin_slot *slot = &sh->slots[i];
+        if (__atomic_load_n(&slot->state, __ATOMIC_SEQ_CST) != PLUGIN_RETIRED)
+            continue;
+        // a call that started before it was retired is still running
+        while (__atomic_load_n(&slot->inflight, __ATOMIC_SEQ_CST) > 0
+                && now_ns() < deadline)
+            usleep(1000);
+        if (__atomic_load_n(&slot->inflight, __ATOMIC_SEQ_CST) > 0) {
+            left++;
+            continue;
+        }
+
+        close_local(&pt->local[i]);
+        __atomic_store_n(&slot->state, PLUGIN_FREE, __ATOMIC_SEQ_CST);
+        // the children close theirs on their next call
+        __atomic_add_fetch(&sh->epoch, 1, __ATOMIC_RELEASE);
+    }
+    return left;
+}
+
+/* Gets the handler of the function (version) for a call in this process,
+   loading its plugin here first if needed, and counts the call in flight
+   until exit_plugin().
+ * Returns the handler, or NULL if its plugin is being (or was) unloaded.
+ */
+rpc_handler enter_plugin(plugin_table *pt, rpc_func *func) {
+    sync_plugins(pt);
+    if (func->plugin == NO_PLUGIN)
+        return func->handler;
+
+    // counted first, so that the server can't close it from now on
+    // (unless it was retired already, which is checked after)
+    plugin_slot *slot = &pt->shared->slots[func->plugin];
+    __atomic_add_fetch(&slot->inflight, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&slot->state, __ATOMIC_SEQ_CST) != PLUGIN_LOADED
+            || plugin_gen(pt, func->plugin) != func->plugin_gen) {
+        exit_plugin(pt, func->plugin);
+        return NULL;
+    }
+
+    plugin_local *l = &pt->local[func->plugin];
+    if (l->gen != func->plugin_gen) {
+        // first call of it here: load the server's copy
+        close_local(l);
+        l->dl = dlopen(slot->image, RTLD_NOW | RTLD_LOCAL);
+        if (l->dl == NULL || dlinfo(l->dl, RTLD_DI_LINKMAP, &l->map) != 0) {
+            fprintf(stderr, "%s: %s\n", slot->path, dlerror());
+            close_local(l);
+            exit_plugin(pt, func->plugin);
+            return NULL;
+        }
+        l->gen = func->plugin_gen;
+    }
+    // same offset into the plugin as in the server
+    uintptr_t offset = (uintptr_t)func->handler - slot->base;
+    return (rpc_handler)(l->map->l_addr + offset);
+}
+
+/* Ends a call of a function of the plugin at index `idx` (or NO_PLUGIN),
+   letting the server know if it was the last call of a plugin being
+   unloaded.
+ */
+void exit_plugin(plugin_table *pt, int idx) {
+    if (idx == NO_PLUGIN)
+        return;
+    plugin_slot *slot = &pt->shared->slots[idx];
+    // the last call of a plugin being unloaded -> the server can close it
+    if (__atomic_sub_fetch(&slot->inflight, 1, __ATOMIC_SEQ_CST) == 0
+            && __atomic_load_n(&slot->state, __ATOMIC_SEQ_CST) == PLUGIN_RETIRED
+            && getpid() != pt->shared->owner)
+        kill(pt->shared->owner, SIGUSR1);
+}
+
+/* Makes SIGHUP and SIGUSR1 interrupt the server's accept(), and note what
+   they ask for (see take_plugin_signals).
+ * Returns SUCCESS on success, FAILED otherwise.
+ */
+int set_up_plugin_signals(void) {
+    struct sigaction sa;
+    sa.sa_handler = plugin_signal_handler;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = 0; // no SA_RESTART: accept() returns, with EINTR
+    if (sigaction(SIGHUP, &sa, NULL) == -1
+            || sigaction(SIGUSR1, &sa, NULL) == -1) {
+        perror("sigaction");
+        return FAILED;
+    }
+    return SUCCESS;
+}
+
+/* Returns what the signals received since the last call asked for
+   (PLUGIN_RESCAN, PLUGIN_ADMIN), and forgets it.
+ */
+int take_plugin_signals(void) {
+    return __atomic_exchange_n(&pending_signals, 0, __ATOMIC_ACQ_REL);
+}
+
+/* Asks the server to carry out an admin request (enum PLUGIN_OP) on the
+   plugin file `name`, and waits for it (called by a child).
+ * Returns the result of the request, FAILED if it was not carried out.
+ */
+int request_plugin_op(plugin_table *pt, int op, char *name) {
+    plugin_shared *sh = pt->shared;
+    plugin_mailbox *m = &sh->mailbox;
+    if (strlen(name) > NAME_MAX) {
+        print_err(INVALID_INPUT);
+        return FAILED;
+    }
+
+    // (the whole request takes PLUGIN_ADMIN_MS at most, waiting included)
+    int waited = 0;
+    if (lock_mailbox(m, &waited) == FAILED) {
+        print_err(PLUGIN_FAILED);
+        return FAILED;
+    }
+    m->op = op;
+    strcpy(m->name, name);
+    uint64_t seq = __atomic_add_fetch(&m->seq, 1, __ATOMIC_RELEASE);
+
+    // (signalled again now and then, in case the server was not in accept()
+    // when it got the signal, and has not woken up since)
+    int result = FAILED;
+    for (; waited < PLUGIN_ADMIN_MS; waited++) {
+        if (waited % ADMIN_RESIGNAL_MS == 0)
+            kill(sh->owner, SIGUSR1);
+        if (__atomic_load_n(&m->done, __ATOMIC_ACQUIRE) == seq) {
+            result = m->result;
+            break;
+        }
+        usleep(1000);
+    }
+    __atomic_store_n(&m->holder, 0, __ATOMIC_RELEASE);
+    return result;
+}
+
+/* Takes the mailbox for this process, waiting for the child holding it
+   (if any) to be done, or taking it over from a child that died holding
+   it. `*waited` counts the milliseconds waited, up to PLUGIN_ADMIN_MS.
+ * Returns SUCCESS on success, FAILED if it was still held by then.
+ */
+int lock_mailbox(plugin_mailbox *m, int *waited) {
+    pid_t self = getpid();
+    for (; *waited < PLUGIN_ADMIN_MS; (*waited)++) {
+        pid_t holder = 0;
+        if (__atomic_compare_exchange_n(&m->holder, &holder, self, FALSE,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            return SUCCESS;
+        // (`holder` is who has it now)
+        if (kill(holder, 0) == -1 && errno == ESRCH
+                && __atomic_compare_exchange_n(&m->holder, &holder, self,
+                                               FALSE, __ATOMIC_ACQUIRE,
+                                               __ATOMIC_RELAXED))
+            return SUCCESS;
+        usleep(1000); // another request is being carried out
+    }
+    return FAILED;
+}
+
+/* Gets the admin request waiting for the server, if any: its operation at
+   `op`, and the name of its file copied to `name` (of NAME_MAX + 1 bytes).
+ * Returns its sequence number (for finish_plugin_op), or 0 if none.
+ */
+uint64_t next_plugin_op(plugin_table *pt, int *op, char *name) {
+    plugin_mailbox *m = &pt->shared->mailbox;
+    uint64_t seq = __atomic_load_n(&m->seq, __ATOMIC_ACQUIRE);
+    if (seq == __atomic_load_n(&m->done, __ATOMIC_ACQUIRE))
+        return 0;
+    *op = m->op;
+    memcpy(name, m->name, NAME_MAX + 1);
+    name[NAME_MAX] = '\0';
+    return seq;
+}
+
+/* Gives the result of the admin request with the sequence number back to
+   the child waiting for it.
+ */
+void finish_plugin_op(plugin_table *pt, uint64_t seq, int result) {
+    plugin_mailbox *m = &pt->shared->mailbox;
+    m->result = result;
+    __atomic_store_n(&m->done, seq, __ATOMIC_RELEASE);
+}
+
+/* Frees the table (closing the plugins loaded by this process).
+ */
+void free_plugin_table(plugin_table *pt) {
+    if (pt == NULL)
+        return;
+    for (int i = 0; i < MAX_PLUGINS; i++) {
+        close_local(&pt->local[i]);
+    }
+    free_shared(pt->shared, sizeof(plugin_shared));
+    free(pt);
+}
+
+/* Copies the file at `path` to a new file in memory, and its status to
+   `st`.
+ * Returns the file descriptor of the copy on success, FAILED otherwise.
+ */
+int copy_to_memory(char *path, struct stat *st) {
+    int src = open(path, O_RDONLY | O_CLOEXEC);
+    if (src == -1) {
+        perror(path);
+        return FAILED;
+    }
+    // (not passed on to whatever the server execs, e.g. its successor;
+    // children open it through the server's /proc entry anyway)
+    int fd = memfd_create("rpc-plugin", MFD_CLOEXEC);
+    if (fd == -1 || fstat(src, st) == -1) {
+        perror("memfd_create");
+        close(src);
+        if (fd != -1)
+            close(fd);
+        return FAILED;
+    }
+
+    char buf[COPY_BUF];
+    ssize_t n;
+    while ((n = read(src, buf, sizeof(buf))) > 0) {
+        if (write(fd, buf, n) != n) {
+            n = -1;
+            break;
+        }
+    }
+    close(src);
+    if (n < 0) {
+        perror(path);
+        close(fd);
+        return FAILED;
+    }
+    return fd;
+}
+
+/* Closes the plugin in this process, if loaded.
+ */
+void close_local(plugin_local *l) {
+    if (l->dl != NULL)
+        dlclose(l->dl);
+    if (l->fd != -1)
+        close(l->fd);
+    *l = (plugin_local){.gen = 0, .dl = NULL, .map = NULL, .fd = -1};
+}
+
+/* Closes the plugins that the server closed since the last time, if loaded
+   in this process (a child; no call is running here in between calls).
+ */
+void sync_plugins(plugin_table *pt) {
+    plugin_shared *sh = pt->shared;
+    uint32_t epoch = __atomic_load_n(&sh->epoch, __ATOMIC_ACQUIRE);
+    if (epoch == pt->epoch)
+        return;
+    pt->epoch = epoch;
+    if (getpid() == sh->owner) // the server closes its own in close_retired
+        return;
+    for (int i = 0; i < MAX_PLUGINS; i++) {
+        plugin_local *l = &pt->local[i];
+        if (l->gen != 0 && (plugin_path(pt, i) == NULL
+                            || plugin_gen(pt, i) != l->gen))
+            close_local(l);
+    }
+}
+
+/* Handler for SIGHUP and SIGUSR1: notes what they ask for.
+ */
+void plugin_signal_handler(int sig) {
+    __atomic_fetch_or(&pending_signals,
+                      sig == SIGHUP ? PLUGIN_RESCAN : PLUGIN_ADMIN,
+                      __ATOMIC_RELAXED);
+}
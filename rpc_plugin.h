@@ -0,0 +1,135 @@
+/*-----------------------------------------------------------------------------
+ * Project 2
+ * rpc_plugin.h :
+              = the interface of the module `rpc_plugin` of the project
+              = handlers loaded at run time from plugins (shared objects),
+                in the server and in every child serving a connection
+ ----------------------------------------------------------------------------*/
+
+#ifndef RPC_PLUGIN_H
+#define RPC_PLUGIN_H
+
+#include <stdint.h>
+#include "rpc.h"
+#include "rpc_ext.h"
+#include "rpc_func_manager.h"
+
+// plugins loaded at once at most
+#define MAX_PLUGINS 64
+// how long unloading a plugin waits for its calls in flight to end
+#define PLUGIN_DRAIN_MS 5000
+// how long a child waits for the server to carry out an admin request
+#define PLUGIN_ADMIN_MS 10000
+
+// What the signals received by the server ask for
+#define PLUGIN_RESCAN 0x1  // SIGHUP: (re)load the plugins of the directory
+#define PLUGIN_ADMIN 0x2   // SIGUSR1: a child has an admin request, or has
+                           // ended the last call of a plugin being unloaded
+
+// Admin requests (from a child, carried out by the server)
+enum PLUGIN_OP {PLUGIN_LOAD = 1, PLUGIN_UNLOAD = 2};
+
+/* The plugins of a server: a table in shared memory, which every process
+   (the server and its children) reads, but only the server changes.
+ * The server loads a private copy of each plugin (in memory, so replacing
+   the file on disk does not affect it); a child loads the same copy the
+   first time it calls one of its functions. Handlers are registered with
+   the address they have in the server, and translated in each child.
+ * Calls in flight are counted per plugin, over all processes, so that a
+   plugin is only closed once the last of them has returned.
+ */
+typedef struct plugin_table plugin_table;
+
+/* Creates an empty table, for plugins loaded by this process.
+ * Returns the table on success, NULL otherwise.
+ */
+plugin_table *create_plugin_table(void);
+
+/* Loads (a copy of) the shared object at `path` as a new plugin, and finds
+   its RPC_PLUGIN_INIT function (not called here) to put at `init`.
+ * Returns the index of the plugin on success, FAILED otherwise.
+ */
+int open_plugin(plugin_table *pt, char *path, rpc_plugin_init_fn *init);
+
+/* Looks up the plugin loaded from `path` (not being unloaded).
+ * Returns its index if found, FAILED otherwise.
+ */
+int find_plugin(plugin_table *pt, char *path);
+
+/* Returns the path of the plugin at index `idx` if it is loaded (not being
+   unloaded), NULL otherwise.
+ */
+char *plugin_path(plugin_table *pt, int idx);
+
+/* Returns the generation of the plugin at index `idx` (which load of it).
+ */
+uint32_t plugin_gen(plugin_table *pt, int idx);
+
+/* Returns TRUE if the file of the plugin at index `idx` was changed (or
+   removed) since it was loaded, FALSE otherwise.
+ */
+int plugin_changed(plugin_table *pt, int idx);
+
+/* Tells which loaded plugin the handler (an address in this process) is
+   from, and its generation at `gen`.
+ * Returns the index of the plugin, or NO_PLUGIN if it is from the program.
+ */
+int plugin_of(plugin_table *pt, rpc_handler handler, uint32_t *gen);
+
+/* Starts unloading the plugin at index `idx`: no call of it starts from
+   now on (its functions should have been removed already).
+ */
+void retire_plugin(plugin_table *pt, int idx);
+
+/* Closes the plugins being unloaded that have no calls in flight, waiting
+   up to `wait_ms` milliseconds for them.
+ * Returns the number of plugins still being unloaded.
+ */
+int close_retired(plugin_table *pt, int wait_ms);
+
+/* Gets the handler of the function (version) for a call in this process,
+   loading its plugin here first if needed, and counts the call in flight
+   until exit_plugin().
+ * Returns the handler, or NULL if its plugin is being (or was) unloaded.
+ */
+rpc_handler enter_plugin(plugin_table *pt, rpc_func *func);
+
+/* Ends a call of a function of the plugin at index `idx` (or NO_PLUGIN),
+   letting the server know if it was the last call of a plugin being
+   unloaded.
+ */
+void exit_plugin(plugin_table *pt, int idx);
+
+/* Makes SIGHUP and SIGUSR1 interrupt the server's accept(), and note what
+   they ask for (see take_plugin_signals).
+ * Returns SUCCESS on success, FAILED otherwise.
+ */
+int set_up_plugin_signals(void);
+
+/* Returns what the signals received since the last call asked for
+   (PLUGIN_RESCAN, PLUGIN_ADMIN), and forgets it.
+ */
+int take_plugin_signals(void);
+
+/* Asks the server to carry out an admin request (enum PLUGIN_OP) on the
+   plugin file `name`, and waits for it (called by a child).
+ * Returns the result of the request, FAILED if it was not carried out.
+ */
+int request_plugin_op(plugin_table *pt, int op, char *name);
+
+/* Gets the admin request waiting for the server, if any: its operation at
+   `op`, and the name of its file copied to `name` (of NAME_MAX + 1 bytes).
+ * Returns its sequence number (for finish_plugin_op), or 0 if none.
+ */
+uint64_t next_plugin_op(plugin_table *pt, int *op, char *name);
+
+/* Gives the result of the admin request with the sequence number back to
+   the child waiting for it.
+ */
+void finish_plugin_op(plugin_table *pt, uint64_t seq, int result);
+
+/* Frees the table (closing the plugins loaded by this process).
+ */
+void free_plugin_table(plugin_table *pt);
+
+#endif
@@ -0,0 +1,333 @@
+#include "rpc_resp_cache.h"
+#include "rpc_cache.h"
+#include "rpc_io_helper.h"
+#include "rpc_safety.h"
+#include "array.h"
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+typedef struct resp_entry resp_entry;
+struct resp_entry {
+    uint64_t hash;          // of the payload
+    uint64_t expires;       // time (now_ns) after which it is stale
+    size_t size;            // bytes charged to the handle's budget
+    rpc_data payload;       // copy of the call's payload
+    rpc_data result;        // copy of the response
+    resp_entry *next;       // in the same bucket
+    resp_entry *newer;      // LRU order
+    resp_entry *older;
+};
+
+// the cached responses of one handle
+typedef struct {
+    uint32_t func;
+    uint64_t ttl_ns;
+    size_t max_bytes;
+    size_t bytes;           // charged by the entries
+    resp_entry *newest;     // most recently used
+    resp_entry *oldest;     // evicted first
+    resp_entry *buckets[RESP_CACHE_BUCKETS];
+} handle_cache;
+
+struct resp_cache {
+    pthread_mutex_t lock;
+    array_t *handles;       // of handle_cache, searched by function index
+    uint64_t hits;
+    uint64_t misses;
+};
+
+/******* Private functions *******/
+handle_cache *find_handle(resp_cache *cache, uint32_t func);
+int cmp_handle_func(void *hc, void *func);
+void free_handle_cache(void *hc);
+void clear_handle_cache(handle_cache *hc);
+resp_entry *find_entry(handle_cache *hc, uint64_t hash, rpc_data *payload);
+void unlink_entry(handle_cache *hc, resp_entry *e);
+void link_newest(handle_cache *hc, resp_entry *e);
+void drop_resp_entry(handle_cache *hc, resp_entry *e);
+void free_resp_entry(resp_entry *e);
+int copy_rpc_data(rpc_data *dst, rpc_data *src);
+
+
+/* Creates an empty cache (no handle opted in).
+ * Returns the cache on success, NULL otherwise.
+ */
+resp_cache *create_resp_cache() {
+    resp_cache *cache = malloc(sizeof(*cache));
+    if (cache == NULL) {
+        print_err(MALLOC_FAILED);
+        return NULL;
+    }
+    cache->handles = create_array(cmp_handle_func, free_handle_cache);
+    if (cache->handles == NULL) {
+        free(cache);
+        return NULL;
+    }
+    pthread_mutex_init(&cache->lock, NULL);
+    cache->hits = 0;
+    cache->misses = 0;
+    return cache;
+}
+
+/* Caches the responses of function `func` for `ttl_ms` milliseconds,
+   using at most `max_bytes` (payloads, results and bookkeeping).
+   A `ttl_ms` of 0 stops caching them and drops those cached.
+ * Returns SUCCESS on success, FAILED otherwise.
+ */
+int resp_cache_configure(resp_cache *cache, uint32_t func, int ttl_ms,
+                         size_t max_bytes) {
+    if (cache == NULL || ttl_ms < 0) {
+        print_err(INVALID_INPUT);
+        return FAILED;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+    handle_cache *hc = find_handle(cache, func);
+    if (hc == NULL && ttl_ms > 0) { // newly opted in
+        hc = calloc(1, sizeof(*hc));
+        if (hc == NULL || array_append(cache->handles, hc) == FAILED) {
+            print_err(MALLOC_FAILED);
+            free(hc);
+            pthread_mutex_unlock(&cache->lock);
+            return FAILED;
+        }
+        hc->func = func;
+    }
+    if (hc != NULL) {
+        // the handle stays in the array (handles are few), just emptied
+        clear_handle_cache(hc);
+        hc->ttl_ns = ttl_ms * NS_PER_MS;
+        hc->max_bytes = ttl_ms > 0 ? max_bytes : 0;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return SUCCESS;
+}
+
+/* Looks up the response of function `func` to `payload`.
+ * Returns a copy of the response if cached and still fresh (to free with
+   rpc_data_free), NULL otherwise.
+ */
+rpc_data *resp_cache_lookup(resp_cache *cache, uint32_t func,
+                            rpc_data *payload) {
+    if (cache == NULL || payload == NULL)
+        return NULL;
+
+    pthread_mutex_lock(&cache->lock);
+    handle_cache *hc = find_handle(cache, func);
+    if (hc == NULL || hc->ttl_ns == 0) { // not cached
+        pthread_mutex_unlock(&cache->lock);
+        return NULL;
+    }
+
+    uint64_t hash = hash_bytes(payload->data1, payload->data2,
+                               payload->data2_len);
+    resp_entry *e = find_entry(hc, hash, payload);
+    if (e != NULL && now_ns() > e->expires) { // stale
+        drop_resp_entry(hc, e);
+        e = NULL;
+    }
+
+    rpc_data *result = NULL;
+    if (e != NULL) {
+        // the caller frees what it gets, so it gets its own copy
+        result = malloc(sizeof(*result));
+        if (result == NULL || copy_rpc_data(result, &e->result) == FAILED) {
+            print_err(MALLOC_FAILED);
+            free(result);
+            result = NULL;
+        } else {
+            unlink_entry(hc, e);
+            link_newest(hc, e);
+        }
+    }
+    if (result != NULL)
+        cache->hits++;
+    else
+        cache->misses++;
+    pthread_mutex_unlock(&cache->lock);
+    return result;
+}
+
+/* Stores the response of function `func` to `payload`, if the function's
+   responses are cached and it fits in their budget.
+ */
+void resp_cache_insert(resp_cache *cache, uint32_t func, rpc_data *payload,
+                       rpc_data *result) {
+    if (cache == NULL || payload == NULL || result == NULL)
+        return;
+
+    pthread_mutex_lock(&cache->lock);
+    handle_cache *hc = find_handle(cache, func);
+    size_t size = sizeof(resp_entry) + payload->data2_len
+                  + result->data2_len;
+    if (hc == NULL || hc->ttl_ns == 0 || size > hc->max_bytes) {
+        pthread_mutex_unlock(&cache->lock);
+        return;
+    }
+
+    resp_entry *e = calloc(1, sizeof(*e));
+    if (e == NULL || copy_rpc_data(&e->payload, payload) == FAILED
+            || copy_rpc_data(&e->result, result) == FAILED) {
+        print_err(MALLOC_FAILED);
+        free_resp_entry(e);
+        pthread_mutex_unlock(&cache->lock);
+        return;
+    }
+    e->hash = hash_bytes(payload->data1, payload->data2, payload->data2_len);
+    e->expires = now_ns() + hc->ttl_ns;
+    e->size = size;
+
+    // replaces the same call's response, if another thread got there first
+    resp_entry *old = find_entry(hc, e->hash, payload);
+    if (old != NULL)
+        drop_resp_entry(hc, old);
+    // make room, least recently used first
+    while (hc->bytes + size > hc->max_bytes && hc->oldest != NULL) {
+        drop_resp_entry(hc, hc->oldest);
+    }
+
+    resp_entry **bucket = &hc->buckets[e->hash % RESP_CACHE_BUCKETS];
+    e->next = *bucket;
+    *bucket = e;
+    link_newest(hc, e);
+    hc->bytes += size;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+/* Copies the lookups that found (`hits`) / did not find (`misses`) a
+   response of a function whose responses are cached.
+ */
+void resp_cache_get_stats(resp_cache *cache, uint64_t *hits,
+                          uint64_t *misses) {
+    if (cache == NULL)
+        return;
+    pthread_mutex_lock(&cache->lock);
+    if (hits != NULL)
+        *hits = cache->hits;
+    if (misses != NULL)
+        *misses = cache->misses;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+/* Frees the cache and every response in it.
+ */
+void free_resp_cache(resp_cache *cache) {
+    if (cache == NULL)
+        return;
+    free_array(cache->handles);
+    pthread_mutex_destroy(&cache->lock);
+    free(cache);
+}
+
+
+/* Returns the cache of the function's responses, NULL if it has none.
+ */
+handle_cache *find_handle(resp_cache *cache, uint32_t func) {
+    int idx = search_array(cache->handles, &func);
+    if (idx == FAILED)
+        return NULL;
+    return get_elem_at(cache->handles, idx);
+}
+
+/* Compares the function of a handle's cache to a function index.
+ * Returns 0 if they are equal, non-zero otherwise.
+ */
+int cmp_handle_func(void *hc, void *func) {
+    return ((handle_cache *)hc)->func != *(uint32_t *)func;
+}
+
+/* Frees a handle's cache and its responses.
+ */
+void free_handle_cache(void *hc) {
+    clear_handle_cache(hc);
+    free(hc);
+}
+
+/* Drops every response of a handle's cache.
+ */
+void clear_handle_cache(handle_cache *hc) {
+    while (hc->oldest != NULL) {
+        drop_resp_entry(hc, hc->oldest);
+    }
+}
+
+/* Returns the entry of the handle's cache for `payload` (whose hash is
+   `hash`), NULL if there is none.
+ */
+resp_entry *find_entry(handle_cache *hc, uint64_t hash, rpc_data *payload) {
+    resp_entry *e = hc->buckets[hash % RESP_CACHE_BUCKETS];
+    for (; e != NULL; e = e->next) {
+        if (e->hash == hash && e->payload.data1 == payload->data1
+                && e->payload.data2_len == payload->data2_len
+                && (payload->data2_len == 0 || memcmp(e->payload.data2,
+                        payload->data2, payload->data2_len) == 0))
+            return e;
+    }
+    return NULL;
+}
+
+/* Takes the entry out of the LRU order.
+ */
+void unlink_entry(handle_cache *hc, resp_entry *e) {
+    if (e->newer != NULL)
+        e->newer->older = e->older;
+    else
+        hc->newest = e->older;
+    if (e->older != NULL)
+        e->older->newer = e->newer;
+    else
+        hc->oldest = e->newer;
+    e->newer = e->older = NULL;
+}
+
+/* Puts the entry first in the LRU order.
+ */
+void link_newest(handle_cache *hc, resp_entry *e) {
+    e->older = hc->newest;
+    e->newer = NULL;
+    if (hc->newest != NULL)
+        hc->newest->newer = e;
+    hc->newest = e;
+    if (hc->oldest == NULL)
+        hc->oldest = e;
+}
+
+/* Removes the entry from the handle's cache and frees it.
+ */
+void drop_resp_entry(handle_cache *hc, resp_entry *e) {
+    resp_entry **p = &hc->buckets[e->hash % RESP_CACHE_BUCKETS];
+    while (*p != e) {
+        p = &(*p)->next;
+    }
+    *p = e->next;
+    unlink_entry(hc, e);
+    hc->bytes -= e->size;
+    free_resp_entry(e);
+}
+
+/* Frees an entry (which may be partly filled in).
+ */
+void free_resp_entry(resp_entry *e) {
+    if (e == NULL)
+        return;
+    free(e->payload.data2);
+    free(e->result.data2);
+    free(e);
+}
+
+/* Copies `src` to `dst`, with its own data2.
+ * Returns SUCCESS on success, FAILED otherwise.
+ */
+int copy_rpc_data(rpc_data *dst, rpc_data *src) {
+    dst->data1 = src->data1;
+    dst->data2_len = src->data2_len;
+    dst->data2 = NULL;
+    if (src->data2_len == 0)
+        return SUCCESS;
+    dst->data2 = malloc(src->data2_len);
+    if (dst->data2 == NULL)
+        return FAILED;
+    memcpy(dst->data2, src->data2, src->data2_len);
+    return SUCCESS;
+}
@@ -0,0 +1,63 @@
+/*-----------------------------------------------------------------------------
+ * Project 2
+ * rpc_resp_cache.h :
+              = the interface of the module `rpc_resp_cache` of the project
+              = a client-side cache of the responses to idempotent calls,
+                kept per handle with a TTL and a byte budget
+ ----------------------------------------------------------------------------*/
+
+#ifndef RPC_RESP_CACHE_H
+#define RPC_RESP_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "rpc.h"
+
+// hash buckets of each handle's cache
+#define RESP_CACHE_BUCKETS 256
+
+/* The responses of a client, for each handle it opted in. Calls are keyed
+   on a hash of their payload (the payload itself is kept to compare with),
+   and the least recently used responses of a handle are dropped first once
+   its byte budget is reached.
+ * Guarded by a mutex, so it may be used by several threads.
+ */
+typedef struct resp_cache resp_cache;
+
+/* Creates an empty cache (no handle opted in).
+ * Returns the cache on success, NULL otherwise.
+ */
+resp_cache *create_resp_cache();
+
+/* Caches the responses of function `func` for `ttl_ms` milliseconds,
+   using at most `max_bytes` (payloads, results and bookkeeping).
+   A `ttl_ms` of 0 stops caching them and drops those cached.
+ * Returns SUCCESS on success, FAILED otherwise.
+ */
+int resp_cache_configure(resp_cache *cache, uint32_t func, int ttl_ms,
+                         size_t max_bytes);
+
+/* Looks up the response of function `func` to `payload`.
+ * Returns a copy of the response if cached and still fresh (to free with
+   rpc_data_free), NULL otherwise.
+ */
+rpc_data *resp_cache_lookup(resp_cache *cache, uint32_t func,
+                            rpc_data *payload);
+
+/* Stores the response of function `func` to `payload`, if the function's
+   responses are cached and it fits in their budget.
+ */
+void resp_cache_insert(resp_cache *cache, uint32_t func, rpc_data *payload,
+                       rpc_data *result);
+
+/* Copies the lookups that found (`hits`) / did not find (`misses`) a
+   response of a function whose responses are cached.
+ */
+void resp_cache_get_stats(resp_cache *cache, uint64_t *hits,
+                          uint64_t *misses);
+
+/* Frees the cache and every response in it.
+ */
+void free_resp_cache(resp_cache *cache);
+
+#endif
@@ -1,4 +1,5 @@
 #include "rpc_safety.h"
+#include "rpc_ext.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -22,7 +23,13 @@ static const char *ERROR_MSG[] = {
     "Connection failed",
     "Connection closed",
     "Memory allocation failed",
-    "Overlength error"
+    "Overlength error",
+    "Deadline exceeded",
+    "Server overloaded",
+    "Invalid frame",
+    "Plugin failed",
+    "Connection idle for too long, closed",
+    "Connection stalled for too long, closed"
 };
 
 
@@ -42,7 +49,7 @@ int is_valid_data(rpc_data *data);
  */
 int check_sys_call(int n, char *msg) {
     if (n < 0) {
-        perror(msg);
+        print_sys_err(msg);
         return FAILED;
     }
     return n;
@@ -58,7 +65,7 @@ int check_io_err(int n, char *msg) {
         print_err(CONNECTION_CLOSED);
         return EMPTY;
     } else if (n < 0) {
-        perror(msg);
+        print_sys_err(msg);
         return FAILED;
     }
     return n;
@@ -124,10 +131,41 @@ int check_rpc_data(rpc_data *data) {
     return SUCCESS;
 }
 
-/* Prints the corresponding error message to the given index.
+/* Returns the message of the error (enum ERROR).
  */
-void print_err(enum ERROR err) {
-    fprintf(stderr, "%s\n", ERROR_MSG[err]);
+const char *error_msg(int err) {
+    return ERROR_MSG[err];
+}
+
+/* Returns the level (enum RPC_LOG_LEVEL) of the error (enum ERROR).
+ */
+int error_level(int err) {
+    switch (err) {
+    case CONNECTION_CLOSED: // (every time a peer is done)
+    case FUNC_NOT_FOUND:    // the client's business
+        return RPC_LOG_INFO;
+    case DEADLINE_EXCEEDED:
+    case SERVER_OVERLOADED:
+    case CONNECTION_IDLE:
+    case CONNECTION_STALLED:
+        return RPC_LOG_WARN;
+    default:
+        return RPC_LOG_ERROR;
+    }
+}
+
+/* Returns the level (enum RPC_LOG_LEVEL) of the error of a system call
+   (errno): the peer going away is no more than RPC_LOG_INFO.
+ */
+int sys_err_level(int sys_errno) {
+    switch (sys_errno) {
+    case ECONNRESET:
+    case EPIPE:
+    case ECONNABORTED:
+        return RPC_LOG_INFO;
+    default:
+        return RPC_LOG_ERROR;
+    }
 }
 
 
@@ -157,8 +195,8 @@ int is_valid_ip(char *addr) {
     if (addr == NULL || !*addr) {
         return FALSE;
     }
-    struct sockaddr_in sa;
-    return inet_pton(AF_INET6, addr, &(sa.sin_addr)) != 0 ? TRUE : FALSE;
+    struct sockaddr_in6 sa;
+    return inet_pton(AF_INET6, addr, &(sa.sin6_addr)) != 0 ? TRUE : FALSE;
 }
 
 /* Returns TRUE if the port number is valid, FALSE otherwise.
@@ -172,8 +210,9 @@ int is_valid_port(int port) {
  */
 int is_valid_prefix(uint32_t prefix) {
 	// assume FIND_REQ is the first in the enum PREFIX
-	// and CLOSE_REQ is the last
-	return prefix >= FIND_REQ && prefix <= CLOSE_REQ;
+	// and PING_REQ is the last of v1
+	// (statuses are read as prefixes too, and are all within that range)
+	return prefix >= FIND_REQ && prefix <= PING_REQ;
 }
 
 /* Returns TRUE if the data length is valid, FALSE otherwise.
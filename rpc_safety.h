@@ -13,7 +13,9 @@
 #include <stdint.h>
 #include <stdarg.h>
 #include <stddef.h>
+#include <errno.h>
 #include "rpc.h"
+#include "rpc_log.h"
 
 #define SUCCESS 1
 #define EMPTY 0
@@ -28,9 +30,21 @@
 #define MAX_DATA2_LEN UINT32_MAX
 
 // Prefixes (indicating the type of request)
-enum PREFIX {FIND_REQ = 1, CALL_REQ = 2, CLOSE_REQ = 3};
+// (HELLO_REQ and CAST_REQ only exist in v2, which has no need for
+// CALL_DL_REQ)
+enum PREFIX {
+    FIND_REQ = 1, CALL_REQ = 2, CLOSE_REQ = 3, CALL_DL_REQ = 4, PING_REQ = 5,
+    HELLO_REQ = 6, CAST_REQ = 7
+};
 // Request status (indicating the type of response)
-enum REQ_STATUS {FAILURE_STAT = 1, SUCCESS_STAT = 2};
+enum REQ_STATUS {
+    FAILURE_STAT = 1, SUCCESS_STAT = 2, EXPIRED_STAT = 3, OVERLOADED_STAT = 4
+};
+
+// What a handle stands for (and is sent as)
+struct rpc_handle {
+    uint32_t idx; // index of the handler in the server's RPC functions array
+};
 
 // Errors
 enum ERROR {
@@ -48,7 +62,13 @@ enum ERROR {
     CONNECTION_FAILED,
     CONNECTION_CLOSED,
     MALLOC_FAILED,
-    OVERLENGTH
+    OVERLENGTH,
+    DEADLINE_EXCEEDED,
+    SERVER_OVERLOADED,
+    INVALID_FRAME,
+    PLUGIN_FAILED,
+    CONNECTION_IDLE,
+    CONNECTION_STALLED
 };
 
 
@@ -102,8 +122,35 @@ int check_prefix(uint32_t prefix);
  */
 int check_rpc_data(rpc_data *data);
 
-/* Prints the corresponding error message to the given index.
+/* Logs the error message of `err` (enum ERROR) at its level, without
+   waiting for it to be written (see rpc_log.h). Each place it is used
+   from logs it a limited number of times a second.
+ */
+#define print_err(err) do { \
+        static log_site site_ = LOG_SITE(); \
+        log_code(&site_, (err), 0); \
+    } while (0)
+
+/* Logs `msg` with the error of the last system call (errno), like
+   perror(3), but without waiting for it to be written (see print_err).
+ */
+#define print_sys_err(msg) do { \
+        int errno_ = errno; \
+        static log_site site_ = LOG_SITE(); \
+        log_text(&site_, sys_err_level(errno_), (msg), errno_); \
+    } while (0)
+
+/* Returns the message of the error (enum ERROR).
+ */
+const char *error_msg(int err);
+
+/* Returns the level (enum RPC_LOG_LEVEL) of the error (enum ERROR).
+ */
+int error_level(int err);
+
+/* Returns the level (enum RPC_LOG_LEVEL) of the error of a system call
+   (errno): the peer going away is no more than RPC_LOG_INFO.
  */
-void print_err(enum ERROR err);
+int sys_err_level(int sys_errno);
 
 #endif
\ No newline at end of file
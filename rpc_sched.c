@@ -0,0 +1,381 @@
+#include "rpc_sched.h"
+#include "rpc_shared.h"
+#include "rpc_safety.h"
+#include "rpc_io_helper.h"
+#include "rpc_server_helper.h"
+#include <stdio.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+
+#define NO_LIMIT 0
+#define NO_CLASS -1
+#define NO_WAITER 0
+
+struct call_sched {
+    pthread_mutex_t lock;                // process-shared, robust
+    pthread_cond_t turn[RPC_NUM_PRIOS];  // broadcast when a class is granted
+    int max_running;                     // or NO_LIMIT
+    int running;                         // calls let through, not released
+    uint64_t tickets[RPC_NUM_PRIOS];     // handed out, in arrival order
+    uint64_t granted[RPC_NUM_PRIOS];     // tickets below this may run
+    int skipped[RPC_NUM_PRIOS];          // grants to others while waiting
+    rpc_class_stats stats[RPC_NUM_PRIOS];
+    // pid of the call holding each ticket not yet claimed (by ticket modulo
+    // SCHED_MAX_WAITING), or NO_WAITER once it left or was let through
+    pid_t waiters[RPC_NUM_PRIOS][SCHED_MAX_WAITING];
+    uint32_t *held;     // slots held by each child (indexed by pid), shared
+    int n_pids;         // entries of held (up to pid_max)
+    uint32_t reclaim;   // slots of reaped children, not yet given back
+    uint8_t reaped;     // a child was reaped since the last look at waiters
+};
+
+/******* Private functions *******/
+int lock_sched(call_sched *sched);
+int wait_turn(call_sched *sched, int prio, uint64_t deadline);
+int timed_wait_turn(call_sched *sched, int prio, uint64_t deadline);
+int pick_class(call_sched *sched);
+void grant_waiting(call_sched *sched);
+uint64_t n_waiting(call_sched *sched, int prio);
+void hold_slot(call_sched *sched, int n);
+void reclaim_slots(call_sched *sched);
+void sched_reaped(pid_t pid, void *arg);
+
+
+/* Creates a scheduler letting at most `max_running` calls run at once
+   (0 for no limit, in which case calls never wait). It is called by the
+   server, whose SIGCHLD handler then gives back the slots of the children
+   it reaps.
+ * Returns the scheduler on success, NULL otherwise.
+ */
+call_sched *create_call_sched(int max_running) {
+    if (max_running < 0) {
+        print_err(INVALID_INPUT);
+        return NULL;
+    }
+    call_sched *sched = create_shared(sizeof(*sched));
+    if (sched == NULL)
+        return NULL;
+
+    // the lock and conditions are used by every child of the server, and
+    // a child dying while holding the lock must not block the others
+    pthread_mutexattr_t mattr;
+    pthread_mutexattr_init(&mattr);
+    pthread_mutexattr_setpshared(&mattr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&mattr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&sched->lock, &mattr);
+    pthread_mutexattr_destroy(&mattr);
+
+    pthread_condattr_t cattr;
+    pthread_condattr_init(&cattr);
+    pthread_condattr_setpshared(&cattr, PTHREAD_PROCESS_SHARED);
+    pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC); // (as now_ns)
+    for (int i = 0; i < RPC_NUM_PRIOS; i++) {
+        pthread_cond_init(&sched->turn[i], &cattr);
+    }
+    pthread_condattr_destroy(&cattr);
+
+    sched->max_running = max_running;
+
+    // the slots a child that died held are given back as it is reaped
+    sched->n_pids = read_pid_max();
+    sched->held = create_shared(sched->n_pids * sizeof(uint32_t));
+    if (sched->held == NULL || add_reap_hook(sched_reaped, sched) == FAILED) {
+        free_call_sched(sched);
+        return NULL;
+    }
+    return sched;
+}
+
+/* Changes how many calls may run at once (0 for no limit).
+ * Returns SUCCESS on success, FAILED otherwise.
+ */
+int sched_set_max_running(call_sched *sched, int max_running) {
+    if (sched == NULL || max_running < 0) {
+        print_err(INVALID_INPUT);
+        return FAILED;
+    }
+    if (lock_sched(sched) == FAILED)
+        return FAILED;
+    sched->max_running = max_running;
+    grant_waiting(sched); // in case the limit went up
+    pthread_mutex_unlock(&sched->lock);
+    return SUCCESS;
+}
+
+/* Waits until a call of the priority class `prio` may run, or until the
+   deadline (unless NO_DEADLINE) passes.
+ * Higher classes go first; within a class, calls run in arrival order. A
+   lower class waiting behind STARVATION_LIMIT grants to higher classes is
+   let through next.
+ * Returns SUCCESS once the call may run (it must then call sched_release),
+   EMPTY if the deadline passed first (it left the queue),
+   FAILED on error (or if SCHED_MAX_WAITING calls of the class wait already).
+ */
+int sched_acquire(call_sched *sched, int prio, uint64_t deadline) {
+    if (sched == NULL || prio < 0 || prio >= RPC_NUM_PRIOS) {
+        print_err(INVALID_INPUT);
+        return FAILED;
+    }
+    if (lock_sched(sched) == FAILED)
+        return FAILED;
+    sched->stats[prio].calls++;
+
+    // Free slot and nobody ahead of us -> run straight away
+    int nobody_waiting = TRUE;
+    for (int i = 0; i < RPC_NUM_PRIOS; i++) {
+        if (n_waiting(sched, i) > 0)
+            nobody_waiting = FALSE;
+    }
+    if (sched->max_running == NO_LIMIT
+            || (nobody_waiting && sched->running < sched->max_running)) {
+        sched->tickets[prio]++;
+        sched->granted[prio]++;
+        sched->running++;
+        hold_slot(sched, 1);
+        pthread_mutex_unlock(&sched->lock);
+        return SUCCESS;
+    }
+
+    int res = wait_turn(sched, prio, deadline);
+    pthread_mutex_unlock(&sched->lock);
+    return res;
+}
+
+/* Marks a call let through by sched_acquire as finished.
+ */
+void sched_release(call_sched *sched) {
+    if (sched == NULL || lock_sched(sched) == FAILED)
+        return;
+    sched->running--;
+    hold_slot(sched, -1);
+    grant_waiting(sched);
+    pthread_mutex_unlock(&sched->lock);
+}
+
+/* Copies the scheduler's per-class counters to `classes`.
+ */
+void sched_get_stats(call_sched *sched, rpc_class_stats *classes) {
+    if (sched == NULL || classes == NULL || lock_sched(sched) == FAILED)
+        return;
+    for (int i = 0; i < RPC_NUM_PRIOS; i++) {
+        classes[i] = sched->stats[i];
+    }
+    pthread_mutex_unlock(&sched->lock);
+}
+
+/* Frees the scheduler.
+ */
+void free_call_sched(call_sched *sched) {
+    if (sched == NULL)
+        return;
+    remove_reap_hook(sched_reaped, sched);
+    if (sched->held != NULL)
+        free_shared(sched->held, sched->n_pids * sizeof(uint32_t));
+    pthread_mutex_destroy(&sched->lock);
+    for (int i = 0; i < RPC_NUM_PRIOS; i++) {
+        pthread_cond_destroy(&sched->turn[i]);
+    }
+    free_shared(sched, sizeof(*sched));
+}
+
+
+/* Locks the scheduler, recovering the lock if its holder died, and gives
+   back the slots of children that died.
+ * Returns SUCCESS on success, FAILED otherwise.
+ */
+int lock_sched(call_sched *sched) {
+    int err = pthread_mutex_lock(&sched->lock);
+    if (err == EOWNERDEAD) {
+        // the counters are only ever changed as a whole under the lock
+        pthread_mutex_consistent(&sched->lock);
+        err = 0;
+    }
+    if (err != 0) {
+        errno = err;
+        print_sys_err("pthread_mutex_lock");
+        return FAILED;
+    }
+    reclaim_slots(sched);
+    return SUCCESS;
+}
+
+/* Queues a call of class `prio` and waits (with the lock held) until it is
+   granted or its deadline passes, keeping the class's waiting statistics.
+ * Returns SUCCESS once granted, EMPTY if the deadline passed first,
+   FAILED on error.
+ */
+int wait_turn(call_sched *sched, int prio, uint64_t deadline) {
+    rpc_class_stats *stats = &sched->stats[prio];
+    uint64_t ticket = sched->tickets[prio];
+    pid_t *waiter = &sched->waiters[prio][ticket % SCHED_MAX_WAITING];
+    if (n_waiting(sched, prio) >= SCHED_MAX_WAITING || *waiter != NO_WAITER) {
+        print_err(SERVER_OVERLOADED);
+        return FAILED;
+    }
+    sched->tickets[prio]++;
+    *waiter = getpid();
+    uint64_t start = now_ns();
+    stats->queued++;
+
+    // a slot may be free (e.g. only other classes are waiting)
+    grant_waiting(sched);
+    int res = SUCCESS;
+    while (ticket >= sched->granted[prio] && res == SUCCESS) {
+        res = timed_wait_turn(sched, prio, deadline);
+    }
+    // (a ticket left behind is skipped when its turn comes)
+    *waiter = NO_WAITER;
+    stats->queued--;
+    if (ticket < sched->granted[prio]) {
+        // let through, even if it is late (the caller sheds it)
+        hold_slot(sched, 1);
+        res = SUCCESS;
+    } else {
+        if (res == EMPTY)
+            stats->expired++;
+        return res;
+    }
+
+    uint64_t waited = now_ns() - start;
+    stats->waited++;
+    stats->wait_ns += waited;
+    if (waited > stats->max_wait_ns)
+        stats->max_wait_ns = waited;
+    return res;
+}
+
+/* Waits (with the lock held) for a grant to class `prio`, the deadline, or
+   SCHED_RECHECK_MS, whichever comes first, then gives back the slots of
+   children that died (if the server is busy, or gone, waiters do it).
+ * Returns SUCCESS if the call may still wait, EMPTY if its deadline passed,
+   FAILED on error.
+ */
+int timed_wait_turn(call_sched *sched, int prio, uint64_t deadline) {
+    uint64_t now = now_ns();
+    if (deadline != NO_DEADLINE && now >= deadline)
+        return EMPTY;
+    uint64_t wake = now + SCHED_RECHECK_MS * NS_PER_MS;
+    if (deadline != NO_DEADLINE && deadline < wake)
+        wake = deadline;
+    struct timespec ts;
+    ts.tv_sec = wake / (NS_PER_MS * 1000);
+    ts.tv_nsec = wake % (NS_PER_MS * 1000);
+
+    int err = pthread_cond_timedwait(&sched->turn[prio], &sched->lock, &ts);
+    if (err == EOWNERDEAD) {
+        pthread_mutex_consistent(&sched->lock);
+    } else if (err != 0 && err != ETIMEDOUT) {
+        errno = err;
+        print_sys_err("pthread_cond_timedwait");
+        return FAILED;
+    }
+    reclaim_slots(sched);
+    return SUCCESS;
+}
+
+/* Chooses which class to let through next (with the lock held).
+ * Returns the class, or NO_CLASS if nobody is waiting.
+ */
+int pick_class(call_sched *sched) {
+    // a starving class goes first, lowest class first
+    for (int i = RPC_NUM_PRIOS - 1; i >= 0; i--) {
+        if (n_waiting(sched, i) > 0 && sched->skipped[i] >= STARVATION_LIMIT)
+            return i;
+    }
+    // otherwise, the highest class waiting
+    for (int i = 0; i < RPC_NUM_PRIOS; i++) {
+        if (n_waiting(sched, i) > 0)
+            return i;
+    }
+    return NO_CLASS;
+}
+
+/* Lets waiting calls through while there are free slots
+   (with the lock held).
+ */
+void grant_waiting(call_sched *sched) {
+    while (sched->max_running == NO_LIMIT
+            || sched->running < sched->max_running) {
+        int prio = pick_class(sched);
+        if (prio == NO_CLASS)
+            return;
+
+        // the call holding the ticket may have left, or died, meanwhile
+        uint64_t ticket = sched->granted[prio]++;
+        if (sched->waiters[prio][ticket % SCHED_MAX_WAITING] == NO_WAITER)
+            continue;
+
+        // every other class still waiting has been skipped once more
+        for (int i = 0; i < RPC_NUM_PRIOS; i++) {
+            if (i != prio && n_waiting(sched, i) > 0)
+                sched->skipped[i]++;
+        }
+        sched->skipped[prio] = 0;
+
+        sched->running++;
+        // waiters of the class check whose ticket it was
+        pthread_cond_broadcast(&sched->turn[prio]);
+    }
+}
+
+/* Returns the number of calls of class `prio` waiting for their turn.
+ */
+uint64_t n_waiting(call_sched *sched, int prio) {
+    return sched->tickets[prio] - sched->granted[prio];
+}
+
+/* Counts `n` more slots (or fewer, if negative) held by the calling child
+   (with the lock held).
+ */
+void hold_slot(call_sched *sched, int n) {
+    pid_t pid = getpid();
+    if (pid < sched->n_pids)
+        __atomic_add_fetch(&sched->held[pid], n, __ATOMIC_RELAXED);
+}
+
+/* Gives back the slots of the children reaped, and the turns of the
+   waiting calls of children that died (with the lock held).
+ */
+void reclaim_slots(call_sched *sched) {
+    int freed = __atomic_exchange_n(&sched->reclaim, 0, __ATOMIC_RELAXED);
+    sched->running -= freed;
+    if (__atomic_exchange_n(&sched->reaped, FALSE, __ATOMIC_RELAXED)) {
+        for (int i = 0; i < RPC_NUM_PRIOS; i++) {
+            uint64_t first = 0;
+            if (sched->tickets[i] > SCHED_MAX_WAITING)
+                first = sched->tickets[i] - SCHED_MAX_WAITING;
+            for (uint64_t t = first; t < sched->tickets[i]; t++) {
+                pid_t *waiter = &sched->waiters[i][t % SCHED_MAX_WAITING];
+                if (*waiter == NO_WAITER
+                        || kill(*waiter, 0) == 0 || errno != ESRCH)
+                    continue;
+                *waiter = NO_WAITER;
+                sched->stats[i].queued--;
+                // (a turn granted but never claimed still holds a slot)
+                if (t < sched->granted[i]) {
+                    sched->running--;
+                    freed++;
+                }
+            }
+        }
+    }
+    if (freed > 0)
+        grant_waiting(sched);
+}
+
+/* Notes the slots held by a child reaped by the server (called by the
+   SIGCHLD handler) as to be given back at the next lock of the scheduler.
+ */
+void sched_reaped(pid_t pid, void *arg) {
+    call_sched *sched = arg;
+    if (pid < sched->n_pids) {
+        uint32_t n = __atomic_exchange_n(&sched->held[pid], 0,
+                                         __ATOMIC_RELAXED);
+        if (n > 0)
+            __atomic_add_fetch(&sched->reclaim, n, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&sched->reaped, TRUE, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,65 @@
+/*-----------------------------------------------------------------------------
+ * Project 2
+ * rpc_sched.h :
+              = the interface of the module `rpc_sched` of the project
+              = schedules the calls of all connections by the priority class
+                of their function, with a limited number running at once
+ ----------------------------------------------------------------------------*/
+
+#ifndef RPC_SCHED_H
+#define RPC_SCHED_H
+
+#include <stdint.h>
+#include "rpc_ext.h"
+
+// grants to higher classes after which a waiting lower class gets its turn
+#define STARVATION_LIMIT 8
+// most calls of a class waiting at once (any more are turned away)
+#define SCHED_MAX_WAITING 1024
+// how often a waiting call looks for calls of children that died
+#define SCHED_RECHECK_MS 100
+
+/* Scheduler state. Lives in shared memory, as every connection is served
+   by its own process. A child dying with a call running, or waiting, must
+   not keep its slot: the slots held are recorded by pid, and given back as
+   the server reaps the child; a waiting one that died is skipped when its
+   turn comes. */
+typedef struct call_sched call_sched;
+
+/* Creates a scheduler letting at most `max_running` calls run at once
+   (0 for no limit, in which case calls never wait). It is called by the
+   server, whose SIGCHLD handler then gives back the slots of the children
+   it reaps.
+ * Returns the scheduler on success, NULL otherwise.
+ */
+call_sched *create_call_sched(int max_running);
+
+/* Changes how many calls may run at once (0 for no limit).
+ * Returns SUCCESS on success, FAILED otherwise.
+ */
+int sched_set_max_running(call_sched *sched, int max_running);
+
+/* Waits until a call of the priority class `prio` may run, or until the
+   deadline (unless NO_DEADLINE) passes.
+ * Higher classes go first; within a class, calls run in arrival order. A
+   lower class waiting behind STARVATION_LIMIT grants to higher classes is
+   let through next.
+ * Returns SUCCESS once the call may run (it must then call sched_release),
+   EMPTY if the deadline passed first (it left the queue),
+   FAILED on error (or if SCHED_MAX_WAITING calls of the class wait already).
+ */
+int sched_acquire(call_sched *sched, int prio, uint64_t deadline);
+
+/* Marks a call let through by sched_acquire as finished.
+ */
+void sched_release(call_sched *sched);
+
+/* Copies the scheduler's per-class counters to `classes`.
+ */
+void sched_get_stats(call_sched *sched, rpc_class_stats *classes);
+
+/* Frees the scheduler.
+ */
+void free_call_sched(call_sched *sched);
+
+#endif
@@ -1,5 +1,7 @@
+#define _GNU_SOURCE // accept4
 #include "rpc_server_helper.h"
 #include "rpc_safety.h"
+#include "rpc_io_helper.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <arpa/inet.h>
@@ -9,6 +11,16 @@
 #include <errno.h>
 #include <sys/wait.h>
 #include <signal.h>
+#include <netinet/tcp.h>
+#include <linux/sock_diag.h>
+
+// decremented for every child reaped (see set_up_sigchld_handler)
+static uint64_t *live_children = NULL;
+// called for every child reaped (see add_reap_hook)
+static reap_hook reap_hooks[MAX_REAP_HOOKS];
+static void *reap_args[MAX_REAP_HOOKS];
+// set by SIGTERM (see set_up_sigterm_handler)
+static volatile sig_atomic_t stop_asked = FALSE;
 
 /* Creates a listening socket that listens on the given port.
  * Returns the new socket's file descriptor on success;
@@ -60,17 +72,26 @@ int create_listening_socket(char* port) {
  * https://beej.us/guide/bgnet/html/
  * Author: Brian “Beej Jorgensen” Hall
  * Also looked up "man waitpid"
- * Modifications: comments and coding style
+ * Modifications: comments and coding style, counting of reaped children
  */
 void sigchld_handler(int s) {
     // save errno in case waitpid overwrites it
     int saved_errno = errno;
 	// prevents waitpid from blocking so we can do other stuff
-    while (waitpid(-1, NULL, WNOHANG) > 0);
+    pid_t pid;
+    while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
+        if (live_children != NULL) // atomic, so fine in a signal handler
+            __atomic_sub_fetch(live_children, 1, __ATOMIC_RELAXED);
+        for (int i = 0; i < MAX_REAP_HOOKS; i++) {
+            if (reap_hooks[i] != NULL)
+                reap_hooks[i](pid, reap_args[i]);
+        }
+    }
     errno = saved_errno;
 }
 
 /* Sets up the SIGCHLD handler.
+ * `live_children` (if not NULL) is decremented for every child reaped.
  * Returns FAILED if the set-up failed, SUCCESS otherwise.
  *
  * Code adapted from: Beej's Guide to Network Programming
@@ -78,7 +99,8 @@ void sigchld_handler(int s) {
  * Author: Brian “Beej Jorgensen” Hall
  * Modifications: converted to function with return values
  */
-int set_up_sigchld_handler() {
+int set_up_sigchld_handler(uint64_t *live) {
+	live_children = live;
 	struct sigaction sa;
     sa.sa_handler = sigchld_handler; // reap the dead processes
     sigemptyset(&sa.sa_mask);
@@ -90,21 +112,131 @@ int set_up_sigchld_handler() {
 	return SUCCESS;
 }
 
+/* Makes the SIGCHLD handler call the hook (with `arg`) for every child it
+   reaps, e.g. to give back what the child held in shared memory.
+ * Returns SUCCESS on success, FAILED if there are MAX_REAP_HOOKS already.
+ */
+int add_reap_hook(reap_hook hook, void *arg) {
+    // (the handler must not see one without the other)
+    sigset_t chld, old;
+    sigemptyset(&chld);
+    sigaddset(&chld, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &chld, &old);
+    int res = FAILED;
+    for (int i = 0; i < MAX_REAP_HOOKS && res == FAILED; i++) {
+        if (reap_hooks[i] == NULL) {
+            reap_hooks[i] = hook;
+            reap_args[i] = arg;
+            res = SUCCESS;
+        }
+    }
+    sigprocmask(SIG_SETMASK, &old, NULL);
+    if (res == FAILED)
+        print_err(INVALID_INPUT);
+    return res;
+}
+
+/* Stops the SIGCHLD handler calling the hook (added with `arg`).
+ */
+void remove_reap_hook(reap_hook hook, void *arg) {
+    sigset_t chld, old;
+    sigemptyset(&chld);
+    sigaddset(&chld, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &chld, &old);
+    for (int i = 0; i < MAX_REAP_HOOKS; i++) {
+        if (reap_hooks[i] == hook && reap_args[i] == arg) {
+            reap_hooks[i] = NULL;
+            reap_args[i] = NULL;
+        }
+    }
+    sigprocmask(SIG_SETMASK, &old, NULL);
+}
+
+/* Handler for SIGTERM: notes that the server should stop.
+ */
+void sigterm_handler(int s) {
+    stop_asked = TRUE;
+}
+
+/* Sets up the SIGTERM handler, which asks the server to stop (see
+   stop_requested); it interrupts a blocking accept or poll.
+ * Returns FAILED if the set-up failed, SUCCESS otherwise.
+ */
+int set_up_sigterm_handler(void) {
+    struct sigaction sa;
+    sa.sa_handler = sigterm_handler;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = 0; // no SA_RESTART: the server looks at it at once
+    if (sigaction(SIGTERM, &sa, NULL) == -1) {
+        perror("sigaction");
+        return FAILED;
+    }
+    return SUCCESS;
+}
+
+/* Returns TRUE if the server was asked to stop (SIGTERM), FALSE otherwise.
+ */
+int stop_requested(void) {
+    return stop_asked ? TRUE : FALSE;
+}
+
 /* Accepts a connection request on the queue of pending connections 
-   for the listening socket.
+   for the listening socket, applying the socket options (if not NULL).
+   The accepted socket is non-blocking, and closed on exec.
  * Returns a file descriptor for the accepted socket on success;
- * Returns FAILURE (-1) on failure.
+ * Returns FAILURE (-1) on failure, or if there is no connection waiting
+   (errno is EAGAIN then).
  */
-int accept_connection(int listening_sd) {
-    struct sockaddr_in cl_addr;
+int accept_connection(int listening_sd, const rpc_sock_opts *opts) {
+    struct sockaddr_in6 cl_addr; // IPv6 (IPv4 ones are mapped into it)
     socklen_t cl_len = sizeof cl_addr;
-    int newsockfd = accept(listening_sd, (struct sockaddr*)&cl_addr, &cl_len);
+    int newsockfd = accept4(listening_sd, (struct sockaddr*)&cl_addr, &cl_len,
+                            SOCK_NONBLOCK | SOCK_CLOEXEC);
     if (newsockfd < 0) {
-        perror("accept");
+        // (a signal for the server, or no connection left: not an error)
+        if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK)
+            perror("accept");
         return FAILED;
     } 
+    apply_sock_opts(newsockfd, opts);
 
     return newsockfd;
 }
 
+/* Sets the size of the queue of connections waiting to be accepted on the
+   listening socket (listen() again changes it), and how long the kernel
+   may hold a connection back until its first request arrives (seconds,
+   0 for not at all; TCP_DEFER_ACCEPT).
+ * Returns SUCCESS on success, FAILED otherwise.
+ */
+int set_listen_opts(int listening_sd, int backlog, int defer_accept_s) {
+    if (setsockopt(listening_sd, IPPROTO_TCP, TCP_DEFER_ACCEPT,
+                   &defer_accept_s, sizeof(int)) < 0
+            || listen(listening_sd, backlog) < 0) {
+        perror("set_listen_opts");
+        return FAILED;
+    }
+    return SUCCESS;
+}
 
+/* Gets the number of connections waiting to be accepted on the listening
+   socket, the size of its queue, and how many were dropped as it was full
+   (the packets dropped by this socket, as counted by the kernel: with
+   TCP_DEFER_ACCEPT, the handshakes held back are counted too).
+ */
+void get_listen_stats(int listening_sd, uint64_t *queued, uint64_t *backlog,
+                      uint64_t *drops) {
+    *queued = *backlog = *drops = 0;
+    // for a listening socket: the length of its queue, and its size
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    if (getsockopt(listening_sd, IPPROTO_TCP, TCP_INFO, &info, &len) == 0) {
+        *queued = info.tcpi_unacked;
+        *backlog = info.tcpi_sacked;
+    }
+    uint32_t meminfo[SK_MEMINFO_VARS];
+    len = sizeof(meminfo);
+    if (getsockopt(listening_sd, SOL_SOCKET, SO_MEMINFO, meminfo, &len) == 0
+            && len > SK_MEMINFO_DROPS * sizeof(uint32_t))
+        *drops = meminfo[SK_MEMINFO_DROPS];
+}
@@ -16,17 +16,25 @@
  */
 int create_listening_socket(char* service);
 
+#include <stdint.h>
+#include <sys/types.h>
+#include "rpc_ext.h"
+
+// most hooks called for every child reaped (see add_reap_hook)
+#define MAX_REAP_HOOKS 16
+
 /* Handler for SIGCHLD.
  *
  * Code adapted from: Beej's Guide to Network Programming
  * https://beej.us/guide/bgnet/html/
  * Author: Brian “Beej Jorgensen” Hall
  * Also looked up "man waitpid"
- * Modifications: comments and coding style
+ * Modifications: comments and coding style, counting of reaped children
  */
 void sigchld_handler(int s);
 
 /* Sets up the SIGCHLD handler.
+ * `live_children` (if not NULL) is decremented for every child reaped.
  * Returns FAILED if the set-up failed, SUCCESS otherwise.
  *
  * Code adapted from: Beej's Guide to Network Programming
@@ -34,14 +42,62 @@ void sigchld_handler(int s);
  * Author: Brian “Beej Jorgensen” Hall
  * Modifications: converted to function with return values
  */
-int set_up_sigchld_handler();
+int set_up_sigchld_handler(uint64_t *live_children);
+
+/* Called by the SIGCHLD handler for every child it reaps, with the `arg`
+   it was added with: it must only do what a signal handler may (e.g.
+   atomic updates of shared memory).
+ */
+typedef void (*reap_hook)(pid_t pid, void *arg);
+
+/* Makes the SIGCHLD handler call the hook (with `arg`) for every child it
+   reaps, e.g. to give back what the child held in shared memory.
+ * Returns SUCCESS on success, FAILED if there are MAX_REAP_HOOKS already.
+ */
+int add_reap_hook(reap_hook hook, void *arg);
+
+/* Stops the SIGCHLD handler calling the hook (added with `arg`).
+ */
+void remove_reap_hook(reap_hook hook, void *arg);
+
+/* Handler for SIGTERM: notes that the server should stop.
+ */
+void sigterm_handler(int s);
+
+/* Sets up the SIGTERM handler, which asks the server to stop (see
+   stop_requested); it interrupts a blocking accept or poll.
+ * Returns FAILED if the set-up failed, SUCCESS otherwise.
+ */
+int set_up_sigterm_handler(void);
+
+/* Returns TRUE if the server was asked to stop (SIGTERM), FALSE otherwise.
+ */
+int stop_requested(void);
 
 /* Accepts a connection request on the queue of pending connections 
-   for the listening socket.
+   for the listening socket, applying the socket options (if not NULL).
+   The accepted socket is non-blocking, and closed on exec.
  * Returns a file descriptor for the accepted socket on success;
- * Returns FAILURE (-1) on failure.
+ * Returns FAILURE (-1) on failure, or if there is no connection waiting
+   (errno is EAGAIN then).
+ */
+int accept_connection(int listening_sd, const rpc_sock_opts *opts);
+
+/* Sets the size of the queue of connections waiting to be accepted on the
+   listening socket (listen() again changes it), and how long the kernel
+   may hold a connection back until its first request arrives (seconds,
+   0 for not at all; TCP_DEFER_ACCEPT).
+ * Returns SUCCESS on success, FAILED otherwise.
+ */
+int set_listen_opts(int listening_sd, int backlog, int defer_accept_s);
+
+/* Gets the number of connections waiting to be accepted on the listening
+   socket, the size of its queue, and how many were dropped as it was full
+   (the packets dropped by this socket, as counted by the kernel: with
+   TCP_DEFER_ACCEPT, the handshakes held back are counted too).
  */
-int accept_connection(int listening_sd);
+void get_listen_stats(int listening_sd, uint64_t *queued, uint64_t *backlog,
+                      uint64_t *drops);
 
 
 #endif
\ No newline at end of file
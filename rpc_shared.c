@@ -0,0 +1,45 @@
+#include "rpc_shared.h"
+#include <stdio.h>
+#include <sys/mman.h>
+
+#define PID_MAX "/proc/sys/kernel/pid_max"
+#define PID_MAX_LIMIT (4 * 1024 * 1024) // the most Linux allows
+
+/* Allocates `size` zeroed bytes that stay shared with every process forked
+   afterwards.
+ * Returns the memory on success, NULL otherwise.
+ */
+void *create_shared(size_t size) {
+    // anonymous mappings are zero-filled
+    void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        perror("mmap");
+        return NULL;
+    }
+    return mem;
+}
+
+/* Frees memory allocated by create_shared().
+ */
+void free_shared(void *mem, size_t size) {
+    if (mem == NULL)
+        return;
+    munmap(mem, size);
+}
+
+/* Returns the largest pid (+ 1) of the system, or the most Linux allows if
+   it cannot be read (the size of the tables indexed by the pids of the
+   children).
+ */
+int read_pid_max(void) {
+    int pid_max = PID_MAX_LIMIT;
+    FILE *f = fopen(PID_MAX, "r");
+    if (f != NULL) {
+        if (fscanf(f, "%d", &pid_max) != 1 || pid_max <= 0
+                || pid_max > PID_MAX_LIMIT)
+            pid_max = PID_MAX_LIMIT;
+        fclose(f);
+    }
+    return pid_max;
+}
@@ -0,0 +1,37 @@
+/*-----------------------------------------------------------------------------
+ * Project 2
+ * rpc_shared.h :
+              = the interface of the module `rpc_shared` of the project
+              = memory shared between the server and the child processes
+                it forks for its connections
+ ----------------------------------------------------------------------------*/
+
+#ifndef RPC_SHARED_H
+#define RPC_SHARED_H
+
+#include <stddef.h>
+
+/* Atomic updates of counters living in shared memory */
+#define SHARED_INC(counter) __atomic_add_fetch(&(counter), 1, __ATOMIC_RELAXED)
+#define SHARED_DEC(counter) __atomic_sub_fetch(&(counter), 1, __ATOMIC_RELAXED)
+#define SHARED_ADD(counter, n) \
+    __atomic_add_fetch(&(counter), (n), __ATOMIC_RELAXED)
+#define SHARED_LOAD(counter) __atomic_load_n(&(counter), __ATOMIC_RELAXED)
+
+/* Allocates `size` zeroed bytes that stay shared with every process forked
+   afterwards.
+ * Returns the memory on success, NULL otherwise.
+ */
+void *create_shared(size_t size);
+
+/* Frees memory allocated by create_shared().
+ */
+void free_shared(void *mem, size_t size);
+
+/* Returns the largest pid (+ 1) of the system, or the most Linux allows if
+   it cannot be read (the size of the tables indexed by the pids of the
+   children).
+ */
+int read_pid_max(void);
+
+#endif
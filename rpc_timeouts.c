@@ -0,0 +1,249 @@
+#include "rpc_timeouts.h"
+#include "rpc_wheel.h"
+#include "rpc_shared.h"
+#include "rpc_safety.h"
+#include "rpc_io_helper.h"
+#include "rpc_server_helper.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <signal.h>
+
+#define TICK_MS 10
+
+// An entry of the table: the state of the child in its lowest bits, and
+// the time it went into it (in milliseconds) in the others
+#define STATE_BITS 2
+#define STATE_MASK ((1 << STATE_BITS) - 1)
+#define CONN_FREE 0              // no child of the server
+#define CONN_EXPIRED UINT64_MAX  // being killed by the server
+#define ENTRY(state, ms) (((uint64_t)(ms) << STATE_BITS) | (state))
+
+struct conn_timeouts {
+    uint64_t *entries;         // indexed by pid, shared with the children
+    int n_entries;             // (pid_max)
+    timer_wheel *wheel;        // the server's timers, indexed by pid too
+    int idle_ms;               // (0: no limit)
+    int io_ms;                 // (0: no limit)
+    rpc_server_stats *stats;   // shared with the children
+};
+
+// The entry of this process, if it serves a connection that is watched
+static uint64_t *own_entry = NULL;
+
+/******* Private functions *******/
+uint64_t now_ms(void);
+int recheck_ms(conn_timeouts *t);
+void expire_connection(int pid, void *arg);
+int wait_for_client(int fd, short events, int timeout_ms);
+void clear_entry(pid_t pid, void *arg);
+
+
+/* Creates the timeouts of the connections of a server, counted in
+   `stats` (shared with its children), without any limit yet.
+ * Returns them on success, NULL otherwise.
+ */
+conn_timeouts *create_conn_timeouts(rpc_server_stats *stats) {
+    conn_timeouts *t = malloc(sizeof(*t));
+    if (t == NULL) {
+        print_err(MALLOC_FAILED);
+        return NULL;
+    }
+    t->n_entries = read_pid_max();
+    t->idle_ms = t->io_ms = 0;
+    t->stats = stats;
+    // (both only take memory as pids are used)
+    t->entries = create_shared(t->n_entries * sizeof(uint64_t));
+    t->wheel = create_wheel(t->n_entries, TICK_MS, now_ms());
+    if (t->entries == NULL || t->wheel == NULL) {
+        free_conn_timeouts(t);
+        return NULL;
+    }
+    // cleared as the children are reaped
+    if (add_reap_hook(clear_entry, t) == FAILED) {
+        free_conn_timeouts(t);
+        return NULL;
+    }
+    return t;
+}
+
+/* Sets how long a connection may stay idle, and stall while reading a
+   request or writing a response (milliseconds, 0 for no limit).
+ */
+void set_conn_timeouts(conn_timeouts *t, int idle_ms, int io_ms) {
+    t->idle_ms = idle_ms;
+    t->io_ms = io_ms;
+}
+
+/* Starts watching the connection served by the child `pid` (called by the
+   server, once forked).
+ */
+void watch_connection(conn_timeouts *t, pid_t pid) {
+    if (t == NULL || recheck_ms(t) == 0 || pid >= t->n_entries)
+        return;
+    uint64_t now = now_ms();
+    // idle until it says otherwise (unless it did already)
+    uint64_t free_entry = CONN_FREE;
+    __atomic_compare_exchange_n(&t->entries[pid], &free_entry,
+                                ENTRY(CONN_IDLE, now), FALSE,
+                                __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+    // (any timer of an earlier child with this pid goes)
+    arm_timer(t->wheel, pid, now + recheck_ms(t));
+}
+
+/* Returns how long the server may wait before calling expire_connections
+   (milliseconds; -1 for as long as it likes).
+ */
+int conn_timeout_ms(conn_timeouts *t) {
+    if (t == NULL)
+        return -1;
+    return wheel_timeout_ms(t->wheel, now_ms());
+}
+
+/* Closes the connections (kills the children serving them) that timed out,
+   counting and logging them.
+ */
+void expire_connections(conn_timeouts *t) {
+    if (t == NULL)
+        return;
+    advance_wheel(t->wheel, now_ms(), expire_connection, t);
+}
+
+/* Frees the timeouts (the children still running are not watched).
+ */
+void free_conn_timeouts(conn_timeouts *t) {
+    if (t == NULL)
+        return;
+    if (t->entries != NULL)
+        remove_reap_hook(clear_entry, t);
+    free_shared(t->entries, t->n_entries * sizeof(uint64_t));
+    free_wheel(t->wheel);
+    free(t);
+}
+
+/* Starts telling the server what the calling process (the child serving a
+   connection, just forked) is doing, and since when; in particular,
+   every time it waits for its client.
+ */
+void enter_connection(conn_timeouts *t) {
+    pid_t pid = getpid();
+    if (t == NULL || pid >= t->n_entries)
+        return;
+    own_entry = &t->entries[pid];
+    set_io_wait_hook(wait_for_client);
+}
+
+/* Tells the server what the calling child is doing now (enum CONN_STATE).
+   If the server is closing its connection already, the child exits.
+ */
+void conn_state(conn_timeouts *t, int state) {
+    if (t == NULL || own_entry == NULL)
+        return;
+    uint64_t old = __atomic_exchange_n(own_entry, ENTRY(state, now_ms()),
+                                       __ATOMIC_ACQ_REL);
+    if (old == CONN_EXPIRED)
+        exit(EXIT_SUCCESS); // (it is being killed anyway)
+}
+
+/* Tells the server that the calling child is done with its connection.
+ */
+void leave_connection(conn_timeouts *t) {
+    if (t == NULL || own_entry == NULL)
+        return;
+    __atomic_store_n(own_entry, CONN_FREE, __ATOMIC_RELEASE);
+    own_entry = NULL;
+    set_io_wait_hook(NULL);
+}
+
+/* Clears the entry of a child reaped by the server (called by the SIGCHLD
+   handler), so that a pid used again is never killed by mistake.
+ */
+void clear_entry(pid_t pid, void *arg) {
+    conn_timeouts *t = arg;
+    if (pid < t->n_entries)
+        __atomic_store_n(&t->entries[pid], CONN_FREE, __ATOMIC_RELEASE);
+}
+
+/* Returns the current time of the monotonic clock, in milliseconds.
+ */
+uint64_t now_ms(void) {
+    return now_ns() / NS_PER_MS;
+}
+
+/* Returns how often a connection is looked at if it cannot time out right
+   now: the shorter timeout (0 if there is none).
+ */
+int recheck_ms(conn_timeouts *t) {
+    if (t->idle_ms == 0 || (t->io_ms != 0 && t->io_ms < t->idle_ms))
+        return t->io_ms;
+    return t->idle_ms;
+}
+
+/* Kills the child `pid` if it timed out (its timer expired), or arms its
+   timer again for when it would.
+ */
+void expire_connection(int pid, void *arg) {
+    conn_timeouts *t = arg;
+    uint64_t *entry = &t->entries[pid];
+    uint64_t seen = __atomic_load_n(entry, __ATOMIC_ACQUIRE);
+    if (seen == CONN_FREE || seen == CONN_EXPIRED || recheck_ms(t) == 0)
+        return; // ended, or not watched any more
+
+    int state = seen & STATE_MASK;
+    uint64_t since = seen >> STATE_BITS;
+    int timeout = state == CONN_IDLE ? t->idle_ms
+                  : state == CONN_IO ? t->io_ms : 0;
+    uint64_t now = now_ms();
+    // Handling a call, or no limit to this -> looked at again later
+    if (timeout == 0) {
+        arm_timer(t->wheel, pid, now + recheck_ms(t));
+        return;
+    }
+    // Made progress since it was looked at -> when it would time out now
+    if (since + timeout > now) {
+        arm_timer(t->wheel, pid, since + timeout);
+        return;
+    }
+
+    // Timed out, unless it moves on right now. It is not reaped meanwhile,
+    // so that its pid is not used again before it is killed.
+    sigset_t chld, old;
+    sigemptyset(&chld);
+    sigaddset(&chld, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &chld, &old);
+    int expired = __atomic_compare_exchange_n(entry, &seen, CONN_EXPIRED,
+                                              FALSE, __ATOMIC_ACQ_REL,
+                                              __ATOMIC_ACQUIRE);
+    if (expired)
+        kill(pid, SIGKILL); // its connection closes with it
+    sigprocmask(SIG_SETMASK, &old, NULL);
+    if (!expired) {
+        arm_timer(t->wheel, pid, now); // (at the next tick)
+        return;
+    }
+
+    if (state == CONN_IDLE) {
+        SHARED_INC(t->stats->idle_timeouts);
+        print_err(CONNECTION_IDLE);
+    } else {
+        SHARED_INC(t->stats->io_timeouts);
+        print_err(CONNECTION_STALLED);
+    }
+}
+
+/* Waits for the client of the connection (the io_wait_fn of a child
+   serving a watched connection): it is making progress until now, if it
+   is reading a request or writing a response.
+ */
+int wait_for_client(int fd, short events, int timeout_ms) {
+    uint64_t seen = __atomic_load_n(own_entry, __ATOMIC_ACQUIRE);
+    // (not while handling a call, which may be a client itself)
+    if ((seen & STATE_MASK) == CONN_IO
+            && !__atomic_compare_exchange_n(own_entry, &seen,
+                                            ENTRY(CONN_IO, now_ms()), FALSE,
+                                            __ATOMIC_ACQ_REL,
+                                            __ATOMIC_ACQUIRE)
+            && seen == CONN_EXPIRED)
+        exit(EXIT_SUCCESS); // (it is being killed anyway)
+    return poll_fd(fd, events, timeout_ms);
+}
@@ -0,0 +1,79 @@
+/*-----------------------------------------------------------------------------
+ * Project 2
+ * rpc_timeouts.h :
+              = the interface of the module `rpc_timeouts` of the project
+              = closing the connections of a server that are idle, or
+                stalled in the middle of a request, for too long
+ ----------------------------------------------------------------------------*/
+
+#ifndef RPC_TIMEOUTS_H
+#define RPC_TIMEOUTS_H
+
+#include <sys/types.h>
+#include "rpc_ext.h"
+
+// What the child serving a connection is doing
+enum CONN_STATE {
+    CONN_IDLE = 1, // waiting for a request
+    CONN_IO = 2,   // reading a request, or writing its response
+    CONN_BUSY = 3  // handling a call (never cut short)
+};
+
+/* How it goes: every child tells the server, in a table shared by all and
+   indexed by its pid, what it is doing (enum CONN_STATE) and since when,
+   which is also updated every time it has to wait for its client in the
+   middle of a request or response (see enter_connection). The server keeps
+   a timer for each child on a timer wheel (see rpc_wheel.h), looks at its
+   entry when it expires, and either arms it again for when the child would
+   time out, or kills the child (closing the connection) if it did. The
+   entry of a child is cleared as it is reaped, so that a pid used again is
+   never killed by mistake.
+ */
+typedef struct conn_timeouts conn_timeouts;
+
+/* Creates the timeouts of the connections of a server, counted in
+   `stats` (shared with its children), without any limit yet.
+ * Returns them on success, NULL otherwise.
+ */
+conn_timeouts *create_conn_timeouts(rpc_server_stats *stats);
+
+/* Sets how long a connection may stay idle, and stall while reading a
+   request or writing a response (milliseconds, 0 for no limit).
+ */
+void set_conn_timeouts(conn_timeouts *t, int idle_ms, int io_ms);
+
+/* Starts watching the connection served by the child `pid` (called by the
+   server, once forked).
+ */
+void watch_connection(conn_timeouts *t, pid_t pid);
+
+/* Returns how long the server may wait before calling expire_connections
+   (milliseconds; -1 for as long as it likes).
+ */
+int conn_timeout_ms(conn_timeouts *t);
+
+/* Closes the connections (kills the children serving them) that timed out,
+   counting and logging them.
+ */
+void expire_connections(conn_timeouts *t);
+
+/* Frees the timeouts (the children still running are not watched).
+ */
+void free_conn_timeouts(conn_timeouts *t);
+
+/* Starts telling the server what the calling process (the child serving a
+   connection, just forked) is doing, and since when; in particular,
+   every time it waits for its client.
+ */
+void enter_connection(conn_timeouts *t);
+
+/* Tells the server what the calling child is doing now (enum CONN_STATE).
+   If the server is closing its connection already, the child exits.
+ */
+void conn_state(conn_timeouts *t, int state);
+
+/* Tells the server that the calling child is done with its connection.
+ */
+void leave_connection(conn_timeouts *t);
+
+#endif
@@ -0,0 +1,217 @@
+#include "rpc_wheel.h"
+#include "rpc_safety.h"
+#include <stdlib.h>
+
+#define SLOT_MASK (WHEEL_SLOTS - 1)
+#define MAX_TICKS ((uint64_t)1 << (WHEEL_BITS * WHEEL_LEVELS))
+#define NO_NODE 0 // (nodes are linked by their index + 1)
+
+// A timer, or the head of (the circular list of) the timers of a slot
+typedef struct {
+    uint32_t next, prev;    // index + 1 of the nodes around it (or NO_NODE
+                            // if not armed)
+    uint64_t expires;       // tick
+} wheel_node;
+
+struct timer_wheel {
+    wheel_node *nodes;      // the ids' timers, then the slots' heads
+    int capacity;           // ids
+    int tick_ms;
+    uint64_t now;           // last tick gone through
+    int armed;              // timers on the wheel
+};
+
+/******* Private functions *******/
+wheel_node *node(timer_wheel *w, uint32_t link);
+uint32_t head(timer_wheel *w, int level, int slot);
+void link_timer(timer_wheel *w, int id);
+void unlink_timer(timer_wheel *w, int id);
+void cascade(timer_wheel *w, int level, int slot);
+
+
+/* Creates a wheel without timers, for ids 0 to `capacity` - 1, moving on
+   every `tick_ms` milliseconds from `now_ms`. Its memory is only taken
+   from the system as ids are used.
+ * Returns it on success, NULL otherwise.
+ */
+timer_wheel *create_wheel(int capacity, int tick_ms, uint64_t now_ms) {
+    if (capacity <= 0 || tick_ms <= 0) {
+        print_err(INVALID_INPUT);
+        return NULL;
+    }
+    timer_wheel *w = malloc(sizeof(*w));
+    // (zeroed pages, mapped as they are touched: not armed)
+    wheel_node *nodes = calloc((size_t)capacity + WHEEL_LEVELS * WHEEL_SLOTS,
+                               sizeof(wheel_node));
+    if (w == NULL || nodes == NULL) {
+        print_err(MALLOC_FAILED);
+        free(w);
+        free(nodes);
+        return NULL;
+    }
+    w->nodes = nodes;
+    w->capacity = capacity;
+    w->tick_ms = tick_ms;
+    w->now = now_ms / tick_ms;
+    w->armed = 0;
+
+    // every slot is an empty list
+    for (int level = 0; level < WHEEL_LEVELS; level++) {
+        for (int slot = 0; slot < WHEEL_SLOTS; slot++) {
+            uint32_t h = head(w, level, slot);
+            node(w, h)->next = node(w, h)->prev = h;
+        }
+    }
+    return w;
+}
+
+/* Arms the timer of `id` (again, if it was armed) to expire at
+   `expires_ms`, or at the first tick after it (at most
+   WHEEL_SLOTS^WHEEL_LEVELS ticks from now).
+ */
+void arm_timer(timer_wheel *w, int id, uint64_t expires_ms) {
+    if (id < 0 || id >= w->capacity)
+        return;
+    cancel_timer(w, id);
+    // (never early, and no sooner than the next tick)
+    uint64_t expires = (expires_ms + w->tick_ms - 1) / w->tick_ms;
+    if (expires <= w->now)
+        expires = w->now + 1;
+    if (expires - w->now >= MAX_TICKS)
+        expires = w->now + MAX_TICKS - 1;
+    w->nodes[id].expires = expires;
+    link_timer(w, id);
+    w->armed++;
+}
+
+/* Disarms the timer of `id`, if armed.
+ */
+void cancel_timer(timer_wheel *w, int id) {
+    if (id < 0 || id >= w->capacity || w->nodes[id].next == NO_NODE)
+        return;
+    unlink_timer(w, id);
+    w->armed--;
+}
+
+/* Returns how long to wait (in milliseconds, from `now_ms`) before moving
+   the wheel on, so as not to miss a timer; -1 if there is none.
+ */
+int wheel_timeout_ms(timer_wheel *w, uint64_t now_ms) {
+    if (w->armed == 0)
+        return -1;
+
+    // the next tick with timers to expire, or to cascade (the timers of
+    // the other wheels are not looked at before then)
+    uint64_t tick = w->now + 1;
+    while ((tick & SLOT_MASK) != 0) {
+        uint32_t h = head(w, 0, tick & SLOT_MASK);
+        if (node(w, h)->next != h)
+            break;
+        tick++;
+    }
+    uint64_t at_ms = tick * w->tick_ms;
+    return at_ms <= now_ms ? 0 : (int)(at_ms - now_ms);
+}
+
+/* Moves the wheel on to `now_ms`, calling `expire` (with `arg`) for every
+   timer that expired meanwhile.
+ * Returns the number of timers that expired.
+ */
+int advance_wheel(timer_wheel *w, uint64_t now_ms, expire_fn expire,
+                  void *arg) {
+    uint64_t target = now_ms / w->tick_ms;
+    int expired = 0;
+    while (w->now < target) {
+        if (w->armed == 0) { // nothing to go through
+            w->now = target;
+            break;
+        }
+        uint64_t tick = ++w->now;
+
+        // A turn of a wheel is over -> the timers of the next slot of the
+        // next wheel move down (and so on up, if that one turned too)
+        int slot = tick & SLOT_MASK;
+        for (int level = 1; slot == 0 && level < WHEEL_LEVELS; level++) {
+            slot = (tick >> (WHEEL_BITS * level)) & SLOT_MASK;
+            cascade(w, level, slot);
+        }
+
+        // The timers of this tick expire
+        uint32_t h = head(w, 0, tick & SLOT_MASK);
+        uint32_t first;
+        while ((first = node(w, h)->next) != h) {
+            int id = first - 1;
+            unlink_timer(w, id);
+            w->armed--;
+            expired++;
+            expire(id, arg);
+        }
+    }
+    return expired;
+}
+
+/* Frees the wheel.
+ */
+void free_wheel(timer_wheel *w) {
+    if (w == NULL)
+        return;
+    free(w->nodes);
+    free(w);
+}
+
+/* Returns the node linked to as `link`.
+ */
+wheel_node *node(timer_wheel *w, uint32_t link) {
+    return &w->nodes[link - 1];
+}
+
+/* Returns the link to the head of the slot of the wheel at `level`.
+ */
+uint32_t head(timer_wheel *w, int level, int slot) {
+    return w->capacity + level * WHEEL_SLOTS + slot + 1;
+}
+
+/* Puts the timer of `id` (not on the wheel, expiring from now on) in the
+   slot of its expiry, on the first wheel whose turn from now reaches it.
+ */
+void link_timer(timer_wheel *w, int id) {
+    wheel_node *n = &w->nodes[id];
+    if (n->expires < w->now)
+        n->expires = w->now; // (really shouldn't happen)
+    uint64_t delta = n->expires - w->now;
+    int level = 0;
+    while (level < WHEEL_LEVELS - 1
+            && delta >= (uint64_t)1 << (WHEEL_BITS * (level + 1)))
+        level++;
+    uint32_t h = head(w, level, (n->expires >> (WHEEL_BITS * level))
+                                & SLOT_MASK);
+
+    // at the end of the slot's list
+    uint32_t self = id + 1;
+    n->next = h;
+    n->prev = node(w, h)->prev;
+    node(w, n->prev)->next = self;
+    node(w, h)->prev = self;
+}
+
+/* Takes the timer of `id` (on the wheel) out of its slot.
+ */
+void unlink_timer(timer_wheel *w, int id) {
+    wheel_node *n = &w->nodes[id];
+    node(w, n->prev)->next = n->next;
+    node(w, n->next)->prev = n->prev;
+    n->next = n->prev = NO_NODE;
+}
+
+/* Moves the timers of the slot of the wheel at `level` to the slots of
+   their expiry on the wheels below (now that it is near).
+ */
+void cascade(timer_wheel *w, int level, int slot) {
+    uint32_t h = head(w, level, slot);
+    uint32_t first;
+    while ((first = node(w, h)->next) != h) {
+        int id = first - 1;
+        unlink_timer(w, id);
+        link_timer(w, id);
+    }
+}
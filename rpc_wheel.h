@@ -0,0 +1,66 @@
+/*-----------------------------------------------------------------------------
+ * Project 2
+ * rpc_wheel.h :
+              = the interface of the module `rpc_wheel` of the project
+              = a hierarchical timer wheel: timers of a very large number
+                of ids, armed, cancelled and expired in O(1) each
+ ----------------------------------------------------------------------------*/
+
+#ifndef RPC_WHEEL_H
+#define RPC_WHEEL_H
+
+#include <stdint.h>
+
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4
+
+/* Timers of the ids 0 to capacity - 1 (at most one each), on WHEEL_LEVELS
+   wheels of WHEEL_SLOTS slots: a slot of the first wheel lasts one tick,
+   and of each next wheel, as long as a whole turn of the previous one.
+   A timer sits in the slot of the wheel its expiry falls in, and moves down
+   to the previous wheel (cascades) when that slot comes up. Time moves on
+   tick by tick, and the timers of a slot of the first wheel expire all at
+   once. Times are in milliseconds (of the monotonic clock).
+ */
+typedef struct timer_wheel timer_wheel;
+
+/* Expires the timer of `id` (taken off the wheel already: it may be armed
+   again from here).
+ */
+typedef void (*expire_fn)(int id, void *arg);
+
+/* Creates a wheel without timers, for ids 0 to `capacity` - 1, moving on
+   every `tick_ms` milliseconds from `now_ms`. Its memory is only taken
+   from the system as ids are used.
+ * Returns it on success, NULL otherwise.
+ */
+timer_wheel *create_wheel(int capacity, int tick_ms, uint64_t now_ms);
+
+/* Arms the timer of `id` (again, if it was armed) to expire at
+   `expires_ms`, or at the first tick after it (at most
+   WHEEL_SLOTS^WHEEL_LEVELS ticks from now).
+ */
+void arm_timer(timer_wheel *w, int id, uint64_t expires_ms);
+
+/* Disarms the timer of `id`, if armed.
+ */
+void cancel_timer(timer_wheel *w, int id);
+
+/* Returns how long to wait (in milliseconds, from `now_ms`) before moving
+   the wheel on, so as not to miss a timer; -1 if there is none.
+ */
+int wheel_timeout_ms(timer_wheel *w, uint64_t now_ms);
+
+/* Moves the wheel on to `now_ms`, calling `expire` (with `arg`) for every
+   timer that expired meanwhile.
+ * Returns the number of timers that expired.
+ */
+int advance_wheel(timer_wheel *w, uint64_t now_ms, expire_fn expire,
+                  void *arg);
+
+/* Frees the wheel.
+ */
+void free_wheel(timer_wheel *w);
+
+#endif